@@ -59,7 +59,7 @@ ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size)
         return err;
 
     len = message.u.info.length;
-    if (len < 0) {
+    if ((ssize_t) len < 0) {
         err = len;
         goto out;
     }
@@ -107,7 +107,7 @@ int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE * stream)
 
     len = message.u.info.length;
     err = len;
-    if (len < 0)
+    if ((ssize_t) len < 0)
         goto out;
 
     while (len) {
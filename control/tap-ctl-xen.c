@@ -19,24 +19,33 @@
 #include "tap-ctl-xen.h"
 
 int tap_ctl_connect_xenblkif(pid_t pid, int minor, domid_t domid,
-                             int devid, const grant_ref_t * grefs,
+                             int devid, int queue, int n_queues,
+                             const grant_ref_t * grefs,
                              int order, evtchn_port_t port, int proto,
+                             int features, int copy_threshold,
                              const char *pool)
 {
     tapdisk_message_t message;
     int i, err;
 
+    if (order < 0 || 1 << order > ARRAY_SIZE(message.u.blkif.gref))
+        return -EINVAL;
+
     memset(&message, 0, sizeof(message));
     message.type = TAPDISK_MESSAGE_XENBLKIF_CONNECT;
     message.cookie = minor;
 
     message.u.blkif.domid = domid;
     message.u.blkif.devid = devid;
+    message.u.blkif.queue = queue;
+    message.u.blkif.n_queues = n_queues;
     for (i = 0; i < 1 << order; i++)
         message.u.blkif.gref[i] = grefs[i];
     message.u.blkif.order = order;
     message.u.blkif.port = port;
     message.u.blkif.proto = proto;
+    message.u.blkif.features = features;
+    message.u.blkif.copy_threshold = copy_threshold;
     if (pool)
         strncpy(message.u.blkif.pool, pool, sizeof(message.u.blkif.pool));
     else
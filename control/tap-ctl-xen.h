@@ -21,9 +21,11 @@
 
 int tap_ctl_connect_xenblkif(pid_t pid, int minor,
                              domid_t domid, int devid,
+                             int queue, int n_queues,
                              const grant_ref_t * grefs, int order,
                              evtchn_port_t port,
-                             int proto, const char *pool);
+                             int proto, int features, int copy_threshold,
+                             const char *pool);
 
 int tap_ctl_disconnect_xenblkif(pid_t pid, int minor,
                                 domid_t domid, int devid,
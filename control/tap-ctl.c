@@ -168,7 +168,8 @@ static void tap_cli_create_usage(FILE * stream)
             "[-e <minor> stack on existing tapdisk for the parent chain] "
             "[-r turn on read caching into leaf node] [-2 <path> "
             "use secondary image (in mirror mode if no -s)] [-s "
-            "fail over to the secondary image on ENOSPC]\n");
+            "fail over to the secondary image on ENOSPC] [-A "
+            "mirror to the secondary image asynchronously]\n");
 }
 
 static int tap_cli_create(int argc, char **argv)
@@ -182,7 +183,7 @@ static int tap_cli_create(int argc, char **argv)
     flags = 0;
 
     optind = 0;
-    while ((c = getopt(argc, argv, "a:R:e:r2:sh")) != -1) {
+    while ((c = getopt(argc, argv, "a:R:e:r2:sAh")) != -1) {
         switch (c) {
         case 'a':
             args = optarg;
@@ -204,6 +205,9 @@ static int tap_cli_create(int argc, char **argv)
         case 's':
             flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
             break;
+        case 'A':
+            flags |= TAPDISK_MESSAGE_FLAG_ASYNC;
+            break;
         case '?':
             goto usage;
         case 'h':
@@ -537,6 +541,49 @@ int tap_cli_unpause(int argc, char **argv)
     return EINVAL;
 }
 
+static void tap_cli_weight_usage(FILE * stream)
+{
+    fprintf(stream, "usage: weight <-p pid> <-m minor> <-w weight>\n");
+}
+
+static int tap_cli_weight(int argc, char **argv)
+{
+    int c, pid, minor, weight;
+
+    pid = -1;
+    minor = -1;
+    weight = -1;
+
+    optind = 0;
+    while ((c = getopt(argc, argv, "p:m:w:h")) != -1) {
+        switch (c) {
+        case 'p':
+            pid = atoi(optarg);
+            break;
+        case 'm':
+            minor = atoi(optarg);
+            break;
+        case 'w':
+            weight = atoi(optarg);
+            break;
+        case '?':
+            goto usage;
+        case 'h':
+            tap_cli_weight_usage(stdout);
+            return 0;
+        }
+    }
+
+    if (pid == -1 || minor == -1 || weight == -1)
+        goto usage;
+
+    return tap_ctl_set_weight(pid, minor, weight);
+
+  usage:
+    tap_cli_weight_usage(stderr);
+    return EINVAL;
+}
+
 static void tap_cli_major_usage(FILE * stream)
 {
     fprintf(stream, "usage: major [-h]\n");
@@ -549,7 +596,8 @@ static void tap_cli_open_usage(FILE * stream)
             "[-e <minor> stack on existing tapdisk for the parent chain] "
             "[-r turn on read caching into leaf node] [-2 <path> "
             "use secondary image (in mirror mode if no -s)] [-s "
-            "fail over to the secondary image on ENOSPC]\n");
+            "fail over to the secondary image on ENOSPC] [-A "
+            "mirror to the secondary image asynchronously]\n");
 }
 
 static int tap_cli_open(int argc, char **argv)
@@ -565,7 +613,7 @@ static int tap_cli_open(int argc, char **argv)
     secondary = NULL;
 
     optind = 0;
-    while ((c = getopt(argc, argv, "a:Rm:p:e:r2:sh")) != -1) {
+    while ((c = getopt(argc, argv, "a:Rm:p:e:r2:sAh")) != -1) {
         switch (c) {
         case 'p':
             pid = atoi(optarg);
@@ -593,6 +641,9 @@ static int tap_cli_open(int argc, char **argv)
         case 's':
             flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
             break;
+        case 'A':
+            flags |= TAPDISK_MESSAGE_FLAG_ASYNC;
+            break;
         case '?':
             goto usage;
         case 'h':
@@ -669,6 +720,7 @@ struct command commands[] = {
     {.name = "pause",.func = tap_cli_pause},
     {.name = "unpause",.func = tap_cli_unpause},
     {.name = "stats",.func = tap_cli_stats},
+    {.name = "weight",.func = tap_cli_weight},
 };
 
 #define print_commands()					\
@@ -97,6 +97,11 @@ int tap_ctl_close(const int id, const int minor, const int force,
 int tap_ctl_pause(const int id, const int minor, struct timeval *timeout);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+/**
+ * Sets the fair-share weight of a VBD, see TAPDISK_IOSCHED.
+ */
+int tap_ctl_set_weight(const int id, const int minor, const int weight);
+
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE * out);
 
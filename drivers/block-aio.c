@@ -44,25 +44,106 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 
-#define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
-
 struct tdaio_state;
 
 struct aio_request {
     td_request_t treq;
     struct tiocb tiocb;
+    struct iovec *iov;
     struct tdaio_state *state;
 };
 
 struct tdaio_state {
     int fd;
     td_driver_t *driver;
-
+    int punch_hole;
+
+    /*
+     * Sized from the driver limits: a request per segment, as split
+     * requests take one each, and the iovecs of one vectored request
+     * per VBD request.
+     */
+    int aio_max_count;
     int aio_free_count;
-    struct aio_request aio_requests[MAX_AIO_REQS];
-    struct aio_request *aio_free_list[MAX_AIO_REQS];
+    struct aio_request *aio_requests;
+    struct aio_request **aio_free_list;
+
+    int aio_iov_max_count;
+    int aio_iov_free_count;
+    struct iovec **aio_iov_free_list;
+    struct iovec *aio_iovecs;
 };
 
+static void tdaio_free_requests(struct tdaio_state *prv)
+{
+    free(prv->aio_requests);
+    prv->aio_requests = NULL;
+
+    free(prv->aio_free_list);
+    prv->aio_free_list = NULL;
+
+    free(prv->aio_iov_free_list);
+    prv->aio_iov_free_list = NULL;
+
+    free(prv->aio_iovecs);
+    prv->aio_iovecs = NULL;
+
+    prv->aio_max_count = prv->aio_free_count = 0;
+    prv->aio_iov_max_count = prv->aio_iov_free_count = 0;
+}
+
+/*
+ * Replaces the pools, which must be idle. The old ones stay if
+ * allocating fails.
+ */
+static int tdaio_alloc_requests(struct tdaio_state *prv,
+                                const td_limits_t * limits)
+{
+    int i, n = td_limits_data_requests(limits), n_iov = limits->requests;
+    struct aio_request *requests, **free_list;
+    struct iovec *iovecs, **iov_free_list;
+
+    requests = calloc(n, sizeof(struct aio_request));
+    free_list = calloc(n, sizeof(struct aio_request *));
+    iovecs = calloc(n_iov * limits->segments, sizeof(struct iovec));
+    iov_free_list = calloc(n_iov, sizeof(struct iovec *));
+    if (!requests || !free_list || !iovecs || !iov_free_list) {
+        free(requests);
+        free(free_list);
+        free(iovecs);
+        free(iov_free_list);
+        return -ENOMEM;
+    }
+
+    tdaio_free_requests(prv);
+
+    prv->aio_requests = requests;
+    prv->aio_free_list = free_list;
+    prv->aio_max_count = n;
+    prv->aio_free_count = n;
+    for (i = 0; i < n; i++)
+        prv->aio_free_list[i] = &prv->aio_requests[i];
+
+    prv->aio_iovecs = iovecs;
+    prv->aio_iov_free_list = iov_free_list;
+    prv->aio_iov_max_count = n_iov;
+    prv->aio_iov_free_count = n_iov;
+    for (i = 0; i < n_iov; i++)
+        prv->aio_iov_free_list[i] = iovecs + i * limits->segments;
+
+    return 0;
+}
+
+static int tdaio_set_limits(td_driver_t * driver, const td_limits_t * limits)
+{
+    struct tdaio_state *prv = (struct tdaio_state *) driver->data;
+
+    if (prv->aio_free_count != prv->aio_max_count)
+        return -EBUSY;
+
+    return tdaio_alloc_requests(prv, limits);
+}
+
 /*Get Image size, secsize*/
 static int tdaio_get_image_info(int fd, td_disk_info_t * info)
 {
@@ -128,7 +209,7 @@ static int tdaio_get_image_info(int fd, td_disk_info_t * info)
 /* Open the disk file and initialize aio state. */
 int tdaio_open(td_driver_t * driver, const char *name, td_flag_t flags)
 {
-    int i, fd, ret, o_flags;
+    int fd, ret, o_flags;
     struct tdaio_state *prv;
 
     ret = 0;
@@ -137,10 +218,11 @@ int tdaio_open(td_driver_t * driver, const char *name, td_flag_t flags)
     DPRINTF("block-aio open('%s')", name);
 
     memset(prv, 0, sizeof(struct tdaio_state));
+    prv->punch_hole = 1;
 
-    prv->aio_free_count = MAX_AIO_REQS;
-    for (i = 0; i < MAX_AIO_REQS; i++)
-        prv->aio_free_list[i] = &prv->aio_requests[i];
+    ret = tdaio_alloc_requests(prv, &driver->limits);
+    if (ret)
+        goto done;
 
     /* Open the file */
     o_flags = O_DIRECT | O_LARGEFILE |
@@ -172,8 +254,11 @@ int tdaio_open(td_driver_t * driver, const char *name, td_flag_t flags)
     }
 
     prv->fd = fd;
+    td_register_file(fd);
 
   done:
+    if (ret)
+        tdaio_free_requests(prv);
     return ret;
 }
 
@@ -183,6 +268,11 @@ void tdaio_complete(void *arg, struct tiocb *tiocb, int err)
     struct tdaio_state *prv = aio->state;
 
     td_complete_request(aio->treq, err);
+
+    if (aio->iov) {
+        prv->aio_iov_free_list[prv->aio_iov_free_count++] = aio->iov;
+        aio->iov = NULL;
+    }
     prv->aio_free_list[prv->aio_free_count++] = aio;
 }
 
@@ -197,6 +287,11 @@ void tdaio_queue_read(td_driver_t * driver, td_request_t treq)
     size = treq.secs * driver->info.sector_size;
     offset = treq.sec * (uint64_t) driver->info.sector_size;
 
+    if (treq.iovcnt > 1 && prv->aio_iov_free_count == 0) {
+        td_split_request(driver, treq, tdaio_queue_read);
+        return;
+    }
+
     if (prv->aio_free_count == 0)
         goto fail;
 
@@ -204,8 +299,15 @@ void tdaio_queue_read(td_driver_t * driver, td_request_t treq)
     aio->treq = treq;
     aio->state = prv;
 
-    td_prep_read(&aio->tiocb, prv->fd, treq.buf,
-                 size, offset, tdaio_complete, aio);
+    if (treq.iovcnt > 1) {
+        aio->iov = prv->aio_iov_free_list[--prv->aio_iov_free_count];
+        td_prep_readv(&aio->tiocb, prv->fd, aio->iov,
+                      td_request_iovec(&treq, aio->iov,
+                                       driver->info.sector_size),
+                      offset, tdaio_complete, aio);
+    } else
+        td_prep_read(&aio->tiocb, prv->fd, treq.buf,
+                     size, offset, tdaio_complete, aio);
     td_queue_tiocb(driver, &aio->tiocb);
 
     return;
@@ -225,6 +327,11 @@ void tdaio_queue_write(td_driver_t * driver, td_request_t treq)
     size = treq.secs * driver->info.sector_size;
     offset = treq.sec * (uint64_t) driver->info.sector_size;
 
+    if (treq.iovcnt > 1 && prv->aio_iov_free_count == 0) {
+        td_split_request(driver, treq, tdaio_queue_write);
+        return;
+    }
+
     if (prv->aio_free_count == 0)
         goto fail;
 
@@ -232,8 +339,15 @@ void tdaio_queue_write(td_driver_t * driver, td_request_t treq)
     aio->treq = treq;
     aio->state = prv;
 
-    td_prep_write(&aio->tiocb, prv->fd, treq.buf,
-                  size, offset, tdaio_complete, aio);
+    if (treq.iovcnt > 1) {
+        aio->iov = prv->aio_iov_free_list[--prv->aio_iov_free_count];
+        td_prep_writev(&aio->tiocb, prv->fd, aio->iov,
+                       td_request_iovec(&treq, aio->iov,
+                                        driver->info.sector_size),
+                       offset, tdaio_complete, aio);
+    } else
+        td_prep_write(&aio->tiocb, prv->fd, treq.buf,
+                      size, offset, tdaio_complete, aio);
     td_queue_tiocb(driver, &aio->tiocb);
 
     return;
@@ -246,8 +360,11 @@ int tdaio_close(td_driver_t * driver)
 {
     struct tdaio_state *prv = (struct tdaio_state *) driver->data;
 
+    td_unregister_file(prv->fd);
     close(prv->fd);
 
+    tdaio_free_requests(prv);
+
     return 0;
 }
 
@@ -267,24 +384,87 @@ void tdaio_stats(td_driver_t * driver, td_stats_t * st)
     struct tdaio_state *prv = (struct tdaio_state *) driver->data;
     int n_pending;
 
-    n_pending = MAX_AIO_REQS - prv->aio_free_count;
+    n_pending = prv->aio_max_count - prv->aio_free_count;
 
     tapdisk_stats_field(st, "reqs", "{");
-    tapdisk_stats_field(st, "max", "lu", MAX_AIO_REQS);
+    tapdisk_stats_field(st, "max", "d", prv->aio_max_count);
     tapdisk_stats_field(st, "pending", "d", n_pending);
     tapdisk_stats_leave(st, '}');
 }
 
+static void tdaio_queue_flush(td_driver_t * driver, td_request_t treq)
+{
+    struct tdaio_state *prv = (struct tdaio_state *) driver->data;
+
+    if (td_flag_test(driver->state, TD_DRIVER_RDONLY)) {
+        td_complete_request(treq, 0);
+        return;
+    }
+
+    td_queue_sync(driver, prv->fd, treq);
+}
+
+static void tdaio_complete_discard(void *arg, struct tiocb *tiocb, int err)
+{
+    struct aio_request *aio = (struct aio_request *) arg;
+    struct tdaio_state *prv = aio->state;
+
+    if (err == -EOPNOTSUPP || err == -ENOSYS) {
+        if (prv->punch_hole)
+            DPRINTF("block-aio: cannot punch holes (%d), "
+                    "ignoring discards\n", err);
+        prv->punch_hole = 0;
+        err = 0;
+    }
+
+    tdaio_complete(arg, tiocb, err);
+}
+
+/*
+ * Discards punch a hole into the file, or discard the blocks of a
+ * device. Those which cannot do either ignore discards.
+ */
+static void tdaio_queue_discard(td_driver_t * driver, td_request_t treq)
+{
+    struct tdaio_state *prv = (struct tdaio_state *) driver->data;
+    struct aio_request *aio;
+    uint64_t offset, len;
+
+    if (!prv->punch_hole) {
+        td_complete_request(treq, 0);
+        return;
+    }
+
+    if (prv->aio_free_count == 0) {
+        td_complete_request(treq, -EBUSY);
+        return;
+    }
+
+    offset = treq.sec * (uint64_t) driver->info.sector_size;
+    len = treq.secs * (uint64_t) driver->info.sector_size;
+
+    aio = prv->aio_free_list[--prv->aio_free_count];
+    aio->treq = treq;
+    aio->state = prv;
+
+    td_prep_discard(&aio->tiocb, prv->fd, len, offset,
+                    tdaio_complete_discard, aio);
+    td_queue_tiocb(driver, &aio->tiocb);
+}
+
 struct tap_disk tapdisk_aio = {
     .disk_type = "tapdisk_aio",
-    .flags = 0,
+    .flags = TD_DRIVER_VECTORED,
     .private_data_size = sizeof(struct tdaio_state),
     .td_open = tdaio_open,
     .td_close = tdaio_close,
     .td_queue_read = tdaio_queue_read,
     .td_queue_write = tdaio_queue_write,
+    .td_queue_flush = tdaio_queue_flush,
+    .td_queue_discard = tdaio_queue_discard,
     .td_get_parent_id = tdaio_get_parent_id,
     .td_validate_parent = tdaio_validate_parent,
     .td_debug = NULL,
     .td_stats = tdaio_stats,
+    .td_set_limits = tdaio_set_limits,
 };
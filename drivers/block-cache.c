@@ -60,7 +60,7 @@
 #define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
 
 #define BLOCK_CACHE_MAX_SIZE            (10 << 20)  /* 100MB cache */
-#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
+#define BLOCK_CACHE_REQUESTS(_l)        td_limits_data_requests(_l)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
 typedef struct radix_tree radix_tree_t;
@@ -128,9 +128,11 @@ struct block_cache {
 
     uint64_t sectors;
 
-    block_cache_request_t requests[BLOCK_CACHE_REQUESTS];
-    block_cache_request_t *request_free_list[BLOCK_CACHE_REQUESTS];
+    /* a request per segment, misses beyond go uncached */
+    block_cache_request_t *requests;
+    block_cache_request_t **request_free_list;
     int requests_free;
+    int requests_max;
 
     event_id_t timeout_id;
 
@@ -514,10 +516,62 @@ block_cache_put_request(block_cache_t * cache,
     cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static void block_cache_free_requests(block_cache_t * cache)
+{
+    free(cache->requests);
+    cache->requests = NULL;
+
+    free(cache->request_free_list);
+    cache->request_free_list = NULL;
+
+    cache->requests_max = cache->requests_free = 0;
+}
+
+/*
+ * Replaces the request pool, which must be idle. The old one stays if
+ * allocating fails.
+ */
+static int
+block_cache_alloc_requests(block_cache_t * cache, const td_limits_t * limits)
+{
+    int i, n = BLOCK_CACHE_REQUESTS(limits);
+    block_cache_request_t *requests, **free_list;
+
+    requests = calloc(n, sizeof(block_cache_request_t));
+    free_list = calloc(n, sizeof(block_cache_request_t *));
+    if (!requests || !free_list) {
+        free(requests);
+        free(free_list);
+        return -ENOMEM;
+    }
+
+    block_cache_free_requests(cache);
+
+    cache->requests = requests;
+    cache->request_free_list = free_list;
+    cache->requests_max = n;
+    cache->requests_free = n;
+    for (i = 0; i < n; i++)
+        cache->request_free_list[i] = cache->requests + i;
+
+    return 0;
+}
+
+static int
+block_cache_set_limits(td_driver_t * driver, const td_limits_t * limits)
+{
+    block_cache_t *cache = (block_cache_t *) driver->data;
+
+    if (cache->requests_free != cache->requests_max)
+        return -EBUSY;
+
+    return block_cache_alloc_requests(cache, limits);
+}
+
 static int
 block_cache_open(td_driver_t * driver, const char *name, td_flag_t flags)
 {
-    int i, err;
+    int err;
     radix_tree_t *tree;
     block_cache_t *cache;
 
@@ -540,13 +594,15 @@ block_cache_open(td_driver_t * driver, const char *name, td_flag_t flags)
         goto fail;
 
     tree->cache = cache;
-    cache->requests_free = BLOCK_CACHE_REQUESTS;
-    for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
-        cache->request_free_list[i] = cache->requests + i;
+
+    err = block_cache_alloc_requests(cache, &driver->limits);
+    if (err)
+        goto fail;
 
     cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,   /* dummy fd */
-                                                      BLOCK_CACHE_PAGE_IDLETIME
-                                                      << 1,
+                                                      SCHEDULER_USECS
+                                                      (BLOCK_CACHE_PAGE_IDLETIME
+                                                       << 1),
                                                       block_cache_prune_event,
                                                       cache);
     if (cache->timeout_id < 0)
@@ -562,6 +618,7 @@ block_cache_open(td_driver_t * driver, const char *name, td_flag_t flags)
     return 0;
 
   fail:
+    block_cache_free_requests(cache);
     free(cache->name);
     radix_tree_free(&cache->tree);
     return err;
@@ -579,6 +636,7 @@ static int block_cache_close(td_driver_t * driver)
 
     tapdisk_server_unregister_event(cache->timeout_id);
     radix_tree_free(tree);
+    block_cache_free_requests(cache);
     free(cache->name);
 
     return 0;
@@ -730,6 +788,12 @@ block_cache_queue_write(td_driver_t * driver, td_request_t treq)
     td_complete_request(treq, -EPERM);
 }
 
+static void
+block_cache_queue_flush(td_driver_t * driver, td_request_t treq)
+{
+    td_complete_request(treq, 0);
+}
+
 static int
 block_cache_get_parent_id(td_driver_t * driver, td_disk_id_t * id)
 {
@@ -771,7 +835,9 @@ struct tap_disk tapdisk_block_cache = {
     .td_close = block_cache_close,
     .td_queue_read = block_cache_queue_read,
     .td_queue_write = block_cache_queue_write,
+    .td_queue_flush = block_cache_queue_flush,
     .td_get_parent_id = block_cache_get_parent_id,
     .td_validate_parent = block_cache_validate_parent,
     .td_debug = block_cache_debug,
+    .td_set_limits = block_cache_set_limits,
 };
@@ -66,8 +66,8 @@
 
 #define MIN(a, b)       ((a) < (b) ? (a) : (b))
 
-#define TD_LCACHE_MAX_REQ               (MAX_REQUESTS*2)
-#define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
+#define TD_LCACHE_MAX_REQ(_l)           ((_l)->requests * 2)
+#define TD_LCACHE_BUFSZ(_l)             ((_l)->segments * \
 					 sysconf(_SC_PAGE_SIZE))
 
 
@@ -90,8 +90,9 @@ struct lcache_request {
 struct lcache {
     char *name;
 
-    td_lcache_req_t reqv[TD_LCACHE_MAX_REQ];
-    td_lcache_req_t *free[TD_LCACHE_MAX_REQ];
+    td_lcache_req_t *reqv;
+    td_lcache_req_t **free;
+    int n_reqs;
     int n_free;
 
     char *buf;
@@ -113,7 +114,7 @@ static td_lcache_req_t *lcache_alloc_request(td_lcache_t * cache)
 
 static void lcache_free_request(td_lcache_t * cache, td_lcache_req_t * req)
 {
-    BUG_ON(cache->n_free >= TD_LCACHE_MAX_REQ);
+    BUG_ON(cache->n_free >= cache->n_reqs);
     cache->free[cache->n_free++] = req;
 }
 
@@ -124,11 +125,20 @@ static void lcache_destroy_buffers(td_lcache_t * cache)
     do {
         req = lcache_alloc_request(cache);
         if (req)
-            munmap(req->buf, TD_LCACHE_BUFSZ);
+            munmap(req->buf, cache->bufsz);
     } while (req);
+
+    free(cache->reqv);
+    cache->reqv = NULL;
+
+    free(cache->free);
+    cache->free = NULL;
+
+    cache->n_reqs = 0;
 }
 
-static int lcache_create_buffers(td_lcache_t * cache)
+static int
+lcache_create_buffers(td_lcache_t * cache, const td_limits_t * limits)
 {
     int prot, flags, i, err;
 
@@ -136,11 +146,20 @@ static int lcache_create_buffers(td_lcache_t * cache)
     flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_LOCKED;
 
     cache->n_free = 0;
+    cache->n_reqs = TD_LCACHE_MAX_REQ(limits);
+    cache->bufsz = TD_LCACHE_BUFSZ(limits);
+
+    cache->reqv = calloc(cache->n_reqs, sizeof(td_lcache_req_t));
+    cache->free = calloc(cache->n_reqs, sizeof(td_lcache_req_t *));
+    if (!cache->reqv || !cache->free) {
+        err = -ENOMEM;
+        goto fail;
+    }
 
-    for (i = 0; i < TD_LCACHE_MAX_REQ; i++) {
+    for (i = 0; i < cache->n_reqs; i++) {
         td_lcache_req_t *req = &cache->reqv[i];
 
-        req->buf = mmap(NULL, TD_LCACHE_BUFSZ, prot, flags, -1, 0);
+        req->buf = mmap(NULL, cache->bufsz, prot, flags, -1, 0);
         if (req->buf == MAP_FAILED) {
             req->buf = NULL;
             err = -errno;
@@ -158,6 +177,29 @@ static int lcache_create_buffers(td_lcache_t * cache)
     return err;
 }
 
+/*
+ * Swaps in buffers for @limits once none is in use, keeping the old
+ * ones if that fails.
+ */
+static int lcache_set_limits(td_driver_t * driver, const td_limits_t * limits)
+{
+    td_lcache_t *cache = driver->data, old = *cache;
+    int err;
+
+    if (cache->n_free != cache->n_reqs)
+        return -EBUSY;
+
+    err = lcache_create_buffers(cache, limits);
+    if (err) {
+        *cache = old;
+        return err;
+    }
+
+    lcache_destroy_buffers(&old);
+
+    return 0;
+}
+
 static int lcache_close(td_driver_t * driver)
 {
     td_lcache_t *cache = driver->data;
@@ -179,7 +221,7 @@ lcache_open(td_driver_t * driver, const char *name, td_flag_t flags)
     if (err)
         goto fail;
 
-    err = lcache_create_buffers(cache);
+    err = lcache_create_buffers(cache, &driver->limits);
     if (err)
         goto fail;
 
@@ -274,6 +316,7 @@ static void lcache_store_read(td_lcache_t * cache, td_lcache_req_t * req)
     vreq->iov = iov;
     vreq->iovcnt = 1;
     vreq->cb = __lcache_write_cb;
+    vreq->batch_cb = NULL;
     vreq->token = cache;
 
     vbd = req->treq.vreq->vbd;
@@ -363,4 +406,5 @@ struct tap_disk tapdisk_lcache = {
     .td_queue_read = lcache_queue_read,
     .td_get_parent_id = lcache_get_parent_id,
     .td_validate_parent = lcache_validate_parent,
+    .td_set_limits = lcache_set_limits,
 };
@@ -219,11 +219,15 @@ llpcache_requeue_treq(td_llpcache_t * s, td_llpcache_req_t * req,
     lvr->target = target;
 
     vreq = &lvr->vreq;
-    vreq->op = TD_OP_WRITE;
+    vreq->op = req->treq.op;
     vreq->sec = req->treq.sec;
     vreq->iov = &req->iov;
-    vreq->iovcnt = 1;
+    vreq->iovcnt = (req->treq.op == TD_OP_WRITE ? 1 : 0);
+    vreq->discard_secs = 0;
+    if (req->treq.op == TD_OP_DISCARD)
+        vreq->discard_secs = req->treq.secs;
     vreq->cb = __llpcache_write_cb;
+    vreq->batch_cb = NULL;
     vreq->token = s;
 
     err = tapdisk_vbd_queue_request(req->treq.vreq->vbd, vreq);
@@ -287,7 +291,12 @@ static void llpcache_forward_write(td_llpcache_t * s, td_request_t treq)
         td_forward_request(treq);
         break;
     case LOCAL:
-        td_queue_write(s->local, treq);
+        if (treq.op == TD_OP_FLUSH)
+            td_queue_flush(s->local, treq);
+        else if (treq.op == TD_OP_DISCARD)
+            td_queue_discard(s->local, treq);
+        else
+            td_queue_write(s->local, treq);
         break;
     default:
         BUG();
@@ -304,6 +313,19 @@ static void llpcache_queue_write(td_driver_t * driver, td_request_t treq)
         llpcache_fork_write(s, treq);
 }
 
+/*
+ * NB. Flushes and discards are mirrored like writes.
+ */
+static void llpcache_queue_flush(td_driver_t * driver, td_request_t treq)
+{
+    llpcache_queue_write(driver, treq);
+}
+
+static void llpcache_queue_discard(td_driver_t * driver, td_request_t treq)
+{
+    llpcache_queue_write(driver, treq);
+}
+
 static void llpcache_queue_read(td_driver_t * driver, td_request_t treq)
 {
     td_llpcache_t *s = driver->data;
@@ -384,6 +406,8 @@ struct tap_disk tapdisk_llpcache = {
     .td_close = llpcache_close,
     .td_queue_read = llpcache_queue_read,
     .td_queue_write = llpcache_queue_write,
+    .td_queue_flush = llpcache_queue_flush,
+    .td_queue_discard = llpcache_queue_discard,
     .td_get_parent_id = llcache_get_parent_id,
     .td_validate_parent = llcache_validate_parent,
 };
@@ -569,6 +593,34 @@ static void llecache_queue_write(td_driver_t * driver, td_request_t treq)
     }
 }
 
+static void llecache_queue_flush(td_driver_t * driver, td_request_t treq)
+{
+    td_llecache_t *s = driver->data;
+
+    switch (s->mode) {
+    case LLE_LOCAL:
+        td_forward_request(treq);
+        break;
+    case LLE_SHARED:
+        td_queue_flush(s->shared, treq);
+        break;
+    }
+}
+
+static void llecache_queue_discard(td_driver_t * driver, td_request_t treq)
+{
+    td_llecache_t *s = driver->data;
+
+    switch (s->mode) {
+    case LLE_LOCAL:
+        td_forward_request(treq);
+        break;
+    case LLE_SHARED:
+        td_queue_discard(s->shared, treq);
+        break;
+    }
+}
+
 static void llecache_queue_read(td_driver_t * driver, td_request_t treq)
 {
     td_llecache_t *s = driver->data;
@@ -593,6 +645,8 @@ struct tap_disk tapdisk_llecache = {
     .td_close = llecache_close,
     .td_queue_read = llecache_queue_read,
     .td_queue_write = llecache_queue_write,
+    .td_queue_flush = llecache_queue_flush,
+    .td_queue_discard = llecache_queue_discard,
     .td_get_parent_id = llcache_get_parent_id,
     .td_validate_parent = llcache_validate_parent,
 };
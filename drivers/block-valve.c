@@ -83,8 +83,9 @@ struct td_valve {
     struct tqh_td_valve_request stor;
     struct tqh_td_valve_request forw;
 
-    td_valve_request_t reqv[MAX_REQUESTS];
-    td_valve_request_t *free[MAX_REQUESTS];
+    td_valve_request_t *reqv;
+    td_valve_request_t **free;
+    int n_reqs;
     int n_free;
 
     struct td_valve_stats stats;
@@ -153,7 +154,7 @@ static td_valve_request_t *valve_alloc_request(td_valve_t * valve)
 static void
 valve_free_request(td_valve_t * valve, td_valve_request_t * req)
 {
-    BUG_ON(valve->n_free >= ARRAY_SIZE(valve->free));
+    BUG_ON(valve->n_free >= valve->n_reqs);
     valve->free[valve->n_free++] = req;
 }
 
@@ -307,7 +308,9 @@ static void valve_schedule_retry(td_valve_t * valve)
     BUG_ON(valve->sock_id >= 0);
 
     id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-                                       -1, TD_VALVE_CONNECT_INTERVAL,
+                                       -1,
+                                       SCHEDULER_USECS
+                                       (TD_VALVE_CONNECT_INTERVAL),
                                        __valve_retry_timeout, valve);
     BUG_ON(id < 0);
 
@@ -500,8 +503,6 @@ static void valve_kill(td_valve_t * valve)
 
 static void valve_init(td_valve_t * valve, unsigned long flags)
 {
-    int i;
-
     memset(valve, 0, sizeof(*valve));
 
     TAILQ_INIT(&valve->stor);
@@ -514,14 +515,53 @@ static void valve_init(td_valve_t * valve, unsigned long flags)
     valve->sched_id = -1;
 
     valve->flags = flags;
+}
 
-    for (i = ARRAY_SIZE(valve->reqv) - 1; i >= 0; i--) {
+/*
+ * Replaces the request pool, which must be idle. The old one stays if
+ * allocating fails.
+ */
+static int valve_init_requests(td_valve_t * valve, const td_limits_t * limits)
+{
+    td_valve_request_t *reqv, **free_list;
+    int i;
+
+    reqv = calloc(limits->requests, sizeof(td_valve_request_t));
+    free_list = calloc(limits->requests, sizeof(td_valve_request_t *));
+    if (!reqv || !free_list) {
+        free(reqv);
+        free(free_list);
+        return -ENOMEM;
+    }
+
+    free(valve->reqv);
+    free(valve->free);
+
+    valve->reqv = reqv;
+    valve->free = free_list;
+    valve->n_reqs = limits->requests;
+    valve->n_free = 0;
+
+    for (i = valve->n_reqs - 1; i >= 0; i--) {
         td_valve_request_t *req = &valve->reqv[i];
 
         req->valve = valve;
 
         valve_free_request(valve, req);
     }
+
+    return 0;
+}
+
+static int
+td_valve_set_limits(td_driver_t * driver, const td_limits_t * limits)
+{
+    td_valve_t *valve = driver->data;
+
+    if (valve->n_free != valve->n_reqs)
+        return -EBUSY;
+
+    return valve_init_requests(valve, limits);
 }
 
 static int td_valve_close(td_driver_t * driver)
@@ -538,6 +578,14 @@ static int td_valve_close(td_driver_t * driver)
         valve->brname = NULL;
     }
 
+    free(valve->reqv);
+    valve->reqv = NULL;
+
+    free(valve->free);
+    valve->free = NULL;
+
+    valve->n_reqs = valve->n_free = 0;
+
     return 0;
 }
 
@@ -549,6 +597,10 @@ td_valve_open(td_driver_t * driver, const char *name, td_flag_t flags)
 
     valve_init(valve, TD_VALVE_WRLIMIT);
 
+    err = valve_init_requests(valve, &driver->limits);
+    if (err)
+        goto fail;
+
     valve->brname = strdup(name);
     if (!valve->brname) {
         err = -errno;
@@ -665,4 +717,5 @@ struct tap_disk tapdisk_valve = {
     .td_get_parent_id = td_valve_get_parent_id,
     .td_validate_parent = td_valve_validate_parent,
     .td_stats = td_valve_stats,
+    .td_set_limits = td_valve_set_limits,
 };
@@ -48,6 +48,10 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *
+ * Discards join bitmap transactions like writes, but have no data to
+ * write and clear their bits instead. A block whose bitmap becomes
+ * empty keeps its BAT entry, but its data is punched out of the file.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -66,6 +70,7 @@
 #include <string.h>             /* for memset.                                 */
 #include <libaio.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "libvhd.h"
 #include "tapdisk.h"
@@ -88,7 +93,7 @@ unsigned int SPB;
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
 		    "%u, BBLK: 0x%04x\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
-		    VHD_REQS_DATA - s->vreq_free_count,			\
+		    s->vreq_max_count - s->vreq_free_count,		\
 		    s->bat.pbw_blk);					\
 	} while(0)
 
@@ -124,9 +129,7 @@ unsigned int SPB;
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
 
-#define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -135,6 +138,8 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_DATA_DISCARD          7
+#define VHD_OP_BLOCK_PUNCH           8
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -157,6 +162,7 @@ unsigned int SPB;
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_PUNCH_PENDING    16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -165,6 +171,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_DISCARD          4
 
 typedef uint8_t vhd_flag_t;
 
@@ -191,11 +198,20 @@ struct vhd_request {
     vhd_flag_t flags;
     td_request_t treq;
     struct tiocb tiocb;
+    struct iovec *iov;
     struct vhd_state *state;
     struct vhd_request *next;
     struct vhd_transaction *tx;
 };
 
+/* a discard, walked one block at a time */
+struct vhd_discard {
+    td_request_t treq;
+    td_sector_t sec;
+    int error;
+    struct vhd_state *state;
+};
+
 struct vhd_bat_state {
     vhd_bat_t bat;
     vhd_batmap_t batmap;
@@ -250,9 +266,23 @@ struct vhd_state {
     struct vhd_bitmap *bitmap_free[VHD_CACHE_SIZE];
     struct vhd_bitmap bitmap_list[VHD_CACHE_SIZE];
 
+    /*
+     * Data requests, sized from the driver limits: one per segment, as
+     * split requests take one each, and the iovecs of one vectored
+     * request per VBD request.
+     */
+    int vreq_max_count;
     int vreq_free_count;
-    struct vhd_request *vreq_free[VHD_REQS_DATA];
-    struct vhd_request vreq_list[VHD_REQS_DATA];
+    struct vhd_request **vreq_free;
+    struct vhd_request *vreq_list;
+
+    int vreq_iov_free_count;
+    struct iovec **vreq_iov_free;
+    struct iovec *vreq_iovecs;
+
+    int discard_free_count;
+    struct vhd_discard **discard_free;
+    struct vhd_discard *discard_list;
 
     /* for redundant bitmap writes */
     int padbm_size;
@@ -269,6 +299,8 @@ struct vhd_state {
     uint64_t read_size;
     uint64_t writes;
     uint64_t write_size;
+    uint64_t discards;
+    uint64_t discard_size;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -278,44 +310,64 @@ struct vhd_state {
 #define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void vhd_complete_discard(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *,
                                     struct vhd_bitmap *);
 
-static struct vhd_state *_vhd_master;
+/*
+ * Zero buffer, shared by the images of all shards.
+ */
+static pthread_mutex_t _vhd_zlock = PTHREAD_MUTEX_INITIALIZER;
+static int _vhd_zrefs;
 static unsigned long _vhd_zsize;
 static char *_vhd_zeros;
 
 static int vhd_initialize(struct vhd_state *s)
 {
-    if (_vhd_zeros)
-        return 0;
-
-    _vhd_zsize = 2 * getpagesize();
-    if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-        _vhd_zsize += VHD_BLOCK_SIZE;
+    unsigned long size;
+    char *zeros;
+    int err = 0;
+
+    pthread_mutex_lock(&_vhd_zlock);
+
+    if (!_vhd_zeros) {
+        /*
+         * NB. always large enough for preallocation, which another
+         * image may ask for while this one is in use. Pages are
+         * only populated once used.
+         */
+        size = 2 * getpagesize() + VHD_BLOCK_SIZE;
+
+        zeros = mmap(0, size, PROT_READ,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (zeros == MAP_FAILED) {
+            err = -errno;
+            EPRINTF("vhd_initialize failed: %d\n", err);
+            goto out;
+        }
 
-    _vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
-                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (_vhd_zeros == MAP_FAILED) {
-        EPRINTF("vhd_initialize failed: %d\n", -errno);
-        _vhd_zeros = NULL;
-        _vhd_zsize = 0;
-        return -errno;
+        _vhd_zeros = zeros;
+        _vhd_zsize = size;
     }
 
-    _vhd_master = s;
-    return 0;
+    _vhd_zrefs++;
+
+  out:
+    pthread_mutex_unlock(&_vhd_zlock);
+    return err;
 }
 
 static void vhd_free(struct vhd_state *s)
 {
-    if (_vhd_master != s || !_vhd_zeros)
-        return;
+    pthread_mutex_lock(&_vhd_zlock);
+
+    if (!--_vhd_zrefs) {
+        munmap(_vhd_zeros, _vhd_zsize);
+        _vhd_zsize = 0;
+        _vhd_zeros = NULL;
+    }
 
-    munmap(_vhd_zeros, _vhd_zsize);
-    _vhd_zsize = 0;
-    _vhd_zeros = NULL;
-    _vhd_master = NULL;
+    pthread_mutex_unlock(&_vhd_zlock);
 }
 
 static char *_get_vhd_zeros(const char *func, unsigned long size)
@@ -339,6 +391,14 @@ static inline void set_batmap(struct vhd_state *s, uint32_t blk)
     }
 }
 
+static inline void clear_batmap(struct vhd_state *s, uint32_t blk)
+{
+    if (s->bat.batmap.map) {
+        vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+        DBG(TLOG_DBG, "block 0x%x no longer full\n", blk);
+    }
+}
+
 static inline int test_batmap(struct vhd_state *s, uint32_t blk)
 {
     if (!s->bat.batmap.map)
@@ -404,6 +464,97 @@ static inline int find_next_free_block(struct vhd_state *s)
     return 0;
 }
 
+static void vhd_free_requests(struct vhd_state *s)
+{
+    free(s->vreq_list);
+    s->vreq_list = NULL;
+
+    free(s->vreq_free);
+    s->vreq_free = NULL;
+
+    free(s->vreq_iov_free);
+    s->vreq_iov_free = NULL;
+
+    free(s->vreq_iovecs);
+    s->vreq_iovecs = NULL;
+
+    s->vreq_max_count = s->vreq_free_count = 0;
+    s->vreq_iov_free_count = 0;
+
+    free(s->discard_list);
+    s->discard_list = NULL;
+
+    free(s->discard_free);
+    s->discard_free = NULL;
+
+    s->discard_free_count = 0;
+}
+
+/*
+ * Replaces the request pools, which must be idle. The old ones stay
+ * if allocating fails.
+ */
+static int
+vhd_initialize_requests(struct vhd_state *s, const td_limits_t * limits)
+{
+    int i, n = td_limits_data_requests(limits);
+    struct vhd_request *list, **free_list;
+    struct iovec *iovecs, **iov_free;
+    struct vhd_discard *discard_list, **discard_free;
+
+    list = calloc(n, sizeof(struct vhd_request));
+    free_list = calloc(n, sizeof(struct vhd_request *));
+    iovecs = calloc(limits->requests * limits->segments,
+                    sizeof(struct iovec));
+    iov_free = calloc(limits->requests, sizeof(struct iovec *));
+    discard_list = calloc(limits->requests, sizeof(struct vhd_discard));
+    discard_free = calloc(limits->requests, sizeof(struct vhd_discard *));
+    if (!list || !free_list || !iovecs || !iov_free ||
+        !discard_list || !discard_free) {
+        free(list);
+        free(free_list);
+        free(iovecs);
+        free(iov_free);
+        free(discard_list);
+        free(discard_free);
+        return -ENOMEM;
+    }
+
+    vhd_free_requests(s);
+
+    s->vreq_list = list;
+    s->vreq_free = free_list;
+    s->vreq_max_count = n;
+    s->vreq_free_count = n;
+    for (i = 0; i < n; i++)
+        s->vreq_free[i] = s->vreq_list + i;
+
+    s->vreq_iovecs = iovecs;
+    s->vreq_iov_free = iov_free;
+    s->vreq_iov_free_count = limits->requests;
+    for (i = 0; i < limits->requests; i++)
+        s->vreq_iov_free[i] = iovecs + i * limits->segments;
+
+    s->discard_list = discard_list;
+    s->discard_free = discard_free;
+    s->discard_free_count = limits->requests;
+    for (i = 0; i < limits->requests; i++)
+        s->discard_free[i] = s->discard_list + i;
+
+    return 0;
+}
+
+static int vhd_set_limits(td_driver_t * driver, const td_limits_t * limits)
+{
+    struct vhd_state *s = (struct vhd_state *) driver->data;
+
+    if (s->vreq_free_count != s->vreq_max_count ||
+        s->discard_free_count != driver->limits.requests)
+        return -EBUSY;
+
+    return vhd_initialize_requests(s, limits);
+}
+
 static void vhd_free_bat(struct vhd_state *s)
 {
     free(s->bat.bat.bat);
@@ -622,7 +773,7 @@ static void vhd_log_open(struct vhd_state *s)
 static int
 __vhd_open(td_driver_t * driver, const char *name, vhd_flag_t flags)
 {
-    int i, o_flags, err;
+    int o_flags, err;
     struct vhd_state *s;
 
     DBG(TLOG_INFO, "vhd_open: %s\n", name);
@@ -651,6 +802,7 @@ __vhd_open(td_driver_t * driver, const char *name, vhd_flag_t flags)
         err = vhd_open(&s->vhd, name, o_flags);
         if (err) {
             EPRINTF("Unable to open [%s] (%d)!\n", name, err);
+            vhd_free(s);
             return err;
         }
     }
@@ -668,12 +820,13 @@ __vhd_open(td_driver_t * driver, const char *name, vhd_flag_t flags)
     }
 
     vhd_log_open(s);
+    td_register_file(s->vhd.fd);
 
     SPB = s->spb;
 
-    s->vreq_free_count = VHD_REQS_DATA;
-    for (i = 0; i < VHD_REQS_DATA; i++)
-        s->vreq_free[i] = s->vreq_list + i;
+    err = vhd_initialize_requests(s, &driver->limits);
+    if (err)
+        goto fail;
 
     driver->info.size = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
     driver->info.sector_size = VHD_SECTOR_SIZE;
@@ -695,6 +848,7 @@ __vhd_open(td_driver_t * driver, const char *name, vhd_flag_t flags)
     return 0;
 
   fail:
+    vhd_free_requests(s);
     vhd_free_bat(s);
     vhd_free_bitmap_cache(s);
     vhd_close(&s->vhd);
@@ -768,9 +922,10 @@ static int _vhd_close(td_driver_t * driver)
     /* 
      * write footer if:
      *   - we killed it on open (opened with strict) 
-     *   - we've written data since opening
+     *   - we've written or discarded data since opening
      */
-    if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
+    if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes ||
+        s->discards) {
         memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
         err = vhd_write_footer(&s->vhd, &s->vhd.footer);
         memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
@@ -788,6 +943,8 @@ static int _vhd_close(td_driver_t * driver)
 
   free:
     vhd_log_close(s);
+    td_unregister_file(s->vhd.fd);
+    vhd_free_requests(s);
     vhd_free_bat(s);
     vhd_free_bitmap_cache(s);
     vhd_close(&s->vhd);
@@ -798,6 +955,28 @@ static int _vhd_close(td_driver_t * driver)
     return 0;
 }
 
+/*
+ * Counts whole blocks allocated in the BAT, even if their bitmaps have
+ * holes.
+ */
+static int vhd_allocated(td_driver_t * driver, td_sector_t sec, int secs)
+{
+    struct vhd_state *s = (struct vhd_state *) driver->data;
+    uint32_t blk;
+    int n;
+
+    if (s->vhd.footer.type == HD_TYPE_FIXED)
+        return secs;
+
+    for (n = 0; n < secs; n += s->spb - (sec + n) % s->spb) {
+        blk = (sec + n) / s->spb;
+        if (blk >= s->bat.bat.entries || bat_entry(s, blk) == DD_BLK_UNUSED)
+            break;
+    }
+
+    return MIN(n, secs);
+}
+
 int
 vhd_validate_parent(td_driver_t * child_driver,
                     td_driver_t * parent_driver, td_flag_t flags)
@@ -917,7 +1096,10 @@ remove_from_req_list(struct vhd_req_list *list, struct vhd_request *e)
 static inline void
 init_vhd_request(struct vhd_state *s, struct vhd_request *req)
 {
+    struct iovec *iov = req->iov;
+
     memset(req, 0, sizeof(struct vhd_request));
+    req->iov = iov;
     req->state = s;
 }
 
@@ -1016,14 +1198,20 @@ static inline int bitmap_locked(struct vhd_bitmap *bm)
     return test_vhd_flag(bm->status, VHD_FLAG_BM_LOCKED);
 }
 
+/*
+ * Requests for a block being read in or punched out wait on
+ * bm->waiting.
+ */
 static inline int bitmap_valid(struct vhd_bitmap *bm)
 {
-    return !test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
+    return !test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING) &&
+        !test_vhd_flag(bm->status, VHD_FLAG_BM_PUNCH_PENDING);
 }
 
 static inline int bitmap_in_use(struct vhd_bitmap *bm)
 {
     return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING) ||
+            test_vhd_flag(bm->status, VHD_FLAG_BM_PUNCH_PENDING) ||
             test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
             test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
             bm->waiting.head || bm->tx.requests.head || bm->queue.head);
@@ -1042,6 +1230,19 @@ static inline int bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
     return 1;
 }
 
+static inline int bitmap_empty(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+    int i, n;
+
+    n = s->spb >> 3;
+    for (i = 0; i < n; i++)
+        if (bm->map[i])
+            return 0;
+
+    DBG(TLOG_DBG, "bitmap 0x%04x empty\n", bm->blk);
+    return 1;
+}
+
 static struct vhd_bitmap *remove_lru_bitmap(struct vhd_state *s)
 {
     int i, idx = 0;
@@ -1184,7 +1385,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
     /* bump lru count */
     touch_bitmap(s, bm);
 
-    if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
+    if (!bitmap_valid(bm))
         return VHD_BM_READ_PENDING;
 
     return ((vhd_bitmap_test(&s->vhd, bm->map, sec)) ?
@@ -1237,6 +1438,9 @@ static inline struct vhd_request *alloc_vhd_request(struct vhd_state *s)
 static inline void
 free_vhd_request(struct vhd_state *s, struct vhd_request *req)
 {
+    if (req->iov)
+        s->vreq_iov_free[s->vreq_iov_free_count++] = req->iov;
+
     memset(req, 0, sizeof(struct vhd_request));
     s->vreq_free[s->vreq_free_count++] = req;
 }
@@ -1246,9 +1450,17 @@ aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
     struct tiocb *tiocb = &req->tiocb;
 
-    td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
-                 vhd_sectors_to_bytes(req->treq.secs),
-                 offset, vhd_complete, req);
+    if (req->treq.iovcnt > 1) {
+        ASSERT(s->vreq_iov_free_count);
+        req->iov = s->vreq_iov_free[--s->vreq_iov_free_count];
+        td_prep_readv(tiocb, s->vhd.fd, req->iov,
+                      td_request_iovec(&req->treq, req->iov,
+                                       VHD_SECTOR_SIZE),
+                      offset, vhd_complete, req);
+    } else
+        td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
+                     vhd_sectors_to_bytes(req->treq.secs),
+                     offset, vhd_complete, req);
     td_queue_tiocb(s->driver, tiocb);
 
     s->queued++;
@@ -1262,9 +1474,17 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
     struct tiocb *tiocb = &req->tiocb;
 
-    td_prep_write(tiocb, s->vhd.fd, req->treq.buf,
-                  vhd_sectors_to_bytes(req->treq.secs),
-                  offset, vhd_complete, req);
+    if (req->treq.iovcnt > 1) {
+        ASSERT(s->vreq_iov_free_count);
+        req->iov = s->vreq_iov_free[--s->vreq_iov_free_count];
+        td_prep_writev(tiocb, s->vhd.fd, req->iov,
+                       td_request_iovec(&req->treq, req->iov,
+                                        VHD_SECTOR_SIZE),
+                       offset, vhd_complete, req);
+    } else
+        td_prep_write(tiocb, s->vhd.fd, req->treq.buf,
+                      vhd_sectors_to_bytes(req->treq.secs),
+                      offset, vhd_complete, req);
     td_queue_tiocb(s->driver, tiocb);
 
     s->queued++;
@@ -1273,6 +1493,21 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
     TRACE(s);
 }
 
+static inline void
+aio_discard(struct vhd_state *s, struct vhd_request *req,
+            uint64_t offset, uint64_t secs)
+{
+    struct tiocb *tiocb = &req->tiocb;
+
+    td_prep_discard(tiocb, s->vhd.fd, vhd_sectors_to_bytes(secs),
+                    vhd_sectors_to_bytes(offset), vhd_complete_discard,
+                    req);
+    td_queue_tiocb(s->driver, tiocb);
+
+    s->queued++;
+    TRACE(s);
+}
+
 static inline uint64_t reserve_new_block(struct vhd_state *s, uint32_t blk)
 {
     int gap = 0;
@@ -1496,6 +1731,45 @@ static int allocate_block(struct vhd_state *s, uint32_t blk)
     return 0;
 }
 
+/*
+ * Gives the data of a block without any sectors left back to the file
+ * system. The BAT entry stays, so writing the block again needs no BAT
+ * update. This drops preallocated blocks too: the guest said it no
+ * longer needs the space.
+ *
+ * Requests for the block wait until the hole is punched, and the
+ * requests of the transaction, @done, complete with it. Returns
+ * -EBUSY if the block is left as it is.
+ */
+static int
+release_block(struct vhd_state *s, struct vhd_bitmap *bm,
+              struct vhd_request *done)
+{
+    uint64_t offset;
+    struct vhd_request *req;
+
+    offset = bat_entry(s, bm->blk);
+    ASSERT(offset != DD_BLK_UNUSED);
+
+    req = alloc_vhd_request(s);
+    if (!req)
+        return -EBUSY;
+
+    DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08" PRIx64 "\n",
+        bm->blk, offset);
+
+    req->treq.sec = (uint64_t) bm->blk * s->spb;
+    req->treq.secs = s->spb;
+    req->op = VHD_OP_BLOCK_PUNCH;
+    req->next = done;
+
+    lock_bitmap(bm);
+    set_vhd_flag(bm->status, VHD_FLAG_BM_PUNCH_PENDING);
+    aio_discard(s, req, offset + s->bm_secs, s->spb);
+
+    return 0;
+}
+
 static int
 schedule_data_read(struct vhd_state *s, td_request_t treq,
                    vhd_flag_t flags)
@@ -1709,7 +1983,7 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
     blk = treq.sec / s->spb;
     bm = get_bitmap(s, blk);
 
-    ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
+    ASSERT(bm && !bitmap_valid(bm));
 
     req = alloc_vhd_request(s);
     if (!req)
@@ -1730,6 +2004,36 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
     return 0;
 }
 
+/*
+ * Issues a vectored request as a single I/O if it maps to one run of
+ * allocated sectors, which is the common case. Returns -EAGAIN if it
+ * does not, or no iovecs are left, and the request needs to be split.
+ */
+static int
+vhd_queue_vectored(struct vhd_state *s, td_request_t treq, uint8_t op)
+{
+    int err;
+
+    if (!s->vreq_iov_free_count)
+        return -EAGAIN;
+
+    if (read_bitmap_cache(s, treq.sec, op) != VHD_BM_BIT_SET)
+        return -EAGAIN;
+
+    if (read_bitmap_cache_span(s, treq.sec, treq.secs, 1) != treq.secs)
+        return -EAGAIN;
+
+    if (op == VHD_OP_DATA_READ)
+        err = schedule_data_read(s, treq, 0);
+    else
+        err = schedule_data_write(s, treq, 0);
+
+    if (err)
+        td_complete_request(treq, err);
+
+    return 0;
+}
+
 static void vhd_queue_read(td_driver_t * driver, td_request_t treq)
 {
     struct vhd_state *s = (struct vhd_state *) driver->data;
@@ -1737,6 +2041,12 @@ static void vhd_queue_read(td_driver_t * driver, td_request_t treq)
     DBG(TLOG_DBG, "%s: lsec: 0x%08" PRIx64 ", secs: 0x%04x (seg: %d)\n",
         s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+    if (treq.iovcnt > 1) {
+        if (vhd_queue_vectored(s, treq, VHD_OP_DATA_READ))
+            td_split_request(driver, treq, vhd_queue_read);
+        return;
+    }
+
     while (treq.secs) {
         int err;
         td_request_t clone;
@@ -1804,6 +2114,22 @@ static void vhd_queue_read(td_driver_t * driver, td_request_t treq)
     }
 }
 
+/*
+ * Metadata updates complete before the writes needing them, so one
+ * sync of the file covers both.
+ */
+static void vhd_queue_flush(td_driver_t * driver, td_request_t treq)
+{
+    struct vhd_state *s = (struct vhd_state *) driver->data;
+
+    if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+        td_complete_request(treq, 0);
+        return;
+    }
+
+    td_queue_sync(driver, s->vhd.fd, treq);
+}
+
 static void vhd_queue_write(td_driver_t * driver, td_request_t treq)
 {
     struct vhd_state *s = (struct vhd_state *) driver->data;
@@ -1811,6 +2137,12 @@ static void vhd_queue_write(td_driver_t * driver, td_request_t treq)
     DBG(TLOG_DBG, "%s: lsec: 0x%08" PRIx64 ", secs: 0x%04x, (seg: %d)\n",
         s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+    if (treq.iovcnt > 1) {
+        if (vhd_queue_vectored(s, treq, VHD_OP_DATA_WRITE))
+            td_split_request(driver, treq, vhd_queue_write);
+        return;
+    }
+
     while (treq.secs) {
         int err;
         uint8_t flags;
@@ -1889,6 +2221,168 @@ static void vhd_queue_write(td_driver_t * driver, td_request_t treq)
     }
 }
 
+/*
+ * Clears the bits of a discard within one block, in the next bitmap
+ * transaction. Returns 1 if the discard completes later, 0 if there is
+ * nothing to clear.
+ */
+static int vhd_discard_block(struct vhd_state *s, td_request_t treq)
+{
+    int i, err;
+    uint32_t blk, sec;
+    struct vhd_bitmap *bm;
+    struct vhd_request *req;
+    struct vhd_transaction *tx;
+
+    blk = treq.sec / s->spb;
+    sec = treq.sec % s->spb;
+
+    if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+        if (bat_locked(s) && s->bat.pbw_blk == blk)
+            return -EBUSY;
+        return 0;
+    }
+
+    bm = get_bitmap(s, blk);
+    if (!bm) {
+        err = schedule_bitmap_read(s, blk);
+        if (err)
+            return err;
+        bm = get_bitmap(s, blk);
+    }
+
+    if (!bitmap_valid(bm)) {
+        err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, treq);
+        return err ? : 1;
+    }
+
+    touch_bitmap(s, bm);
+
+    for (i = 0; i < treq.secs; i++)
+        if (vhd_bitmap_test(&s->vhd, bm->map, sec + i) ||
+            vhd_bitmap_test(&s->vhd, bm->shadow, sec + i))
+            break;
+
+    if (i == treq.secs)
+        return 0;
+
+    req = alloc_vhd_request(s);
+    if (!req)
+        return -EBUSY;
+
+    req->treq = treq;
+    req->op = VHD_OP_DATA_DISCARD;
+    req->flags = VHD_FLAG_REQ_FINISHED;
+    req->next = NULL;
+
+    /* no I/O, the request finished right away */
+    s->queued++;
+    s->completed++;
+
+    lock_bitmap(bm);
+    tx = &bm->tx;
+
+    if (tx->closed) {
+        add_to_tail(&bm->queue, req);
+        set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+        return 1;
+    }
+
+    add_to_transaction(tx, req);
+    set_vhd_flag(tx->status, VHD_FLAG_TX_DISCARD);
+    tx->finished++;
+
+    for (i = 0; i < treq.secs; i++)
+        vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+
+    if (transaction_completed(tx))
+        finish_data_transaction(s, bm);
+
+    return 1;
+}
+
+static void vhd_discard_continue(struct vhd_state *, struct vhd_discard *);
+
+static void __vhd_discard_cb(td_request_t clone, int err)
+{
+    struct vhd_discard *d = clone.cb_data;
+
+    d->error = d->error ? : err;
+    vhd_discard_continue(d->state, d);
+}
+
+static void vhd_discard_continue(struct vhd_state *s, struct vhd_discard *d)
+{
+    td_sector_t end = d->treq.sec + d->treq.secs;
+    td_request_t treq, clone;
+    int err;
+
+    while (!d->error && d->sec < end) {
+        clone = d->treq;
+        clone.sec = d->sec;
+        clone.secs = MIN(end - d->sec, s->spb - (d->sec % s->spb));
+        clone.cb = __vhd_discard_cb;
+        clone.cb_data = d;
+
+        d->sec += clone.secs;
+
+        err = vhd_discard_block(s, clone);
+        if (err > 0)
+            return;
+
+        d->error = err;
+    }
+
+    treq = d->treq;
+    err = d->error;
+    s->discard_free[s->discard_free_count++] = d;
+
+    td_complete_request(treq, err);
+}
+
+/*
+ * Blocks of dynamic disks are discarded one after the other, so a
+ * discard needs at most one bitmap at a time.
+ */
+static void vhd_queue_discard(td_driver_t * driver, td_request_t treq)
+{
+    struct vhd_state *s = (struct vhd_state *) driver->data;
+    struct vhd_discard *d;
+
+    DBG(TLOG_DBG, "%s: lsec: 0x%08" PRIx64 ", secs: 0x%04x\n",
+        s->vhd.file, treq.sec, treq.secs);
+
+    s->discards++;
+    s->discard_size += treq.secs;
+
+    if (s->vhd.footer.type == HD_TYPE_FIXED) {
+        struct vhd_request *req = alloc_vhd_request(s);
+        if (!req) {
+            td_complete_request(treq, -EBUSY);
+            return;
+        }
+
+        req->treq = treq;
+        req->op = VHD_OP_DATA_DISCARD;
+        req->next = NULL;
+        aio_discard(s, req, treq.sec, treq.secs);
+        return;
+    }
+
+    if (!s->discard_free_count) {
+        td_complete_request(treq, -EBUSY);
+        return;
+    }
+
+    d = s->discard_free[--s->discard_free_count];
+    d->treq = treq;
+    d->sec = treq.sec;
+    d->error = 0;
+    d->state = s;
+
+    vhd_discard_continue(s, d);
+}
+
 static inline void signal_completion(struct vhd_request *list, int error)
 {
     struct vhd_state *s;
@@ -1941,12 +2435,18 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
         clear_vhd_flag(r->flags, VHD_FLAG_REQ_QUEUED);
 
         add_to_transaction(tx, r);
+        if (r->op == VHD_OP_DATA_DISCARD)
+            set_vhd_flag(tx->status, VHD_FLAG_TX_DISCARD);
+
         if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
             tx->finished++;
             if (!r->error) {
                 uint32_t sec = r->treq.sec % s->spb;
                 for (i = 0; i < r->treq.secs; i++)
-                    vhd_bitmap_set(&s->vhd, bm->shadow, sec + i);
+                    if (r->op == VHD_OP_DATA_DISCARD)
+                        vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+                    else
+                        vhd_bitmap_set(&s->vhd, bm->shadow, sec + i);
             }
         }
         r = next;
@@ -1989,6 +2489,7 @@ finish_bitmap_transaction(struct vhd_state *s,
 {
     int map_size;
     struct vhd_transaction *tx = &bm->tx;
+    struct vhd_request *done = tx->requests.head;
 
     DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", bm->blk, error);
     tx->error = (tx->error ? tx->error : error);
@@ -2013,10 +2514,20 @@ finish_bitmap_transaction(struct vhd_state *s,
         memcpy(bm->map, bm->shadow, map_size);
         if (!test_batmap(s, bm->blk) && bitmap_full(s, bm))
             set_batmap(s, bm->blk);
+
+        if (test_vhd_flag(tx->status, VHD_FLAG_TX_DISCARD)) {
+            if (test_batmap(s, bm->blk) && !bitmap_full(s, bm))
+                clear_batmap(s, bm->blk);
+
+            /* queued writes may have data in the block already */
+            if (!bm->queue.head && bitmap_empty(s, bm) &&
+                !release_block(s, bm, done))
+                done = NULL;
+        }
     }
 
     /* transaction done; signal completions */
-    signal_completion(tx->requests.head, tx->error);
+    signal_completion(done, tx->error);
     init_tx(tx);
     start_new_bitmap_transaction(s, bm);
 
@@ -2133,11 +2644,43 @@ static int finish_redundant_bm_write(struct vhd_request *req)
 }
 
 
+/*
+ * Reissues the requests which waited for a bitmap.
+ */
+static void requeue_waiting(struct vhd_state *s, struct vhd_request *r)
+{
+    struct vhd_request *next;
+
+    while (r) {
+        struct vhd_request tmp;
+
+        tmp = *r;
+        next = r->next;
+        free_vhd_request(s, r);
+
+        ASSERT(tmp.op == VHD_OP_DATA_READ ||
+               tmp.op == VHD_OP_DATA_WRITE ||
+               tmp.op == VHD_OP_DATA_DISCARD);
+
+        if (tmp.op == VHD_OP_DATA_READ)
+            vhd_queue_read(s->driver, tmp.treq);
+        else if (tmp.op == VHD_OP_DATA_WRITE)
+            vhd_queue_write(s->driver, tmp.treq);
+        else if (tmp.op == VHD_OP_DATA_DISCARD) {
+            int err = vhd_discard_block(s, tmp.treq);
+            if (err <= 0)
+                td_complete_request(tmp.treq, err);
+        }
+
+        r = next;
+    }
+}
+
 static void finish_bitmap_read(struct vhd_request *req)
 {
     uint32_t blk;
     struct vhd_bitmap *bm;
-    struct vhd_request *r, *next;
+    struct vhd_request *r;
     struct vhd_state *s = req->state;
 
     s->returned++;
@@ -2156,23 +2699,7 @@ static void finish_bitmap_read(struct vhd_request *req)
     if (!req->error) {
         memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
 
-        while (r) {
-            struct vhd_request tmp;
-
-            tmp = *r;
-            next = r->next;
-            free_vhd_request(s, r);
-
-            ASSERT(tmp.op == VHD_OP_DATA_READ ||
-                   tmp.op == VHD_OP_DATA_WRITE);
-
-            if (tmp.op == VHD_OP_DATA_READ)
-                vhd_queue_read(s->driver, tmp.treq);
-            else if (tmp.op == VHD_OP_DATA_WRITE)
-                vhd_queue_write(s->driver, tmp.treq);
-
-            r = next;
-        }
+        requeue_waiting(s, r);
     } else {
         int err = req->error;
         unlock_bitmap(bm);
@@ -2310,6 +2837,71 @@ void vhd_complete(void *arg, struct tiocb *tiocb, int err)
     }
 }
 
+/*
+ * Punching holes only frees space, so the discards succeed anyway.
+ */
+static void finish_data_discard(struct vhd_request *req)
+{
+    req->error = 0;
+    signal_completion(req, 0);
+}
+
+static void finish_block_punch(struct vhd_request *req)
+{
+    uint32_t blk;
+    struct vhd_bitmap *bm;
+    struct vhd_request *r;
+    struct vhd_state *s = req->state;
+
+    s->returned++;
+    TRACE(s);
+
+    blk = req->treq.sec / s->spb;
+    bm = get_bitmap(s, blk);
+
+    DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
+    ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_PUNCH_PENDING));
+
+    signal_completion(req->next, 0);
+    free_vhd_request(s, req);
+
+    r = bm->waiting.head;
+    clear_req_list(&bm->waiting);
+    clear_vhd_flag(bm->status, VHD_FLAG_BM_PUNCH_PENDING);
+
+    requeue_waiting(s, r);
+
+    if (!bitmap_in_use(bm))
+        unlock_bitmap(bm);
+}
+
+void vhd_complete_discard(void *arg, struct tiocb *tiocb, int err)
+{
+    struct vhd_request *req = (struct vhd_request *) arg;
+    struct vhd_state *s = req->state;
+
+    s->completed++;
+    TRACE(s);
+
+    if (err)
+        DBG(TLOG_INFO, "%s: punching 0x%04x secs at 0x%08" PRIx64
+            ": %d\n", s->vhd.file, req->treq.secs, req->treq.sec, err);
+
+    switch (req->op) {
+    case VHD_OP_DATA_DISCARD:
+        finish_data_discard(req);
+        break;
+
+    case VHD_OP_BLOCK_PUNCH:
+        finish_block_punch(req);
+        break;
+
+    default:
+        ASSERT(0);
+        break;
+    }
+}
+
 void vhd_debug(td_driver_t * driver)
 {
     int i;
@@ -2324,9 +2916,12 @@ void vhd_debug(td_driver_t * driver)
         (s->writes ? ((float) s->write_size / s->writes) : 0.0));
     DBG(TLOG_WARN, "READS: 0x%08" PRIx64 ", AVG_READ_SIZE: %f\n", s->reads,
         (s->reads ? ((float) s->read_size / s->reads) : 0.0));
+    DBG(TLOG_WARN, "DISCARDS: 0x%08" PRIx64 ", AVG_DISCARD_SIZE: %f\n",
+        s->discards,
+        (s->discards ? ((float) s->discard_size / s->discards) : 0.0));
 
-    DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%u total)\n", VHD_REQS_DATA);
-    for (i = 0; i < VHD_REQS_DATA; i++) {
+    DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%d total)\n", s->vreq_max_count);
+    for (i = 0; i < s->vreq_max_count; i++) {
         struct vhd_request *r = &s->vreq_list[i];
         td_request_t *t = &r->treq;
         const char *vname = t->vreq ? t->vreq->name : NULL;
@@ -2388,13 +2983,17 @@ void vhd_debug(td_driver_t * driver)
 
 struct tap_disk tapdisk_vhd = {
     .disk_type = "tapdisk_vhd",
-    .flags = 0,
+    .flags = TD_DRIVER_VECTORED,
     .private_data_size = sizeof(struct vhd_state),
     .td_open = _vhd_open,
     .td_close = _vhd_close,
     .td_queue_read = vhd_queue_read,
     .td_queue_write = vhd_queue_write,
+    .td_queue_flush = vhd_queue_flush,
+    .td_queue_discard = vhd_queue_discard,
+    .td_allocated = vhd_allocated,
     .td_get_parent_id = vhd_get_parent_id,
     .td_validate_parent = vhd_validate_parent,
     .td_debug = vhd_debug,
+    .td_set_limits = vhd_set_limits,
 };
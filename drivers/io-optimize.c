@@ -63,6 +63,9 @@ void opio_free(struct opioctx *ctx)
 
     free(ctx->event_queue);
     ctx->event_queue = NULL;
+
+    free(ctx->iovecs);
+    ctx->iovecs = NULL;
 }
 
 int opio_init(struct opioctx *ctx, int num_iocbs)
@@ -77,9 +80,11 @@ int opio_init(struct opioctx *ctx, int num_iocbs)
     ctx->free_opios = calloc(1, sizeof(struct opio *) * num_iocbs);
     ctx->iocb_queue = calloc(1, sizeof(struct iocb *) * num_iocbs);
     ctx->event_queue = calloc(1, sizeof(struct io_event) * num_iocbs);
+    ctx->iovecs = calloc(num_iocbs * OPIO_MAX_IOVECS,
+                         sizeof(struct iovec));
 
     if (!ctx->opios || !ctx->free_opios ||
-        !ctx->iocb_queue || !ctx->event_queue)
+        !ctx->iocb_queue || !ctx->event_queue || !ctx->iovecs)
         goto fail;
 
     for (i = 0; i < num_iocbs; i++)
@@ -110,8 +115,10 @@ static inline void restore_iocb(struct opio *op)
     struct iocb *io = op->iocb;
 
     io->data = op->data;
+    io->aio_lio_opcode = op->opcode;
     io->u.c.buf = op->buf;
     io->u.c.nbytes = op->nbytes;
+    io->u.c.offset = op->offset;
 }
 
 static inline int iocb_optimized(struct opioctx *ctx, struct iocb *io)
@@ -139,6 +146,31 @@ static inline int contiguous_iocbs(struct iocb *l, struct iocb *r)
             contiguous_sectors(l, r) && contiguous_buffers(l, r));
 }
 
+static inline int iocb_vectored(struct iocb *io)
+{
+    return (io->aio_lio_opcode == IO_CMD_PREADV ||
+            io->aio_lio_opcode == IO_CMD_PWRITEV);
+}
+
+static inline long long iocb_offset(struct iocb *io)
+{
+    return iocb_vectored(io) ? io->u.v.offset : io->u.c.offset;
+}
+
+static inline unsigned long iocb_nbytes(struct iocb *io)
+{
+    unsigned long nbytes = 0;
+    int i;
+
+    if (!iocb_vectored(io))
+        return io->u.c.nbytes;
+
+    for (i = 0; i < io->u.v.nr; i++)
+        nbytes += io->u.v.vec[i].iov_len;
+
+    return nbytes;
+}
+
 static inline void init_opio_list(struct opio *op)
 {
     op->list.head = op->list.tail = op;
@@ -155,6 +187,7 @@ static struct opio *opio_iocb_init(struct opioctx *ctx, struct iocb *io)
     op->buf = io->u.c.buf;
     op->nbytes = io->u.c.nbytes;
     op->offset = io->u.c.offset;
+    op->opcode = io->aio_lio_opcode;
     op->data = io->data;
     op->iocb = io;
     io->data = op;
@@ -197,12 +230,146 @@ static int merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
     if (head->aio_lio_opcode != io->aio_lio_opcode)
         return -EINVAL;
 
+    /* NB. vectored iocbs go out as they are */
+    if (io->aio_lio_opcode != IO_CMD_PREAD &&
+        io->aio_lio_opcode != IO_CMD_PWRITE)
+        return -EINVAL;
+
     if (!contiguous_iocbs(head, io))
         return -EINVAL;
 
     return merge_tail(ctx, head, io);
 }
 
+static inline struct iovec *opio_iovecs(struct opioctx *ctx,
+                                        struct opio *op)
+{
+    return ctx->iovecs + (op - ctx->opios) * OPIO_MAX_IOVECS;
+}
+
+/*
+ * Turns a merged head into a vectored iocb covering its current
+ * buffer. The original is saved in its opio, see restore_iocb().
+ */
+static void vectorize_head(struct opioctx *ctx, struct opio *ophead)
+{
+    struct iocb *head = ophead->iocb;
+    struct iovec *iov = opio_iovecs(ctx, ophead);
+
+    iov[0].iov_base = head->u.c.buf;
+    iov[0].iov_len = head->u.c.nbytes;
+
+    head->aio_lio_opcode = (ophead->opcode == IO_CMD_PREAD ?
+                            IO_CMD_PREADV : IO_CMD_PWRITEV);
+    head->u.v.vec = iov;
+    head->u.v.nr = 1;
+    head->u.v.offset = ophead->offset;
+}
+
+/*
+ * Like merge(), but only needs the sectors to be contiguous. Buffers
+ * which are not become another segment of a vectored head.
+ */
+static int
+merge_vectored(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+{
+    struct opio *ophead, *opio;
+    struct iovec *iov;
+    long long end;
+    short opcode;
+
+    if (io->aio_lio_opcode != IO_CMD_PREAD &&
+        io->aio_lio_opcode != IO_CMD_PWRITE)
+        return -EINVAL;
+
+    if (head->aio_fildes != io->aio_fildes)
+        return -EINVAL;
+
+    if (iocb_optimized(ctx, head)) {
+        ophead = (struct opio *) head->data;
+        opcode = ophead->opcode;
+        end = ophead->list.tail->offset + ophead->list.tail->nbytes;
+    } else {
+        if (iocb_vectored(head))
+            return -EINVAL;
+        ophead = NULL;
+        opcode = head->aio_lio_opcode;
+        end = head->u.c.offset + head->u.c.nbytes;
+    }
+
+    if (opcode != io->aio_lio_opcode || end != io->u.c.offset)
+        return -EINVAL;
+
+    if (!iocb_vectored(head)) {
+        if (contiguous_buffers(head, io))
+            return merge_tail(ctx, head, io);
+
+        if (!ophead) {
+            ophead = opio_get(ctx, head);
+            if (!ophead)
+                return -ENOMEM;
+        }
+        vectorize_head(ctx, ophead);
+    }
+
+    iov = (struct iovec *) head->u.v.vec + head->u.v.nr - 1;
+    if ((char *) iov->iov_base + iov->iov_len != io->u.c.buf &&
+        head->u.v.nr == OPIO_MAX_IOVECS)
+        return -EINVAL;
+
+    opio = opio_get(ctx, io);
+    if (!opio)
+        return -ENOMEM;
+
+    if ((char *) iov->iov_base + iov->iov_len != io->u.c.buf) {
+        iov++;
+        iov->iov_base = io->u.c.buf;
+        iov->iov_len = 0;
+        head->u.v.nr++;
+    }
+
+    iov->iov_len += io->u.c.nbytes;
+    opio->head = ophead;
+    ophead->list.tail = ophead->list.tail->next = opio;
+
+    return 0;
+}
+
+static inline int iocb_sync(struct iocb *io)
+{
+    return (io->aio_lio_opcode == IO_CMD_FSYNC ||
+            io->aio_lio_opcode == IO_CMD_FDSYNC);
+}
+
+static inline int iocb_before(struct iocb *l, struct iocb *r)
+{
+    if (l->aio_fildes != r->aio_fildes)
+        return l->aio_fildes < r->aio_fildes;
+
+    /* syncs have no offset, keep them off the data runs */
+    if (iocb_sync(l) || iocb_sync(r))
+        return !iocb_sync(l);
+
+    return iocb_offset(l) < iocb_offset(r);
+}
+
+/*
+ * Stable insertion sort by (fd, offset). Batches are small and mostly
+ * in order already.
+ */
+static void sort_iocbs(struct iocb **q, int num)
+{
+    struct iocb *io;
+    int i, j;
+
+    for (i = 1; i < num; i++) {
+        io = q[i];
+        for (j = i; j > 0 && iocb_before(io, q[j - 1]); j--)
+            q[j] = q[j - 1];
+        q[j] = io;
+    }
+}
+
 #if (defined(TEST) || defined(DEBUG))
 static void
 print_optimized_iocbs(struct opioctx *ctx, struct opio *op, int *cnt)
@@ -253,15 +420,28 @@ int io_merge(struct opioctx *ctx, struct iocb **queue, int num)
     q = ctx->iocb_queue;
     memcpy(q, queue, num * sizeof(struct iocb *));
 
-    for (i = 1; i < num; i++) {
-        io = q[i];
-        if (merge(ctx, queue[on_queue], io) != 0)
-            queue[++on_queue] = io;
-    }
+    if (ctx->flags & OPIO_SORT) {
+        sort_iocbs(q, num);
+        queue[0] = q[0];
+
+        for (i = 1; i < num; i++) {
+            io = q[i];
+            if (merge_vectored(ctx, queue[on_queue], io) != 0)
+                queue[++on_queue] = io;
+        }
+    } else
+        for (i = 1; i < num; i++) {
+            io = q[i];
+            if (merge(ctx, queue[on_queue], io) != 0)
+                queue[++on_queue] = io;
+        }
 
     print_merged_iocbs(ctx, queue, on_queue + 1);
 
-    return ++on_queue;
+    ctx->merge_in += num;
+    ctx->merge_out += ++on_queue;
+
+    return on_queue;
 }
 
 static int
@@ -315,12 +495,16 @@ expand_event(struct opioctx *ctx,
     struct iocb *io;
     struct io_event *ep;
     struct opio *ophead, *op, *next;
+    unsigned long nbytes = 0;
 
     io = event->obj;
     ophead = (struct opio *) io->data;
+
+    for (op = ophead; op; op = op->next)
+        nbytes += op->nbytes;
     op = ophead;
 
-    if (event->res == io->u.c.nbytes)
+    if (event->res == nbytes)
         err = 0;
     else if ((int) event->res < 0)
         err = (int) event->res;
@@ -372,8 +556,8 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
     DBG(ctx,
         "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
-        " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes,
-        io->u.c.buf,
+        " optimized: %d\n", prefix, iocb_offset(io), iocb_nbytes(io),
+        iocb_vectored(io) ? io->u.v.vec[0].iov_base : io->u.c.buf,
         (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write"),
         (unsigned long) io->data, iocb_optimized(ctx, io));
 }
@@ -397,7 +581,7 @@ end debug print functions
 static void usage(void)
 {
     fprintf(stderr, "usage: io_optimize [-n num_runs] "
-            "[-i num_iocbs] [-s num_secs] [-r random_seed]\n");
+            "[-i num_iocbs] [-s num_secs] [-r random_seed] [-o]\n");
     exit(-1);
 }
 
@@ -472,6 +656,20 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
     }
 }
 
+static void
+shuffle_iocbs(struct iocb **iocbs, int num_iocbs)
+{
+    int i, j;
+    struct iocb *io;
+
+    for (i = num_iocbs - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        io = iocbs[i];
+        iocbs[i] = iocbs[j];
+        iocbs[j] = io;
+    }
+}
+
 static int
 simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
@@ -488,7 +686,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
         io = iocbs[i];
         ep = &events[i];
         ep->obj = io;
-        ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+        ep->res = (random() % 10 < 8 ? iocb_nbytes(io) : 0);
     }
 
     return done;
@@ -560,15 +758,16 @@ int main(int argc, char **argv)
     uint64_t num_secs;
     struct opioctx ctx;
     struct io_event *events;
-    int i, c, num_runs, num_iocbs, seed;
+    int i, c, num_runs, num_iocbs, seed, flags;
     struct iocb *iocb_list, **iocbs, **ioqueue;
 
     num_runs = 1;
     num_iocbs = 300;
     seed = time(NULL);
     num_secs = ((4ULL << 20) >> 9); /* 4GB disk */
+    flags = 0;
 
-    while ((c = getopt(argc, argv, "n:i:s:r:h")) != -1) {
+    while ((c = getopt(argc, argv, "n:i:s:r:oh")) != -1) {
         switch (c) {
         case 'n':
             num_runs = atoi(optarg);
@@ -582,6 +781,9 @@ int main(int argc, char **argv)
         case 'r':
             seed = atoi(optarg);
             break;
+        case 'o':
+            flags |= OPIO_SORT;
+            break;
         case 'h':
             usage();
         case '?':
@@ -604,12 +806,16 @@ int main(int argc, char **argv)
         exit(ENOMEM);
     }
 
+    ctx.flags = flags;
+
     for (i = 0; i < num_runs; i++) {
         int op_rem, op_done, num_split, num_events, num_done;
 
         ioqueue = iocbs;
         init_optest(iocb_list, ioqueue, events, num_iocbs);
         randomize_iocbs(ioqueue, num_iocbs, num_secs);
+        if (flags & OPIO_SORT)
+            shuffle_iocbs(ioqueue, num_iocbs);
         print_iocbs(&ctx, ioqueue, num_iocbs);
 
         op_done = 0;
@@ -5,8 +5,22 @@
 #ifndef __IO_OPTIMIZE_H__
 #define __IO_OPTIMIZE_H__
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <libaio.h>
 
+/*
+ * Merged iocbs with discontiguous buffers become vectored, with at most
+ * this many segments.
+ */
+#define OPIO_MAX_IOVECS 16
+
+/*
+ * OPIO_SORT: sort each batch by (fd, offset) before merging, and
+ * merge disk-contiguous iocbs into vectored ones.
+ */
+#define OPIO_SORT       (1 << 0)
+
 struct opio;
 
 struct opio_list {
@@ -18,6 +32,7 @@ struct opio {
     char *buf;
     unsigned long nbytes;
     long long offset;
+    short opcode;
     void *data;
     struct iocb *iocb;
     struct io_event event;
@@ -33,6 +48,13 @@ struct opioctx {
     struct opio **free_opios;
     struct iocb **iocb_queue;
     struct io_event *event_queue;
+    struct iovec *iovecs;
+
+    int flags;
+
+    /* iocbs passed to and returned from io_merge */
+    uint64_t merge_in;
+    uint64_t merge_out;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -31,11 +31,15 @@
 #endif
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "tapdisk.h"
 #include "scheduler.h"
@@ -44,7 +48,7 @@
 #define DBG(_f, _a...)               if (0) { tlog_syslog(TLOG_DBG, _f, ##_a); }
 #define BUG_ON(_cond)                if (_cond) td_panic()
 
-#define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_TIMEOUT        SCHEDULER_USECS(600)
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -57,20 +61,247 @@
 #define scheduler_for_each_event_safe(s, event, tmp)	\
 	TAILQ_FOREACH_SAFE(event,&(s)->events, entry, tmp)
 
-static void scheduler_prepare_events(scheduler_t * s)
+/*
+ * All events polling a given fd. The backend is told about changes
+ * per fd, not per event, since epoll accepts each fd only once.
+ */
+struct scheduler_fd {
+    int fd;
+    char mode;
+    struct tqh_event events;
+};
+
+#define scheduler_fd_for_each_event(sfd, event)	\
+	TAILQ_FOREACH(event, &(sfd)->events, fd_entry)
+
+static char scheduler_fd_mode(struct scheduler_fd *sfd)
 {
-    int diff;
-    struct timeval now;
     event_t *event;
+    char mode = 0;
+
+    scheduler_fd_for_each_event(sfd, event) {
+        if (event->dead || event->masked)
+            continue;
+
+        mode |= event->mode & SCHEDULER_POLL_FD;
+    }
+
+    return mode;
+}
+
+static struct scheduler_fd *scheduler_get_fd(scheduler_t * s, int fd)
+{
+    struct scheduler_fd *sfd;
+
+    if (fd < 0)
+        return NULL;
+
+    if (fd >= s->n_fds) {
+        struct scheduler_fd **fds;
+        int n;
+
+        n = MAX(fd + 1, 2 * s->n_fds);
+        fds = realloc(s->fds, n * sizeof(*fds));
+        if (!fds)
+            return NULL;
+
+        memset(fds + s->n_fds, 0, (n - s->n_fds) * sizeof(*fds));
+        s->fds = fds;
+        s->n_fds = n;
+    }
+
+    sfd = s->fds[fd];
+    if (!sfd) {
+        sfd = calloc(1, sizeof(*sfd));
+        if (!sfd)
+            return NULL;
+
+        sfd->fd = fd;
+        TAILQ_INIT(&sfd->events);
+        s->fds[fd] = sfd;
+    }
+
+    return sfd;
+}
+
+static void scheduler_put_fd(scheduler_t * s, event_t * event)
+{
+    struct scheduler_fd *sfd = s->fds[event->fd];
+
+    TAILQ_REMOVE(&sfd->events, event, fd_entry);
+
+    if (TAILQ_EMPTY(&sfd->events)) {
+        s->fds[event->fd] = NULL;
+        free(sfd);
+    }
+}
+
+static int scheduler_update_fd(scheduler_t * s, int fd)
+{
+    if (fd < 0 || fd >= s->n_fds || !s->fds[fd])
+        return 0;
+
+    return s->backend->update(s, s->fds[fd]);
+}
+
+static void scheduler_set_pending(scheduler_t * s, event_t * event,
+                                  char mode)
+{
+    if (!event->pending)
+        TAILQ_INSERT_TAIL(&s->pending, event, pending_entry);
+
+    event->pending |= mode;
+}
+
+int64_t scheduler_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return SCHEDULER_USECS(ts.tv_sec) + ts.tv_nsec / 1000;
+}
+
+/*
+ * Timer heap. Only live, unmasked timeout events are kept on it;
+ * event->timer_idx is their position, or -1.
+ */
+
+static void scheduler_timer_set(scheduler_t * s, int i, event_t * event)
+{
+    s->timers[i] = event;
+    event->timer_idx = i;
+}
+
+static void scheduler_timer_sift_up(scheduler_t * s, int i)
+{
+    event_t *event = s->timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (s->timers[parent]->deadline <= event->deadline)
+            break;
+
+        scheduler_timer_set(s, i, s->timers[parent]);
+        i = parent;
+    }
+
+    scheduler_timer_set(s, i, event);
+}
+
+static void scheduler_timer_sift_down(scheduler_t * s, int i)
+{
+    event_t *event = s->timers[i];
 
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= s->n_timers)
+            break;
+
+        if (child + 1 < s->n_timers &&
+            s->timers[child + 1]->deadline < s->timers[child]->deadline)
+            child++;
+
+        if (event->deadline <= s->timers[child]->deadline)
+            break;
+
+        scheduler_timer_set(s, i, s->timers[child]);
+        i = child;
+    }
+
+    scheduler_timer_set(s, i, event);
+}
+
+static int scheduler_timer_reserve(scheduler_t * s)
+{
+    event_t **timers;
+    int n;
+
+    if (s->n_timer_events < s->max_timers)
+        return 0;
+
+    n = s->max_timers ? 2 * s->max_timers : 16;
+    timers = realloc(s->timers, n * sizeof(*timers));
+    if (!timers)
+        return -ENOMEM;
+
+    s->timers = timers;
+    s->max_timers = n;
+
+    return 0;
+}
+
+static void scheduler_timer_add(scheduler_t * s, event_t * event)
+{
+    if (event->timer_idx >= 0 || event->dead || event->masked)
+        return;
+
+    BUG_ON(s->n_timers >= s->max_timers);
+
+    scheduler_timer_set(s, s->n_timers++, event);
+    scheduler_timer_sift_up(s, event->timer_idx);
+}
+
+static void scheduler_timer_del(scheduler_t * s, event_t * event)
+{
+    int i = event->timer_idx;
+    event_t *last;
+
+    if (i < 0)
+        return;
+
+    event->timer_idx = -1;
+
+    last = s->timers[--s->n_timers];
+    if (last == event)
+        return;
+
+    scheduler_timer_set(s, i, last);
+    scheduler_timer_sift_up(s, i);
+    scheduler_timer_sift_down(s, last->timer_idx);
+}
+
+static void scheduler_timer_rearm(scheduler_t * s, event_t * event)
+{
+    scheduler_timer_del(s, event);
+    event->deadline = scheduler_now() + event->timeout;
+    scheduler_timer_add(s, event);
+}
+
+/*
+ * select(2) backend. Rebuilds the fd sets on every iteration and
+ * cannot poll fds beyond FD_SETSIZE.
+ */
+
+static int scheduler_select_init(scheduler_t * s)
+{
     FD_ZERO(&s->read_fds);
     FD_ZERO(&s->write_fds);
     FD_ZERO(&s->except_fds);
 
-    s->max_fd = -1;
-    s->timeout = SCHEDULER_MAX_TIMEOUT;
+    return 0;
+}
 
-    gettimeofday(&now, NULL);
+static int scheduler_select_update(scheduler_t * s,
+                                   struct scheduler_fd *sfd)
+{
+    if (sfd->fd >= FD_SETSIZE)
+        return -EINVAL;
+
+    return 0;
+}
+
+static void scheduler_select_prepare(scheduler_t * s)
+{
+    event_t *event;
+
+    FD_ZERO(&s->read_fds);
+    FD_ZERO(&s->write_fds);
+    FD_ZERO(&s->except_fds);
+
+    s->max_fd = -1;
 
     scheduler_for_each_event(s, event) {
         if (event->masked || event->dead)
@@ -90,20 +321,10 @@ static void scheduler_prepare_events(scheduler_t * s)
             FD_SET(event->fd, &s->except_fds);
             s->max_fd = MAX(event->fd, s->max_fd);
         }
-
-        if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-            diff = event->deadline - now.tv_sec;
-            if (diff > 0)
-                s->timeout = MIN(s->timeout, diff);
-            else
-                s->timeout = 0;
-        }
     }
-
-    s->timeout = MIN(s->timeout, s->max_timeout);
 }
 
-static int scheduler_check_fd_events(scheduler_t * s, int nfds)
+static int scheduler_select_check(scheduler_t * s, int nfds)
 {
     event_t *event;
 
@@ -117,21 +338,21 @@ static int scheduler_check_fd_events(scheduler_t * s, int nfds)
         if ((event->mode & SCHEDULER_POLL_READ_FD) &&
             FD_ISSET(event->fd, &s->read_fds)) {
             FD_CLR(event->fd, &s->read_fds);
-            event->pending |= SCHEDULER_POLL_READ_FD;
+            scheduler_set_pending(s, event, SCHEDULER_POLL_READ_FD);
             --nfds;
         }
 
         if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
             FD_ISSET(event->fd, &s->write_fds)) {
             FD_CLR(event->fd, &s->write_fds);
-            event->pending |= SCHEDULER_POLL_WRITE_FD;
+            scheduler_set_pending(s, event, SCHEDULER_POLL_WRITE_FD);
             --nfds;
         }
 
         if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
             FD_ISSET(event->fd, &s->except_fds)) {
             FD_CLR(event->fd, &s->except_fds);
-            event->pending |= SCHEDULER_POLL_EXCEPT_FD;
+            scheduler_set_pending(s, event, SCHEDULER_POLL_EXCEPT_FD);
             --nfds;
         }
     }
@@ -139,49 +360,256 @@ static int scheduler_check_fd_events(scheduler_t * s, int nfds)
     return nfds;
 }
 
-static void scheduler_check_timeouts(scheduler_t * s)
+static int scheduler_select_wait(scheduler_t * s, int64_t timeout)
 {
-    struct timeval now;
-    event_t *event;
+    struct timeval tv;
+    int ret;
 
-    gettimeofday(&now, NULL);
+    scheduler_select_prepare(s);
 
-    scheduler_for_each_event(s, event) {
-        BUG_ON(event->pending && event->masked);
+    tv.tv_sec = timeout / SCHEDULER_USECS(1);
+    tv.tv_usec = timeout % SCHEDULER_USECS(1);
 
-        if (event->dead)
-            continue;
+    ret = select(s->max_fd + 1, &s->read_fds,
+                 &s->write_fds, &s->except_fds, &tv);
+    if (ret < 0)
+        return -errno;
 
-        if (event->pending)
+    if (ret) {
+        ret = scheduler_select_check(s, ret);
+        BUG_ON(ret);
+    }
+
+    return 0;
+}
+
+static const struct scheduler_backend scheduler_select = {
+    .name = "select",
+    .init = scheduler_select_init,
+    .update = scheduler_select_update,
+    .wait = scheduler_select_wait,
+};
+
+/*
+ * epoll(7) backend. Interest is only updated when events are
+ * (un)registered or (un)masked, and ready fds map straight to
+ * their events. epoll_wait only takes milliseconds, so timeouts
+ * with a sub-millisecond part go through a timerfd.
+ */
+
+static int scheduler_epoll_init(scheduler_t * s)
+{
+    struct epoll_event ev;
+    int err;
+
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0)
+        goto fail;
+
+    s->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                 TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->timer_fd < 0)
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = s->timer_fd;
+
+    err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->timer_fd, &ev);
+    if (err)
+        goto fail;
+
+    return 0;
+
+  fail:
+    err = -errno;
+    if (s->timer_fd >= 0) {
+        close(s->timer_fd);
+        s->timer_fd = -1;
+    }
+    if (s->epoll_fd >= 0) {
+        close(s->epoll_fd);
+        s->epoll_fd = -1;
+    }
+    return err;
+}
+
+static int scheduler_epoll_update(scheduler_t * s, struct scheduler_fd *sfd)
+{
+    struct epoll_event ev;
+    int err, op;
+    char mode;
+
+    mode = scheduler_fd_mode(sfd);
+    if (mode == sfd->mode)
+        return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = sfd->fd;
+
+    if (mode & SCHEDULER_POLL_READ_FD)
+        ev.events |= EPOLLIN;
+    if (mode & SCHEDULER_POLL_WRITE_FD)
+        ev.events |= EPOLLOUT;
+    if (mode & SCHEDULER_POLL_EXCEPT_FD)
+        ev.events |= EPOLLPRI;
+
+    if (!mode)
+        op = EPOLL_CTL_DEL;
+    else if (!sfd->mode)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    /*
+     * NB. The kernel drops closed fds from the interest set behind
+     * our back, and fd numbers get reused.
+     */
+    err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+    if (err && op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+        err = 0;
+    if (err && op == EPOLL_CTL_MOD && errno == ENOENT)
+        err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, sfd->fd, &ev);
+    if (err && op == EPOLL_CTL_ADD && errno == EEXIST)
+        err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+    if (err)
+        return -errno;
+
+    sfd->mode = mode;
+
+    return 0;
+}
+
+static int scheduler_epoll_wait(scheduler_t * s, int64_t timeout)
+{
+    struct scheduler_fd *sfd;
+    event_t *event;
+    int i, n, ms;
+
+    if (timeout % 1000) {
+        struct itimerspec its;
+
+        /*
+         * NB. A timer which did not fire before some fd did may
+         * cause one spurious wakeup later. Rearming it resets
+         * the expiry count.
+         */
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = timeout / SCHEDULER_USECS(1);
+        its.it_value.tv_nsec = (timeout % SCHEDULER_USECS(1)) * 1000;
+
+        if (timerfd_settime(s->timer_fd, 0, &its, NULL))
+            return -errno;
+
+        ms = -1;
+    } else
+        ms = timeout / 1000;
+
+    n = epoll_wait(s->epoll_fd, s->epoll_events,
+                   SCHEDULER_EPOLL_EVENTS, ms);
+    if (n < 0)
+        return -errno;
+
+    for (i = 0; i < n; i++) {
+        struct epoll_event *ev = &s->epoll_events[i];
+        char mode = 0;
+
+        if (ev->data.fd == s->timer_fd) {
+            uint64_t expired;
+
+            if (read(s->timer_fd, &expired, sizeof(expired)) < 0 &&
+                errno != EAGAIN)
+                return -errno;
             continue;
+        }
 
-        if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+        if (ev->data.fd >= s->n_fds)
             continue;
 
-        if (event->deadline > now.tv_sec)
+        sfd = s->fds[ev->data.fd];
+        if (!sfd)
             continue;
 
-        event->pending = SCHEDULER_POLL_TIMEOUT;
+        /*
+         * NB. select reports errors and hangups as readable or
+         * writable, whichever was asked for.
+         */
+        if (ev->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            mode |= SCHEDULER_POLL_READ_FD;
+        if (ev->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            mode |= SCHEDULER_POLL_WRITE_FD;
+        if (ev->events & EPOLLPRI)
+            mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+        scheduler_fd_for_each_event(sfd, event) {
+            char pending;
+
+            if (event->dead || event->masked)
+                continue;
+
+            pending = event->mode & mode;
+            if (pending)
+                scheduler_set_pending(s, event, pending);
+        }
     }
+
+    return 0;
 }
 
-static int scheduler_check_events(scheduler_t * s, int nfds)
+static const struct scheduler_backend scheduler_epoll = {
+    .name = "epoll",
+    .init = scheduler_epoll_init,
+    .update = scheduler_epoll_update,
+    .wait = scheduler_epoll_wait,
+};
+
+static const struct scheduler_backend *scheduler_backends[] = {
+    &scheduler_epoll,
+    &scheduler_select,
+};
+
+static void scheduler_prepare_timeout(scheduler_t * s)
 {
-    if (nfds)
-        nfds = scheduler_check_fd_events(s, nfds);
+    int64_t diff;
 
-    scheduler_check_timeouts(s);
+    s->timeout = SCHEDULER_MAX_TIMEOUT;
 
-    return nfds;
+    if (s->n_timers) {
+        diff = s->timers[0]->deadline - scheduler_now();
+        if (diff > 0)
+            s->timeout = MIN(s->timeout, diff);
+        else
+            s->timeout = 0;
+    }
+
+    s->timeout = MIN(s->timeout, s->max_timeout);
 }
 
-static void scheduler_event_callback(event_t * event, char mode)
+static void scheduler_check_timeouts(scheduler_t * s)
 {
-    if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        event->deadline = now.tv_sec + event->timeout;
+    int64_t now;
+    event_t *event;
+
+    now = scheduler_now();
+
+    while (s->n_timers) {
+        event = s->timers[0];
+
+        if (event->deadline > now)
+            break;
+
+        scheduler_timer_del(s, event);
+
+        if (!event->pending)
+            scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
     }
+}
+
+static void scheduler_event_callback(scheduler_t * s, event_t * event,
+                                     char mode)
+{
+    if (event->mode & SCHEDULER_POLL_TIMEOUT)
+        scheduler_timer_rearm(s, event);
 
     if (!event->masked)
         event->cb(event->id, mode, event->private);
@@ -192,19 +620,19 @@ static int scheduler_run_events(scheduler_t * s)
     event_t *event;
     int n_dispatched = 0;
 
-    scheduler_for_each_event(s, event) {
+    while ((event = TAILQ_FIRST(&s->pending))) {
         char pending;
 
+        TAILQ_REMOVE(&s->pending, event, pending_entry);
+        pending = event->pending;
+        event->pending = 0;
+
         if (event->dead)
             continue;
 
-        pending = event->pending;
-        if (pending) {
-            event->pending = 0;
-            /* NB. must clear before cb */
-            scheduler_event_callback(event, pending);
-            n_dispatched++;
-        }
+        /* NB. must clear before cb */
+        scheduler_event_callback(s, event, pending);
+        n_dispatched++;
     }
 
     return n_dispatched;
@@ -212,10 +640,11 @@ static int scheduler_run_events(scheduler_t * s)
 
 int
 scheduler_register_event(scheduler_t * s, char mode, int fd,
-                         int timeout, event_cb_t cb, void *private)
+                         int64_t timeout, event_cb_t cb, void *private)
 {
     event_t *event;
-    struct timeval now;
+    struct scheduler_fd *sfd;
+    int err;
 
     if (!cb)
         return -EINVAL;
@@ -223,24 +652,49 @@ scheduler_register_event(scheduler_t * s, char mode, int fd,
     if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
         return -EINVAL;
 
+    if (mode & SCHEDULER_POLL_TIMEOUT) {
+        err = scheduler_timer_reserve(s);
+        if (err)
+            return err;
+    }
+
     event = calloc(1, sizeof(event_t));
     if (!event)
         return -ENOMEM;
 
-    gettimeofday(&now, NULL);
-
-    //FIXME
-    //INIT_LIST_HEAD(&event->next);
-
     event->mode = mode;
     event->fd = fd;
     event->timeout = timeout;
-    event->deadline = now.tv_sec + timeout;
+    event->deadline = scheduler_now() + timeout;
+    event->timer_idx = -1;
     event->cb = cb;
     event->private = private;
-    event->id = s->uuid++;
     event->masked = 0;
 
+    if (mode & SCHEDULER_POLL_FD) {
+        sfd = scheduler_get_fd(s, fd);
+        if (!sfd) {
+            free(event);
+            return fd < 0 ? -EINVAL : -ENOMEM;
+        }
+
+        TAILQ_INSERT_TAIL(&sfd->events, event, fd_entry);
+
+        err = s->backend->update(s, sfd);
+        if (err) {
+            scheduler_put_fd(s, event);
+            free(event);
+            return err;
+        }
+    }
+
+    if (mode & SCHEDULER_POLL_TIMEOUT) {
+        s->n_timer_events++;
+        scheduler_timer_add(s, event);
+    }
+
+    event->id = s->uuid++;
+
     if (!s->uuid)
         s->uuid++;
 
@@ -258,7 +712,13 @@ void scheduler_unregister_event(scheduler_t * s, event_id_t id)
 
     scheduler_for_each_event(s, event)
         if (event->id == id) {
+        if (event->dead)
+            break;
         event->dead = 1;
+        s->n_dead++;
+        if (event->mode & SCHEDULER_POLL_FD)
+            scheduler_update_fd(s, event->fd);
+        scheduler_timer_del(s, event);
         break;
     }
 }
@@ -273,6 +733,14 @@ void scheduler_mask_event(scheduler_t * s, event_id_t id, int masked)
     scheduler_for_each_event(s, event)
         if (event->id == id) {
         event->masked = ! !masked;
+        if (event->mode & SCHEDULER_POLL_FD)
+            scheduler_update_fd(s, event->fd);
+        if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+            if (event->masked)
+                scheduler_timer_del(s, event);
+            else if (!event->pending)
+                scheduler_timer_add(s, event);
+        }
         break;
     }
 }
@@ -281,14 +749,25 @@ static void scheduler_gc_events(scheduler_t * s)
 {
     event_t *event, *next;
 
+    if (!s->n_dead)
+        return;
+
     scheduler_for_each_event_safe(s, event, next)
         if (event->dead) {
         TAILQ_REMOVE(&s->events, event, entry);
+        if (event->mode & SCHEDULER_POLL_FD)
+            scheduler_put_fd(s, event);
+        if (event->mode & SCHEDULER_POLL_TIMEOUT)
+            s->n_timer_events--;
+        if (event->pending)
+            TAILQ_REMOVE(&s->pending, event, pending_entry);
         free(event);
     }
+
+    s->n_dead = 0;
 }
 
-void scheduler_set_max_timeout(scheduler_t * s, int timeout)
+void scheduler_set_max_timeout(scheduler_t * s, int64_t timeout)
 {
     if (timeout >= 0)
         s->max_timeout = MIN(s->max_timeout, timeout);
@@ -297,7 +776,6 @@ void scheduler_set_max_timeout(scheduler_t * s, int timeout)
 int scheduler_wait_for_events(scheduler_t * s)
 {
     int ret;
-    struct timeval tv;
 
     s->depth++;
     ret = 0;
@@ -308,21 +786,16 @@ int scheduler_wait_for_events(scheduler_t * s)
          * progress. */
         goto out;
 
-    scheduler_prepare_events(s);
-
-    tv.tv_sec = s->timeout;
-    tv.tv_usec = 0;
-
-    DBG("timeout: %d, max_timeout: %d\n", s->timeout, s->max_timeout);
+    scheduler_prepare_timeout(s);
 
-    ret = select(s->max_fd + 1, &s->read_fds,
-                 &s->write_fds, &s->except_fds, &tv);
+    DBG("timeout: %" PRId64 ", max_timeout: %" PRId64 "\n",
+        s->timeout, s->max_timeout);
 
+    ret = s->backend->wait(s, s->timeout);
     if (ret < 0)
         goto out;
 
-    ret = scheduler_check_events(s, ret);
-    BUG_ON(ret);
+    scheduler_check_timeouts(s);
 
     s->timeout = SCHEDULER_MAX_TIMEOUT;
     s->max_timeout = SCHEDULER_MAX_TIMEOUT;
@@ -338,16 +811,39 @@ int scheduler_wait_for_events(scheduler_t * s)
     return ret;
 }
 
-void scheduler_initialize(scheduler_t * s)
+int scheduler_initialize(scheduler_t * s, const char *name)
 {
+    const struct scheduler_backend *backend;
+    int i, err;
+
     memset(s, 0, sizeof(scheduler_t));
 
     s->uuid = 1;
     s->depth = 0;
-
-    FD_ZERO(&s->read_fds);
-    FD_ZERO(&s->write_fds);
-    FD_ZERO(&s->except_fds);
+    s->epoll_fd = -1;
+    s->timer_fd = -1;
+    s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
     TAILQ_INIT(&s->events);
+    TAILQ_INIT(&s->pending);
+
+    err = -EINVAL;
+
+    for (i = 0; i < ARRAY_SIZE(scheduler_backends); i++) {
+        backend = scheduler_backends[i];
+
+        if (name && strcmp(name, backend->name))
+            continue;
+
+        err = backend->init(s);
+        if (!err) {
+            s->backend = backend;
+            break;
+        }
+
+        if (name)
+            break;
+    }
+
+    return err;
 }
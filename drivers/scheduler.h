@@ -28,7 +28,9 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
+#include <stdint.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include "blktap.h"
 
 #define SCHEDULER_POLL_READ_FD       0x1
@@ -36,6 +38,11 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+/*
+ * Timeouts are in microseconds, measured on CLOCK_MONOTONIC.
+ */
+#define SCHEDULER_USECS(_secs)       ((int64_t)(_secs) * 1000000)
+
 typedef int event_id_t;
 typedef void (*event_cb_t) (event_id_t id, char mode, void *private);
 
@@ -48,8 +55,9 @@ typedef struct event {
     event_id_t id;
 
     int fd;
-    int timeout;
-    int deadline;
+    int64_t timeout;
+    int64_t deadline;
+    int timer_idx;
 
     event_cb_t cb;
     void *private;
@@ -58,31 +66,80 @@ typedef struct event {
      * for linked lists
      */
      TAILQ_ENTRY(event) entry;
+     TAILQ_ENTRY(event) fd_entry;
+     TAILQ_ENTRY(event) pending_entry;
 } event_t;
 
 TAILQ_HEAD(tqh_event, event);
 
+struct scheduler;
+struct scheduler_fd;
+
+/*
+ * Poll backends. update() is called whenever the set of live, unmasked
+ * events on an fd changed, wait() blocks for at most timeout
+ * microseconds and marks ready events pending.
+ */
+struct scheduler_backend {
+    const char *name;
+    int (*init) (struct scheduler *);
+    int (*update) (struct scheduler *, struct scheduler_fd *);
+    int (*wait) (struct scheduler *, int64_t timeout);
+};
+
+#define SCHEDULER_EPOLL_EVENTS       64
+
 typedef struct scheduler {
+    const struct scheduler_backend *backend;
+
+    /* select */
     fd_set read_fds;
     fd_set write_fds;
     fd_set except_fds;
+    int max_fd;
+
+    /* epoll */
+    int epoll_fd;
+    int timer_fd;
+    struct epoll_event epoll_events[SCHEDULER_EPOLL_EVENTS];
 
     struct tqh_event events;
+    struct tqh_event pending;
+
+    /* min-heap of armed timeouts, by deadline */
+    event_t **timers;
+    int n_timers;
+    int max_timers;
+    int n_timer_events;
+
+    /* fd -> events polling it */
+    struct scheduler_fd **fds;
+    int n_fds;
 
     int uuid;
-    int max_fd;
-    int timeout;
-    int max_timeout;
+    int n_dead;
+    int64_t timeout;
+    int64_t max_timeout;
     int depth;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+/**
+ * Initializes the scheduler with the named poll backend ("epoll" or
+ * "select"). If name is NULL, the first backend which initializes
+ * successfully is used, trying epoll first.
+ */
+int scheduler_initialize(scheduler_t *, const char *name);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
-                                    int fd, int timeout,
+                                    int fd, int64_t timeout,
                                     event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *, event_id_t);
 void scheduler_mask_event(scheduler_t *, event_id_t, int masked);
-void scheduler_set_max_timeout(scheduler_t *, int);
+void scheduler_set_max_timeout(scheduler_t *, int64_t);
 int scheduler_wait_for_events(scheduler_t *);
 
+/**
+ * Current CLOCK_MONOTONIC time, in microseconds.
+ */
+int64_t scheduler_now(void);
+
 #endif
@@ -93,7 +93,7 @@ struct tapdisk_ctl_conn {
 
     struct {
         int event_id;
-        int busy;
+        int busy;               /* handler steps not done yet */
     } in;
 
     struct tapdisk_control_info *info;
@@ -164,6 +164,50 @@ tapdisk_ctl_conn_init(struct tapdisk_ctl_conn *conn, size_t bufsz)
     return err;
 }
 
+/*
+ * NB. Output beyond TD_CTL_SEND_BUFSZ, such as stats for many VBDs,
+ * grows the buffer, until the connection closes.
+ */
+static int
+tapdisk_ctl_conn_reserve(struct tapdisk_ctl_conn *conn, size_t size)
+{
+    size_t prod, cons, bufsz;
+    void *buf;
+
+    prod = conn->out.prod - conn->out.buf;
+    if (conn->out.bufsz - prod >= size)
+        return 0;
+
+    cons = conn->out.cons - conn->out.buf;
+    bufsz = page_align(prod + size);
+
+    buf = mremap(conn->out.buf, conn->out.bufsz, bufsz, MREMAP_MAYMOVE);
+    if (buf == MAP_FAILED)
+        return -errno;
+
+    conn->out.buf = buf;
+    conn->out.bufsz = bufsz;
+    conn->out.prod = buf + prod;
+    conn->out.cons = buf + cons;
+
+    return 0;
+}
+
+static void tapdisk_ctl_conn_shrink(struct tapdisk_ctl_conn *conn)
+{
+    size_t bufsz = page_align(TD_CTL_SEND_BUFSZ);
+    void *buf;
+
+    if (conn->out.bufsz <= bufsz)
+        return;
+
+    buf = mremap(conn->out.buf, conn->out.bufsz, bufsz, 0);
+    if (buf == MAP_FAILED)
+        return;
+
+    conn->out.bufsz = bufsz;
+}
+
 static int tapdisk_ctl_conn_connected(struct tapdisk_ctl_conn *conn)
 {
     return conn->fd >= 1;
@@ -197,6 +241,8 @@ static void tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
         close(conn->fd);
         conn->fd = -1;
 
+        tapdisk_ctl_conn_shrink(conn);
+
         tapdisk_ctl_conn_free(conn);
         tapdisk_server_mask_event(td_control.event_id, 0);
     }
@@ -322,6 +368,8 @@ tapdisk_ctl_conn_write(struct tapdisk_ctl_conn *conn, void *buf,
 {
     size_t rest;
 
+    tapdisk_ctl_conn_reserve(conn, size);
+
     rest = conn->out.buf + conn->out.bufsz - conn->out.prod;
     if (rest < size)
         size = rest;
@@ -330,17 +378,22 @@ tapdisk_ctl_conn_write(struct tapdisk_ctl_conn *conn, void *buf,
 
     memcpy(conn->out.prod, buf, size);
     conn->out.prod += size;
-    tapdisk_ctl_conn_unmask_out(conn);
 
     return size;
 }
 
+/*
+ * NB. Handlers may run on another shard, so output is only
+ * scheduled once the handler is done.
+ */
 static void tapdisk_ctl_conn_release(struct tapdisk_ctl_conn *conn)
 {
     conn->out.done = 1;
 
     if (conn->out.prod == conn->out.cons)
         tapdisk_ctl_conn_close(conn);
+    else
+        tapdisk_ctl_conn_unmask_out(conn);
 }
 
 static void tapdisk_control_initialize(void)
@@ -400,7 +453,7 @@ void tapdisk_control_close(void)
 static void
 tapdisk_control_release_connection(struct tapdisk_ctl_conn *conn)
 {
-    if (conn->in.event_id) {
+    if (conn->in.event_id >= 0) {
         tapdisk_server_unregister_event(conn->in.event_id);
         conn->in.event_id = -1;
     }
@@ -408,6 +461,20 @@ tapdisk_control_release_connection(struct tapdisk_ctl_conn *conn)
     tapdisk_ctl_conn_release(conn);
 }
 
+/*
+ * Drops a step of the request, and replies once all are done.
+ */
+static void tapdisk_control_put_connection(struct tapdisk_ctl_conn *conn)
+{
+    if (--conn->in.busy)
+        return;
+
+    if (!(conn->info->flags & TAPDISK_MSG_REENTER))
+        td_control.busy = 0;
+
+    tapdisk_control_release_connection(conn);
+}
+
 static void tapdisk_control_close_connection(struct tapdisk_ctl_conn *conn)
 {
     tapdisk_control_release_connection(conn);
@@ -526,47 +593,82 @@ tapdisk_control_list_minors(struct tapdisk_ctl_conn *conn,
 }
 #endif
 
-static void
-tapdisk_control_list(struct tapdisk_ctl_conn *conn,
-                     tapdisk_message_t * request)
-{
-    td_vbd_t *vbd;
-    struct tqh_td_vbd_handle *head;
+struct tapdisk_control_list {
+    struct tapdisk_ctl_conn *conn;
     tapdisk_message_t response;
     int count;
+    struct tapdisk_server_call call;
+};
 
-    memset(&response, 0, sizeof(response));
-    response.type = TAPDISK_MESSAGE_LIST_RSP;
-    response.cookie = request->cookie;
+static void __tapdisk_control_list(void *private)
+{
+    struct tapdisk_control_list *list = private;
+    tapdisk_message_t *response = &list->response;
+    struct tqh_td_vbd_handle *head;
+    td_vbd_t *vbd;
 
     head = tapdisk_server_get_all_vbds();
 
-    /*
-     * Count all the VBDs.
-     * TODO avoid this by maintaining this number?
-     */
-    count = 0;
-    TAILQ_FOREACH(vbd, head, entry)
-        count++;
-
     TAILQ_FOREACH(vbd, head, entry) {
-        response.u.list.count = count--;
-        response.u.list.minor = vbd->tap ? vbd->tap->minor : -1;
-        response.u.list.state = vbd->state;
-        response.u.list.path[0] = 0;
+        if (!list->count)
+            break;
+
+        response->u.list.count = list->count--;
+        response->u.list.minor = vbd->tap ? vbd->tap->minor : -1;
+        response->u.list.state = vbd->state;
+        response->u.list.path[0] = 0;
 
         if (vbd->name)
-            strncpy(response.u.list.path, vbd->name,
-                    sizeof(response.u.list.path));
+            strncpy(response->u.list.path, vbd->name,
+                    sizeof(response->u.list.path));
+
+        tapdisk_control_write_message(list->conn, response);
+    }
+}
+
+static void __tapdisk_control_list_done(void *private)
+{
+    struct tapdisk_control_list *list = private;
+    struct tapdisk_ctl_conn *conn = list->conn;
+    tapdisk_message_t *response = &list->response;
+
+    response->u.list.count = list->count;
+    response->u.list.minor = -1;
+    response->u.list.path[0] = 0;
+
+    tapdisk_control_write_message(conn, response);
+    tapdisk_control_put_connection(conn);
+    free(list);
+}
+
+static void
+tapdisk_control_list(struct tapdisk_ctl_conn *conn,
+                     tapdisk_message_t * request)
+{
+    struct tapdisk_control_list *list;
+    tapdisk_message_t response;
 
+    list = calloc(1, sizeof(*list));
+    if (!list) {
+        memset(&response, 0, sizeof(response));
+        response.type = TAPDISK_MESSAGE_ERROR;
+        response.cookie = request->cookie;
+        response.u.response.error = ENOMEM;
         tapdisk_control_write_message(conn, &response);
+        return;
     }
 
-    response.u.list.count = count;
-    response.u.list.minor = -1;
-    response.u.list.path[0] = 0;
+    list->conn = conn;
+    list->response.type = TAPDISK_MESSAGE_LIST_RSP;
+    list->response.cookie = request->cookie;
+    list->count = tapdisk_server_count_vbds();
 
-    tapdisk_control_write_message(conn, &response);
+    list->call.fn = __tapdisk_control_list;
+    list->call.done = __tapdisk_control_list_done;
+    list->call.arg = list;
+
+    conn->in.busy++;
+    tapdisk_server_call_each(&list->call);
 }
 
 static void
@@ -723,6 +825,8 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
         flags |= TD_OPEN_REUSE_PARENT;
     if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_STANDBY)
         flags |= TD_OPEN_STANDBY;
+    if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ASYNC)
+        flags |= TD_OPEN_ASYNC_MIRROR;
     if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SECONDARY) {
         char *name = strdup(request->u.params.secondary);
         if (!name) {
@@ -896,50 +1000,120 @@ tapdisk_control_resume_vbd(struct tapdisk_ctl_conn *conn,
     tapdisk_control_write_message(conn, &response);
 }
 
+struct tapdisk_control_stats {
+    struct tapdisk_ctl_conn *conn;
+    uint16_t cookie;
+    td_stats_t st;
+    struct tapdisk_server_call call;
+};
+
+/*
+ * NB. replies with the stats length, or a negative error if they could
+ * not be gathered in full, rather than send truncated JSON.
+ */
+static void
+tapdisk_control_stats_reply(struct tapdisk_ctl_conn *conn,
+                            uint16_t cookie, td_stats_t * st, int err)
+{
+    tapdisk_message_t response;
+    size_t len = 0;
+
+    if (!err)
+        err = tapdisk_stats_error(st);
+    if (!err) {
+        len = tapdisk_stats_length(st);
+        err = tapdisk_ctl_conn_reserve(conn, sizeof(response) + len);
+    }
+
+    memset(&response, 0, sizeof(response));
+    response.type = TAPDISK_MESSAGE_STATS_RSP;
+    response.cookie = cookie;
+    response.u.info.length = err ? (size_t) err : len;
+
+    tapdisk_control_write_message(conn, &response);
+    if (!err)
+        tapdisk_ctl_conn_write(conn, st->buf, len);
+}
+
+static void __tapdisk_control_stats(void *private)
+{
+    struct tqh_td_vbd_handle *list = tapdisk_server_get_all_vbds();
+    struct tapdisk_control_stats *stats = private;
+    td_vbd_t *vbd;
+
+    /* NB. shard-wide, so once ahead of the shard's VBDs */
+    tapdisk_server_stats(&stats->st);
+
+    TAILQ_FOREACH(vbd, list, entry)
+        tapdisk_vbd_stats(vbd, &stats->st);
+}
+
+static void __tapdisk_control_stats_done(void *private)
+{
+    struct tapdisk_control_stats *stats = private;
+    struct tapdisk_ctl_conn *conn = stats->conn;
+    td_stats_t *st = &stats->st;
+
+    tapdisk_stats_leave(st, ']');
+    tapdisk_control_stats_reply(conn, stats->cookie, st, 0);
+
+    tapdisk_control_put_connection(conn);
+    tapdisk_stats_free(st);
+    free(stats);
+}
+
 static void
 tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
                       tapdisk_message_t * request)
 {
-    tapdisk_message_t response;
+    struct tapdisk_control_stats *stats;
     td_stats_t _st, *st = &_st;
     td_vbd_t *vbd;
-    size_t rv;
-
-    tapdisk_stats_init(st,
-                       conn->out.buf + sizeof(response),
-                       conn->out.bufsz - sizeof(response));
+    int err;
 
     if (request->cookie != (uint16_t) - 1) {
+        err = tapdisk_stats_alloc(st, TD_CTL_SEND_BUFSZ);
+        if (err)
+            goto out;
 
         vbd = tapdisk_server_get_vbd(request->cookie);
-        if (!vbd) {
-            rv = -ENODEV;
-            goto out;
-        }
+        if (!vbd)
+            err = -ENODEV;
+        else
+            tapdisk_vbd_stats(vbd, st);
 
-        tapdisk_vbd_stats(vbd, st);
+        tapdisk_control_stats_reply(conn, request->cookie, st, err);
+        tapdisk_stats_free(st);
+        return;
+    }
 
-    } else {
-        struct tqh_td_vbd_handle *list = tapdisk_server_get_all_vbds();
+    stats = calloc(1, sizeof(*stats));
+    if (!stats) {
+        err = -ENOMEM;
+        goto out;
+    }
 
-        tapdisk_stats_enter(st, '[');
+    err = tapdisk_stats_alloc(&stats->st, TD_CTL_SEND_BUFSZ);
+    if (err) {
+        free(stats);
+        goto out;
+    }
 
-        TAILQ_FOREACH(vbd, list, entry)
-            tapdisk_vbd_stats(vbd, st);
+    stats->conn = conn;
+    stats->cookie = request->cookie;
+    tapdisk_stats_enter(&stats->st, '[');
 
-        tapdisk_stats_leave(st, ']');
-    }
+    stats->call.fn = __tapdisk_control_stats;
+    stats->call.done = __tapdisk_control_stats_done;
+    stats->call.arg = stats;
 
-    rv = tapdisk_stats_length(st);
-  out:
-    memset(&response, 0, sizeof(response));
-    response.type = TAPDISK_MESSAGE_STATS_RSP;
-    response.cookie = request->cookie;
-    response.u.info.length = rv;
+    /* NB. replies once every shard was visited */
+    conn->in.busy++;
+    tapdisk_server_call_each(&stats->call);
+    return;
 
-    tapdisk_control_write_message(conn, &response);
-    if (rv > 0)
-        conn->out.prod += rv;
+  out:
+    tapdisk_control_stats_reply(conn, request->cookie, NULL, err);
 }
 
 static void
@@ -969,15 +1143,20 @@ tapdisk_control_xenblkif_connect(struct tapdisk_ctl_conn *conn,
     } else
         pool = blkif->pool;
 
-    DPRINTF("connecting vbd-%d-%d to minor %d, pool %s, evt %d\n",
-            blkif->domid, blkif->devid, request->cookie, pool,
-            blkif->port);
+    DPRINTF("connecting vbd-%d-%d queue %u/%u to minor %d, pool %s, "
+            "evt %d, features %#x, copy threshold %u\n", blkif->domid,
+            blkif->devid, blkif->queue, blkif->n_queues, request->cookie,
+            pool, blkif->port, blkif->features, blkif->copy_threshold);
 
     err = tapdisk_xenblkif_connect(blkif->domid,
                                    blkif->devid,
+                                   blkif->queue,
+                                   blkif->n_queues,
                                    blkif->gref,
                                    blkif->order,
-                                   blkif->port, blkif->proto, pool, vbd);
+                                   blkif->port, blkif->proto,
+                                   blkif->features, blkif->copy_threshold,
+                                   pool, vbd);
   out:
     memset(&response, 0, sizeof(response));
     response.type = TAPDISK_MESSAGE_XENBLKIF_CONNECT_RSP;
@@ -1042,6 +1221,29 @@ tapdisk_control_disk_info(struct tapdisk_ctl_conn *conn,
     tapdisk_control_write_message(conn, &response);
 }
 
+static void
+tapdisk_control_set_weight(struct tapdisk_ctl_conn *conn,
+                           tapdisk_message_t * request)
+{
+    tapdisk_message_t response;
+    td_vbd_t *vbd;
+    int err;
+
+    vbd = tapdisk_server_get_vbd(request->cookie);
+    if (!vbd) {
+        err = -ENODEV;
+        goto out;
+    }
+
+    err = tapdisk_vbd_set_weight(vbd, request->u.weight);
+  out:
+    memset(&response, 0, sizeof(response));
+    response.type = TAPDISK_MESSAGE_SET_WEIGHT_RSP;
+    response.cookie = request->cookie;
+    response.u.response.error = -err;
+    tapdisk_control_write_message(conn, &response);
+}
+
 struct tapdisk_control_info message_infos[] = {
     [TAPDISK_MESSAGE_PID] = {
                              .handler = tapdisk_control_get_pid,
@@ -1098,9 +1300,63 @@ struct tapdisk_control_info message_infos[] = {
                                    TAPDISK_MSG_VERBOSE |
                                    TAPDISK_MSG_VERBOSE_ERROR,
                                    },
+    [TAPDISK_MESSAGE_SET_WEIGHT] = {
+                                    .handler = tapdisk_control_set_weight,
+                                    .flags = TAPDISK_MSG_VERBOSE,
+                                    },
 };
 
 
+struct tapdisk_control_call {
+    struct tapdisk_control_info *info;
+    struct tapdisk_ctl_conn *conn;
+    tapdisk_message_t message;
+    struct tapdisk_server_call call;
+};
+
+static void __tapdisk_control_call(void *private)
+{
+    struct tapdisk_control_call *call = private;
+
+    call->info->handler(call->conn, &call->message);
+}
+
+static void __tapdisk_control_call_done(void *private)
+{
+    struct tapdisk_control_call *call = private;
+
+    tapdisk_control_put_connection(call->conn);
+    free(call);
+}
+
+/*
+ * Requests for a VBD are handled on the shard owning it. New VBDs go
+ * to the least loaded shard.
+ */
+static int tapdisk_control_shard(tapdisk_message_t * message)
+{
+    int shard;
+
+    switch (message->type) {
+    case TAPDISK_MESSAGE_PID:
+    case TAPDISK_MESSAGE_LIST:
+        return tapdisk_server_shard();
+    case TAPDISK_MESSAGE_STATS:
+        if (message->cookie == (uint16_t) - 1)
+            return tapdisk_server_shard();
+        break;
+    }
+
+    shard = tapdisk_server_find_vbd_shard(message->cookie);
+    if (shard >= 0)
+        return shard;
+
+    if (message->type == TAPDISK_MESSAGE_ATTACH)
+        return tapdisk_server_pick_shard();
+
+    return tapdisk_server_shard();
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -1108,6 +1364,7 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
     tapdisk_message_t message, response;
     struct tapdisk_ctl_conn *conn = private;
     struct tapdisk_control_info *info;
+    struct tapdisk_control_call *call;
 
     err = tapdisk_control_read_message(conn->fd, &message, 2);
     if (err)
@@ -1133,22 +1390,37 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
             tapdisk_message_name(message.type), message.cookie);
 
     excl = !(info->flags & TAPDISK_MSG_REENTER);
-    if (excl) {
-        if (td_control.busy)
-            goto busy;
+    if (excl && td_control.busy)
+        goto busy;
 
-        td_control.busy = 1;
+    call = malloc(sizeof(*call));
+    if (!call) {
+        err = -ENOMEM;
+        goto error;
     }
+
+    if (excl)
+        td_control.busy = 1;
     conn->in.busy = 1;
     conn->info = info;
 
-    info->handler(conn, &message);
+    /* NB. the connection takes no more input, it is done after the reply */
+    tapdisk_server_unregister_event(conn->in.event_id);
+    conn->in.event_id = -1;
 
-    conn->in.busy = 0;
-    if (excl)
-        td_control.busy = 0;
+    call->info = info;
+    call->conn = conn;
+    call->message = message;
+    call->call.fn = __tapdisk_control_call;
+    call->call.done = __tapdisk_control_call_done;
+    call->call.arg = call;
 
-    tapdisk_control_release_connection(conn);
+    /*
+     * NB. handlers may block their shard for a while, e.g. pause and
+     * close wait for the VBD to drain. Nothing waits for them here,
+     * the reply goes out once the call is done.
+     */
+    tapdisk_server_call(tapdisk_control_shard(&message), &call->call);
     return;
 
   error:
@@ -32,9 +32,11 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
+#include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-stats.h"
 
@@ -69,6 +71,55 @@ int tapdisk_driver_log_pass(td_driver_t * driver, const char *__caller)
     return 0;
 }
 
+/*
+ * Limits of drivers allocated by this thread, set by the VBD opening
+ * its images.
+ */
+static __thread td_limits_t tapdisk_driver_limits = {
+    .requests = MAX_REQUESTS,
+    .segments = MAX_SEGMENTS_PER_REQ,
+};
+
+void tapdisk_driver_set_limits(const td_limits_t * limits)
+{
+    tapdisk_driver_limits = *limits;
+}
+
+/*
+ * Resizes the request pools of an open driver to @limits. Drivers
+ * shared with another VBD keep theirs, as do drivers which cannot
+ * resize.
+ */
+int tapdisk_driver_resize(td_driver_t * driver, const td_limits_t * limits)
+{
+    struct td_driver_sync *sync = &driver->sync;
+    int err;
+
+    if (driver->refcnt > 1 || !driver->ops->td_set_limits)
+        return 0;
+
+    if (driver->limits.requests == limits->requests &&
+        driver->limits.segments == limits->segments)
+        return 0;
+
+    if (sync->n_waiting || sync->n_syncing)
+        return -EBUSY;
+
+    err = driver->ops->td_set_limits(driver, limits);
+    if (err)
+        return err;
+
+    driver->limits = *limits;
+
+    /* the next flush sizes these again */
+    free(sync->waiting);
+    sync->waiting = NULL;
+    free(sync->syncing);
+    sync->syncing = NULL;
+
+    return 0;
+}
+
 td_driver_t *tapdisk_driver_allocate(int type, const char *name,
                                      td_flag_t flags)
 {
@@ -91,6 +142,7 @@ td_driver_t *tapdisk_driver_allocate(int type, const char *name,
     driver->ops = ops;
     driver->type = type;
     driver->storage = -1;
+    driver->limits = tapdisk_driver_limits;
     driver->data = calloc(1, ops->private_data_size);
     if (!driver->data)
         goto fail;
@@ -124,6 +176,15 @@ void tapdisk_driver_free(td_driver_t * driver)
 
     tapdisk_driver_log_flush(driver, __func__);
 
+    if (driver->sync.n_waiting || driver->sync.n_syncing)
+        EPRINTF("freeing driver %s with %d flushes pending\n",
+                driver->name,
+                driver->sync.n_waiting + driver->sync.n_syncing);
+    if (driver->sync.queued)
+        tapdisk_server_cancel_sync(driver);
+    free(driver->sync.waiting);
+    free(driver->sync.syncing);
+
     free(driver->name);
     free(driver->data);
     free(driver);
@@ -134,6 +195,87 @@ void tapdisk_driver_queue_tiocb(td_driver_t * driver, struct tiocb *tiocb)
     tapdisk_server_queue_tiocb(tiocb);
 }
 
+static int tapdisk_driver_init_sync(td_driver_t * driver)
+{
+    struct td_driver_sync *sync = &driver->sync;
+
+    sync->size = driver->limits.requests;
+    sync->waiting = calloc(sync->size, sizeof(td_request_t));
+    sync->syncing = calloc(sync->size, sizeof(td_request_t));
+    if (!sync->waiting || !sync->syncing) {
+        free(sync->waiting);
+        sync->waiting = NULL;
+        free(sync->syncing);
+        sync->syncing = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void tapdisk_driver_queue_sync(td_driver_t * driver, int fd,
+                               td_request_t treq)
+{
+    struct td_driver_sync *sync = &driver->sync;
+    int err;
+
+    if (!sync->waiting) {
+        err = tapdisk_driver_init_sync(driver);
+        if (err) {
+            td_complete_request(treq, err);
+            return;
+        }
+    }
+
+    if (sync->n_waiting == sync->size) {
+        td_complete_request(treq, -EBUSY);
+        return;
+    }
+
+    sync->fd = fd;
+    sync->waiting[sync->n_waiting++] = treq;
+    sync->flushes++;
+
+    if (!sync->n_syncing && !sync->queued)
+        tapdisk_server_queue_sync(driver);
+}
+
+static void
+__tapdisk_driver_sync_cb(void *arg, struct tiocb *tiocb, int err)
+{
+    td_driver_t *driver = arg;
+    struct td_driver_sync *sync = &driver->sync;
+    int i;
+
+    for (i = 0; i < sync->n_syncing; i++)
+        td_complete_request(sync->syncing[i], err);
+    sync->n_syncing = 0;
+
+    if (sync->n_waiting && !sync->queued)
+        tapdisk_server_queue_sync(driver);
+}
+
+void tapdisk_driver_submit_sync(td_driver_t * driver)
+{
+    struct td_driver_sync *sync = &driver->sync;
+    td_request_t *reqs;
+
+    if (sync->n_syncing || !sync->n_waiting)
+        return;
+
+    reqs = sync->syncing;
+    sync->syncing = sync->waiting;
+    sync->waiting = reqs;
+
+    sync->n_syncing = sync->n_waiting;
+    sync->n_waiting = 0;
+    sync->syncs++;
+
+    tapdisk_prep_tiocb_sync(&sync->tiocb, sync->fd,
+                            __tapdisk_driver_sync_cb, driver);
+    tapdisk_driver_queue_tiocb(driver, &sync->tiocb);
+}
+
 void tapdisk_driver_debug(td_driver_t * driver)
 {
     if (driver->ops->td_debug)
@@ -156,4 +298,11 @@ void tapdisk_driver_stats(td_driver_t * driver, td_stats_t * st)
     } else
         tapdisk_stats_field(st, "status", NULL);
 
+    if (driver->sync.flushes) {
+        tapdisk_stats_field(st, "sync", "{");
+        tapdisk_stats_field(st, "flushes", "llu", driver->sync.flushes);
+        tapdisk_stats_field(st, "fdatasyncs", "llu", driver->sync.syncs);
+        tapdisk_stats_leave(st, '}');
+    }
+
 }
@@ -36,6 +36,31 @@
 #define TD_DRIVER_OPEN               0x0001
 #define TD_DRIVER_RDONLY             0x0002
 
+TAILQ_HEAD(tqh_td_driver_handle, td_driver_handle);
+
+/*
+ * Group commit of the driver's file. Flushes wait until the shard
+ * submits its tiocbs, then all go out as one fdatasync. Flushes
+ * queued while it is in flight wait for the next one.
+ */
+struct td_driver_sync {
+    int fd;
+    int size;
+
+    int n_waiting;
+    td_request_t *waiting;
+
+    int n_syncing;
+    td_request_t *syncing;
+    struct tiocb tiocb;
+
+    int queued;
+     TAILQ_ENTRY(td_driver_handle) entry;
+
+    uint64_t flushes;
+    uint64_t syncs;
+};
+
 struct td_driver_handle {
     int type;
     char *name;
@@ -46,18 +71,25 @@ struct td_driver_handle {
     td_flag_t state;
 
     td_disk_info_t info;
+    td_limits_t limits;
 
     void *data;
     const struct tap_disk *ops;
 
     td_loglimit_t loglimit;
      TAILQ_ENTRY(td_driver_handle) next;
+
+    struct td_driver_sync sync;
 };
 
 td_driver_t *tapdisk_driver_allocate(int, const char *, td_flag_t);
+void tapdisk_driver_set_limits(const td_limits_t *);
+int tapdisk_driver_resize(td_driver_t *, const td_limits_t *);
 void tapdisk_driver_free(td_driver_t *);
 
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
+void tapdisk_driver_queue_sync(td_driver_t *, int, td_request_t);
+void tapdisk_driver_submit_sync(td_driver_t *);
 
 void tapdisk_driver_debug(td_driver_t *);
 
@@ -155,6 +155,11 @@ static void check_data(struct tfilter *filter, int type, struct iocb *io)
     int rw;
     uint64_t i;
 
+    /* only plain reads and writes carry a buffer */
+    if (io->aio_lio_opcode != IO_CMD_PREAD &&
+        io->aio_lio_opcode != IO_CMD_PWRITE)
+        return;
+
     rw = (io->aio_lio_opcode == IO_CMD_PWRITE);
 
     for (i = 0; i < io->u.c.nbytes; i += 512) {
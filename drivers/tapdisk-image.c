@@ -103,14 +103,18 @@ int tapdisk_image_check_td_request(td_image_t * image, td_request_t treq)
     info = &image->info;
     rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-    if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+    if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+        treq.op != TD_OP_FLUSH && treq.op != TD_OP_DISCARD)
         goto fail;
 
-    if (treq.op == TD_OP_WRITE && rdonly) {
+    if ((treq.op == TD_OP_WRITE || treq.op == TD_OP_DISCARD) && rdonly) {
         err = -EPERM;
         goto fail;
     }
 
+    if (treq.op == TD_OP_FLUSH)
+        return 0;
+
     if (treq.secs <= 0 || treq.sec + treq.secs > info->size)
         goto fail;
 
@@ -161,6 +165,19 @@ tapdisk_image_check_request(td_image_t * image, td_vbd_request_t * vreq)
             goto fail;
         }
         break;
+    case TD_OP_FLUSH:
+        break;
+    case TD_OP_DISCARD:
+        if (rdonly) {
+            err = -EPERM;
+            goto fail;
+        }
+        if (vreq->iovcnt || !vreq->discard_secs ||
+            vreq->sec + vreq->discard_secs > info->size) {
+            err = -EINVAL;
+            goto fail;
+        }
+        break;
     default:
         err = -EOPNOTSUPP;
         goto fail;
@@ -552,6 +569,38 @@ int tapdisk_image_validate_chain(struct tqh_td_image_handle *head)
     return 0;
 }
 
+int
+tapdisk_image_chain_allocated(struct tqh_td_image_handle *head,
+                              td_sector_t sec, int secs)
+{
+    td_image_t *image;
+    int n, span, max;
+
+    for (n = 0; n < secs; n += max) {
+        max = 0;
+
+        tapdisk_for_each_image(image, head) {
+            /* filters hold no data of their own */
+            if (tapdisk_disk_types[image->type]->flags & DISK_TYPE_FILTER)
+                continue;
+
+            span = td_allocated(image, sec + n, secs - n);
+            if (span < 0)
+                return span;
+
+            if (span > max)
+                max = span;
+            if (max == secs - n)
+                break;
+        }
+
+        if (!max)
+            break;
+    }
+
+    return n;
+}
+
 void tapdisk_image_stats(td_image_t * image, td_stats_t * st)
 {
     tapdisk_stats_enter(st, '{');
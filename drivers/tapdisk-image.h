@@ -104,6 +104,13 @@ int tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 void tapdisk_image_close_chain(struct tqh_td_image_handle *);
 int tapdisk_image_validate_chain(struct tqh_td_image_handle *);
 
+/**
+ * Returns how many of @secs sectors from @sec on hold data in some
+ * image of the chain, see td_allocated.
+ */
+int tapdisk_image_chain_allocated(struct tqh_td_image_handle *,
+                                  td_sector_t sec, int secs);
+
 td_image_t *tapdisk_image_allocate(const char *, int, td_flag_t);
 void tapdisk_image_free(td_image_t *, struct tqh_td_image_handle *head);
 
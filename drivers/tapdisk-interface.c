@@ -140,6 +140,28 @@ int td_get_parent_id(td_image_t * image, td_disk_id_t * id)
     return driver->ops->td_get_parent_id(driver, id);
 }
 
+/*
+ * Returns how many of @secs sectors from @sec on hold data in this
+ * image, at the driver's allocation granularity. Drivers which cannot
+ * tell are fully allocated.
+ */
+int td_allocated(td_image_t * image, td_sector_t sec, int secs)
+{
+    td_driver_t *driver;
+
+    driver = image->driver;
+    if (!driver)
+        return -ENODEV;
+
+    if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+        return -EBADF;
+
+    if (!driver->ops->td_allocated)
+        return secs;
+
+    return driver->ops->td_allocated(driver, sec, secs);
+}
+
 int td_validate_parent(td_image_t * image, td_image_t * parent)
 {
     td_driver_t *driver, *pdriver;
@@ -224,6 +246,72 @@ void td_queue_read(td_image_t * image, td_request_t treq)
     td_complete_request(treq, err);
 }
 
+void td_queue_flush(td_image_t * image, td_request_t treq)
+{
+    int err;
+    td_driver_t *driver;
+
+    driver = image->driver;
+    if (!driver) {
+        err = -ENODEV;
+        goto fail;
+    }
+
+    if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+        err = -EBADF;
+        goto fail;
+    }
+
+    err = tapdisk_image_check_td_request(image, treq);
+    if (err)
+        goto fail;
+
+    if (!driver->ops->td_queue_flush) {
+        td_forward_request(treq);
+        return;
+    }
+
+    driver->ops->td_queue_flush(driver, treq);
+
+    return;
+
+  fail:
+    td_complete_request(treq, err);
+}
+
+void td_queue_discard(td_image_t * image, td_request_t treq)
+{
+    int err;
+    td_driver_t *driver;
+
+    driver = image->driver;
+    if (!driver) {
+        err = -ENODEV;
+        goto fail;
+    }
+
+    if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+        err = -EBADF;
+        goto fail;
+    }
+
+    err = tapdisk_image_check_td_request(image, treq);
+    if (err)
+        goto fail;
+
+    if (!driver->ops->td_queue_discard) {
+        td_complete_request(treq, 0);
+        return;
+    }
+
+    driver->ops->td_queue_discard(driver, treq);
+
+    return;
+
+  fail:
+    td_complete_request(treq, err);
+}
+
 void td_forward_request(td_request_t treq)
 {
     tapdisk_vbd_forward_request(treq);
@@ -239,6 +327,24 @@ void td_queue_tiocb(td_driver_t * driver, struct tiocb *tiocb)
     tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+void td_queue_sync(td_driver_t * driver, int fd, td_request_t treq)
+{
+    tapdisk_driver_queue_sync(driver, fd, treq);
+}
+
+/*
+ * Optional, lets the I/O queue set up faster access to an image fd.
+ */
+void td_register_file(int fd)
+{
+    tapdisk_server_register_file(fd);
+}
+
+void td_unregister_file(int fd)
+{
+    tapdisk_server_unregister_file(fd);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
              long long offset, td_queue_callback_t cb, void *arg)
@@ -253,6 +359,68 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
     tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+void
+td_prep_readv(struct tiocb *tiocb, int fd, struct iovec *iov, int iovcnt,
+              long long offset, td_queue_callback_t cb, void *arg)
+{
+    tapdisk_prep_tiocbv(tiocb, fd, 0, iov, iovcnt, offset, cb, arg);
+}
+
+void
+td_prep_writev(struct tiocb *tiocb, int fd, struct iovec *iov, int iovcnt,
+               long long offset, td_queue_callback_t cb, void *arg)
+{
+    tapdisk_prep_tiocbv(tiocb, fd, 1, iov, iovcnt, offset, cb, arg);
+}
+
+void
+td_prep_discard(struct tiocb *tiocb, int fd, size_t bytes,
+                long long offset, td_queue_callback_t cb, void *arg)
+{
+    tapdisk_prep_tiocb_discard(tiocb, fd, bytes, offset, cb, arg);
+}
+
+/*
+ * Fills @iov with the segments of a vectored request, returns the
+ * number of entries.
+ */
+int td_request_iovec(td_request_t * treq, struct iovec *iov,
+                     long sector_size)
+{
+    int i;
+
+    for (i = 0; i < treq->iovcnt; i++) {
+        iov[i].iov_base = treq->iov[i].base;
+        iov[i].iov_len = treq->iov[i].secs * sector_size;
+    }
+
+    return treq->iovcnt;
+}
+
+/*
+ * Passes a vectored request to @queue one segment at a time, for
+ * drivers which take only some vectored requests.
+ */
+void
+td_split_request(td_driver_t * driver, td_request_t treq,
+                 void (*queue) (td_driver_t *, td_request_t))
+{
+    td_request_t seg = treq;
+    int i;
+
+    for (i = 0; i < treq.iovcnt; i++) {
+        seg.iov = &treq.iov[i];
+        seg.iovcnt = 1;
+        seg.buf = seg.iov->base;
+        seg.secs = seg.iov->secs;
+        seg.sidx = treq.sidx + i;
+
+        queue(driver, seg);
+
+        seg.sec += seg.secs;
+    }
+}
+
 void td_debug(td_image_t * image)
 {
     td_driver_t *driver;
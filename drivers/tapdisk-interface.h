@@ -40,16 +40,31 @@ int td_validate_parent(td_image_t *, td_image_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_flush(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
+int td_allocated(td_image_t *, td_sector_t, int);
 void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
+void td_queue_sync(td_driver_t *, int, td_request_t);
+void td_register_file(int);
+void td_unregister_file(int);
 void td_prep_read(struct tiocb *, int, char *, size_t,
                   long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
                    long long, td_queue_callback_t, void *);
+void td_prep_readv(struct tiocb *, int, struct iovec *, int,
+                   long long, td_queue_callback_t, void *);
+void td_prep_writev(struct tiocb *, int, struct iovec *, int,
+                    long long, td_queue_callback_t, void *);
+void td_prep_discard(struct tiocb *, int, size_t,
+                     long long, td_queue_callback_t, void *);
+int td_request_iovec(td_request_t *, struct iovec *, long);
+void td_split_request(td_driver_t *, td_request_t,
+                      void (*)(td_driver_t *, td_request_t));
 void td_panic(void) __attribute__ ((noreturn));
 
 #endif
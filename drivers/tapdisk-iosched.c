@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "tapdisk-iosched.h"
+
+/*
+ * Weights scale the quantum: a VBD of TD_VBD_WEIGHT_DEFAULT gets one
+ * quantum of credit per round. Credit is kept multiplied by
+ * TD_VBD_WEIGHT_DEFAULT, so small weights need no rounding.
+ */
+#define TD_IOSCHED_DRR_QUANTUM      128 /* sectors */
+#define TD_IOSCHED_DRR_IOPS_QUANTUM 4   /* requests */
+
+/* flushes and discards move no data, charge them a page */
+#define TD_IOSCHED_NODATA_SECS      8
+
+static uint64_t tapdisk_iosched_cost_secs(td_vbd_request_t * vreq)
+{
+    uint64_t secs = 0;
+    int i;
+
+    if (vreq->op != TD_OP_READ && vreq->op != TD_OP_WRITE)
+        return TD_IOSCHED_NODATA_SECS;
+
+    for (i = 0; i < vreq->iovcnt; i++)
+        secs += vreq->iov[i].secs;
+
+    return secs;
+}
+
+static uint64_t tapdisk_iosched_cost_reqs(td_vbd_request_t * vreq)
+{
+    return 1;
+}
+
+/*
+ * NB. internal requests still cost the VBD its deficit, but the shares
+ * are of guest requests only.
+ */
+static void
+tapdisk_iosched_served(td_iosched_t * sched, td_vbd_t * vbd,
+                       uint64_t cost, int internal)
+{
+    if (internal) {
+        vbd->sched.internal += cost;
+        return;
+    }
+
+    vbd->sched.served += cost;
+    sched->served += cost;
+}
+
+static int
+tapdisk_iosched_fifo_run(td_iosched_t * sched,
+                         struct tqh_td_vbd_handle *vbds,
+                         struct tqueue *queue)
+{
+    td_vbd_t *vbd, *tmp;
+    td_vbd_request_t *vreq;
+    uint64_t cost;
+    int err, internal, n = 0;
+
+    TAILQ_FOREACH_SAFE(vbd, vbds, entry, tmp) {
+        while ((vreq = tapdisk_vbd_first_new_request(vbd))) {
+            cost = sched->ops->cost(vreq);
+            internal = td_flag_test(vreq->flags, TD_VREQ_INTERNAL);
+
+            err = tapdisk_vbd_issue_new_request(vbd, vreq);
+            if (err)
+                break;
+
+            tapdisk_iosched_served(sched, vbd, cost, internal);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static void tapdisk_iosched_activate(td_iosched_t * sched, td_vbd_t * vbd)
+{
+    TAILQ_INSERT_TAIL(&sched->active, vbd, sched.entry);
+    vbd->sched.active = 1;
+}
+
+static void
+tapdisk_iosched_deactivate(td_iosched_t * sched, td_vbd_t * vbd)
+{
+    TAILQ_REMOVE(&sched->active, vbd, sched.entry);
+    vbd->sched.active = 0;
+    vbd->sched.credited = 0;
+}
+
+/*
+ * Deficit round robin. Each turn credits the VBD at the head of the
+ * active list with its quantum, then issues requests while they are
+ * covered by the credit. VBDs running out of requests leave the list
+ * and lose their credit, the others go to the back. When the queue
+ * fills up mid-turn, the turn continues on the next run.
+ */
+static int
+tapdisk_iosched_drr_run(td_iosched_t * sched,
+                        struct tqh_td_vbd_handle *vbds,
+                        struct tqueue *queue)
+{
+    const struct td_iosched_ops *ops = sched->ops;
+    td_vbd_t *vbd, *tmp;
+    td_vbd_request_t *vreq;
+    uint64_t cost;
+    int err, internal, n = 0;
+
+    TAILQ_FOREACH_SAFE(vbd, vbds, entry, tmp)
+        if (!vbd->sched.active && tapdisk_vbd_first_new_request(vbd))
+        tapdisk_iosched_activate(sched, vbd);
+
+    while (tapdisk_queue_room(queue) > 0 &&
+           (vbd = TAILQ_FIRST(&sched->active))) {
+
+        if (!vbd->sched.credited) {
+            vbd->sched.deficit += (int64_t) ops->quantum * vbd->sched.weight;
+            vbd->sched.credited = 1;
+        }
+
+        err = 0;
+        while ((vreq = tapdisk_vbd_first_new_request(vbd))) {
+            cost = ops->cost(vreq);
+            internal = td_flag_test(vreq->flags, TD_VREQ_INTERNAL);
+            if (cost * TD_VBD_WEIGHT_DEFAULT > vbd->sched.deficit)
+                break;
+
+            if (tapdisk_queue_room(queue) <= 0)
+                return n;
+
+            err = tapdisk_vbd_issue_new_request(vbd, vreq);
+            if (err)
+                break;
+
+            vbd->sched.deficit -= cost * TD_VBD_WEIGHT_DEFAULT;
+            tapdisk_iosched_served(sched, vbd, cost, internal);
+            n++;
+        }
+
+        tapdisk_iosched_deactivate(sched, vbd);
+
+        /* backing off after an error, until the next run */
+        if (err)
+            continue;
+
+        if (vreq)
+            tapdisk_iosched_activate(sched, vbd);
+        else
+            vbd->sched.deficit = 0;
+    }
+
+    return n;
+}
+
+static const struct td_iosched_ops td_iosched_fifo = {
+    .name = "fifo",
+    .unit = "sectors",
+    .run = tapdisk_iosched_fifo_run,
+    .cost = tapdisk_iosched_cost_secs,
+};
+
+static const struct td_iosched_ops td_iosched_drr = {
+    .name = "drr",
+    .unit = "sectors",
+    .run = tapdisk_iosched_drr_run,
+    .cost = tapdisk_iosched_cost_secs,
+    .quantum = TD_IOSCHED_DRR_QUANTUM,
+};
+
+static const struct td_iosched_ops td_iosched_drr_iops = {
+    .name = "drr-iops",
+    .unit = "requests",
+    .run = tapdisk_iosched_drr_run,
+    .cost = tapdisk_iosched_cost_reqs,
+    .quantum = TD_IOSCHED_DRR_IOPS_QUANTUM,
+};
+
+int tapdisk_iosched_driver(const char *name)
+{
+    if (!strcmp(name, td_iosched_fifo.name))
+        return TD_IOSCHED_FIFO;
+    if (!strcmp(name, td_iosched_drr.name))
+        return TD_IOSCHED_DRR;
+    if (!strcmp(name, td_iosched_drr_iops.name))
+        return TD_IOSCHED_DRR_IOPS;
+
+    return -EINVAL;
+}
+
+void tapdisk_iosched_init(td_iosched_t * sched, int drv)
+{
+    memset(sched, 0, sizeof(*sched));
+    TAILQ_INIT(&sched->active);
+
+    switch (drv) {
+    case TD_IOSCHED_DRR:
+        sched->ops = &td_iosched_drr;
+        break;
+    case TD_IOSCHED_DRR_IOPS:
+        sched->ops = &td_iosched_drr_iops;
+        break;
+    default:
+        sched->ops = &td_iosched_fifo;
+        break;
+    }
+}
+
+int
+tapdisk_iosched_run(td_iosched_t * sched, struct tqh_td_vbd_handle *vbds,
+                    struct tqueue *queue)
+{
+    return sched->ops->run(sched, vbds, queue);
+}
+
+void tapdisk_iosched_remove_vbd(td_iosched_t * sched, td_vbd_t * vbd)
+{
+    if (vbd->sched.active)
+        tapdisk_iosched_deactivate(sched, vbd);
+}
+
+void
+tapdisk_iosched_stats(td_iosched_t * sched, td_vbd_t * vbd,
+                      td_stats_t * st)
+{
+    double share = 0;
+
+    if (sched->served)
+        share = 100.0 * vbd->sched.served / sched->served;
+
+    tapdisk_stats_field(st, "sched", "{");
+    tapdisk_stats_field(st, "policy", "s", sched->ops->name);
+    tapdisk_stats_field(st, "weight", "d", vbd->sched.weight);
+    tapdisk_stats_field(st, "unit", "s", sched->ops->unit);
+    tapdisk_stats_field(st, "served", "llu", vbd->sched.served);
+    tapdisk_stats_field(st, "share", ".1f", share);
+    tapdisk_stats_field(st, "internal", "llu", vbd->sched.internal);
+    tapdisk_stats_field(st, "issued", "llu", vbd->sched.issued);
+    tapdisk_stats_field(st, "delay_usecs", "llu", vbd->sched.delay_usecs);
+    tapdisk_stats_field(st, "delay_max_usecs", "llu",
+                        vbd->sched.delay_max_usecs);
+    tapdisk_stats_leave(st, '}');
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_IOSCHED_H_
+#define _TAPDISK_IOSCHED_H_
+
+#include "tapdisk-vbd.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Server-level I/O scheduler. Each shard runs one, deciding which of
+ * its VBDs get their new requests issued into the shard's AIO queue:
+ *
+ *   fifo      issues all new requests, VBD by VBD (default)
+ *   drr       deficit round robin over sectors, by VBD weight
+ *   drr-iops  deficit round robin over requests, by VBD weight
+ *
+ * The fair schedulers only issue while the AIO queue has room, so a
+ * busy VBD cannot push its siblings into deferral. Selected with
+ * TAPDISK_IOSCHED.
+ */
+enum {
+    TD_IOSCHED_FIFO = 1,
+    TD_IOSCHED_DRR = 2,
+    TD_IOSCHED_DRR_IOPS = 3,
+};
+
+typedef struct td_iosched td_iosched_t;
+
+struct td_iosched_ops {
+    const char *name;
+    const char *unit;
+
+    /*
+     * Issues new requests while the queue has room. Returns the
+     * number of requests issued.
+     */
+    int (*run) (td_iosched_t *, struct tqh_td_vbd_handle *,
+                struct tqueue *);
+
+    /* cost of a request, and the credit per weight unit and round */
+    uint64_t(*cost) (td_vbd_request_t *);
+    int quantum;
+};
+
+struct td_iosched {
+    const struct td_iosched_ops *ops;
+
+    /* backlogged VBDs, in round robin order */
+    struct tqh_td_vbd_handle active;
+
+    /* cost served, over all VBDs */
+    uint64_t served;
+};
+
+/**
+ * Maps a scheduler name to TD_IOSCHED_*.
+ */
+int tapdisk_iosched_driver(const char *);
+
+void tapdisk_iosched_init(td_iosched_t *, int);
+int tapdisk_iosched_run(td_iosched_t *, struct tqh_td_vbd_handle *,
+                        struct tqueue *);
+
+/**
+ * Drops a VBD leaving the shard from the active list.
+ */
+void tapdisk_iosched_remove_vbd(td_iosched_t *, td_vbd_t *);
+
+void tapdisk_iosched_stats(td_iosched_t *, td_vbd_t *, td_stats_t *);
+
+#endif
@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "tapdisk-mirror.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-log.h"
+#include "scheduler.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+#define BUG_ON(_cond)   if (unlikely(_cond)) { td_panic(); }
+
+#define TD_MIRROR_BUF_ALIGN         4096
+
+static inline uint64_t tapdisk_mirror_region(td_sector_t sec)
+{
+    return sec >> TD_MIRROR_REGION_SHIFT;
+}
+
+static inline int tapdisk_mirror_test(td_mirror_t * mirror, uint64_t region)
+{
+    return (mirror->dirty[region / 64] >> (region % 64)) & 1;
+}
+
+static void tapdisk_mirror_set(td_mirror_t * mirror, uint64_t region)
+{
+    if (!tapdisk_mirror_test(mirror, region)) {
+        mirror->dirty[region / 64] |= 1ULL << (region % 64);
+        mirror->n_dirty++;
+    }
+}
+
+static void tapdisk_mirror_clear(td_mirror_t * mirror, uint64_t region)
+{
+    if (tapdisk_mirror_test(mirror, region)) {
+        mirror->dirty[region / 64] &= ~(1ULL << (region % 64));
+        mirror->n_dirty--;
+    }
+}
+
+static void
+tapdisk_mirror_set_dirty(td_mirror_t * mirror, td_sector_t sec,
+                         td_sector_t secs)
+{
+    uint64_t region, last;
+
+    last = tapdisk_mirror_region(sec + secs - 1);
+    for (region = tapdisk_mirror_region(sec); region <= last; region++)
+        tapdisk_mirror_set(mirror, region);
+}
+
+static int
+tapdisk_mirror_range_dirty(td_mirror_t * mirror, td_sector_t sec,
+                           td_sector_t secs)
+{
+    uint64_t region, last;
+
+    last = tapdisk_mirror_region(sec + secs - 1);
+    for (region = tapdisk_mirror_region(sec); region <= last; region++)
+        if (!tapdisk_mirror_test(mirror, region))
+            return 0;
+
+    return 1;
+}
+
+static int
+tapdisk_mirror_overlaps(td_sector_t sec, td_sector_t secs, uint64_t region)
+{
+    return tapdisk_mirror_region(sec) <= region &&
+        region <= tapdisk_mirror_region(sec + secs - 1);
+}
+
+static inline int tapdisk_mirror_cost(int op, int secs)
+{
+    return op == TD_OP_WRITE ? secs : 1;
+}
+
+static td_mirror_request_t *tapdisk_mirror_alloc_request(td_mirror_t *
+                                                         mirror,
+                                                         td_request_t treq)
+{
+    td_mirror_request_t *req;
+    size_t size;
+    char *buf;
+    int i;
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return NULL;
+
+    req->op = treq.op;
+    req->sec = treq.sec;
+    req->secs = treq.secs;
+    req->mirror = mirror;
+
+    if (treq.op != TD_OP_WRITE)
+        return req;
+
+    size = (size_t) treq.secs << SECTOR_SHIFT;
+    if (posix_memalign((void **) &buf, TD_MIRROR_BUF_ALIGN, size)) {
+        free(req);
+        return NULL;
+    }
+
+    req->iov.base = buf;
+    req->iov.secs = treq.secs;
+
+    if (treq.iovcnt > 1)
+        for (i = 0; i < treq.iovcnt; i++) {
+            size = (size_t) treq.iov[i].secs << SECTOR_SHIFT;
+            memcpy(buf, treq.iov[i].base, size);
+            buf += size;
+    } else
+        memcpy(buf, treq.buf, size);
+
+    return req;
+}
+
+static void
+tapdisk_mirror_free_request(td_mirror_t * mirror, td_mirror_request_t * req)
+{
+    mirror->queued_secs -= tapdisk_mirror_cost(req->op, req->secs);
+    free(req->iov.base);
+    free(req);
+}
+
+/*
+ * Queued writes are dropped, and left to the resync.
+ */
+static void tapdisk_mirror_drop_queue(td_mirror_t * mirror)
+{
+    td_mirror_request_t *req;
+
+    while ((req = TAILQ_FIRST(&mirror->queue))) {
+        TAILQ_REMOVE(&mirror->queue, req, entry);
+        mirror->n_queued--;
+
+        tapdisk_mirror_set_dirty(mirror, req->sec, req->secs);
+        tapdisk_mirror_free_request(mirror, req);
+    }
+}
+
+static void tapdisk_mirror_fail(td_mirror_t * mirror, int err)
+{
+    mirror->errors++;
+
+    if (!mirror->failed)
+        ERR(err, "%s: mirroring to %s failed, retrying in %ds\n",
+            mirror->vbd->name, mirror->image->name,
+            TD_MIRROR_RETRY_INTERVAL);
+
+    mirror->failed = 1;
+    mirror->retry_at = scheduler_now() +
+        SCHEDULER_USECS(TD_MIRROR_RETRY_INTERVAL);
+
+    tapdisk_mirror_drop_queue(mirror);
+}
+
+/*
+ * Returns nonzero once all of the request completed.
+ */
+static int
+tapdisk_mirror_request_done(td_mirror_request_t * req, td_request_t treq,
+                            int res)
+{
+    int err = (res <= 0 ? res : -res);
+
+    req->secs_pending -= tapdisk_mirror_cost(treq.op, treq.secs);
+    req->error = (req->error ? : err);
+
+    return !req->secs_pending;
+}
+
+static void
+tapdisk_mirror_issue(td_mirror_t * mirror, td_mirror_request_t * req,
+                     td_callback_t cb)
+{
+    td_request_t treq;
+
+    memset(&treq, 0, sizeof(treq));
+    treq.op = req->op;
+    treq.sec = req->sec;
+    treq.secs = req->secs;
+    treq.image = mirror->image;
+    treq.cb = cb;
+    treq.cb_data = req;
+
+    req->secs_pending = tapdisk_mirror_cost(req->op, req->secs);
+    req->error = 0;
+
+    switch (req->op) {
+    case TD_OP_WRITE:
+        treq.buf = req->iov.base;
+        treq.iov = &req->iov;
+        treq.iovcnt = 1;
+        td_queue_write(mirror->image, treq);
+        break;
+
+    case TD_OP_DISCARD:
+        td_queue_discard(mirror->image, treq);
+        break;
+    }
+}
+
+static void tapdisk_mirror_complete(td_request_t treq, int res)
+{
+    td_mirror_request_t *req = treq.cb_data;
+    td_mirror_t *mirror = req->mirror;
+    int64_t lag;
+
+    if (!tapdisk_mirror_request_done(req, treq, res))
+        return;
+
+    TAILQ_REMOVE(&mirror->inflight, req, entry);
+    mirror->n_inflight--;
+
+    if (req->error) {
+        tapdisk_mirror_set_dirty(mirror, req->sec, req->secs);
+        tapdisk_mirror_fail(mirror, req->error);
+    } else {
+        lag = scheduler_now() - req->ts;
+        mirror->lag_max_usecs = MAX(mirror->lag_max_usecs, lag);
+        mirror->mirrored += tapdisk_mirror_cost(req->op, req->secs);
+    }
+
+    tapdisk_mirror_free_request(mirror, req);
+}
+
+void tapdisk_mirror_queue(td_mirror_t * mirror, td_request_t treq)
+{
+    td_mirror_request_t *req;
+    int cost;
+
+    if (tapdisk_mirror_range_dirty(mirror, treq.sec, treq.secs))
+        return;
+
+    if (!mirror->image || mirror->failed)
+        goto dirty;
+
+    if (mirror->resyncing &&
+        tapdisk_mirror_overlaps(treq.sec, treq.secs,
+                                mirror->resync_region))
+        goto dirty;
+
+    cost = tapdisk_mirror_cost(treq.op, treq.secs);
+    if (mirror->queued_secs + cost > TD_MIRROR_QUEUE_SECS) {
+        mirror->overflows++;
+        goto dirty;
+    }
+
+    req = tapdisk_mirror_alloc_request(mirror, treq);
+    if (!req)
+        goto dirty;
+
+    req->ts = scheduler_now();
+    TAILQ_INSERT_TAIL(&mirror->queue, req, entry);
+    mirror->n_queued++;
+    mirror->queued_secs += cost;
+    return;
+
+  dirty:
+    tapdisk_mirror_set_dirty(mirror, treq.sec, treq.secs);
+}
+
+/*
+ * A region may only be read back once no queued write to it can land
+ * on the secondary after the resync did.
+ */
+static int tapdisk_mirror_conflicts(td_mirror_t * mirror, uint64_t region)
+{
+    td_mirror_request_t *req;
+
+    TAILQ_FOREACH(req, &mirror->queue, entry)
+        if (tapdisk_mirror_overlaps(req->sec, req->secs, region))
+        return 1;
+
+    TAILQ_FOREACH(req, &mirror->inflight, entry)
+        if (tapdisk_mirror_overlaps(req->sec, req->secs, region))
+        return 1;
+
+    return 0;
+}
+
+/*
+ * Writes in flight to the secondary may complete in any order, so a
+ * queued one must wait for those to the same sectors.
+ */
+static int
+tapdisk_mirror_inflight(td_mirror_t * mirror, td_mirror_request_t * req)
+{
+    td_mirror_request_t *tmp;
+
+    TAILQ_FOREACH(tmp, &mirror->inflight, entry)
+        if (req->sec < tmp->sec + tmp->secs &&
+            tmp->sec < req->sec + req->secs)
+        return 1;
+
+    return 0;
+}
+
+static uint64_t tapdisk_mirror_next_dirty(td_mirror_t * mirror)
+{
+    uint64_t region = mirror->cursor;
+
+    while (!tapdisk_mirror_test(mirror, region))
+        region = (region + 1) % mirror->n_regions;
+
+    return region;
+}
+
+static void tapdisk_mirror_resync_done(td_mirror_t * mirror, int err)
+{
+    mirror->resyncing = 0;
+
+    if (err) {
+        tapdisk_mirror_set(mirror, mirror->resync_region);
+        tapdisk_mirror_fail(mirror, err);
+    } else
+        mirror->resynced++;
+}
+
+static void tapdisk_mirror_resync_complete(td_request_t treq, int res)
+{
+    td_mirror_request_t *req = treq.cb_data;
+
+    if (tapdisk_mirror_request_done(req, treq, res))
+        tapdisk_mirror_resync_done(req->mirror, req->error);
+}
+
+static void
+tapdisk_mirror_resync_read(td_vbd_request_t * vreq, int err,
+                           void *token, int final)
+{
+    td_mirror_t *mirror = token;
+    td_mirror_request_t *req = &mirror->resync_req;
+
+    if (mirror->failed) {
+        mirror->resyncing = 0;
+        tapdisk_mirror_set(mirror, mirror->resync_region);
+        return;
+    }
+
+    if (err) {
+        tapdisk_mirror_resync_done(mirror, err);
+        return;
+    }
+
+    tapdisk_mirror_issue(mirror, req, tapdisk_mirror_resync_complete);
+}
+
+static void tapdisk_mirror_resync(td_mirror_t * mirror)
+{
+    td_mirror_request_t *req = &mirror->resync_req;
+    td_vbd_request_t *vreq = &mirror->resync_vreq;
+    uint64_t region;
+    td_sector_t secs;
+    int i, err;
+
+    if (mirror->resyncing || !mirror->n_dirty)
+        return;
+
+    region = tapdisk_mirror_next_dirty(mirror);
+    if (tapdisk_mirror_conflicts(mirror, region))
+        return;
+
+    tapdisk_mirror_clear(mirror, region);
+    mirror->cursor = (region + 1) % mirror->n_regions;
+    mirror->resync_region = region;
+    mirror->resyncing = 1;
+
+    req->op = TD_OP_WRITE;
+    req->sec = region << TD_MIRROR_REGION_SHIFT;
+    req->secs = MIN(TD_MIRROR_REGION_SECS, mirror->size - req->sec);
+    req->iov.secs = req->secs;
+    req->mirror = mirror;
+
+    memset(vreq, 0, sizeof(*vreq));
+    td_flag_set(vreq->flags, TD_VREQ_INTERNAL);
+    vreq->op = TD_OP_READ;
+    vreq->sec = req->sec;
+    vreq->iov = mirror->resync_iov;
+    vreq->cb = tapdisk_mirror_resync_read;
+    vreq->token = mirror;
+    vreq->name = "mirror-resync";
+
+    for (i = 0, secs = req->secs; secs; i++) {
+        vreq->iov[i].base = req->iov.base +
+            ((size_t) i * TD_MIRROR_RESYNC_SEG_SECS << SECTOR_SHIFT);
+        vreq->iov[i].secs = MIN(secs, TD_MIRROR_RESYNC_SEG_SECS);
+        secs -= vreq->iov[i].secs;
+    }
+    vreq->iovcnt = i;
+
+    err = tapdisk_vbd_queue_request(mirror->vbd, vreq);
+    BUG_ON(err);
+}
+
+void tapdisk_mirror_kick(td_mirror_t * mirror)
+{
+    td_mirror_request_t *req;
+    int64_t now;
+
+    if (!mirror->image)
+        return;
+
+    if (mirror->failed) {
+        now = scheduler_now();
+        if (now < mirror->retry_at) {
+            tapdisk_server_set_max_timeout(mirror->retry_at - now);
+            return;
+        }
+
+        DPRINTF("%s: retrying mirror %s, %" PRIu64 " regions dirty\n",
+                mirror->vbd->name, mirror->image->name, mirror->n_dirty);
+        mirror->failed = 0;
+    }
+
+    while (mirror->n_inflight < TD_MIRROR_MAX_INFLIGHT &&
+           (req = TAILQ_FIRST(&mirror->queue))) {
+        /* NB. holds back the rest of the queue too, keeping its order */
+        if (tapdisk_mirror_inflight(mirror, req))
+            break;
+
+        TAILQ_REMOVE(&mirror->queue, req, entry);
+        mirror->n_queued--;
+
+        TAILQ_INSERT_TAIL(&mirror->inflight, req, entry);
+        mirror->n_inflight++;
+
+        tapdisk_mirror_issue(mirror, req, tapdisk_mirror_complete);
+        if (mirror->failed)
+            return;
+    }
+
+    tapdisk_mirror_resync(mirror);
+}
+
+int tapdisk_mirror_busy(td_mirror_t * mirror)
+{
+    return mirror->n_inflight || mirror->resyncing;
+}
+
+int
+tapdisk_mirror_open(td_mirror_t * mirror, td_vbd_t * vbd,
+                    td_image_t * image)
+{
+    uint64_t n_regions;
+    void *buf;
+    int err;
+
+    n_regions = tapdisk_mirror_region(image->info.size +
+                                      TD_MIRROR_REGION_SECS - 1);
+
+    if (mirror->dirty && mirror->n_regions != n_regions)
+        tapdisk_mirror_free(mirror);
+
+    if (!mirror->dirty) {
+        memset(mirror, 0, sizeof(*mirror));
+        TAILQ_INIT(&mirror->queue);
+        TAILQ_INIT(&mirror->inflight);
+
+        err = posix_memalign(&buf, TD_MIRROR_BUF_ALIGN,
+                             TD_MIRROR_REGION_SECS << SECTOR_SHIFT);
+        if (err)
+            return -err;
+
+        mirror->dirty = calloc((n_regions + 63) / 64, sizeof(uint64_t));
+        if (!mirror->dirty) {
+            free(buf);
+            return -ENOMEM;
+        }
+
+        mirror->resync_req.iov.base = buf;
+        mirror->n_regions = n_regions;
+    }
+
+    mirror->vbd = vbd;
+    mirror->image = image;
+    mirror->size = image->info.size;
+    mirror->failed = 0;
+
+    if (mirror->n_dirty)
+        DPRINTF("%s: mirror %s has %" PRIu64 " dirty regions\n",
+                vbd->name, image->name, mirror->n_dirty);
+
+    return 0;
+}
+
+void tapdisk_mirror_close(td_mirror_t * mirror)
+{
+    if (!mirror->dirty)
+        return;
+
+    tapdisk_mirror_drop_queue(mirror);
+    mirror->image = NULL;
+}
+
+void tapdisk_mirror_free(td_mirror_t * mirror)
+{
+    if (!mirror->dirty)
+        return;
+
+    tapdisk_mirror_close(mirror);
+    free(mirror->resync_req.iov.base);
+    free(mirror->dirty);
+    memset(mirror, 0, sizeof(*mirror));
+}
+
+void tapdisk_mirror_stats(td_mirror_t * mirror, td_stats_t * st)
+{
+    td_mirror_request_t *req;
+    int64_t lag;
+
+    /* both lists are in queueing order */
+    req = TAILQ_FIRST(&mirror->inflight) ? : TAILQ_FIRST(&mirror->queue);
+    lag = req ? scheduler_now() - req->ts : 0;
+
+    tapdisk_stats_field(st, "mirror", "{");
+    tapdisk_stats_field(st, "mode", "s", "async");
+    tapdisk_stats_field(st, "failed", "d", mirror->failed);
+    tapdisk_stats_field(st, "queued", "d", mirror->n_queued);
+    tapdisk_stats_field(st, "inflight", "d", mirror->n_inflight);
+    tapdisk_stats_field(st, "queued_secs", "d", mirror->queued_secs);
+    tapdisk_stats_field(st, "lag_usecs", "lld", (long long) lag);
+    tapdisk_stats_field(st, "lag_max_usecs", "lld",
+                        (long long) mirror->lag_max_usecs);
+    tapdisk_stats_field(st, "mirrored_secs", "llu", mirror->mirrored);
+    tapdisk_stats_field(st, "overflows", "llu", mirror->overflows);
+    tapdisk_stats_field(st, "errors", "llu", mirror->errors);
+
+    tapdisk_stats_field(st, "resync", "{");
+    tapdisk_stats_field(st, "region_secs", "d", TD_MIRROR_REGION_SECS);
+    tapdisk_stats_field(st, "regions", "llu", mirror->n_regions);
+    tapdisk_stats_field(st, "dirty", "llu", mirror->n_dirty);
+    tapdisk_stats_field(st, "resynced", "llu", mirror->resynced);
+    tapdisk_stats_field(st, "synced", ".1f", mirror->n_regions ?
+                        100.0 * (mirror->n_regions - mirror->n_dirty) /
+                        mirror->n_regions : 100.0);
+    tapdisk_stats_leave(st, '}');
+
+    tapdisk_stats_leave(st, '}');
+}
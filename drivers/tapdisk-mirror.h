@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_MIRROR_H_
+#define _TAPDISK_MIRROR_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Asynchronous mirroring to a secondary image. Writes completed on the
+ * primary are copied into a bounded queue and written to the secondary
+ * in the background, so guest completions never wait for it.
+ *
+ * Writes which could not be mirrored, because the queue was full or the
+ * secondary failed, are tracked in a bitmap of dirty regions. Those are
+ * resynced by reading them back through the VBD once the queue holds no
+ * writes to them. The bitmap lives as long as the VBD, across pauses,
+ * but is not persistent.
+ */
+#define TD_MIRROR_QUEUE_SECS        8192        /* data queued, 4MB */
+#define TD_MIRROR_MAX_INFLIGHT      32
+#define TD_MIRROR_REGION_SHIFT      10          /* 512KB regions */
+#define TD_MIRROR_REGION_SECS       (1 << TD_MIRROR_REGION_SHIFT)
+#define TD_MIRROR_RESYNC_SEG_SECS   128
+#define TD_MIRROR_RESYNC_SEGS                                   \
+    (TD_MIRROR_REGION_SECS / TD_MIRROR_RESYNC_SEG_SECS)
+#define TD_MIRROR_RETRY_INTERVAL    5           /* seconds */
+
+typedef struct td_mirror td_mirror_t;
+typedef struct td_mirror_request td_mirror_request_t;
+
+struct td_mirror_request {
+    int op;
+    td_sector_t sec;
+    int secs;
+    struct td_iovec iov;
+
+    /* when it was queued, on scheduler_now() */
+    int64_t ts;
+
+    int secs_pending;
+    int error;
+
+    td_mirror_t *mirror;
+     TAILQ_ENTRY(td_mirror_request) entry;
+};
+
+TAILQ_HEAD(tqh_td_mirror_request, td_mirror_request);
+
+struct td_mirror {
+    td_vbd_t *vbd;
+    td_image_t *image;
+
+    /* queued, and issued to the secondary */
+    struct tqh_td_mirror_request queue;
+    struct tqh_td_mirror_request inflight;
+    int n_queued;
+    int n_inflight;
+    int queued_secs;
+
+    /* regions not mirrored yet */
+    uint64_t *dirty;
+    uint64_t n_regions;
+    uint64_t n_dirty;
+    uint64_t cursor;
+    td_sector_t size;
+
+    /* region being read back, then written to the secondary */
+    int resyncing;
+    uint64_t resync_region;
+    td_vbd_request_t resync_vreq;
+    struct td_iovec resync_iov[TD_MIRROR_RESYNC_SEGS];
+    td_mirror_request_t resync_req;
+
+    /* set when the secondary failed, until retry_at */
+    int failed;
+    int64_t retry_at;
+
+    uint64_t mirrored;
+    uint64_t overflows;
+    uint64_t errors;
+    uint64_t resynced;
+    int64_t lag_max_usecs;
+};
+
+/**
+ * Starts mirroring to @image. Dirty regions of an earlier open of the
+ * same size are kept.
+ */
+int tapdisk_mirror_open(td_mirror_t *, td_vbd_t *, td_image_t *);
+
+/**
+ * Stops mirroring. Queued writes are dropped and their regions marked
+ * dirty. Nothing may be in flight.
+ */
+void tapdisk_mirror_close(td_mirror_t *);
+void tapdisk_mirror_free(td_mirror_t *);
+
+/**
+ * Mirrors a write or discard which completed on the primary.
+ */
+void tapdisk_mirror_queue(td_mirror_t *, td_request_t);
+
+/**
+ * Issues queued writes, and resyncs dirty regions when idle.
+ */
+void tapdisk_mirror_kick(td_mirror_t *);
+
+int tapdisk_mirror_busy(td_mirror_t *);
+void tapdisk_mirror_stats(td_mirror_t *, td_stats_t *);
+
+#endif
@@ -33,11 +33,21 @@
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #ifdef __linux__
 #include <linux/version.h>
+#include <linux/io_uring.h>
 #endif
 
 #include "tapdisk.h"
@@ -74,6 +84,52 @@ static inline void queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
     queue->iocbs[queue->queued++] = iocb;
 }
 
+static inline int tqueue_hist_bucket(unsigned int n)
+{
+    int b;
+
+    if (n <= 1)
+        return 0;
+
+    b = 31 - __builtin_clz(n);
+
+    return b < TQUEUE_HIST_BUCKETS ? b : TQUEUE_HIST_BUCKETS - 1;
+}
+
+static inline void
+tapdisk_queue_account_submit(struct tqueue *queue, int tiocbs, int iocbs)
+{
+    struct tqueue_stats *st = &queue->stats;
+
+    st->submitted += tiocbs;
+    st->iocbs += iocbs;
+    st->batch[tqueue_hist_bucket(iocbs)]++;
+    st->depth[tqueue_hist_bucket(queue->iocbs_pending)]++;
+}
+
+static inline void tapdisk_queue_account_reap(struct tqueue *queue, int n)
+{
+    if (n > 0)
+        queue->stats.reap[tqueue_hist_bucket(n)]++;
+}
+
+/*
+ * Accumulates the time the deferred tiocbs have been waiting. Called
+ * before the deferred list changes, so the clock is only read while
+ * the queue is deferring.
+ */
+static inline void tapdisk_queue_account_deferred(struct tqueue *queue)
+{
+    struct tqueue_stats *st = &queue->stats;
+    int64_t now = scheduler_now();
+
+    if (queue->tiocbs_deferred)
+        st->deferred_usecs +=
+            (uint64_t) queue->tiocbs_deferred * (now - st->deferred_stamp);
+
+    st->deferred_stamp = now;
+}
+
 static inline int deferred_tiocbs(struct tqueue *queue)
 {
     return (queue->deferred.head != NULL);
@@ -83,6 +139,8 @@ static inline void defer_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
     struct tlist *list = &queue->deferred;
 
+    tapdisk_queue_account_deferred(queue);
+
     if (!list->head)
         list->head = list->tail = tiocb;
     else
@@ -110,10 +168,31 @@ static inline void queue_deferred_tiocb(struct tqueue *queue)
 
 static inline void queue_deferred_tiocbs(struct tqueue *queue)
 {
+    if (tapdisk_queue_full(queue) || !deferred_tiocbs(queue))
+        return;
+
+    tapdisk_queue_account_deferred(queue);
+
     while (!tapdisk_queue_full(queue) && deferred_tiocbs(queue))
         queue_deferred_tiocb(queue);
 }
 
+static inline size_t iocb_nbytes(struct iocb *iocb)
+{
+    size_t size = 0;
+    int i;
+
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_PREADV:
+    case IO_CMD_PWRITEV:
+        for (i = 0; i < iocb->u.v.nr; i++)
+            size += iocb->u.v.vec[i].iov_len;
+        return size;
+    }
+
+    return iocb->u.c.nbytes;
+}
+
 /*
  * td_complete may queue more tiocbs
  */
@@ -124,13 +203,15 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb,
     int err;
     struct iocb *iocb = &tiocb->iocb;
 
-    if (res == iocb->u.c.nbytes)
+    if (res == iocb_nbytes(iocb))
         err = 0;
     else if ((int) res < 0)
         err = (int) res;
     else
         err = -EIO;
 
+    queue->stats.completed++;
+
     tiocb->cb(tiocb->arg, tiocb, err);
 }
 
@@ -158,6 +239,81 @@ static int cancel_tiocbs(struct tqueue *queue, int err)
     return queued;
 }
 
+static ssize_t tapdisk_rwio_rw(const struct iocb *iocb);
+static int tapdisk_queue_init_offload(struct tqueue *queue);
+
+static inline int iocb_offloaded(struct tqueue *queue, struct iocb *iocb)
+{
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_FDSYNC:
+        return queue->offload_ops & TIO_OFFLOAD_FDSYNC;
+    case TIO_CMD_DISCARD:
+        return queue->offload_ops & TIO_OFFLOAD_DISCARD;
+    }
+
+    return 0;
+}
+
+/*
+ * Takes the ops the driver cannot run off the queue, before it sees
+ * them. They are submitted to the offload pool, started on the first
+ * of them, or without one run synchronously. Completions may queue
+ * more tiocbs, so those complete off a private list, as in
+ * cancel_tiocbs.
+ */
+static void offload_tiocbs(struct tqueue *queue)
+{
+    struct tiocb *tiocb, *inline_tiocbs = NULL, **tail = &inline_tiocbs;
+    struct iocb *iocb;
+    int i, n, offloaded = 0;
+
+    for (i = n = 0; i < queue->queued; i++) {
+        iocb = queue->iocbs[i];
+        tiocb = iocb->data;
+
+        if (!iocb_offloaded(queue, iocb)) {
+            if (n) {
+                struct tiocb *prev = queue->iocbs[n - 1]->data;
+                prev->next = tiocb;
+            }
+            queue->iocbs[n++] = iocb;
+            continue;
+        }
+
+        tiocb->next = NULL;
+        offloaded++;
+
+        if (!queue->offload && !queue->offload_err)
+            queue->offload_err = tapdisk_queue_init_offload(queue);
+
+        if (queue->offload)
+            tapdisk_queue_tiocb(queue->offload, tiocb);
+        else {
+            *tail = tiocb;
+            tail = &tiocb->next;
+        }
+    }
+
+    if (!offloaded)
+        return;
+
+    if (n) {
+        tiocb = queue->iocbs[n - 1]->data;
+        tiocb->next = NULL;
+    }
+    queue->queued = n;
+    queue->stats.offloaded += offloaded;
+
+    if (queue->offload)
+        tapdisk_submit_all_tiocbs(queue->offload);
+
+    while ((tiocb = inline_tiocbs)) {
+        inline_tiocbs = tiocb->next;
+        tiocb->next = NULL;
+        complete_tiocb(queue, tiocb, tapdisk_rwio_rw(&tiocb->iocb));
+    }
+}
+
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
@@ -200,7 +356,17 @@ static int tapdisk_rwio_setup(struct tqueue *queue, int size)
     return 0;
 }
 
-static inline ssize_t tapdisk_rwio_rw(const struct iocb *iocb)
+static ssize_t tapdisk_punch_hole(const struct iocb *iocb)
+{
+    if (fallocate(iocb->aio_fildes,
+                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  iocb->u.c.offset, iocb->u.c.nbytes))
+        return -errno;
+
+    return iocb->u.c.nbytes;
+}
+
+static ssize_t tapdisk_rwio_rw(const struct iocb *iocb)
 {
     int fd = iocb->aio_fildes;
     char *buf = iocb->u.c.buf;
@@ -208,6 +374,20 @@ static inline ssize_t tapdisk_rwio_rw(const struct iocb *iocb)
     size_t size = iocb->u.c.nbytes;
     ssize_t(*func) (int, void *, size_t) =
         (iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+    ssize_t n;
+
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_PREADV:
+        n = preadv(fd, iocb->u.v.vec, iocb->u.v.nr, iocb->u.v.offset);
+        return n < 0 ? -errno : n;
+    case IO_CMD_PWRITEV:
+        n = pwritev(fd, iocb->u.v.vec, iocb->u.v.nr, iocb->u.v.offset);
+        return n < 0 ? -errno : n;
+    case IO_CMD_FDSYNC:
+        return fdatasync(fd) ? -errno : 0;
+    case TIO_CMD_DISCARD:
+        return tapdisk_punch_hole(iocb);
+    }
 
     if (lseek64(fd, off, SEEK_SET) == (off64_t) - 1)
         return -errno;
@@ -232,6 +412,8 @@ static int tapdisk_rwio_submit(struct tqueue *queue)
     tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
     merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 
+    tapdisk_queue_account_submit(queue, queue->queued, merged);
+    tapdisk_queue_account_reap(queue, merged);
     queue->queued = 0;
 
     for (i = 0; i < merged; i++) {
@@ -257,12 +439,345 @@ static int tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
     .name = "rwio",
-    .data_size = 0,
+    .data_size = sizeof(struct rwio),
     .tio_setup = tapdisk_rwio_setup,
     .tio_destroy = tapdisk_rwio_destroy,
     .tio_submit = tapdisk_rwio_submit
 };
 
+/*
+ * rwio on a worker pool
+ *
+ * Same I/O as rwio, for images which cannot do O_DIRECT AIO, but the
+ * blocking calls run on a few worker threads. Completions are handed
+ * back through an eventfd, so a slow request only stalls its worker.
+ */
+
+struct rwpool {
+    pthread_t *threads;
+    int n_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+
+    /* submitted iocbs, a ring of queue->size */
+    struct iocb **work;
+    int work_head;
+    int n_work;
+
+    /* completions, not yet reaped by the event loop */
+    struct io_event *done;
+    int n_done;
+
+    struct io_event *aio_events;
+
+    int event_fd;
+    event_id_t event_id;
+};
+
+static int tapdisk_rwpool_threads = TIO_RWPOOL_DEFAULT_THREADS;
+
+void tapdisk_queue_set_threads(int n_threads)
+{
+    tapdisk_rwpool_threads = n_threads;
+}
+
+static ssize_t tapdisk_rwpool_rw(const struct iocb *iocb)
+{
+    int fd = iocb->aio_fildes;
+    char *buf = iocb->u.c.buf;
+    off64_t off = iocb->u.c.offset;
+    size_t size = iocb->u.c.nbytes, done = 0;
+    ssize_t n;
+
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_PREADV:
+        n = preadv(fd, iocb->u.v.vec, iocb->u.v.nr, iocb->u.v.offset);
+        return n < 0 ? -errno : n;
+    case IO_CMD_PWRITEV:
+        n = pwritev(fd, iocb->u.v.vec, iocb->u.v.nr, iocb->u.v.offset);
+        return n < 0 ? -errno : n;
+    case IO_CMD_FDSYNC:
+        return fdatasync(fd) ? -errno : 0;
+    case TIO_CMD_DISCARD:
+        return tapdisk_punch_hole(iocb);
+    }
+
+    while (done < size) {
+        if (iocb->aio_lio_opcode == IO_CMD_PWRITE)
+            n = pwrite64(fd, buf + done, size - done, off + done);
+        else
+            n = pread64(fd, buf + done, size - done, off + done);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (!n)
+            break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+static void *tapdisk_rwpool_worker(void *private)
+{
+    struct tqueue *queue = private;
+    struct rwpool *pool = queue->tio_data;
+    struct io_event *ep;
+    struct iocb *iocb;
+    uint64_t val = 1;
+    ssize_t res;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        while (!pool->n_work && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        if (pool->stop)
+            break;
+
+        iocb = pool->work[pool->work_head];
+        pool->work_head = (pool->work_head + 1) % queue->size;
+        pool->n_work--;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        res = tapdisk_rwpool_rw(iocb);
+
+        pthread_mutex_lock(&pool->lock);
+
+        ep = &pool->done[pool->n_done++];
+        ep->obj = iocb;
+        ep->res = res;
+
+        if (pool->n_done == 1 &&
+            write(pool->event_fd, &val, sizeof(val)) < 0)
+            ERR(-errno, "failed to signal rwio completion");
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static int tapdisk_rwpool_reap(struct tqueue *queue)
+{
+    struct rwpool *pool = queue->tio_data;
+    int i, ret, split;
+    struct iocb *iocb;
+    struct tiocb *tiocb;
+    struct io_event *ep;
+
+    pthread_mutex_lock(&pool->lock);
+    ret = pool->n_done;
+    memcpy(pool->aio_events, pool->done, ret * sizeof(struct io_event));
+    pool->n_done = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!ret)
+        return 0;
+
+    split = io_split(&queue->opioctx, pool->aio_events, ret);
+    tapdisk_filter_events(queue->filter, pool->aio_events, split);
+
+    DBG("events: %d, tiocbs: %d\n", ret, split);
+    tapdisk_queue_account_reap(queue, ret);
+
+    queue->iocbs_pending -= ret;
+    queue->tiocbs_pending -= split;
+
+    for (i = split, ep = pool->aio_events; i-- > 0; ep++) {
+        iocb = ep->obj;
+        tiocb = iocb->data;
+        complete_tiocb(queue, tiocb, ep->res);
+    }
+
+    queue_deferred_tiocbs(queue);
+
+    return ret;
+}
+
+static void tapdisk_rwpool_event(event_id_t id, char mode, void *private)
+{
+    struct tqueue *queue = private;
+    struct rwpool *pool = queue->tio_data;
+    uint64_t val;
+
+    if (read(pool->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        ERR(-errno, "failed to read rwio event fd");
+
+    tapdisk_rwpool_reap(queue);
+}
+
+static int tapdisk_rwpool_poll(struct tqueue *queue)
+{
+    struct rwpool *pool = queue->tio_data;
+
+    if (!__atomic_load_n(&pool->n_done, __ATOMIC_RELAXED))
+        return 0;
+
+    return tapdisk_rwpool_reap(queue);
+}
+
+static void tapdisk_rwpool_destroy(struct tqueue *queue)
+{
+    struct rwpool *pool = queue->tio_data;
+    int i;
+
+    if (!pool)
+        return;
+
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->n_threads; i++)
+            pthread_join(pool->threads[i], NULL);
+
+        free(pool->threads);
+        pool->threads = NULL;
+
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+    }
+
+    if (pool->event_id >= 0) {
+        tapdisk_server_unregister_event(pool->event_id);
+        pool->event_id = -1;
+    }
+
+    if (pool->event_fd >= 0) {
+        close(pool->event_fd);
+        pool->event_fd = -1;
+    }
+
+    free(pool->work);
+    pool->work = NULL;
+
+    free(pool->done);
+    pool->done = NULL;
+
+    free(pool->aio_events);
+    pool->aio_events = NULL;
+}
+
+static int tapdisk_rwpool_setup(struct tqueue *queue, int size)
+{
+    struct rwpool *pool = queue->tio_data;
+    sigset_t set, oset;
+    int err;
+
+    pool->event_fd = -1;
+    pool->event_id = -1;
+
+    pool->work = calloc(size, sizeof(struct iocb *));
+    pool->done = calloc(size, sizeof(struct io_event));
+    pool->aio_events = calloc(size, sizeof(struct io_event));
+    if (!pool->work || !pool->done || !pool->aio_events) {
+        err = -errno;
+        goto fail;
+    }
+
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->event_fd < 0) {
+        err = -errno;
+        goto fail;
+    }
+
+    pool->event_id =
+        tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+                                      pool->event_fd, 0,
+                                      tapdisk_rwpool_event, queue);
+    err = pool->event_id;
+    if (err < 0)
+        goto fail;
+
+    pool->threads = calloc(tapdisk_rwpool_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        err = -errno;
+        goto fail;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    /* NB. keep signals on the event loop threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+    for (err = 0; pool->n_threads < tapdisk_rwpool_threads;
+         pool->n_threads++) {
+        err = -pthread_create(&pool->threads[pool->n_threads], NULL,
+                              tapdisk_rwpool_worker, queue);
+        if (err)
+            break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    if (err)
+        goto fail;
+
+    return 0;
+
+  fail:
+    tapdisk_rwpool_destroy(queue);
+    return err;
+}
+
+static int tapdisk_rwpool_submit(struct tqueue *queue)
+{
+    struct rwpool *pool = queue->tio_data;
+    int i, merged, tail;
+
+    if (!queue->queued)
+        return 0;
+
+    tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+    merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (i = 0; i < merged; i++) {
+        tail = (pool->work_head + pool->n_work++) % queue->size;
+        pool->work[tail] = queue->iocbs[i];
+    }
+
+    if (merged == 1)
+        pthread_cond_signal(&pool->cond);
+    else
+        pthread_cond_broadcast(&pool->cond);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    DBG("queued: %d, merged: %d\n", queue->queued, merged);
+
+    queue->iocbs_pending += merged;
+    queue->tiocbs_pending += queue->queued;
+    tapdisk_queue_account_submit(queue, queue->queued, merged);
+    queue->queued = 0;
+
+    return merged;
+}
+
+static const struct tio td_tio_rwpool = {
+    .name = "rwpool",
+    .data_size = sizeof(struct rwpool),
+    .tio_setup = tapdisk_rwpool_setup,
+    .tio_destroy = tapdisk_rwpool_destroy,
+    .tio_submit = tapdisk_rwpool_submit,
+    .tio_poll = tapdisk_rwpool_poll,
+};
+
 /*
  * libaio
  */
@@ -279,6 +794,24 @@ struct lio {
 
 #define LIO_FLAG_EVENTFD        (1<<0)
 
+/*
+ * The completion ring the kernel maps at the io_context_t address,
+ * see fs/aio.c. Lets us check for completions without a syscall.
+ */
+struct lio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define LIO_RING_MAGIC          0xa10a10a1
+
 static int tapdisk_lio_check_resfd(void)
 {
     return tapdisk_linux_version() >= KERNEL_VERSION(2, 6, 22);
@@ -425,17 +958,14 @@ static void tapdisk_lio_ack_event(struct tqueue *queue)
     }
 }
 
-static void tapdisk_lio_event(event_id_t id, char mode, void *private)
+static int tapdisk_lio_reap(struct tqueue *queue)
 {
-    struct tqueue *queue = private;
     struct lio *lio;
     int i, ret, split;
     struct iocb *iocb;
     struct tiocb *tiocb;
     struct io_event *ep;
 
-    tapdisk_lio_ack_event(queue);
-
     lio = queue->tio_data;
     ret = io_getevents(lio->aio_ctx, 0,
                        queue->size, lio->aio_events, NULL);
@@ -443,6 +973,7 @@ static void tapdisk_lio_event(event_id_t id, char mode, void *private)
     tapdisk_filter_events(queue->filter, lio->aio_events, split);
 
     DBG("events: %d, tiocbs: %d\n", ret, split);
+    tapdisk_queue_account_reap(queue, ret);
 
     queue->iocbs_pending -= ret;
     queue->tiocbs_pending -= split;
@@ -454,18 +985,80 @@ static void tapdisk_lio_event(event_id_t id, char mode, void *private)
     }
 
     queue_deferred_tiocbs(queue);
+
+    return ret;
 }
 
-static int tapdisk_lio_setup(struct tqueue *queue, int qlen)
+static void tapdisk_lio_event(event_id_t id, char mode, void *private)
 {
-    struct lio *lio = queue->tio_data;
-    int err;
+    struct tqueue *queue = private;
 
-    lio->event_id = -1;
+    tapdisk_lio_ack_event(queue);
+    tapdisk_lio_reap(queue);
+}
 
-    err = tapdisk_lio_setup_aio(queue, qlen);
-    if (err)
-        goto fail;
+/*
+ * NB. Leaves the eventfd count alone, the next tapdisk_lio_event
+ * will just find an empty ring.
+ */
+static int tapdisk_lio_poll(struct tqueue *queue)
+{
+    struct lio *lio = queue->tio_data;
+    volatile struct lio_ring *ring;
+
+    if (!queue->iocbs_pending)
+        return 0;
+
+    ring = (struct lio_ring *) lio->aio_ctx;
+    if (ring->magic == LIO_RING_MAGIC && ring->head == ring->tail)
+        return 0;
+
+    return tapdisk_lio_reap(queue);
+}
+
+/*
+ * IOCB_CMD_FDSYNC needs Linux 4.18, earlier kernels refuse it in
+ * io_submit, failing everything queued behind. Try one on a memfd
+ * before any image I/O goes in.
+ */
+static int tapdisk_lio_probe_fdsync(struct tqueue *queue)
+{
+    struct lio *lio = queue->tio_data;
+    struct iocb iocb, *iocbs[1] = { &iocb };
+    struct io_event event;
+    int fd, ok = 0;
+
+    fd = syscall(__NR_memfd_create, "tapdisk-fdsync", 0);
+    if (fd < 0)
+        return 0;
+
+    io_prep_fdsync(&iocb, fd);
+    if (io_submit(lio->aio_ctx, 1, iocbs) == 1)
+        ok = io_getevents(lio->aio_ctx, 1, 1, &event, NULL) == 1 &&
+            event.res == 0;
+
+    close(fd);
+
+    return ok;
+}
+
+static int tapdisk_lio_setup(struct tqueue *queue, int qlen)
+{
+    struct lio *lio = queue->tio_data;
+    int err;
+
+    lio->event_id = -1;
+
+    err = tapdisk_lio_setup_aio(queue, qlen);
+    if (err)
+        goto fail;
+
+    queue->offload_ops |= TIO_OFFLOAD_DISCARD;
+
+    if (!tapdisk_lio_probe_fdsync(queue)) {
+        DPRINTF("no aio fdsync, running it on the offload pool\n");
+        queue->offload_ops |= TIO_OFFLOAD_FDSYNC;
+    }
 
     lio->event_id =
         tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
@@ -512,6 +1105,7 @@ static int tapdisk_lio_submit(struct tqueue *queue)
 
     queue->iocbs_pending += submitted;
     queue->tiocbs_pending += queue->queued;
+    tapdisk_queue_account_submit(queue, queue->queued, merged);
     queue->queued = 0;
 
     if (err)
@@ -527,6 +1121,406 @@ static const struct tio td_tio_lio = {
     .tio_setup = tapdisk_lio_setup,
     .tio_destroy = tapdisk_lio_destroy,
     .tio_submit = tapdisk_lio_submit,
+    .tio_poll = tapdisk_lio_poll,
+};
+
+/*
+ * io_uring
+ *
+ * Driven through the raw syscalls, completions are reaped straight off
+ * the mapped CQ ring when the ring fd polls readable. Needs 5.6 for
+ * IORING_OP_READ/WRITE and sparse fixed file sets.
+ */
+
+#define URING_MAX_FILES         1024
+
+struct uring {
+    int fd;
+    int event_id;
+
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* registered files, indexed by fd, -1 if not registered */
+    int *files;
+
+    struct io_event *aio_events;
+};
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int tapdisk_uring_update_file(struct uring *uring, int fd, int val)
+{
+    struct io_uring_files_update up;
+    int err;
+
+    memset(&up, 0, sizeof(up));
+    up.offset = fd;
+    up.fds = (uintptr_t) & val;
+
+    err = __uring_register(uring->fd, IORING_REGISTER_FILES_UPDATE,
+                           &up, 1);
+    if (err < 0)
+        return -errno;
+
+    uring->files[fd] = val;
+
+    return 0;
+}
+
+static int tapdisk_uring_register_file(struct tqueue *queue, int fd)
+{
+    struct uring *uring = queue->tio_data;
+
+    if (!uring->files || fd < 0 || fd >= URING_MAX_FILES)
+        return -ENOSPC;
+
+    return tapdisk_uring_update_file(uring, fd, fd);
+}
+
+static void tapdisk_uring_unregister_file(struct tqueue *queue, int fd)
+{
+    struct uring *uring = queue->tio_data;
+    int err;
+
+    if (!uring->files || fd < 0 || fd >= URING_MAX_FILES)
+        return;
+
+    if (uring->files[fd] != fd)
+        return;
+
+    err = tapdisk_uring_update_file(uring, fd, -1);
+    if (err)
+        ERR(err, "failed to unregister fd %d", fd);
+}
+
+static void tapdisk_uring_setup_files(struct uring *uring)
+{
+    int i, err;
+
+    uring->files = malloc(URING_MAX_FILES * sizeof(int));
+    if (!uring->files)
+        return;
+
+    for (i = 0; i < URING_MAX_FILES; i++)
+        uring->files[i] = -1;
+
+    err = __uring_register(uring->fd, IORING_REGISTER_FILES,
+                           uring->files, URING_MAX_FILES);
+    if (err < 0) {
+        DBG("fixed files not supported: %d\n", -errno);
+        free(uring->files);
+        uring->files = NULL;
+    }
+}
+
+static void tapdisk_uring_destroy(struct tqueue *queue)
+{
+    struct uring *uring = queue->tio_data;
+
+    if (!uring)
+        return;
+
+    if (uring->event_id >= 0) {
+        tapdisk_server_unregister_event(uring->event_id);
+        uring->event_id = -1;
+    }
+
+    if (uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
+        uring->sqes = NULL;
+    }
+
+    if (uring->ring) {
+        munmap(uring->ring, uring->ring_size);
+        uring->ring = NULL;
+    }
+
+    if (uring->fd >= 0) {
+        close(uring->fd);
+        uring->fd = -1;
+    }
+
+    free(uring->files);
+    uring->files = NULL;
+
+    free(uring->aio_events);
+    uring->aio_events = NULL;
+}
+
+static int tapdisk_uring_reap(struct tqueue *queue)
+{
+    struct uring *uring = queue->tio_data;
+    unsigned head, tail;
+    int i, ret, split;
+    struct io_uring_cqe *cqe;
+    struct iocb *iocb;
+    struct tiocb *tiocb;
+    struct io_event *ep;
+
+    head = *uring->cq_head;
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (ret = 0; head != tail; head++, ret++) {
+        cqe = &uring->cqes[head & *uring->cq_mask];
+        ep = &uring->aio_events[ret];
+        ep->obj = (struct iocb *) (uintptr_t) cqe->user_data;
+        ep->res = cqe->res;
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (!ret)
+        return 0;
+
+    split = io_split(&queue->opioctx, uring->aio_events, ret);
+    tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+    DBG("events: %d, tiocbs: %d\n", ret, split);
+    tapdisk_queue_account_reap(queue, ret);
+
+    queue->iocbs_pending -= ret;
+    queue->tiocbs_pending -= split;
+
+    for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+        iocb = ep->obj;
+        tiocb = iocb->data;
+        complete_tiocb(queue, tiocb, ep->res);
+    }
+
+    queue_deferred_tiocbs(queue);
+
+    return ret;
+}
+
+static void tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+    tapdisk_uring_reap(private);
+}
+
+static int tapdisk_uring_poll(struct tqueue *queue)
+{
+    struct uring *uring = queue->tio_data;
+
+    if (!queue->iocbs_pending)
+        return 0;
+
+    if (*uring->cq_head ==
+        __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    return tapdisk_uring_reap(queue);
+}
+
+static int tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+    struct uring *uring = queue->tio_data;
+    struct io_uring_params p;
+    void *ring;
+    int err;
+
+    uring->fd = -1;
+    uring->event_id = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 2 * qlen;
+
+    uring->fd = syscall(__NR_io_uring_setup, qlen, &p);
+    if (uring->fd < 0) {
+        err = -errno;
+        goto fail;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        err = -ENOSYS;
+        goto fail;
+    }
+
+    uring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (uring->ring_size <
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        uring->ring_size =
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        err = -errno;
+        goto fail;
+    }
+    uring->ring = ring;
+
+    uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        err = -errno;
+        goto fail;
+    }
+
+    uring->sq_head = ring + p.sq_off.head;
+    uring->sq_tail = ring + p.sq_off.tail;
+    uring->sq_mask = ring + p.sq_off.ring_mask;
+    uring->sq_array = ring + p.sq_off.array;
+
+    uring->cq_head = ring + p.cq_off.head;
+    uring->cq_tail = ring + p.cq_off.tail;
+    uring->cq_mask = ring + p.cq_off.ring_mask;
+    uring->cqes = ring + p.cq_off.cqes;
+
+    uring->aio_events = calloc(p.cq_entries, sizeof(struct io_event));
+    if (!uring->aio_events) {
+        err = -errno;
+        goto fail;
+    }
+
+    tapdisk_uring_setup_files(uring);
+
+    uring->event_id =
+        tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+                                      uring->fd, 0,
+                                      tapdisk_uring_event, queue);
+    err = uring->event_id;
+    if (err < 0)
+        goto fail;
+
+    queue->offload_ops |= TIO_OFFLOAD_DISCARD;
+
+    return 0;
+
+  fail:
+    tapdisk_uring_destroy(queue);
+    return err;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *uring,
+                       struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+    int fd = iocb->aio_fildes;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+        sqe->opcode = IORING_OP_READ;
+        break;
+    case IO_CMD_PWRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        break;
+    case IO_CMD_PREADV:
+        sqe->opcode = IORING_OP_READV;
+        break;
+    case IO_CMD_PWRITEV:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+    case IO_CMD_FDSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    }
+
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_FDSYNC:
+        break;
+    case IO_CMD_PREAD:
+    case IO_CMD_PWRITE:
+        sqe->addr = (uintptr_t) iocb->u.c.buf;
+        sqe->len = iocb->u.c.nbytes;
+        sqe->off = iocb->u.c.offset;
+        break;
+    default:
+        sqe->addr = (uintptr_t) iocb->u.v.vec;
+        sqe->len = iocb->u.v.nr;
+        sqe->off = iocb->u.v.offset;
+        break;
+    }
+
+    if (uring->files && fd < URING_MAX_FILES && uring->files[fd] == fd)
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t) iocb;
+}
+
+static int tapdisk_uring_submit(struct tqueue *queue)
+{
+    struct uring *uring = queue->tio_data;
+    int i, merged, submitted, err = 0;
+    unsigned start, tail, idx;
+
+    if (!queue->queued)
+        return 0;
+
+    tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+    merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+    start = tail = *uring->sq_tail;
+    for (i = 0; i < merged; i++, tail++) {
+        idx = tail & *uring->sq_mask;
+        tapdisk_uring_prep_sqe(uring, &uring->sqes[idx], queue->iocbs[i]);
+        uring->sq_array[idx] = idx;
+    }
+    __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    submitted = syscall(__NR_io_uring_enter, uring->fd, merged, 0, 0,
+                        NULL, 0);
+
+    DBG("queued: %d, merged: %d, submitted: %d\n",
+        queue->queued, merged, submitted);
+
+    if (submitted < 0) {
+        err = -errno;
+        submitted = 0;
+    } else if (submitted < merged)
+        err = -EIO;
+
+    if (err)
+        /* take back whatever the kernel did not consume */
+        __atomic_store_n(uring->sq_tail, start + submitted,
+                         __ATOMIC_RELEASE);
+
+    queue->iocbs_pending += submitted;
+    queue->tiocbs_pending += queue->queued;
+    tapdisk_queue_account_submit(queue, queue->queued, merged);
+    queue->queued = 0;
+
+    if (err)
+        queue->tiocbs_pending -=
+            fail_tiocbs(queue, submitted, merged, err);
+
+    return submitted;
+}
+
+static const struct tio td_tio_uring = {
+    .name = "uring",
+    .data_size = sizeof(struct uring),
+    .tio_setup = tapdisk_uring_setup,
+    .tio_destroy = tapdisk_uring_destroy,
+    .tio_submit = tapdisk_uring_submit,
+    .tio_poll = tapdisk_uring_poll,
+    .tio_register_file = tapdisk_uring_register_file,
+    .tio_unregister_file = tapdisk_uring_unregister_file,
 };
 
 static void tapdisk_queue_free_io(struct tqueue *queue)
@@ -555,6 +1549,12 @@ static int tapdisk_queue_init_io(struct tqueue *queue, int drv)
     case TIO_DRV_RWIO:
         tio = &td_tio_rwio;
         break;
+    case TIO_DRV_URING:
+        tio = &td_tio_uring;
+        break;
+    case TIO_DRV_RWPOOL:
+        tio = &td_tio_rwpool;
+        break;
     default:
         err = -EINVAL;
         goto fail;
@@ -584,6 +1584,43 @@ static int tapdisk_queue_init_io(struct tqueue *queue, int drv)
     return err;
 }
 
+static int tapdisk_queue_sort;
+
+/*
+ * A worker pool for the offloaded ops. Without one they run inline,
+ * which is slow but still correct.
+ */
+static int tapdisk_queue_init_offload(struct tqueue *queue)
+{
+    struct tqueue *offload;
+    int err;
+
+    offload = malloc(sizeof(*offload));
+    if (!offload) {
+        err = -errno;
+        goto fail;
+    }
+
+    err = tapdisk_init_queue(offload, queue->size, TIO_DRV_RWPOOL, NULL);
+    if (err) {
+        free(offload);
+        goto fail;
+    }
+
+    queue->offload = offload;
+    return 0;
+
+  fail:
+    ERR(err, "no offload pool, %s runs offloaded ops inline",
+        queue->tio->name);
+    return err;
+}
+
+void tapdisk_queue_set_sort(int sort)
+{
+    tapdisk_queue_sort = sort;
+}
+
 int
 tapdisk_init_queue(struct tqueue *queue, int size,
                    int drv, struct tfilter *filter)
@@ -612,6 +1649,9 @@ tapdisk_init_queue(struct tqueue *queue, int size,
     if (err)
         goto fail;
 
+    if (tapdisk_queue_sort)
+        queue->opioctx.flags |= OPIO_SORT;
+
     return 0;
 
   fail:
@@ -621,6 +1661,12 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 
 void tapdisk_free_queue(struct tqueue *queue)
 {
+    if (queue->offload) {
+        tapdisk_free_queue(queue->offload);
+        free(queue->offload);
+        queue->offload = NULL;
+    }
+
     tapdisk_queue_free_io(queue);
 
     free(queue->iocbs);
@@ -629,6 +1675,16 @@ void tapdisk_free_queue(struct tqueue *queue)
     opio_free(&queue->opioctx);
 }
 
+static double tapdisk_queue_merge_ratio(struct tqueue *queue)
+{
+    struct opioctx *ctx = &queue->opioctx;
+
+    if (!ctx->merge_out)
+        return 1.0;
+
+    return (double) ctx->merge_in / ctx->merge_out;
+}
+
 void tapdisk_debug_queue(struct tqueue *queue)
 {
     struct tiocb *tiocb = queue->deferred.head;
@@ -636,9 +1692,15 @@ void tapdisk_debug_queue(struct tqueue *queue)
     WARN("TAPDISK QUEUE:\n");
     WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
          "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %" PRIx64
-         "\n", queue->size, queue->tio->name, queue->queued,
-         queue->iocbs_pending, queue->tiocbs_pending,
-         queue->tiocbs_deferred, queue->deferrals);
+         ", sort: %d, merge ratio: %.2f\n", queue->size, queue->tio->name,
+         queue->queued, queue->iocbs_pending, queue->tiocbs_pending,
+         queue->tiocbs_deferred, queue->deferrals,
+         !!(queue->opioctx.flags & OPIO_SORT),
+         tapdisk_queue_merge_ratio(queue));
+    WARN("tiocbs submitted: %" PRIu64 ", completed: %" PRIu64
+         ", iocbs: %" PRIu64 ", deferred usecs: %" PRIu64 "\n",
+         queue->stats.submitted, queue->stats.completed,
+         queue->stats.iocbs, queue->stats.deferred_usecs);
 
     if (tiocb) {
         WARN("deferred:\n");
@@ -651,6 +1713,67 @@ void tapdisk_debug_queue(struct tqueue *queue)
     }
 }
 
+static void
+tapdisk_queue_stats_hist(td_stats_t * st, const char *name,
+                         const uint64_t * hist)
+{
+    int i;
+
+    tapdisk_stats_field(st, name, "[");
+    for (i = 0; i < TQUEUE_HIST_BUCKETS; i++)
+        tapdisk_stats_val(st, "llu", (unsigned long long) hist[i]);
+    tapdisk_stats_leave(st, ']');
+}
+
+void tapdisk_queue_stats(struct tqueue *queue, td_stats_t * st)
+{
+    struct tqueue_stats *stats = &queue->stats;
+    struct opioctx *ctx = &queue->opioctx;
+
+    if (queue->tiocbs_deferred)
+        tapdisk_queue_account_deferred(queue);
+
+    tapdisk_stats_field(st, "tio", "{");
+    tapdisk_stats_field(st, "name", "s", queue->tio->name);
+    tapdisk_stats_field(st, "size", "d", queue->size);
+    tapdisk_stats_field(st, "sort", "d", !!(ctx->flags & OPIO_SORT));
+
+    tapdisk_stats_field(st, "tiocbs", "[");
+    tapdisk_stats_val(st, "llu", (unsigned long long) stats->submitted);
+    tapdisk_stats_val(st, "llu", (unsigned long long) stats->completed);
+    tapdisk_stats_leave(st, ']');
+
+    tapdisk_stats_field(st, "iocbs", "llu",
+                        (unsigned long long) stats->iocbs);
+    tapdisk_stats_field(st, "pending", "[");
+    tapdisk_stats_val(st, "d", queue->iocbs_pending);
+    tapdisk_stats_val(st, "d", queue->tiocbs_pending);
+    tapdisk_stats_leave(st, ']');
+
+    tapdisk_stats_field(st, "merge_in", "llu",
+                        (unsigned long long) ctx->merge_in);
+    tapdisk_stats_field(st, "merge_out", "llu",
+                        (unsigned long long) ctx->merge_out);
+    tapdisk_stats_field(st, "merged", "llu",
+                        (unsigned long long) (ctx->merge_in -
+                                              ctx->merge_out));
+    tapdisk_stats_field(st, "merge_ratio", ".2f",
+                        tapdisk_queue_merge_ratio(queue));
+
+    tapdisk_stats_field(st, "deferred", "d", queue->tiocbs_deferred);
+    tapdisk_stats_field(st, "deferrals", "llu",
+                        (unsigned long long) queue->deferrals);
+    tapdisk_stats_field(st, "deferred_usecs", "llu",
+                        (unsigned long long) stats->deferred_usecs);
+    tapdisk_stats_field(st, "offloaded", "llu",
+                        (unsigned long long) stats->offloaded);
+
+    tapdisk_queue_stats_hist(st, "batch", stats->batch);
+    tapdisk_queue_stats_hist(st, "depth", stats->depth);
+    tapdisk_queue_stats_hist(st, "reap", stats->reap);
+    tapdisk_stats_leave(st, '}');
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf,
                    size_t size, long long offset, td_queue_callback_t cb,
@@ -669,6 +1792,64 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf,
     tiocb->next = NULL;
 }
 
+void
+tapdisk_prep_tiocbv(struct tiocb *tiocb, int fd, int rw,
+                    struct iovec *iov, int iovcnt, long long offset,
+                    td_queue_callback_t cb, void *arg)
+{
+    struct iocb *iocb = &tiocb->iocb;
+
+    if (rw)
+        io_prep_pwritev(iocb, fd, iov, iovcnt, offset);
+    else
+        io_prep_preadv(iocb, fd, iov, iovcnt, offset);
+
+    iocb->data = tiocb;
+    tiocb->cb = cb;
+    tiocb->arg = arg;
+    tiocb->next = NULL;
+}
+
+/*
+ * NB. Where the lio driver lacks IOCB_CMD_FDSYNC (before Linux 4.18),
+ * the sync is offloaded.
+ */
+void
+tapdisk_prep_tiocb_sync(struct tiocb *tiocb, int fd,
+                        td_queue_callback_t cb, void *arg)
+{
+    struct iocb *iocb = &tiocb->iocb;
+
+    io_prep_fdsync(iocb, fd);
+
+    iocb->data = tiocb;
+    tiocb->cb = cb;
+    tiocb->arg = arg;
+    tiocb->next = NULL;
+}
+
+/*
+ * Punches a hole of @size bytes at @offset, see TIO_CMD_DISCARD.
+ */
+void
+tapdisk_prep_tiocb_discard(struct tiocb *tiocb, int fd, size_t size,
+                           long long offset, td_queue_callback_t cb,
+                           void *arg)
+{
+    struct iocb *iocb = &tiocb->iocb;
+
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = TIO_CMD_DISCARD;
+    iocb->u.c.nbytes = size;
+    iocb->u.c.offset = offset;
+
+    iocb->data = tiocb;
+    tiocb->cb = cb;
+    tiocb->arg = arg;
+    tiocb->next = NULL;
+}
+
 void tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
     if (!tapdisk_queue_full(queue))
@@ -683,6 +1864,9 @@ void tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
  */
 int tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+    if (queue->offload_ops)
+        offload_tiocbs(queue);
+
     return queue->tio->tio_submit(queue);
 }
 
@@ -715,3 +1899,50 @@ int tapdisk_cancel_all_tiocbs(struct tqueue *queue)
 
     return cancelled;
 }
+
+/*
+ * Reaps completed iocbs without blocking, if the driver supports it.
+ * Returns the number of completions.
+ */
+int tapdisk_poll_tiocbs(struct tqueue *queue)
+{
+    if (!queue->tio || !queue->tio->tio_poll)
+        return 0;
+
+    return queue->tio->tio_poll(queue);
+}
+
+/*
+ * Registers an image fd with the driver, if it can do anything with
+ * it. Unregister before closing the fd.
+ */
+int tapdisk_queue_register_file(struct tqueue *queue, int fd)
+{
+    if (!queue->tio || !queue->tio->tio_register_file)
+        return -EOPNOTSUPP;
+
+    return queue->tio->tio_register_file(queue, fd);
+}
+
+void tapdisk_queue_unregister_file(struct tqueue *queue, int fd)
+{
+    if (queue->tio && queue->tio->tio_unregister_file)
+        queue->tio->tio_unregister_file(queue, fd);
+}
+
+/*
+ * Maps a driver name to TIO_DRV_*.
+ */
+int tapdisk_queue_driver(const char *name)
+{
+    if (!strcmp(name, td_tio_lio.name))
+        return TIO_DRV_LIO;
+    if (!strcmp(name, td_tio_rwio.name))
+        return TIO_DRV_RWIO;
+    if (!strcmp(name, td_tio_uring.name))
+        return TIO_DRV_URING;
+    if (!strcmp(name, td_tio_rwpool.name))
+        return TIO_DRV_RWPOOL;
+
+    return -EINVAL;
+}
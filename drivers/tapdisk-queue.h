@@ -9,6 +9,7 @@
 
 #include "io-optimize.h"
 #include "scheduler.h"
+#include "tapdisk-stats.h"
 
 struct tiocb;
 struct tfilter;
@@ -29,6 +30,37 @@ struct tlist {
     struct tiocb *tail;
 };
 
+/*
+ * Histogram buckets are powers of two: bucket n counts samples in
+ * [2^n, 2^(n+1)), the first one includes 0, the last one is open.
+ */
+#define TQUEUE_HIST_BUCKETS 13
+
+struct tqueue_stats {
+    /* tiocbs handed to and completed by the aio layer */
+    uint64_t submitted;
+    uint64_t completed;
+
+    /* iocbs submitted, after merging */
+    uint64_t iocbs;
+
+    /* time spent on the deferred list, summed over tiocbs */
+    uint64_t deferred_usecs;
+    int64_t deferred_stamp;
+
+    /* iocbs per submission */
+    uint64_t batch[TQUEUE_HIST_BUCKETS];
+
+    /* iocbs pending after each submission */
+    uint64_t depth[TQUEUE_HIST_BUCKETS];
+
+    /* iocbs per reap */
+    uint64_t reap[TQUEUE_HIST_BUCKETS];
+
+    /* tiocbs run by the offload pool or inline, see offload_tiocbs */
+    uint64_t offloaded;
+};
+
 struct tqueue {
     int size;
 
@@ -58,6 +90,16 @@ struct tqueue {
     struct tfilter *filter;
 
     uint64_t deferrals;
+
+    /*
+     * Ops the driver cannot run, TIO_OFFLOAD_*. They go to a worker
+     * pool, started on first use, or run inline if it failed to start.
+     */
+    unsigned int offload_ops;
+    struct tqueue *offload;
+    int offload_err;
+
+    struct tqueue_stats stats;
 };
 
 struct tio {
@@ -67,13 +109,30 @@ struct tio {
     int (*tio_setup) (struct tqueue * queue, int qlen);
     void (*tio_destroy) (struct tqueue * queue);
     int (*tio_submit) (struct tqueue * queue);
+    int (*tio_poll) (struct tqueue * queue);
+    int (*tio_register_file) (struct tqueue * queue, int fd);
+    void (*tio_unregister_file) (struct tqueue * queue, int fd);
 };
 
 enum {
     TIO_DRV_LIO = 1,
     TIO_DRV_RWIO = 2,
+    TIO_DRV_URING = 3,
+    TIO_DRV_RWPOOL = 4,
 };
 
+#define TIO_OFFLOAD_FDSYNC          (1<<0)
+#define TIO_OFFLOAD_DISCARD         (1<<1)
+
+/*
+ * Hole punching, not an aio opcode: u.c.offset and u.c.nbytes give the
+ * range. Only the rw drivers run it, the others offload it.
+ */
+#define TIO_CMD_DISCARD             16
+
+#define TIO_RWPOOL_DEFAULT_THREADS  4
+#define TIO_RWPOOL_MAX_THREADS      64
+
 /*
  * Interface for request producer (i.e., tapdisk)
  * NB: the following functions may cause additional tiocbs to be queued:
@@ -87,6 +146,8 @@ enum {
 #define tapdisk_queue_empty(q) ((q)->queued == 0)
 #define tapdisk_queue_full(q)  \
 	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+#define tapdisk_queue_room(q)  \
+	((q)->size - (q)->tiocbs_pending - (q)->queued - (q)->tiocbs_deferred)
 int tapdisk_init_queue(struct tqueue *, int size, int drv,
                        struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
@@ -96,7 +157,20 @@ int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
+int tapdisk_poll_tiocbs(struct tqueue *);
+int tapdisk_queue_register_file(struct tqueue *, int);
+void tapdisk_queue_unregister_file(struct tqueue *, int);
+int tapdisk_queue_driver(const char *);
+void tapdisk_queue_set_threads(int);
+void tapdisk_queue_set_sort(int);
+void tapdisk_queue_stats(struct tqueue *, td_stats_t *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
                         long long, td_queue_callback_t, void *);
+void tapdisk_prep_tiocbv(struct tiocb *, int, int, struct iovec *, int,
+                         long long, td_queue_callback_t, void *);
+void tapdisk_prep_tiocb_sync(struct tiocb *, int, td_queue_callback_t,
+                             void *);
+void tapdisk_prep_tiocb_discard(struct tiocb *, int, size_t, long long,
+                                td_queue_callback_t, void *);
 
 #endif
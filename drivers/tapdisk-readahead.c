@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "tapdisk-readahead.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-log.h"
+
+#define TD_RA_CHUNK_SIZE            (TD_RA_CHUNK_SECS << SECTOR_SHIFT)
+#define TD_RA_BUF_ALIGN             4096
+
+static int tapdisk_readahead_pool_kb = TD_RA_POOL_KB;
+
+static void tapdisk_readahead_complete(td_vbd_request_t *, int, void *, int);
+
+int tapdisk_readahead_set_pool(int kb)
+{
+    if (kb < 0 || kb > TD_RA_MAX_POOL_KB)
+        return -EINVAL;
+
+    tapdisk_readahead_pool_kb = kb;
+    return 0;
+}
+
+void tapdisk_readahead_init(td_readahead_t * ra, td_vbd_t * vbd)
+{
+    memset(ra, 0, sizeof(*ra));
+    ra->vbd = vbd;
+    ra->n_chunks = tapdisk_readahead_pool_kb / (TD_RA_CHUNK_SIZE >> 10);
+}
+
+static int tapdisk_readahead_alloc(td_readahead_t * ra)
+{
+    void *buf;
+    int i, err;
+
+    err = posix_memalign(&buf, TD_RA_BUF_ALIGN,
+                         (size_t) ra->n_chunks * TD_RA_CHUNK_SIZE);
+    if (err)
+        goto fail;
+
+    ra->chunks = calloc(ra->n_chunks, sizeof(td_ra_chunk_t));
+    if (!ra->chunks) {
+        free(buf);
+        err = ENOMEM;
+        goto fail;
+    }
+
+    ra->buf = buf;
+    for (i = 0; i < ra->n_chunks; i++) {
+        ra->chunks[i].iov.base = ra->buf + (size_t) i * TD_RA_CHUNK_SIZE;
+        ra->chunks[i].ra = ra;
+    }
+
+    return 0;
+
+  fail:
+    EPRINTF("%s: read-ahead disabled: %d\n", ra->vbd->name, -err);
+    ra->n_chunks = 0;
+    return -err;
+}
+
+void tapdisk_readahead_free(td_readahead_t * ra)
+{
+    free(ra->chunks);
+    free(ra->buf);
+    ra->chunks = NULL;
+    ra->buf = NULL;
+}
+
+static int tapdisk_readahead_vreq_secs(td_vbd_request_t * vreq)
+{
+    int i, secs = 0;
+
+    for (i = 0; i < vreq->iovcnt; i++)
+        secs += vreq->iov[i].secs;
+
+    return secs;
+}
+
+static inline td_sector_t tapdisk_readahead_align(td_sector_t sec)
+{
+    return sec & ~((td_sector_t) TD_RA_CHUNK_SECS - 1);
+}
+
+static inline int
+tapdisk_readahead_overlaps(td_sector_t a, td_sector_t a_secs,
+                           td_sector_t b, td_sector_t b_secs)
+{
+    return a < b + b_secs && b < a + a_secs;
+}
+
+static td_ra_chunk_t *tapdisk_readahead_find(td_readahead_t * ra,
+                                             td_sector_t sec)
+{
+    td_ra_chunk_t *c;
+
+    for (c = ra->chunks; c < ra->chunks + ra->n_chunks; c++)
+        if (c->state != TD_RA_FREE && c->sec == sec)
+            return c;
+
+    return NULL;
+}
+
+static void tapdisk_readahead_use(td_readahead_t * ra, td_ra_chunk_t * c)
+{
+    struct td_ra_stream *s = &ra->streams[c->stream];
+
+    c->lru = ++ra->clock;
+
+    if (!c->used) {
+        c->used = 1;
+        s->window = MIN(s->window + TD_RA_CHUNK_SECS, TD_RA_MAX_WINDOW);
+    }
+}
+
+static void tapdisk_readahead_drop(td_readahead_t * ra, td_ra_chunk_t * c)
+{
+    struct td_ra_stream *s = &ra->streams[c->stream];
+
+    if (!c->used) {
+        ra->wasted += c->secs;
+        s->window = MAX(s->window / 2, TD_RA_MIN_WINDOW);
+    }
+
+    c->state = TD_RA_FREE;
+}
+
+/*
+ * Takes a free chunk, or evicts the least recently used loaded one.
+ * NB. a chunk whose request is still queued on the VBD is never free.
+ */
+static td_ra_chunk_t *tapdisk_readahead_get(td_readahead_t * ra)
+{
+    td_ra_chunk_t *c, *lru = NULL;
+
+    for (c = ra->chunks; c < ra->chunks + ra->n_chunks; c++) {
+        if (c->state == TD_RA_FREE && !c->vreq.list_head)
+            return c;
+
+        if (c->state == TD_RA_VALID && (!lru || c->lru < lru->lru))
+            lru = c;
+    }
+
+    if (lru)
+        tapdisk_readahead_drop(ra, lru);
+
+    return lru;
+}
+
+static int
+tapdisk_readahead_lookup(td_readahead_t * ra, td_sector_t sec, int secs)
+{
+    td_sector_t csec;
+    td_ra_chunk_t *c;
+    int ret = TD_RA_HIT;
+
+    for (csec = tapdisk_readahead_align(sec); csec < sec + secs;
+         csec += TD_RA_CHUNK_SECS) {
+        c = tapdisk_readahead_find(ra, csec);
+        if (!c || c->stale || c->sec + c->secs < MIN(sec + secs,
+                                                     csec +
+                                                     TD_RA_CHUNK_SECS))
+            return TD_RA_MISS;
+
+        if (c->state == TD_RA_LOADING)
+            ret = TD_RA_WAIT;
+
+        c->lru = ++ra->clock;
+    }
+
+    return ret;
+}
+
+static void tapdisk_readahead_copy(td_readahead_t * ra,
+                                   td_vbd_request_t * vreq)
+{
+    td_sector_t sec = vreq->sec;
+    td_ra_chunk_t *c;
+    char *dst;
+    int i, left, off, n;
+
+    for (i = 0; i < vreq->iovcnt; i++) {
+        dst = vreq->iov[i].base;
+        left = vreq->iov[i].secs;
+
+        while (left) {
+            c = tapdisk_readahead_find(ra, tapdisk_readahead_align(sec));
+            off = sec - c->sec;
+            n = MIN(left, c->secs - off);
+
+            memcpy(dst, c->iov.base + ((size_t) off << SECTOR_SHIFT),
+                   (size_t) n << SECTOR_SHIFT);
+            tapdisk_readahead_use(ra, c);
+
+            dst += (size_t) n << SECTOR_SHIFT;
+            sec += n;
+            left -= n;
+        }
+    }
+}
+
+/*
+ * Serves the waiting reads whose chunks all loaded. Reads which lost a
+ * chunk to an error or a write are requeued as plain reads.
+ */
+static void tapdisk_readahead_wake(td_readahead_t * ra)
+{
+    td_vbd_request_t *vreq;
+    int i, ret;
+
+    for (i = 0; i < ra->n_waiters;) {
+        vreq = ra->waiters[i];
+
+        ret = tapdisk_readahead_lookup(ra, vreq->sec,
+                                       tapdisk_readahead_vreq_secs(vreq));
+        if (ret == TD_RA_WAIT) {
+            i++;
+            continue;
+        }
+
+        ra->waiters[i] = ra->waiters[--ra->n_waiters];
+
+        if (ret == TD_RA_HIT) {
+            tapdisk_readahead_copy(ra, vreq);
+            tapdisk_vbd_complete_readahead(vreq, 0);
+        } else
+            tapdisk_vbd_requeue_readahead(vreq);
+    }
+}
+
+static void
+tapdisk_readahead_complete(td_vbd_request_t * vreq, int err,
+                           void *token, int final)
+{
+    td_ra_chunk_t *c = containerof(vreq, td_ra_chunk_t, vreq);
+    td_readahead_t *ra = token;
+
+    if (err)
+        c->state = TD_RA_FREE;
+    else if (c->stale)
+        tapdisk_readahead_drop(ra, c);
+    else
+        c->state = TD_RA_VALID;
+
+    tapdisk_readahead_wake(ra);
+}
+
+/*
+ * Reads racing with a write could load data older than it.
+ */
+static int
+tapdisk_readahead_writing(td_vbd_t * vbd, td_sector_t sec, int secs)
+{
+    struct tqh_td_vbd_request *lists[] = {
+        &vbd->pending_requests, &vbd->failed_requests
+    };
+    td_vbd_request_t *vreq;
+    td_sector_t vsecs;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(lists); i++)
+        TAILQ_FOREACH(vreq, lists[i], next) {
+        if (vreq->op == TD_OP_WRITE)
+            vsecs = tapdisk_readahead_vreq_secs(vreq);
+        else if (vreq->op == TD_OP_DISCARD)
+            vsecs = vreq->discard_secs;
+        else
+            continue;
+
+        if (tapdisk_readahead_overlaps(vreq->sec, vsecs, sec, secs))
+            return 1;
+        }
+
+    return 0;
+}
+
+static void
+tapdisk_readahead_load(td_readahead_t * ra, td_ra_chunk_t * c,
+                       int stream, td_sector_t sec, int secs)
+{
+    td_vbd_request_t *vreq = &c->vreq;
+
+    c->state = TD_RA_LOADING;
+    c->stale = 0;
+    c->used = 0;
+    c->stream = stream;
+    c->lru = ++ra->clock;
+    c->sec = sec;
+    c->secs = secs;
+    c->iov.secs = secs;
+
+    memset(vreq, 0, sizeof(*vreq));
+    td_flag_set(vreq->flags, TD_VREQ_INTERNAL);
+    vreq->op = TD_OP_READ;
+    vreq->sec = sec;
+    vreq->iov = &c->iov;
+    vreq->iovcnt = 1;
+    vreq->cb = tapdisk_readahead_complete;
+    vreq->token = ra;
+    vreq->name = "readahead";
+
+    ra->prefetched += secs;
+
+    tapdisk_vbd_queue_request(ra->vbd, vreq);
+}
+
+static void tapdisk_readahead_prefetch(td_readahead_t * ra, int stream)
+{
+    struct td_ra_stream *s = &ra->streams[stream];
+    td_vbd_t *vbd = ra->vbd;
+    td_sector_t sec, end, size;
+    td_ra_chunk_t *c;
+    int secs;
+
+    if (!ra->chunks && tapdisk_readahead_alloc(ra))
+        return;
+
+    size = tapdisk_vbd_first_image(vbd)->info.size;
+    end = MIN(s->next + s->window, size);
+
+    for (sec = MAX(s->end, tapdisk_readahead_align(s->next)); sec < end;
+         sec += TD_RA_CHUNK_SECS) {
+        if (tapdisk_readahead_find(ra, sec))
+            continue;
+
+        secs = MIN(TD_RA_CHUNK_SECS, size - sec);
+
+        if (tapdisk_image_chain_allocated(&vbd->images, sec, secs) < secs)
+            break;
+
+        if (tapdisk_readahead_writing(vbd, sec, secs))
+            break;
+
+        c = tapdisk_readahead_get(ra);
+        if (!c)
+            break;
+
+        tapdisk_readahead_load(ra, c, stream, sec, secs);
+    }
+
+    s->end = sec;
+}
+
+/*
+ * Returns the stream a read continues, or restarts the least recently
+ * used one from it.
+ */
+static int
+tapdisk_readahead_stream(td_readahead_t * ra, td_sector_t sec, int secs)
+{
+    struct td_ra_stream *s, *lru = NULL;
+
+    for (s = ra->streams; s < ra->streams + TD_RA_STREAMS; s++) {
+        if (s->seq && s->next == sec) {
+            s->seq++;
+            goto out;
+        }
+
+        if (!lru || s->lru < lru->lru)
+            lru = s;
+    }
+
+    s = lru;
+    s->seq = 1;
+    s->end = 0;
+    s->window = TD_RA_MIN_WINDOW;
+
+  out:
+    s->next = sec + secs;
+    s->lru = ++ra->clock;
+    return s - ra->streams;
+}
+
+int tapdisk_readahead_read(td_readahead_t * ra, td_vbd_request_t * vreq)
+{
+    int secs, stream, ret;
+
+    if (!ra->n_chunks || vreq->cb == tapdisk_readahead_complete)
+        return TD_RA_MISS;
+
+    secs = tapdisk_readahead_vreq_secs(vreq);
+    if (secs > TD_RA_MAX_READ_SECS)
+        return TD_RA_MISS;
+
+    ret = TD_RA_MISS;
+    if (ra->chunks)
+        ret = tapdisk_readahead_lookup(ra, vreq->sec, secs);
+
+    stream = tapdisk_readahead_stream(ra, vreq->sec, secs);
+
+    switch (ret) {
+    case TD_RA_HIT:
+        tapdisk_readahead_copy(ra, vreq);
+        ra->hits++;
+        break;
+
+    case TD_RA_WAIT:
+        if (ra->n_waiters == TD_RA_WAITERS) {
+            ret = TD_RA_MISS;
+            ra->misses++;
+            break;
+        }
+        ra->waiters[ra->n_waiters++] = vreq;
+        ra->waits++;
+        break;
+
+    default:
+        if (ra->streams[stream].seq > TD_RA_TRIGGER)
+            ra->misses++;
+    }
+
+    if (ra->streams[stream].seq >= TD_RA_TRIGGER)
+        tapdisk_readahead_prefetch(ra, stream);
+
+    return ret;
+}
+
+void tapdisk_readahead_invalidate(td_readahead_t * ra,
+                                  td_vbd_request_t * vreq)
+{
+    td_ra_chunk_t *c;
+    td_sector_t secs;
+
+    if (!ra->chunks)
+        return;
+
+    switch (vreq->op) {
+    case TD_OP_WRITE:
+        secs = tapdisk_readahead_vreq_secs(vreq);
+        break;
+    case TD_OP_DISCARD:
+        secs = vreq->discard_secs;
+        break;
+    default:
+        return;
+    }
+
+    for (c = ra->chunks; c < ra->chunks + ra->n_chunks; c++) {
+        if (c->state == TD_RA_FREE ||
+            !tapdisk_readahead_overlaps(c->sec, c->secs, vreq->sec, secs))
+            continue;
+
+        if (c->state == TD_RA_LOADING)
+            c->stale = 1;
+        else
+            tapdisk_readahead_drop(ra, c);
+    }
+}
+
+/*
+ * Takes a prefetch back from the VBD queue it sits on.
+ */
+static void
+tapdisk_readahead_unqueue(td_readahead_t * ra, td_ra_chunk_t * c)
+{
+    td_vbd_request_t *vreq = &c->vreq;
+
+    TAILQ_REMOVE(vreq->list_head, vreq, next);
+    vreq->list_head = NULL;
+
+    c->state = TD_RA_FREE;
+}
+
+/*
+ * Requeues the waiting reads as plain reads.
+ */
+static void tapdisk_readahead_requeue_waiters(td_readahead_t * ra)
+{
+    td_vbd_request_t *vreq;
+
+    while (ra->n_waiters) {
+        vreq = ra->waiters[--ra->n_waiters];
+        tapdisk_vbd_requeue_readahead(vreq);
+    }
+}
+
+void tapdisk_readahead_cancel(td_readahead_t * ra)
+{
+    td_vbd_t *vbd = ra->vbd;
+    td_vbd_request_t *vreq;
+    td_ra_chunk_t *c;
+    int n = 0;
+
+    if (!ra->chunks)
+        return;
+
+    for (c = ra->chunks; c < ra->chunks + ra->n_chunks; c++) {
+        vreq = &c->vreq;
+
+        if (c->state != TD_RA_LOADING || vreq->secs_pending)
+            continue;
+
+        if (vreq->list_head != &vbd->new_requests &&
+            vreq->list_head != &vbd->failed_requests)
+            continue;
+
+        tapdisk_readahead_unqueue(ra, c);
+        n++;
+    }
+
+    if (!n)
+        return;
+
+    for (n = 0; n < TD_RA_STREAMS; n++)
+        ra->streams[n].end = 0;
+
+    tapdisk_readahead_wake(ra);
+}
+
+void tapdisk_readahead_reset(td_readahead_t * ra)
+{
+    td_vbd_t *vbd = ra->vbd;
+    td_vbd_request_t *vreq;
+    td_ra_chunk_t *c;
+
+    for (c = ra->chunks; c && c < ra->chunks + ra->n_chunks; c++) {
+        vreq = &c->vreq;
+
+        if (c->state != TD_RA_LOADING)
+            c->state = TD_RA_FREE;
+        else if (vreq->list_head == &vbd->pending_requests ||
+                 vreq->secs_pending)
+            /* NB. in flight, dropped once it completes */
+            c->stale = 1;
+        else if (vreq->list_head)
+            tapdisk_readahead_unqueue(ra, c);
+    }
+
+    tapdisk_readahead_requeue_waiters(ra);
+
+    memset(ra->streams, 0, sizeof(ra->streams));
+}
+
+void tapdisk_readahead_stats(td_readahead_t * ra, td_stats_t * st)
+{
+    struct td_ra_stream *s;
+
+    tapdisk_stats_field(st, "readahead", "{");
+    tapdisk_stats_field(st, "chunks", "d", ra->chunks ? ra->n_chunks : 0);
+    tapdisk_stats_field(st, "chunk_secs", "d", TD_RA_CHUNK_SECS);
+    tapdisk_stats_field(st, "hits", "llu", ra->hits);
+    tapdisk_stats_field(st, "waits", "llu", ra->waits);
+    tapdisk_stats_field(st, "misses", "llu", ra->misses);
+    tapdisk_stats_field(st, "prefetched_secs", "llu", ra->prefetched);
+    tapdisk_stats_field(st, "wasted_secs", "llu", ra->wasted);
+
+    tapdisk_stats_field(st, "windows", "[");
+    for (s = ra->streams; s < ra->streams + TD_RA_STREAMS; s++)
+        if (s->seq >= TD_RA_TRIGGER)
+            tapdisk_stats_val(st, "d", s->window);
+    tapdisk_stats_leave(st, ']');
+
+    tapdisk_stats_leave(st, '}');
+}
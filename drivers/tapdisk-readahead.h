@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_READAHEAD_H_
+#define _TAPDISK_READAHEAD_H_
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Per-VBD read-ahead. Small reads are matched against a few sequential
+ * streams. Once a stream read TD_RA_TRIGGER times in a row, chunks
+ * ahead of it are read through the VBD into a bounded pool, and later
+ * reads fully covered by the pool are served from it, waiting for
+ * chunks still loading.
+ *
+ * Each stream prefetches a window which grows by a chunk whenever a
+ * chunk of it is used, and halves whenever one is evicted or dropped
+ * unused. Prefetching stops at blocks no image of the chain holds,
+ * and around writes in flight. Writes and discards drop the chunks
+ * they overlap.
+ */
+#define TD_RA_CHUNK_SHIFT           7           /* 64KB chunks */
+#define TD_RA_CHUNK_SECS            (1 << TD_RA_CHUNK_SHIFT)
+#define TD_RA_POOL_KB               4096
+#define TD_RA_MAX_POOL_KB           65536
+#define TD_RA_STREAMS               8
+#define TD_RA_TRIGGER               2
+#define TD_RA_MAX_READ_SECS         256
+#define TD_RA_MIN_WINDOW            (2 * TD_RA_CHUNK_SECS)
+#define TD_RA_MAX_WINDOW            (32 * TD_RA_CHUNK_SECS)
+#define TD_RA_WAITERS               32
+
+#define TD_RA_MISS                  0
+#define TD_RA_HIT                   1
+#define TD_RA_WAIT                  2
+
+typedef struct td_readahead td_readahead_t;
+typedef struct td_ra_chunk td_ra_chunk_t;
+
+enum {
+    TD_RA_FREE,
+    TD_RA_LOADING,
+    TD_RA_VALID,
+};
+
+struct td_ra_chunk {
+    int state;
+    int stale;                  /* written to while loading */
+    int used;
+    int stream;
+    uint64_t lru;
+
+    td_sector_t sec;
+    int secs;
+
+    td_vbd_request_t vreq;
+    struct td_iovec iov;
+    td_readahead_t *ra;
+};
+
+struct td_ra_stream {
+    td_sector_t next;           /* where a sequential read would start */
+    td_sector_t end;            /* prefetched up to */
+    int seq;
+    int window;
+    uint64_t lru;
+};
+
+struct td_readahead {
+    td_vbd_t *vbd;
+
+    td_ra_chunk_t *chunks;
+    int n_chunks;
+    char *buf;
+
+    struct td_ra_stream streams[TD_RA_STREAMS];
+    td_vbd_request_t *waiters[TD_RA_WAITERS];
+    int n_waiters;
+    uint64_t clock;
+
+    uint64_t hits;
+    uint64_t waits;
+    uint64_t misses;
+    uint64_t prefetched;
+    uint64_t wasted;
+};
+
+/**
+ * Sets the pool size of VBDs created from now on, 0 turns read-ahead
+ * off.
+ */
+int tapdisk_readahead_set_pool(int kb);
+
+void tapdisk_readahead_init(td_readahead_t *, td_vbd_t *);
+
+/**
+ * Looks up a read about to be issued. Returns TD_RA_HIT if it was
+ * served, TD_RA_WAIT if it will complete through
+ * tapdisk_vbd_complete_readahead, or TD_RA_MISS.
+ */
+int tapdisk_readahead_read(td_readahead_t *, td_vbd_request_t *);
+
+/**
+ * Drops chunks overlapping a write or discard about to be issued.
+ */
+void tapdisk_readahead_invalidate(td_readahead_t *, td_vbd_request_t *);
+
+/**
+ * Takes back prefetches the VBD has not issued yet, and requeues their
+ * waiters as plain reads, see tapdisk_vbd_requeue_readahead. Called
+ * while quiescing, since queued requests are only issued once the
+ * queue restarts.
+ */
+void tapdisk_readahead_cancel(td_readahead_t *);
+
+/**
+ * Drops all chunks and requeues all waiters as plain reads. Chunks
+ * still in flight are dropped once they complete.
+ */
+void tapdisk_readahead_reset(td_readahead_t *);
+void tapdisk_readahead_free(td_readahead_t *);
+
+void tapdisk_readahead_stats(td_readahead_t *, td_stats_t *);
+
+#endif
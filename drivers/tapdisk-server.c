@@ -34,26 +34,135 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
+#include <sys/eventfd.h>
 
 #include "tapdisk-syslog.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-iosched.h"
+#include "tapdisk-readahead.h"
 #include "tapdisk-log.h"
+#include "tapdisk-xenblkif.h"
 
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
-typedef struct tapdisk_server {
-    int run;
+/*
+ * Selects the scheduler poll backend, "epoll" or "select".
+ */
+#define TAPDISK_SCHEDULER_ENV       "TAPDISK_SCHEDULER"
+
+/*
+ * Selects the AIO driver, "lio" (default), "uring", "rwio" or
+ * "rwpool". TAPDISK_TIO_DEPTH bounds the iocbs in flight per shard,
+ * TAPDISK_TIO_THREADS sizes the rwpool worker pools.
+ */
+#define TAPDISK_TIO_ENV             "TAPDISK_TIO"
+#define TAPDISK_TIO_DEPTH_ENV       "TAPDISK_TIO_DEPTH"
+#define TAPDISK_TIO_THREADS_ENV     "TAPDISK_TIO_THREADS"
+
+/*
+ * TAPDISK_TIO_SORT=1 sorts each submitted batch by file and offset,
+ * and merges disk-contiguous iocbs into vectored ones.
+ */
+#define TAPDISK_TIO_SORT_ENV        "TAPDISK_TIO_SORT"
+#define TAPDISK_TIO_MAX_DEPTH       4096
+
+/*
+ * Selects the I/O scheduler sharing each shard's AIO queue among its
+ * VBDs, "fifo" (default), "drr" or "drr-iops".
+ */
+#define TAPDISK_IOSCHED_ENV         "TAPDISK_IOSCHED"
+
+/*
+ * Retry backoff of failed requests, as "<base>:<max>" microseconds,
+ * for resource errors (EBUSY, EAGAIN, ENOMEM) and any other errors.
+ */
+#define TAPDISK_RETRY_BUSY_ENV      "TAPDISK_RETRY_BUSY_USECS"
+#define TAPDISK_RETRY_ERROR_ENV     "TAPDISK_RETRY_ERROR_USECS"
+
+/*
+ * Size of each VBD's read-ahead pool, in KB. 0 turns read-ahead off.
+ */
+#define TAPDISK_READAHEAD_ENV       "TAPDISK_READAHEAD_KB"
+
+/*
+ * Number of event loop threads.
+ */
+#define TAPDISK_SHARDS_ENV          "TAPDISK_SHARDS"
+#define TAPDISK_MAX_SHARDS          64
+
+/*
+ * Upper bound of the busy-polling budget, in microseconds. Polling is
+ * off by default. The budget of each shard starts at zero, grows from
+ * TAPDISK_POLL_GROW_USECS up to the bound while the shard keeps getting
+ * woken up soon after going to sleep, and shrinks when it sleeps longer
+ * than the bound, like KVM's halt polling.
+ */
+#define TAPDISK_POLL_ENV            "TAPDISK_POLL_USECS"
+#define TAPDISK_POLL_MAX_USECS      1000
+#define TAPDISK_POLL_GROW_USECS     10
+
+TAILQ_HEAD(tqh_tapdisk_server_work, tapdisk_server_work);
+TAILQ_HEAD(tqh_tapdisk_server_poller, tapdisk_server_poller);
+
+struct tapdisk_poll_stats {
+    int64_t budget;
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+/*
+ * An event loop. Each shard runs in its own thread and owns a
+ * scheduler, an AIO queue and the VBDs placed on it. Shard 0 runs on
+ * the main thread and also serves the control socket.
+ */
+typedef struct tapdisk_shard {
+    int id;
+    pthread_t thread;
 
     struct tqh_td_vbd_handle vbds;
+    int n_vbds;
     scheduler_t scheduler;
     struct tqueue aio_queue;
+    td_iosched_t iosched;
+
+    int kick_fd;
+    event_id_t kick_event;
+    struct tqh_tapdisk_server_work work;
+    volatile sig_atomic_t signal;
+
+    struct tqh_tapdisk_server_poller pollers;
+    struct tapdisk_poll_stats poll;
+
+    /* drivers with flushes waiting for a group commit */
+    struct tqh_td_driver_handle syncs;
+} tapdisk_shard_t;
+
+typedef struct tapdisk_server {
+    int run;
+
+    /*
+     * Protects the VBD lists against lookups from other shards, and
+     * the work queues.
+     */
+    pthread_mutex_t lock;
+
+    tapdisk_shard_t shards[TAPDISK_MAX_SHARDS];
+    int n_shards;
+    int started;
+
+    int64_t poll_max;
+    int tio;
+    int tio_depth;
+    int iosched;
+
     char *name;
     char *ident;
     int facility;
@@ -61,8 +170,17 @@ typedef struct tapdisk_server {
 
 static tapdisk_server_t server;
 
+/*
+ * The shard of the calling thread.
+ */
+static __thread tapdisk_shard_t *shard;
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	TAILQ_FOREACH_SAFE(vbd, &server.vbds, entry, tmp)
+	TAILQ_FOREACH_SAFE(vbd, &shard->vbds, entry, tmp)
+
+#define tapdisk_server_for_each_shard(_s)				\
+	for ((_s) = server.shards;					\
+	     (_s) < server.shards + server.n_shards; (_s)++)
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t * image)
 {
@@ -72,6 +190,7 @@ td_image_t *tapdisk_server_get_shared_image(td_image_t * image)
     if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
         return NULL;
 
+    /* NB. images are only shared among the VBDs of one shard */
     tapdisk_server_for_each_vbd(vbd, tmpv)
         tapdisk_vbd_for_each_image(vbd, img, tmpi)
         if (img->type == image->type && !strcmp(img->name, image->name))
@@ -82,7 +201,7 @@ td_image_t *tapdisk_server_get_shared_image(td_image_t * image)
 
 struct tqh_td_vbd_handle *tapdisk_server_get_all_vbds(void)
 {
-    return &server.vbds;
+    return &shard->vbds;
 }
 
 td_vbd_t *tapdisk_server_get_vbd(uint16_t uuid)
@@ -98,25 +217,34 @@ td_vbd_t *tapdisk_server_get_vbd(uint16_t uuid)
 
 void tapdisk_server_add_vbd(td_vbd_t * vbd)
 {
-    TAILQ_INSERT_TAIL(&server.vbds, vbd, entry);
+    pthread_mutex_lock(&server.lock);
+    TAILQ_INSERT_TAIL(&shard->vbds, vbd, entry);
+    shard->n_vbds++;
+    pthread_mutex_unlock(&server.lock);
 }
 
 void tapdisk_server_remove_vbd(td_vbd_t * vbd)
 {
-    TAILQ_REMOVE(&server.vbds, vbd, entry);
+    pthread_mutex_lock(&server.lock);
+    TAILQ_REMOVE(&shard->vbds, vbd, entry);
+    shard->n_vbds--;
+    pthread_mutex_unlock(&server.lock);
+
+    tapdisk_iosched_remove_vbd(&shard->iosched, vbd);
+
     tapdisk_server_check_state();
 }
 
 void tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-    tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+    tapdisk_queue_tiocb(&shard->aio_queue, tiocb);
 }
 
 void tapdisk_server_debug(void)
 {
     td_vbd_t *vbd, *tmp;
 
-    tapdisk_debug_queue(&server.aio_queue);
+    tapdisk_debug_queue(&shard->aio_queue);
 
     tapdisk_server_for_each_vbd(vbd, tmp)
         tapdisk_vbd_debug(vbd);
@@ -125,49 +253,241 @@ void tapdisk_server_debug(void)
     tlog_precious();
 }
 
+static void tapdisk_shard_kick(tapdisk_shard_t * s)
+{
+    uint64_t one = 1;
+    ssize_t n;
+
+    /* NB. async-signal-safe */
+    n = write(s->kick_fd, &one, sizeof(one));
+    if (n < 0 && errno != EAGAIN)
+        td_panic();
+}
+
+int tapdisk_server_count_vbds(void)
+{
+    tapdisk_shard_t *s;
+    int n = 0;
+
+    pthread_mutex_lock(&server.lock);
+    tapdisk_server_for_each_shard(s)
+        n += s->n_vbds;
+    pthread_mutex_unlock(&server.lock);
+
+    return n;
+}
+
 void tapdisk_server_check_state(void)
 {
-    if (TAILQ_EMPTY(&server.vbds))
-        server.run = 0;
+    tapdisk_shard_t *s;
+
+    if (tapdisk_server_count_vbds())
+        return;
+
+    server.run = 0;
+
+    tapdisk_server_for_each_shard(s)
+        if (s != shard)
+        tapdisk_shard_kick(s);
+}
+
+int tapdisk_server_n_shards(void)
+{
+    return server.n_shards;
+}
+
+int tapdisk_server_shard(void)
+{
+    return shard->id;
+}
+
+int tapdisk_server_find_vbd_shard(td_uuid_t uuid)
+{
+    tapdisk_shard_t *s;
+    td_vbd_t *vbd;
+    int id = -ENODEV;
+
+    pthread_mutex_lock(&server.lock);
+    tapdisk_server_for_each_shard(s) {
+        TAILQ_FOREACH(vbd, &s->vbds, entry)
+            if (vbd->uuid == uuid)
+            break;
+
+        if (vbd) {
+            id = s->id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    return id;
+}
+
+int tapdisk_server_pick_shard(void)
+{
+    tapdisk_shard_t *s, *min;
+
+    /* NB. shard 0 also serves control, place there last */
+    min = &server.shards[0];
+
+    pthread_mutex_lock(&server.lock);
+    tapdisk_server_for_each_shard(s) {
+        if (s->n_vbds < min->n_vbds)
+            min = s;
+        else if (s->n_vbds == min->n_vbds && !min->id)
+            min = s;
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    return min->id;
+}
+
+void tapdisk_server_queue_work(int id, struct tapdisk_server_work *work)
+{
+    tapdisk_shard_t *s = &server.shards[id];
+
+    pthread_mutex_lock(&server.lock);
+    if (!work->queued) {
+        work->queued = 1;
+        TAILQ_INSERT_TAIL(&s->work, work, entry);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    tapdisk_shard_kick(s);
+}
+
+static void __tapdisk_server_call_done(void *private)
+{
+    struct tapdisk_server_call *call = private;
+
+    call->done(call->arg);
+}
+
+static void __tapdisk_server_call(void *private)
+{
+    struct tapdisk_server_call *call = private;
+
+    call->fn(call->arg);
+
+    if (call->each && ++call->shard < server.n_shards) {
+        tapdisk_server_queue_work(call->shard, &call->work);
+        return;
+    }
+
+    call->work.fn = __tapdisk_server_call_done;
+    tapdisk_server_queue_work(call->caller, &call->work);
+}
+
+static void
+__tapdisk_server_queue_call(int id, struct tapdisk_server_call *call,
+                            int each)
+{
+    memset(&call->work, 0, sizeof(call->work));
+    call->work.fn = __tapdisk_server_call;
+    call->work.arg = call;
+    call->caller = shard->id;
+    call->shard = id;
+    call->each = each;
+
+    tapdisk_server_queue_work(id, &call->work);
+}
+
+void tapdisk_server_call(int id, struct tapdisk_server_call *call)
+{
+    __tapdisk_server_queue_call(id, call, 0);
+}
+
+void tapdisk_server_call_each(struct tapdisk_server_call *call)
+{
+    __tapdisk_server_queue_call(0, call, 1);
+}
+
+void tapdisk_server_run_on(int id, void (*fn) (void *), void *arg)
+{
+    tapdisk_shard_t *prev = shard;
+
+    shard = &server.shards[id];
+    fn(arg);
+    shard = prev;
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
-                              int timeout, event_cb_t cb, void *data)
+                              int64_t timeout, event_cb_t cb, void *data)
 {
-    return scheduler_register_event(&server.scheduler,
+    return scheduler_register_event(&shard->scheduler,
                                     mode, fd, timeout, cb, data);
 }
 
 void tapdisk_server_unregister_event(event_id_t event)
 {
-    return scheduler_unregister_event(&server.scheduler, event);
+    return scheduler_unregister_event(&shard->scheduler, event);
 }
 
 void tapdisk_server_mask_event(event_id_t event, int masked)
 {
-    return scheduler_mask_event(&server.scheduler, event, masked);
+    return scheduler_mask_event(&shard->scheduler, event, masked);
 }
 
-void tapdisk_server_set_max_timeout(int seconds)
+void tapdisk_server_set_max_timeout(int64_t usecs)
 {
-    scheduler_set_max_timeout(&server.scheduler, seconds);
+    scheduler_set_max_timeout(&shard->scheduler, usecs);
 }
 
-static void tapdisk_server_assert_locks(void)
+void tapdisk_server_register_poller(struct tapdisk_server_poller *poller)
 {
+    TAILQ_INSERT_TAIL(&shard->pollers, poller, entry);
+}
 
+void tapdisk_server_unregister_poller(struct tapdisk_server_poller *poller)
+{
+    TAILQ_REMOVE(&shard->pollers, poller, entry);
 }
 
-static void tapdisk_server_set_retry_timeout(void)
+/*
+ * NB. Images may be opened by utilities which never start a server.
+ */
+int tapdisk_server_register_file(int fd)
+{
+    if (!shard)
+        return -ENODEV;
+
+    return tapdisk_queue_register_file(&shard->aio_queue, fd);
+}
+
+void tapdisk_server_unregister_file(int fd)
+{
+    if (shard)
+        tapdisk_queue_unregister_file(&shard->aio_queue, fd);
+}
+
+void tapdisk_server_stats(td_stats_t * st)
+{
+    tapdisk_stats_enter(st, '{');
+    tapdisk_stats_field(st, "shard", "d", shard->id);
+
+    tapdisk_stats_field(st, "poll", "{");
+    tapdisk_stats_field(st, "max_usecs", "lld",
+                        (long long) server.poll_max);
+    tapdisk_stats_field(st, "budget_usecs", "lld",
+                        (long long) shard->poll.budget);
+    tapdisk_stats_field(st, "hits", "llu", shard->poll.hits);
+    tapdisk_stats_field(st, "misses", "llu", shard->poll.misses);
+    tapdisk_stats_leave(st, '}');
+
+    tapdisk_queue_stats(&shard->aio_queue, st);
+
+    tapdisk_stats_leave(st, '}');
+}
+
+void tapdisk_server_iosched_stats(td_vbd_t * vbd, td_stats_t * st)
+{
+    tapdisk_iosched_stats(&shard->iosched, vbd, st);
+}
+
+static void tapdisk_server_assert_locks(void)
 {
-    td_vbd_t *vbd, *tmp;
 
-    tapdisk_server_for_each_vbd(vbd, tmp)
-        if (tapdisk_vbd_retry_needed(vbd)) {
-        tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
-        return;
-    }
 }
 
 static void tapdisk_server_check_progress(void)
@@ -181,17 +501,52 @@ static void tapdisk_server_check_progress(void)
         tapdisk_vbd_check_progress(vbd);
 }
 
+void tapdisk_server_queue_sync(td_driver_t * driver)
+{
+    TAILQ_INSERT_TAIL(&shard->syncs, driver, sync.entry);
+    driver->sync.queued = 1;
+}
+
+void tapdisk_server_cancel_sync(td_driver_t * driver)
+{
+    TAILQ_REMOVE(&shard->syncs, driver, sync.entry);
+    driver->sync.queued = 0;
+}
+
+static void tapdisk_server_submit_syncs(void)
+{
+    td_driver_t *driver;
+
+    while ((driver = TAILQ_FIRST(&shard->syncs))) {
+        tapdisk_server_cancel_sync(driver);
+        tapdisk_driver_submit_sync(driver);
+    }
+}
+
+/*
+ * NB. Syncs completing right away, as with rwio, may start the next
+ * group commit.
+ */
 static void tapdisk_server_submit_tiocbs(void)
 {
-    tapdisk_submit_all_tiocbs(&server.aio_queue);
+    do {
+        tapdisk_server_submit_syncs();
+        tapdisk_submit_all_tiocbs(&shard->aio_queue);
+    } while (!TAILQ_EMPTY(&shard->syncs));
 }
 
+/*
+ * Completes the requests of all VBDs, then pushes the guest responses
+ * gathered on the way in one go.
+ */
 static void tapdisk_server_kick_responses(void)
 {
     td_vbd_t *vbd, *tmp;
 
     tapdisk_server_for_each_vbd(vbd, tmp)
         tapdisk_vbd_kick(vbd);
+
+    tapdisk_xenblkif_push_responses();
 }
 
 static void tapdisk_server_check_vbds(void)
@@ -202,15 +557,13 @@ static void tapdisk_server_check_vbds(void)
         tapdisk_vbd_check_state(vbd);
 }
 
+/*
+ * Issues new requests, as far as the I/O scheduler lets them in.
+ */
 static int tapdisk_server_recheck_vbds(void)
 {
-    td_vbd_t *vbd, *tmp;
-    int rv = 0;
-
-    tapdisk_server_for_each_vbd(vbd, tmp)
-        rv += tapdisk_vbd_recheck_state(vbd);
-
-    return rv;
+    return tapdisk_iosched_run(&shard->iosched, &shard->vbds,
+                               &shard->aio_queue);
 }
 
 static void tapdisk_server_stop_vbds(void)
@@ -221,15 +574,95 @@ static void tapdisk_server_stop_vbds(void)
         tapdisk_vbd_kill_queue(vbd);
 }
 
+static void tapdisk_server_run_vbds(void)
+{
+    int ret;
+
+    tapdisk_server_check_vbds();
+    do {
+        tapdisk_server_submit_tiocbs();
+        tapdisk_server_kick_responses();
+
+        ret = tapdisk_server_recheck_vbds();
+    } while (ret);
+}
+
+/*
+ * Spins on the guest rings and the AIO completion ring for up to the
+ * shard's budget. Returns nonzero if there is work to run.
+ */
+static int tapdisk_server_poll(void)
+{
+    struct tapdisk_server_poller *poller, *tmp;
+    int64_t deadline;
+    int hit;
+
+    if (!shard->poll.budget)
+        return 0;
+
+    if (TAILQ_EMPTY(&shard->pollers) && !shard->aio_queue.iocbs_pending)
+        return 0;
+
+    deadline = scheduler_now() + shard->poll.budget;
+    do {
+        hit = tapdisk_poll_tiocbs(&shard->aio_queue);
+
+        TAILQ_FOREACH_SAFE(poller, &shard->pollers, entry, tmp)
+            hit += poller->fn(poller->arg);
+
+        if (hit) {
+            shard->poll.hits++;
+            return hit;
+        }
+    } while (server.run && !shard->signal && scheduler_now() < deadline);
+
+    shard->poll.misses++;
+    return 0;
+}
+
+/*
+ * Adjusts the polling budget after sleeping for @slept microseconds.
+ */
+static void tapdisk_server_tune_poll(int64_t slept)
+{
+    int64_t budget = shard->poll.budget;
+
+    if (!server.poll_max)
+        return;
+
+    if (slept > server.poll_max) {
+        budget /= 2;
+        if (budget < TAPDISK_POLL_GROW_USECS)
+            budget = 0;
+    } else {
+        budget *= 2;
+        if (budget < TAPDISK_POLL_GROW_USECS)
+            budget = TAPDISK_POLL_GROW_USECS;
+        if (budget > server.poll_max)
+            budget = server.poll_max;
+    }
+
+    shard->poll.budget = budget;
+}
+
 static int tapdisk_server_init_aio(void)
 {
-    return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-                              TIO_DRV_LIO, NULL);
+    int err;
+
+    err = tapdisk_init_queue(&shard->aio_queue, server.tio_depth,
+                             server.tio, NULL);
+    if (err && server.tio == TIO_DRV_URING) {
+        ERR(err, "io_uring unavailable, falling back to libaio");
+        err = tapdisk_init_queue(&shard->aio_queue, server.tio_depth,
+                                 TIO_DRV_LIO, NULL);
+    }
+
+    return err;
 }
 
 static void tapdisk_server_close_aio(void)
 {
-    tapdisk_free_queue(&server.aio_queue);
+    tapdisk_free_queue(&shard->aio_queue);
 }
 
 int tapdisk_server_openlog(const char *name, int options, int facility)
@@ -272,31 +705,221 @@ static void tapdisk_server_close_tlog(void)
     tlog_close();
 }
 
+static void tapdisk_server_handle_signal(int signal)
+{
+    td_vbd_t *vbd, *tmp;
+    static int xfsz_error_sent = 0;
+
+    switch (signal) {
+    case SIGBUS:
+    case SIGINT:
+        tapdisk_server_for_each_vbd(vbd, tmp)
+            tapdisk_vbd_close(vbd);
+        break;
+
+    case SIGXFSZ:
+        tapdisk_server_stop_vbds();
+
+        /* NB. every shard handles the signal, report it once */
+        if (__atomic_exchange_n(&xfsz_error_sent, 1, __ATOMIC_RELAXED))
+            break;
+
+        ERR(EFBIG, "received SIGXFSZ");
+        break;
+
+    case SIGUSR1:
+        DBG(TLOG_INFO, "debugging on signal %d\n", signal);
+        tapdisk_server_debug();
+        break;
+    }
+}
+
+static void tapdisk_shard_run_work(void *private)
+{
+    struct tapdisk_server_work *work;
+    tapdisk_shard_t *s = private;
+
+    pthread_mutex_lock(&server.lock);
+    while ((work = TAILQ_FIRST(&s->work))) {
+        TAILQ_REMOVE(&s->work, work, entry);
+        work->queued = 0;
+        pthread_mutex_unlock(&server.lock);
+
+        work->fn(work->arg);
+
+        pthread_mutex_lock(&server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void tapdisk_shard_kick_event(event_id_t id, char mode, void *private)
+{
+    tapdisk_shard_t *s = private;
+    uint64_t val;
+    int signal;
+
+    if (read(s->kick_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        ERR(-errno, "shard %d: failed to read kick fd", s->id);
+
+    signal = s->signal;
+    if (signal) {
+        s->signal = 0;
+        tapdisk_server_handle_signal(signal);
+    }
+
+    tapdisk_shard_run_work(s);
+}
+
+static int tapdisk_shard_init(tapdisk_shard_t * s, int id)
+{
+    int err;
+
+    s->id = id;
+    s->kick_event = -1;
+    TAILQ_INIT(&s->vbds);
+    TAILQ_INIT(&s->work);
+    TAILQ_INIT(&s->pollers);
+    TAILQ_INIT(&s->syncs);
+    tapdisk_iosched_init(&s->iosched, server.iosched);
+
+    err = scheduler_initialize(&s->scheduler,
+                               getenv(TAPDISK_SCHEDULER_ENV));
+    if (err)
+        return err;
+
+    s->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->kick_fd < 0)
+        return -errno;
+
+    return 0;
+}
+
+/*
+ * Called on the shard, see tapdisk_server_run_on().
+ */
+static void tapdisk_shard_open(void *private)
+{
+    int *err = private;
+
+    *err = tapdisk_server_init_aio();
+    if (*err)
+        return;
+
+    shard->kick_event =
+        tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+                                      shard->kick_fd, 0,
+                                      tapdisk_shard_kick_event, shard);
+    if (shard->kick_event < 0) {
+        *err = shard->kick_event;
+        tapdisk_server_close_aio();
+    }
+}
+
+static void tapdisk_shard_close(void *private)
+{
+    if (shard->kick_event >= 0) {
+        tapdisk_server_unregister_event(shard->kick_event);
+        shard->kick_event = -1;
+        tapdisk_server_close_aio();
+    }
+}
+
+static void *tapdisk_shard_run(void *private)
+{
+    shard = private;
+
+    while (server.run)
+        tapdisk_server_iterate();
+
+    return NULL;
+}
+
+static int tapdisk_server_start_shards(void)
+{
+    sigset_t set, oset;
+    tapdisk_shard_t *s;
+    int err = 0;
+
+    /* NB. signals go to the main thread, which forwards them */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+    tapdisk_server_for_each_shard(s) {
+        if (!s->id)
+            continue;
+
+        err = -pthread_create(&s->thread, NULL, tapdisk_shard_run, s);
+        if (err) {
+            ERR(err, "failed to start shard %d", s->id);
+            server.n_shards = s->id;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    server.started = 1;
+
+    return err;
+}
+
+static void tapdisk_server_stop_shards(void)
+{
+    tapdisk_shard_t *s;
+    int busy;
+
+    if (!server.started)
+        return;
+
+    server.run = 0;
+
+    tapdisk_server_for_each_shard(s)
+        if (s->id) {
+        tapdisk_shard_kick(s);
+        pthread_join(s->thread, NULL);
+    }
+
+    server.started = 0;
+
+    /* NB. finish calls still in flight, so their callers get a reply */
+    do {
+        busy = 0;
+        tapdisk_server_for_each_shard(s)
+            if (!TAILQ_EMPTY(&s->work)) {
+            tapdisk_server_run_on(s->id, tapdisk_shard_run_work, s);
+            busy = 1;
+        }
+    } while (busy);
+}
+
 static void tapdisk_server_close(void)
 {
+    tapdisk_shard_t *s;
+
+    tapdisk_server_stop_shards();
     tapdisk_server_close_tlog();
-    tapdisk_server_close_aio();
+
+    tapdisk_server_for_each_shard(s)
+        tapdisk_server_run_on(s->id, tapdisk_shard_close, NULL);
 }
 
 void tapdisk_server_iterate(void)
 {
+    int64_t slept;
     int ret;
 
     tapdisk_server_assert_locks();
-    tapdisk_server_set_retry_timeout();
     tapdisk_server_check_progress();
 
-    ret = scheduler_wait_for_events(&server.scheduler);
+    slept = scheduler_now();
+    ret = scheduler_wait_for_events(&shard->scheduler);
     if (ret < 0)
         DBG(TLOG_WARN, "server wait returned %d\n", ret);
+    tapdisk_server_tune_poll(scheduler_now() - slept);
 
-    tapdisk_server_check_vbds();
     do {
-        tapdisk_server_submit_tiocbs();
-        tapdisk_server_kick_responses();
-
-        ret = tapdisk_server_recheck_vbds();
-    } while (ret);
+        tapdisk_server_run_vbds();
+    } while (tapdisk_server_poll());
 }
 
 static void __tapdisk_server_run(void)
@@ -305,51 +928,133 @@ static void __tapdisk_server_run(void)
         tapdisk_server_iterate();
 }
 
+/*
+ * NB. Signals are handled by the shards, on their next iteration.
+ */
 static void tapdisk_server_signal_handler(int signal)
 {
-    td_vbd_t *vbd, *tmp;
-    static int xfsz_error_sent = 0;
+    tapdisk_shard_t *s;
 
-    switch (signal) {
-    case SIGBUS:
-    case SIGINT:
-        tapdisk_server_for_each_vbd(vbd, tmp)
-            tapdisk_vbd_close(vbd);
-        break;
+    tapdisk_server_for_each_shard(s) {
+        s->signal = signal;
+        tapdisk_shard_kick(s);
+    }
+}
 
-    case SIGXFSZ:
-        ERR(EFBIG, "received SIGXFSZ");
-        tapdisk_server_stop_vbds();
-        if (xfsz_error_sent)
-            break;
+static int tapdisk_server_parse_retry_policy(int class, const char *spec)
+{
+    long long base, max;
 
-        xfsz_error_sent = 1;
-        break;
+    if (sscanf(spec, "%lld:%lld", &base, &max) != 2)
+        return -EINVAL;
 
-    case SIGUSR1:
-        DBG(TLOG_INFO, "debugging on signal %d\n", signal);
-        tapdisk_server_debug();
-        break;
-    }
+    return tapdisk_vbd_set_retry_policy(class, base, max);
 }
 
 int tapdisk_server_init(void)
 {
+    const char *env;
+    int i, n, err;
+
     memset(&server, 0, sizeof(server));
-    TAILQ_INIT(&server.vbds);
+    pthread_mutex_init(&server.lock, NULL);
+
+    n = 1;
+    env = getenv(TAPDISK_SHARDS_ENV);
+    if (env) {
+        n = atoi(env);
+        if (n < 1 || n > TAPDISK_MAX_SHARDS)
+            return -EINVAL;
+    }
+
+    server.tio = TIO_DRV_LIO;
+    env = getenv(TAPDISK_TIO_ENV);
+    if (env) {
+        server.tio = tapdisk_queue_driver(env);
+        if (server.tio < 0)
+            return server.tio;
+    }
 
-    scheduler_initialize(&server.scheduler);
+    server.tio_depth = TAPDISK_TIOCBS;
+    env = getenv(TAPDISK_TIO_DEPTH_ENV);
+    if (env) {
+        server.tio_depth = atoi(env);
+        if (server.tio_depth < 1 ||
+            server.tio_depth > TAPDISK_TIO_MAX_DEPTH)
+            return -EINVAL;
+    }
+
+    env = getenv(TAPDISK_TIO_THREADS_ENV);
+    if (env) {
+        int threads = atoi(env);
+        if (threads < 1 || threads > TIO_RWPOOL_MAX_THREADS)
+            return -EINVAL;
+        tapdisk_queue_set_threads(threads);
+    }
+
+    env = getenv(TAPDISK_TIO_SORT_ENV);
+    if (env)
+        tapdisk_queue_set_sort(!!atoi(env));
+
+    server.iosched = TD_IOSCHED_FIFO;
+    env = getenv(TAPDISK_IOSCHED_ENV);
+    if (env) {
+        server.iosched = tapdisk_iosched_driver(env);
+        if (server.iosched < 0)
+            return server.iosched;
+    }
+
+    env = getenv(TAPDISK_RETRY_BUSY_ENV);
+    if (env) {
+        err = tapdisk_server_parse_retry_policy(TD_VBD_RETRY_BUSY, env);
+        if (err)
+            return err;
+    }
+
+    env = getenv(TAPDISK_RETRY_ERROR_ENV);
+    if (env) {
+        err = tapdisk_server_parse_retry_policy(TD_VBD_RETRY_ERROR, env);
+        if (err)
+            return err;
+    }
+
+    env = getenv(TAPDISK_READAHEAD_ENV);
+    if (env) {
+        err = tapdisk_readahead_set_pool(atoi(env));
+        if (err)
+            return err;
+    }
+
+    env = getenv(TAPDISK_POLL_ENV);
+    if (env) {
+        server.poll_max = atoll(env);
+        if (server.poll_max < 0 ||
+            server.poll_max > TAPDISK_POLL_MAX_USECS)
+            return -EINVAL;
+    }
+
+    for (i = 0; i < n; i++) {
+        err = tapdisk_shard_init(&server.shards[i], i);
+        if (err)
+            return err;
+    }
+
+    server.n_shards = n;
+    shard = &server.shards[0];
 
     return 0;
 }
 
 int tapdisk_server_complete(void)
 {
+    tapdisk_shard_t *s;
     int err;
 
-    err = tapdisk_server_init_aio();
-    if (err)
-        goto fail;
+    tapdisk_server_for_each_shard(s) {
+        tapdisk_server_run_on(s->id, tapdisk_shard_open, &err);
+        if (err)
+            goto fail;
+    }
 
     err = tapdisk_server_open_tlog();
     if (err)
@@ -361,7 +1066,8 @@ int tapdisk_server_complete(void)
 
   fail:
     tapdisk_server_close_tlog();
-    tapdisk_server_close_aio();
+    tapdisk_server_for_each_shard(s)
+        tapdisk_server_run_on(s->id, tapdisk_shard_close, NULL);
     return err;
 }
 
@@ -369,7 +1075,9 @@ int tapdisk_server_initialize(const char *read, const char *write)
 {
     int err;
 
-    tapdisk_server_init();
+    err = tapdisk_server_init();
+    if (err)
+        return err;
 
     err = tapdisk_server_complete();
     if (err)
@@ -390,6 +1098,12 @@ int tapdisk_server_run()
     if (err)
         return err;
 
+    err = tapdisk_server_start_shards();
+    if (err) {
+        tapdisk_server_close();
+        return err;
+    }
+
     signal(SIGBUS, tapdisk_server_signal_handler);
     signal(SIGINT, tapdisk_server_signal_handler);
     signal(SIGUSR1, tapdisk_server_signal_handler);
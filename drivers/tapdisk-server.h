@@ -50,13 +50,122 @@ void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
 
+/**
+ * Queues the driver's group commit, see struct td_driver_sync. It is
+ * started right before the shard submits its tiocbs.
+ */
+void tapdisk_server_queue_sync(td_driver_t *);
+void tapdisk_server_cancel_sync(td_driver_t *);
+
+/**
+ * Lets the AIO driver of the calling shard register an image fd, e.g.
+ * as an io_uring fixed file. Unregister before closing the fd.
+ */
+int tapdisk_server_register_file(int);
+void tapdisk_server_unregister_file(int);
+
 void tapdisk_server_check_state(void);
 
-event_id_t tapdisk_server_register_event(char, int, int, event_cb_t,
+/*
+ * Shards. Each shard is an event loop thread owning its VBDs; all
+ * tapdisk_server_* calls operate on the shard of the calling thread.
+ */
+
+/**
+ * Deferred call, run on the target shard's thread.
+ */
+struct tapdisk_server_work {
+    void (*fn) (void *);
+    void *arg;
+    int queued;
+     TAILQ_ENTRY(tapdisk_server_work) entry;
+};
+
+/**
+ * Busy-polled by the shard before it goes to sleep, see
+ * TAPDISK_POLL_USECS. Returns nonzero if it found work.
+ */
+struct tapdisk_server_poller {
+    int (*fn) (void *);
+    void *arg;
+     TAILQ_ENTRY(tapdisk_server_poller) entry;
+};
+
+int tapdisk_server_n_shards(void);
+
+/**
+ * Returns the shard of the calling thread.
+ */
+int tapdisk_server_shard(void);
+
+/**
+ * Returns the shard owning the VBD, or -ENODEV.
+ */
+int tapdisk_server_find_vbd_shard(td_uuid_t);
+
+/**
+ * Returns the least loaded shard, for placing a new VBD.
+ */
+int tapdisk_server_pick_shard(void);
+
+int tapdisk_server_count_vbds(void);
+
+/**
+ * Queues work on a shard. Does nothing if the work is already queued.
+ */
+void tapdisk_server_queue_work(int, struct tapdisk_server_work *);
+
+/**
+ * Cross-shard call: fn runs on the target shard, or on each shard in
+ * turn, then done runs back on the calling shard. Nobody waits for it,
+ * so the call must stay around until done.
+ */
+struct tapdisk_server_call {
+    void (*fn) (void *);
+    void (*done) (void *);
+    void *arg;
+
+    int caller;
+    int shard;
+    int each;
+    struct tapdisk_server_work work;
+};
+
+void tapdisk_server_call(int, struct tapdisk_server_call *);
+void tapdisk_server_call_each(struct tapdisk_server_call *);
+
+/**
+ * Runs fn on behalf of the given shard, on the calling thread. Only
+ * for setting up and tearing down shards while they are not running.
+ */
+void tapdisk_server_run_on(int, void (*fn) (void *), void *);
+
+/**
+ * Registers an event with the server scheduler. Timeouts are in
+ * microseconds, see SCHEDULER_USECS().
+ */
+event_id_t tapdisk_server_register_event(char, int, int64_t, event_cb_t,
                                          void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
-void tapdisk_server_set_max_timeout(int);
+void tapdisk_server_set_max_timeout(int64_t);
+
+/**
+ * Adds a poller to the shard of the calling thread.
+ */
+void tapdisk_server_register_poller(struct tapdisk_server_poller *);
+void tapdisk_server_unregister_poller(struct tapdisk_server_poller *);
+
+/**
+ * Reports the polling and AIO queue of the calling shard, as one
+ * object.
+ */
+void tapdisk_server_stats(td_stats_t *);
+
+/**
+ * Reports the VBD's share of its shard, see tapdisk-iosched.h.
+ */
+void tapdisk_server_iosched_stats(td_vbd_t *, td_stats_t *);
 
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(const char *, const char *);
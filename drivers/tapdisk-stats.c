@@ -32,17 +32,83 @@
 #endif
 
 #include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <sys/param.h>
 
 #include "tapdisk.h"
 #include "tapdisk-stats.h"
 
 #define BUG_ON(_cond) if (_cond) { td_panic(); }
 
+int tapdisk_stats_alloc(td_stats_t * st, size_t size)
+{
+    char *buf;
+
+    buf = malloc(size);
+    if (!buf)
+        return -ENOMEM;
+
+    tapdisk_stats_init(st, buf, size);
+    st->grow = 1;
+
+    return 0;
+}
+
+void tapdisk_stats_free(td_stats_t * st)
+{
+    if (st->grow) {
+        free(st->buf);
+        st->buf = st->pos = NULL;
+        st->size = 0;
+    }
+}
+
+static int __stats_grow(td_stats_t * st, size_t need)
+{
+    size_t len = tapdisk_stats_length(st), size = st->size;
+    void *buf;
+
+    while (size < len + need)
+        size = size ? size * 2 : need;
+
+    buf = realloc(st->buf, size);
+    if (!buf)
+        return -ENOMEM;
+
+    st->buf = buf;
+    st->pos = buf + len;
+    st->size = size;
+
+    return 0;
+}
+
 static void __stats_vsprintf(td_stats_t * st, const char *fmt, va_list ap)
 {
     size_t size = st->buf + st->size - st->pos;
-    st->pos += vsnprintf(st->pos, size, fmt, ap);
+    va_list aq;
+    int n, err;
+
+    if (st->err)
+        return;
+
+    va_copy(aq, ap);
+    n = vsnprintf(st->pos, size, fmt, aq);
+    va_end(aq);
+
+    if (n >= 0 && (size_t) n >= size) {
+        err = st->grow ? __stats_grow(st, n + 1) : -ENOSPC;
+        if (!err) {
+            size = st->buf + st->size - st->pos;
+            n = vsnprintf(st->pos, size, fmt, ap);
+        } else
+            st->err = err;
+    }
+
+    /* NB. on error, truncate rather than run past the end of the buffer */
+    if (n > 0)
+        st->pos += MIN((size_t) n, size ? size - 1 : 0);
 }
 
 static void __printf(2, 3)
@@ -42,6 +42,9 @@ struct tapdisk_stats_ctx {
 
     int n_elem[TD_STATS_MAX_DEPTH];
     int depth;
+
+    int grow;                   /* buf is ours, realloc as needed */
+    int err;                    /* -ENOSPC/-ENOMEM once truncated */
 };
 
 typedef struct tapdisk_stats_ctx td_stats_t;
@@ -61,6 +64,18 @@ static inline size_t tapdisk_stats_length(td_stats_t * st)
     return st->pos - st->buf;
 }
 
+static inline int tapdisk_stats_error(td_stats_t * st)
+{
+    return st->err;
+}
+
+/**
+ * Like tapdisk_stats_init, but on a heap buffer of initial @size,
+ * grown on demand. Release with tapdisk_stats_free.
+ */
+int tapdisk_stats_alloc(td_stats_t * st, size_t size);
+void tapdisk_stats_free(td_stats_t * st);
+
 void tapdisk_stats_enter(td_stats_t * st, char t);
 void tapdisk_stats_leave(td_stats_t * st, char t);
 void tapdisk_stats_field(td_stats_t * st, const char *key,
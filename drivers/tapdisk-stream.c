@@ -300,6 +300,7 @@ tapdisk_stream_queue_request(td_stream_t * s, td_stream_req_t * req)
     vreq->name = NULL;
     vreq->token = s;
     vreq->cb = __tapdisk_stream_request_cb;
+    vreq->batch_cb = NULL;
 
     s->count -= secs;
     s->sec_in += secs;
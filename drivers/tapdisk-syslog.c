@@ -311,8 +311,8 @@ tapdisk_syslog_vsprintf(char *buf, size_t size,
  * In summary, no attempts to mask service blackouts in here.
  */
 
-int
-tapdisk_vsyslog(td_syslog_t * log, int prio, const char *fmt, va_list ap)
+static int
+__tapdisk_vsyslog(td_syslog_t * log, int prio, const char *fmt, va_list ap)
 {
     struct timeval now;
     size_t len;
@@ -368,6 +368,18 @@ tapdisk_vsyslog(td_syslog_t * log, int prio, const char *fmt, va_list ap)
     return err;
 }
 
+int
+tapdisk_vsyslog(td_syslog_t * log, int prio, const char *fmt, va_list ap)
+{
+    int err;
+
+    pthread_mutex_lock(&log->lock);
+    err = __tapdisk_vsyslog(log, prio, fmt, ap);
+    pthread_mutex_unlock(&log->lock);
+
+    return err;
+}
+
 int tapdisk_syslog(td_syslog_t * log, int prio, const char *fmt, ...)
 {
     va_list ap;
@@ -399,10 +411,14 @@ tapdisk_syslog_sock_event(event_id_t id, char mode, void *private)
 {
     td_syslog_t *log = private;
 
+    pthread_mutex_lock(&log->lock);
+
     tapdisk_syslog_ring_dispatch(log);
 
     if (log->cons == log->prod)
         tapdisk_syslog_sock_mask(log);
+
+    pthread_mutex_unlock(&log->lock);
 }
 
 static void __tapdisk_syslog_sock_init(td_syslog_t * log)
@@ -480,14 +496,34 @@ static void tapdisk_syslog_sock_mask(td_syslog_t * log)
     tapdisk_server_mask_event(log->event_id, 1);
 }
 
+static void __tapdisk_syslog_sock_unmask(void *private)
+{
+    td_syslog_t *log = private;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (log->cons != log->prod)
+        tapdisk_server_mask_event(log->event_id, 0);
+
+    pthread_mutex_unlock(&log->lock);
+}
+
 static void tapdisk_syslog_sock_unmask(td_syslog_t * log)
 {
+    if (log->shard != tapdisk_server_shard()) {
+        tapdisk_server_queue_work(log->shard, &log->unmask);
+        return;
+    }
+
     tapdisk_server_mask_event(log->event_id, 0);
 }
 
 void __tapdisk_syslog_init(td_syslog_t * log)
 {
     memset(log, 0, sizeof(td_syslog_t));
+    pthread_mutex_init(&log->lock, NULL);
+    log->unmask.fn = __tapdisk_syslog_sock_unmask;
+    log->unmask.arg = log;
     __tapdisk_syslog_sock_init(log);
     __tapdisk_syslog_ring_init(log);
 }
@@ -513,6 +549,7 @@ tapdisk_syslog_open(td_syslog_t * log, const char *ident, int facility,
 
     log->facility = facility;
     log->ident = ident ? strndup(ident, TD_SYSLOG_IDENT_MAX) : NULL;
+    log->shard = tapdisk_server_shard();
 
     err = tapdisk_syslog_sock_open(log);
     if (err)
@@ -31,7 +31,9 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "scheduler.h"
+#include "tapdisk-server.h"
 
 typedef struct _td_syslog td_syslog_t;
 
@@ -49,6 +51,14 @@ struct _td_syslog {
     char *ident;
     int facility;
 
+    /*
+     * Messages may come from any shard, the socket is served by the
+     * shard which opened the log.
+     */
+    pthread_mutex_t lock;
+    int shard;
+    struct tapdisk_server_work unmask;
+
     int sock;
     event_id_t event_id;
 
@@ -72,11 +72,23 @@
 #define TD_VBD_EIO_RETRIES          10
 #define TD_VBD_EIO_SLEEP            1
 #define TD_VBD_WATCHDOG_TIMEOUT     10
+#define TD_VBD_DISCARD_MAX_SECS     (1 << 30)
 
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *,
                                              td_vbd_request_t *);
 static int tapdisk_vbd_queue_ready(td_vbd_t *);
 static void tapdisk_vbd_check_queue_state(td_vbd_t *);
+static int tapdisk_vbd_issue_failed_requests(td_vbd_t *);
+
+static struct td_vbd_retry_policy {
+    int64_t base_usecs;
+    int64_t max_usecs;
+} tapdisk_vbd_retry_policies[TD_VBD_RETRY_CLASSES] = {
+    [TD_VBD_RETRY_BUSY] = {
+        TD_VBD_RETRY_BUSY_USECS, TD_VBD_RETRY_BUSY_MAX_USECS},
+    [TD_VBD_RETRY_ERROR] = {
+        TD_VBD_RETRY_ERROR_USECS, SCHEDULER_USECS(TD_VBD_RETRY_INTERVAL)},
+};
 
 /* 
  * initialization
@@ -98,6 +110,11 @@ td_vbd_t *tapdisk_vbd_create(uint16_t uuid)
     }
 
     vbd->uuid = uuid;
+    vbd->limits.requests = MAX_REQUESTS;
+    vbd->limits.segments = MAX_SEGMENTS_PER_REQ;
+    vbd->sched.weight = TD_VBD_WEIGHT_DEFAULT;
+    vbd->retry.event = -1;
+    tapdisk_readahead_init(&vbd->readahead, vbd);
 
     TAILQ_INIT(&vbd->images);
     TAILQ_INIT(&vbd->new_requests);
@@ -133,9 +150,14 @@ static int tapdisk_vbd_validate_chain(td_vbd_t * vbd)
 
 void tapdisk_vbd_close_vdi(td_vbd_t * vbd)
 {
+    if (vbd->secondary_mode == TD_VBD_SECONDARY_ASYNC)
+        tapdisk_mirror_close(&vbd->mirror);
+
     tapdisk_image_close_chain(&vbd->images);
+    tapdisk_readahead_reset(&vbd->readahead);
 
-    if (vbd->secondary && vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
+    if (vbd->secondary && vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR &&
+        vbd->secondary_mode != TD_VBD_SECONDARY_ASYNC) {
         tapdisk_image_close(vbd->secondary, NULL);
         vbd->secondary = NULL;
     }
@@ -287,12 +309,23 @@ static int tapdisk_vbd_add_secondary(td_vbd_t * vbd)
     }
 
     vbd->secondary = second;
-    leaf->flags |= TD_IGNORE_ENOSPC;
     if (td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
         DPRINTF("In standby mode\n");
+        leaf->flags |= TD_IGNORE_ENOSPC;
         vbd->secondary_mode = TD_VBD_SECONDARY_STANDBY;
+    } else if (td_flag_test(vbd->flags, TD_OPEN_ASYNC_MIRROR)) {
+        /* no failing over to a secondary which may lag behind */
+        DPRINTF("In asynchronous mirror mode\n");
+        err = tapdisk_mirror_open(&vbd->mirror, vbd, second);
+        if (err) {
+            vbd->secondary = NULL;
+            goto fail;
+        }
+        vbd->secondary_mode = TD_VBD_SECONDARY_ASYNC;
+        TAILQ_INSERT_AFTER(&vbd->images, leaf, second, entry);
     } else {
         DPRINTF("In mirror mode\n");
+        leaf->flags |= TD_IGNORE_ENOSPC;
         vbd->secondary_mode = TD_VBD_SECONDARY_MIRROR;
         /* we actually need this image to also be part of the chain, 
          * since it may already contain data */
@@ -431,6 +464,8 @@ tapdisk_vbd_open_vdi(td_vbd_t * vbd, const char *name, td_flag_t flags,
         }
     }
 
+    tapdisk_driver_set_limits(&vbd->limits);
+
     err =
         tapdisk_image_open_chain(vbd->name, flags, prt_devnum,
                                  &vbd->images);
@@ -438,6 +473,7 @@ tapdisk_vbd_open_vdi(td_vbd_t * vbd, const char *name, td_flag_t flags,
         goto fail;
 
     td_flag_clear(vbd->state, TD_VBD_CLOSED);
+    td_flag_clear(vbd->state, TD_VBD_LIMITS_PENDING);
     vbd->flags = flags;
 
     if (td_flag_test(vbd->flags, TD_OPEN_LOG_DIRTY)) {
@@ -564,7 +600,8 @@ static int tapdisk_vbd_shutdown(td_vbd_t * vbd)
 {
     int new, pending, failed, completed;
 
-    if (!TAILQ_EMPTY(&vbd->pending_requests))
+    if (!TAILQ_EMPTY(&vbd->pending_requests) ||
+        tapdisk_mirror_busy(&vbd->mirror))
         return -EAGAIN;
 
     tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
@@ -579,9 +616,14 @@ static int tapdisk_vbd_shutdown(td_vbd_t * vbd)
             vbd->errors, vbd->retries, vbd->received, vbd->returned,
             vbd->kicked);
 
+    if (vbd->retry.event >= 0)
+        tapdisk_server_unregister_event(vbd->retry.event);
+
     tapdisk_vbd_close_vdi(vbd);
     tapdisk_vbd_detach(vbd);
     tapdisk_server_remove_vbd(vbd);
+    tapdisk_mirror_free(&vbd->mirror);
+    tapdisk_readahead_free(&vbd->readahead);
     free(vbd->name);
     free(vbd);
 
@@ -665,15 +707,13 @@ static int tapdisk_vbd_queue_ready(td_vbd_t * vbd)
             !td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED));
 }
 
-int tapdisk_vbd_retry_needed(td_vbd_t * vbd)
-{
-    return !(TAILQ_EMPTY(&vbd->failed_requests) &&
-             TAILQ_EMPTY(&vbd->new_requests));
-}
-
 int tapdisk_vbd_quiesce_queue(td_vbd_t * vbd)
 {
-    if (!TAILQ_EMPTY(&vbd->pending_requests)) {
+    /* NB. reads waiting on queued prefetches would hold up the quiesce */
+    tapdisk_readahead_cancel(&vbd->readahead);
+
+    if (!TAILQ_EMPTY(&vbd->pending_requests) ||
+        tapdisk_mirror_busy(&vbd->mirror)) {
         td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
         return -EAGAIN;
     }
@@ -743,6 +783,82 @@ int tapdisk_vbd_pause(td_vbd_t * vbd)
     return 0;
 }
 
+/*
+ * Resizes the pools of the images to the VBD limits, once the queue is
+ * quiesced. Images which fail to keep their old pools.
+ */
+static void tapdisk_vbd_apply_limits(td_vbd_t * vbd)
+{
+    td_image_t *image, *tmp;
+    int err;
+
+    if (!td_flag_test(vbd->state, TD_VBD_QUIESCED))
+        return;
+
+    tapdisk_vbd_for_each_image(vbd, image, tmp) {
+        err = tapdisk_driver_resize(image->driver, &vbd->limits);
+        if (err)
+            EPRINTF("%s: resizing %s: %d\n",
+                    vbd->name, image->name, err);
+    }
+
+    if (vbd->secondary) {
+        err = tapdisk_driver_resize(vbd->secondary->driver, &vbd->limits);
+        if (err)
+            EPRINTF("%s: resizing %s: %d\n",
+                    vbd->name, vbd->secondary->name, err);
+    }
+
+    td_flag_clear(vbd->state, TD_VBD_LIMITS_PENDING);
+
+    if (!td_flag_test(vbd->state, TD_VBD_DEAD) &&
+        !td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED) &&
+        !td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
+        tapdisk_vbd_start_queue(vbd);
+}
+
+int tapdisk_vbd_set_limits(td_vbd_t * vbd, const td_limits_t * limits)
+{
+    if (limits->requests < 1 || limits->requests > TD_MAX_REQUESTS ||
+        limits->segments < 1 || limits->segments > TD_MAX_SEGMENTS_PER_REQ)
+        return -EINVAL;
+
+    if (limits->requests == vbd->limits.requests &&
+        limits->segments == vbd->limits.segments)
+        return 0;
+
+    DPRINTF("%s: limits %d requests x %d segments, were %d x %d\n",
+            vbd->name, limits->requests, limits->segments,
+            vbd->limits.requests, vbd->limits.segments);
+
+    vbd->limits = *limits;
+
+    if (TAILQ_EMPTY(&vbd->images) ||
+        td_flag_test(vbd->state, TD_VBD_PAUSED))
+        return 0;
+
+    /*
+     * The images resize their pools once the queue drained, see
+     * tapdisk_vbd_check_state.
+     */
+    td_flag_set(vbd->state, TD_VBD_LIMITS_PENDING);
+    tapdisk_vbd_quiesce_queue(vbd);
+    tapdisk_vbd_apply_limits(vbd);
+
+    return 0;
+}
+
+int tapdisk_vbd_set_weight(td_vbd_t * vbd, int weight)
+{
+    if (weight < 1 || weight > TD_VBD_WEIGHT_MAX)
+        return -EINVAL;
+
+    DPRINTF("%s: weight %d, was %d\n", vbd->name, weight, vbd->sched.weight);
+    vbd->sched.weight = weight;
+
+    return 0;
+}
+
 int tapdisk_vbd_resume(td_vbd_t * vbd, const char *name)
 {
     int i, err;
@@ -819,9 +935,10 @@ static void tapdisk_vbd_check_queue_state(td_vbd_t * vbd)
         if (__tapdisk_vbd_request_timeout(vreq, &now))
         tapdisk_vbd_complete_vbd_request(vbd, vreq);
 
-    if (!TAILQ_EMPTY(&vbd->new_requests) ||
-        !TAILQ_EMPTY(&vbd->failed_requests))
-        tapdisk_vbd_issue_requests(vbd);
+    /* new requests are issued by the server's I/O scheduler */
+    if (!TAILQ_EMPTY(&vbd->failed_requests) ||
+        td_flag_test(vbd->state, TD_VBD_DEAD))
+        tapdisk_vbd_issue_failed_requests(vbd);
 
 }
 
@@ -829,9 +946,16 @@ void tapdisk_vbd_check_state(td_vbd_t * vbd)
 {
     tapdisk_vbd_check_queue_state(vbd);
 
+    if (vbd->secondary_mode == TD_VBD_SECONDARY_ASYNC &&
+        tapdisk_vbd_queue_ready(vbd))
+        tapdisk_mirror_kick(&vbd->mirror);
+
     if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
         tapdisk_vbd_quiesce_queue(vbd);
 
+    if (td_flag_test(vbd->state, TD_VBD_LIMITS_PENDING))
+        tapdisk_vbd_apply_limits(vbd);
+
     if (td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
         tapdisk_vbd_pause(vbd);
 
@@ -858,7 +982,8 @@ void tapdisk_vbd_check_progress(td_vbd_t * vbd)
         return;
     }
 
-    tapdisk_server_set_max_timeout(TD_VBD_WATCHDOG_TIMEOUT - diff);
+    tapdisk_server_set_max_timeout(SCHEDULER_USECS
+                                   (TD_VBD_WATCHDOG_TIMEOUT - diff));
 }
 
 /*
@@ -897,14 +1022,129 @@ tapdisk_vbd_request_should_retry(td_vbd_t * vbd, td_vbd_request_t * vreq)
     return 1;
 }
 
+int
+tapdisk_vbd_set_retry_policy(int class, int64_t base_usecs,
+                             int64_t max_usecs)
+{
+    if (class < 0 || class >= TD_VBD_RETRY_CLASSES)
+        return -EINVAL;
+
+    if (base_usecs < 1 || max_usecs < base_usecs ||
+        max_usecs > TD_VBD_RETRY_MAX_USECS)
+        return -EINVAL;
+
+    tapdisk_vbd_retry_policies[class].base_usecs = base_usecs;
+    tapdisk_vbd_retry_policies[class].max_usecs = max_usecs;
+    return 0;
+}
+
+static int tapdisk_vbd_retry_class(int error)
+{
+    switch (abs(error)) {
+    case EBUSY:
+    case EAGAIN:
+    case ENOMEM:
+        return TD_VBD_RETRY_BUSY;
+    }
+
+    return TD_VBD_RETRY_ERROR;
+}
+
+/*
+ * Doubles with each retry of the request, up to the class maximum.
+ * Half of the delay is random, so requests failed together do not all
+ * come back at once.
+ */
+static int64_t tapdisk_vbd_retry_backoff(td_vbd_request_t * vreq)
+{
+    const struct td_vbd_retry_policy *policy;
+    int64_t delay;
+
+    policy = &tapdisk_vbd_retry_policies
+        [tapdisk_vbd_retry_class(vreq->error)];
+
+    delay = policy->base_usecs << MIN(vreq->num_retries, 30);
+    delay = MIN(delay, policy->max_usecs);
+
+    return delay - delay / 2 + random() % (delay / 2 + 1);
+}
+
+/*
+ * Retries are reissued by tapdisk_vbd_check_state, which the server
+ * runs on every VBD once events fired. The timer only needs to wake
+ * the server up.
+ */
+static void tapdisk_vbd_retry_timeout(event_id_t id, char mode, void *private)
+{
+    td_vbd_t *vbd = private;
+
+    tapdisk_server_unregister_event(vbd->retry.event);
+    vbd->retry.event = -1;
+}
+
+static void tapdisk_vbd_arm_retry(td_vbd_t * vbd, int64_t deadline)
+{
+    event_id_t id;
+    int64_t timeout;
+
+    if (vbd->retry.event >= 0) {
+        if (vbd->retry.deadline <= deadline)
+            return;
+
+        tapdisk_server_unregister_event(vbd->retry.event);
+        vbd->retry.event = -1;
+    }
+
+    timeout = MAX(deadline - scheduler_now(), 0);
+
+    id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1, timeout,
+                                       tapdisk_vbd_retry_timeout, vbd);
+    if (id < 0) {
+        /* poll instead, the next check re-arms */
+        tapdisk_server_set_max_timeout(timeout);
+        return;
+    }
+
+    vbd->retry.event = id;
+    vbd->retry.deadline = deadline;
+}
+
+static void
+tapdisk_vbd_schedule_retry(td_vbd_t * vbd, td_vbd_request_t * vreq)
+{
+    vreq->failed_at = scheduler_now();
+    vreq->retry_at = vreq->failed_at + tapdisk_vbd_retry_backoff(vreq);
+
+    tapdisk_vbd_arm_retry(vbd, vreq->retry_at);
+}
+
+static void
+tapdisk_vbd_count_retry(td_vbd_t * vbd, td_vbd_request_t * vreq,
+                        int64_t now)
+{
+    int class;
+    uint64_t usecs;
+
+    class = tapdisk_vbd_retry_class(vreq->error);
+    usecs = now - vreq->failed_at;
+
+    vbd->retry.count[class]++;
+    vbd->retry.delay_usecs[class] += usecs;
+    if (usecs > vbd->retry.delay_max_usecs[class])
+        vbd->retry.delay_max_usecs[class] = usecs;
+}
+
 static void
 tapdisk_vbd_complete_vbd_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
 {
     if (!vreq->submitting && !vreq->secs_pending) {
-        if (vreq->error && tapdisk_vbd_request_should_retry(vbd, vreq))
+        if (vreq->error && tapdisk_vbd_request_should_retry(vbd, vreq)) {
             tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-        else
+            tapdisk_vbd_schedule_retry(vbd, vreq);
+        } else {
+            vreq->done = vbd->ts;
             tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+        }
     }
 }
 
@@ -918,18 +1158,49 @@ FIXME_maybe_count_enospc_redirect(td_vbd_t * vbd, td_request_t treq)
         vbd->FIXME_enospc_redirect_count += treq.secs;
 }
 
+static inline int tapdisk_vbd_td_request_data(td_request_t treq)
+{
+    return treq.op == TD_OP_READ || treq.op == TD_OP_WRITE;
+}
+
+/*
+ * Flushes and discards carry no data, but hold their request pending
+ * as one sector.
+ */
+static inline int tapdisk_vbd_td_request_secs(td_request_t treq)
+{
+    return tapdisk_vbd_td_request_data(treq) ? treq.secs : 1;
+}
+
+static const char *tapdisk_vbd_op_name(int op)
+{
+    switch (op) {
+    case TD_OP_READ:
+        return "read";
+    case TD_OP_WRITE:
+        return "write";
+    case TD_OP_FLUSH:
+        return "flush";
+    case TD_OP_DISCARD:
+        return "discard";
+    }
+
+    return "unknown";
+}
+
 static void
 __tapdisk_vbd_complete_td_request(td_vbd_t * vbd, td_vbd_request_t * vreq,
                                   td_request_t treq, int res)
 {
     td_image_t *image = treq.image;
-    int err;
+    int err, secs;
 
     err = (res <= 0 ? res : -res);
-    vbd->secs_pending -= treq.secs;
-    vreq->secs_pending -= treq.secs;
+    secs = tapdisk_vbd_td_request_secs(treq);
+    vbd->secs_pending -= secs;
+    vreq->secs_pending -= secs;
 
-    if (err != -EBUSY) {
+    if (err != -EBUSY && tapdisk_vbd_td_request_data(treq)) {
         int write = treq.op == TD_OP_WRITE;
         td_sector_count_add(&image->stats.hits, treq.secs, write);
         if (err)
@@ -943,8 +1214,7 @@ __tapdisk_vbd_complete_td_request(td_vbd_t * vbd, td_vbd_request_t * vreq,
             if (!vreq->error && err != vreq->prev_error)
                 tlog_drv_error(image->driver, err,
                                "req %s: %s 0x%04x secs @ 0x%08" PRIx64,
-                               vreq->name,
-                               (treq.op == TD_OP_WRITE ? "write" : "read"),
+                               vreq->name, tapdisk_vbd_op_name(treq.op),
                                treq.secs, treq.sec);
             vbd->errors++;
         }
@@ -967,7 +1237,8 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t * vbd,
     vreq->submitting++;
 
     if (tapdisk_vbd_is_last_image(vbd, image)) {
-        memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+        if (tapdisk_vbd_td_request_data(treq))
+            memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
         td_complete_request(treq, 0);
         goto done;
     }
@@ -975,6 +1246,16 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t * vbd,
     parent = tapdisk_vbd_next_image(image);
     treq.image = parent;
 
+    if (treq.op == TD_OP_FLUSH) {
+        td_queue_flush(parent, treq);
+        goto done;
+    }
+
+    if (treq.op == TD_OP_DISCARD) {
+        td_queue_discard(parent, treq);
+        goto done;
+    }
+
     /* return zeros for requests that extend beyond end of parent image */
     if (treq.sec + treq.secs > parent->info.size) {
         td_request_t clone = treq;
@@ -1065,6 +1346,12 @@ void tapdisk_vbd_complete_td_request(td_request_t treq, int res)
         vreq->name, treq.sidx, treq.sec, treq.secs,
         treq.buf, vreq->op, res);
 
+    /* the guest buffer is still ours until the request completes */
+    if (vbd->secondary_mode == TD_VBD_SECONDARY_ASYNC && !res &&
+        image == tapdisk_vbd_first_image(vbd) &&
+        (treq.op == TD_OP_WRITE || treq.op == TD_OP_DISCARD))
+        tapdisk_mirror_queue(&vbd->mirror, treq);
+
     __tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
@@ -1074,13 +1361,114 @@ static inline void queue_mirror_req(td_vbd_t * vbd, td_request_t clone)
     td_queue_write(vbd->secondary, clone);
 }
 
+/*
+ * Flushes go to the leaf, and the mirror if there is one. Disks pass
+ * them on to their parents as needed.
+ */
+static void
+tapdisk_vbd_issue_flush(td_vbd_t * vbd, td_vbd_request_t * vreq,
+                        td_image_t * image)
+{
+    td_request_t treq;
+
+    memset(&treq, 0, sizeof(treq));
+    treq.op = TD_OP_FLUSH;
+    treq.sec = vreq->sec;
+    treq.image = image;
+    treq.cb = tapdisk_vbd_complete_td_request;
+    treq.vreq = vreq;
+
+    vreq->secs_pending++;
+    vbd->secs_pending++;
+
+    if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
+        vreq->secs_pending++;
+        vbd->secs_pending++;
+
+        treq.image = vbd->secondary;
+        td_queue_flush(vbd->secondary, treq);
+        treq.image = image;
+    }
+
+    td_queue_flush(image, treq);
+
+    DBG(TLOG_DBG, "%s: req %s flush\n", image->name, vreq->name);
+}
+
+/*
+ * Discards go to the leaf, and the mirror if there is one, in chunks
+ * a td_request can describe.
+ */
+static void
+tapdisk_vbd_issue_discard(td_vbd_t * vbd, td_vbd_request_t * vreq,
+                          td_image_t * image)
+{
+    td_sector_t sec, end;
+    td_request_t treq;
+
+    memset(&treq, 0, sizeof(treq));
+    treq.op = TD_OP_DISCARD;
+    treq.cb = tapdisk_vbd_complete_td_request;
+    treq.vreq = vreq;
+
+    end = vreq->sec + vreq->discard_secs;
+
+    for (sec = vreq->sec; sec < end; sec += treq.secs) {
+        treq.sec = sec;
+        treq.secs = MIN(end - sec, TD_VBD_DISCARD_MAX_SECS);
+
+        vreq->secs_pending++;
+        vbd->secs_pending++;
+
+        if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
+            vreq->secs_pending++;
+            vbd->secs_pending++;
+
+            treq.image = vbd->secondary;
+            td_queue_discard(vbd->secondary, treq);
+        }
+
+        treq.image = image;
+        td_queue_discard(image, treq);
+    }
+
+    DBG(TLOG_DBG, "%s: req %s discard sec 0x%08" PRIx64 " secs 0x%"
+        PRIx64 "\n", image->name, vreq->name, vreq->sec,
+        vreq->discard_secs);
+}
+
+static int tapdisk_image_max_segments(td_image_t * image)
+{
+    if (!td_flag_test(image->driver->ops->flags, TD_DRIVER_VECTORED))
+        return 1;
+
+    return image->driver->limits.segments;
+}
+
+/*
+ * How many segments of a request can go to the images in one
+ * td_request, see TD_DRIVER_VECTORED.
+ */
+static int
+tapdisk_vbd_max_segments(td_vbd_t * vbd, td_image_t * image,
+                         td_vbd_request_t * vreq)
+{
+    int segs = tapdisk_image_max_segments(image);
+
+    if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
+        vreq->op == TD_OP_WRITE)
+        segs = MIN(segs, tapdisk_image_max_segments(vbd->secondary));
+
+    return segs;
+}
+
 static int
 tapdisk_vbd_issue_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
 {
     td_image_t *image;
     td_request_t treq;
     td_sector_t sec;
-    int i, err;
+    int i, j, err, max_segs;
 
     sec = vreq->sec;
     image = tapdisk_vbd_first_image(vbd);
@@ -1104,25 +1492,60 @@ tapdisk_vbd_issue_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
         goto fail;
     }
 
-    for (i = 0; i < vreq->iovcnt; i++) {
+    if (vreq->op != TD_OP_READ)
+        tapdisk_readahead_invalidate(&vbd->readahead, vreq);
+    else if (!td_flag_test(vreq->flags, TD_VREQ_REQUEUED)) {
+        switch (tapdisk_readahead_read(&vbd->readahead, vreq)) {
+        case TD_RA_WAIT:
+            vreq->secs_pending++;
+            vbd->secs_pending++;
+            /* fall through */
+        case TD_RA_HIT:
+            err = 0;
+            goto out;
+        }
+    }
+
+    if (vreq->op == TD_OP_FLUSH) {
+        tapdisk_vbd_issue_flush(vbd, vreq, image);
+        err = 0;
+        goto out;
+    }
+
+    if (vreq->op == TD_OP_DISCARD) {
+        tapdisk_vbd_issue_discard(vbd, vreq, image);
+        err = 0;
+        goto out;
+    }
+
+    max_segs = tapdisk_vbd_max_segments(vbd, image, vreq);
+
+    for (i = 0; i < vreq->iovcnt; i += treq.iovcnt) {
         struct td_iovec *iov = &vreq->iov[i];
 
         treq.sidx = i;
         treq.buf = iov->base;
         treq.sec = sec;
+        treq.iov = iov;
+        treq.iovcnt = 1;
         treq.secs = iov->secs;
         treq.image = image;
         treq.cb = tapdisk_vbd_complete_td_request;
         treq.cb_data = NULL;
         treq.vreq = vreq;
 
+        if (max_segs > 1) {
+            treq.iovcnt = MIN(vreq->iovcnt - i, max_segs);
+            for (j = 1; j < treq.iovcnt; j++)
+                treq.secs += iov[j].secs;
+        }
 
-        vreq->secs_pending += iov->secs;
-        vbd->secs_pending += iov->secs;
+        vreq->secs_pending += treq.secs;
+        vbd->secs_pending += treq.secs;
         if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
             vreq->op == TD_OP_WRITE) {
-            vreq->secs_pending += iov->secs;
-            vbd->secs_pending += iov->secs;
+            vreq->secs_pending += treq.secs;
+            vbd->secs_pending += treq.secs;
         }
 
         switch (vreq->op) {
@@ -1148,7 +1571,7 @@ tapdisk_vbd_issue_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
         DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08" PRIx64 " secs 0x%04x "
             "buf %p op %d\n", image->name, vreq->name, i, treq.sec,
             treq.secs, treq.buf, vreq->op);
-        sec += iov->secs;
+        sec += treq.secs;
     }
 
     err = 0;
@@ -1176,11 +1599,12 @@ tapdisk_vbd_request_completed(td_vbd_t * vbd, td_vbd_request_t * vreq)
 static int tapdisk_vbd_reissue_failed_requests(td_vbd_t * vbd)
 {
     int err;
-    struct timeval now;
+    int64_t now, next;
     td_vbd_request_t *vreq, *tmp;
 
     err = 0;
-    gettimeofday(&now, NULL);
+    now = scheduler_now();
+    next = INT64_MAX;
 
     tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests) {
         if (vreq->secs_pending)
@@ -1191,10 +1615,12 @@ static int tapdisk_vbd_reissue_failed_requests(td_vbd_t * vbd)
             continue;
         }
 
-        if (vreq->error != -EBUSY &&
-            now.tv_sec - vreq->last_try.tv_sec < TD_VBD_RETRY_INTERVAL)
+        if (now < vreq->retry_at) {
+            next = MIN(next, vreq->retry_at);
             continue;
+        }
 
+        tapdisk_vbd_count_retry(vbd, vreq, now);
         vbd->retries++;
         vreq->num_retries++;
 
@@ -1214,6 +1640,9 @@ static int tapdisk_vbd_reissue_failed_requests(td_vbd_t * vbd)
             break;
     }
 
+    if (next != INT64_MAX)
+        tapdisk_vbd_arm_retry(vbd, next);
+
     return 0;
 }
 
@@ -1229,38 +1658,66 @@ tapdisk_vbd_count_new_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
         td_sector_count_add(&vbd->secs, iov->secs, write);
 }
 
-static int tapdisk_vbd_issue_new_requests(td_vbd_t * vbd)
+static void
+tapdisk_vbd_count_queue_delay(td_vbd_t * vbd, td_vbd_request_t * vreq)
 {
-    int err;
-    td_vbd_request_t *vreq, *tmp;
+    struct timeval delta;
+    uint64_t usecs;
 
-    tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
-        err = tapdisk_vbd_issue_request(vbd, vreq);
-        /*
-         * if this request failed, but was not completed,
-         * we'll back off for a while.
-         */
-        if (err && !tapdisk_vbd_request_completed(vbd, vreq))
-            return err;
+    timersub(&vreq->last_try, &vreq->ts, &delta);
+    usecs = delta.tv_sec * 1000000ULL + delta.tv_usec;
+
+    vbd->sched.issued++;
+    vbd->sched.delay_usecs += usecs;
+    if (usecs > vbd->sched.delay_max_usecs)
+        vbd->sched.delay_max_usecs = usecs;
+}
+
+td_vbd_request_t *tapdisk_vbd_first_new_request(td_vbd_t * vbd)
+{
+    if (td_flag_test(vbd->state, TD_VBD_DEAD) ||
+        td_flag_test(vbd->state, TD_VBD_QUIESCED) ||
+        td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
+        return NULL;
+
+    return TAILQ_FIRST(&vbd->new_requests);
+}
+
+int tapdisk_vbd_issue_new_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
+{
+    int err, count;
+
+    /* NB. not a guest request, or counted when first issued */
+    count = !td_flag_test(vreq->flags, TD_VREQ_INTERNAL | TD_VREQ_REQUEUED);
+
+    err = tapdisk_vbd_issue_request(vbd, vreq);
+    if (count)
+        tapdisk_vbd_count_queue_delay(vbd, vreq);
+    /*
+     * if this request failed, but was not completed,
+     * we'll back off for a while.
+     */
+    if (err && !tapdisk_vbd_request_completed(vbd, vreq))
+        return err;
 
+    if (count)
         tapdisk_vbd_count_new_request(vbd, vreq);
-    }
 
     return 0;
 }
 
-int tapdisk_vbd_recheck_state(td_vbd_t * vbd)
+static int tapdisk_vbd_issue_new_requests(td_vbd_t * vbd)
 {
-    if (TAILQ_EMPTY(&vbd->new_requests))
-        return 0;
-
-    if (td_flag_test(vbd->state, TD_VBD_QUIESCED) ||
-        td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
-        return 0;
+    int err;
+    td_vbd_request_t *vreq;
 
-    tapdisk_vbd_issue_new_requests(vbd);
+    while ((vreq = TAILQ_FIRST(&vbd->new_requests))) {
+        err = tapdisk_vbd_issue_new_request(vbd, vreq);
+        if (err)
+            return err;
+    }
 
-    return 1;
+    return 0;
 }
 
 static int tapdisk_vbd_kill_requests(td_vbd_t * vbd)
@@ -1269,21 +1726,21 @@ static int tapdisk_vbd_kill_requests(td_vbd_t * vbd)
 
     tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
         vreq->error = -ESHUTDOWN;
+        vreq->last_try = vreq->done = vbd->ts;
         tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
     }
 
     tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests) {
         vreq->error = -ESHUTDOWN;
+        vreq->done = vbd->ts;
         tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
     }
 
     return 0;
 }
 
-int tapdisk_vbd_issue_requests(td_vbd_t * vbd)
+static int tapdisk_vbd_issue_failed_requests(td_vbd_t * vbd)
 {
-    int err;
-
     if (td_flag_test(vbd->state, TD_VBD_DEAD))
         return tapdisk_vbd_kill_requests(vbd);
 
@@ -1291,49 +1748,263 @@ int tapdisk_vbd_issue_requests(td_vbd_t * vbd)
         td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
         return -EAGAIN;
 
-    err = tapdisk_vbd_reissue_failed_requests(vbd);
+    return tapdisk_vbd_reissue_failed_requests(vbd);
+}
+
+int tapdisk_vbd_issue_requests(td_vbd_t * vbd)
+{
+    int err;
+
+    err = tapdisk_vbd_issue_failed_requests(vbd);
     if (err)
         return err;
 
     return tapdisk_vbd_issue_new_requests(vbd);
 }
 
+void tapdisk_vbd_complete_readahead(td_vbd_request_t * vreq, int err)
+{
+    td_vbd_t *vbd = vreq->vbd;
+
+    vbd->secs_pending--;
+    vreq->secs_pending--;
+    vreq->error = (vreq->error ? : err);
+
+    tapdisk_vbd_complete_vbd_request(vbd, vreq);
+}
+
+void tapdisk_vbd_requeue_readahead(td_vbd_request_t * vreq)
+{
+    td_vbd_t *vbd = vreq->vbd;
+
+    vbd->secs_pending--;
+    vreq->secs_pending--;
+    td_flag_set(vreq->flags, TD_VREQ_REQUEUED);
+
+    TAILQ_REMOVE(vreq->list_head, vreq, next);
+    TAILQ_INSERT_HEAD(&vbd->new_requests, vreq, next);
+    vreq->list_head = &vbd->new_requests;
+}
+
 int tapdisk_vbd_queue_request(td_vbd_t * vbd, td_vbd_request_t * vreq)
 {
     gettimeofday(&vreq->ts, NULL);
     vreq->vbd = vbd;
+    td_flag_clear(vreq->flags, TD_VREQ_REQUEUED);
 
     TAILQ_INSERT_TAIL(&vbd->new_requests, vreq, next);
-    vbd->received++;
+    vreq->list_head = &vbd->new_requests;
+    if (!td_flag_test(vreq->flags, TD_VREQ_INTERNAL))
+        vbd->received++;
 
     return 0;
 }
 
+/* upper bounds of the latency size classes, in sectors */
+static const int tapdisk_vbd_latency_secs[TD_VBD_LAT_SIZES - 1] =
+    { 8, 64, 256 };
+
+static int tapdisk_vbd_latency_bucket(const struct timeval *from,
+                                      const struct timeval *to)
+{
+    struct timeval delta;
+    uint64_t usecs;
+    int b;
+
+    timersub(to, from, &delta);
+    if (delta.tv_sec < 0)
+        return 0;
+
+    usecs = (uint64_t) delta.tv_sec * 1000000 + delta.tv_usec;
+    if (usecs <= 1)
+        return 0;
+
+    b = 63 - __builtin_clzll(usecs);
+
+    return MIN(b, TD_VBD_LAT_BUCKETS - 1);
+}
+
+static int tapdisk_vbd_latency_size(td_vbd_request_t * vreq)
+{
+    int i, secs = 0;
+
+    for (i = 0; i < vreq->iovcnt; i++)
+        secs += vreq->iov[i].secs;
+
+    for (i = 0; i < TD_VBD_LAT_SIZES - 1; i++)
+        if (secs <= tapdisk_vbd_latency_secs[i])
+            break;
+
+    return i;
+}
+
+static void
+tapdisk_vbd_account_latency(td_vbd_t * vbd, td_vbd_request_t * vreq,
+                            const struct timeval *now)
+{
+    int write = vreq->op == TD_OP_WRITE;
+    int size = tapdisk_vbd_latency_size(vreq);
+    struct td_vbd_latency *lat = &vbd->latency;
+
+    /* no data moved; flushes count in the driver sync stats */
+    if (vreq->op == TD_OP_FLUSH || vreq->op == TD_OP_DISCARD)
+        return;
+
+    lat->hist[TD_VBD_LAT_QUEUE][write][size]
+        [tapdisk_vbd_latency_bucket(&vreq->ts, &vreq->last_try)]++;
+    lat->hist[TD_VBD_LAT_SERVICE][write][size]
+        [tapdisk_vbd_latency_bucket(&vreq->last_try, &vreq->done)]++;
+    lat->hist[TD_VBD_LAT_RESPONSE][write][size]
+        [tapdisk_vbd_latency_bucket(&vreq->done, now)]++;
+}
+
+/*
+ * Completed requests, grouped by token. Frontends rarely have more
+ * than a few tokens per VBD, a kick seeing more returns in rounds.
+ */
+#define TD_VBD_KICK_BATCHES 16
+
+struct td_vbd_batch {
+    void *token;
+    struct tqh_td_vbd_request reqs;
+};
+
+static void tapdisk_vbd_return_batch(struct td_vbd_batch *batch)
+{
+    struct tqh_td_vbd_request *list = &batch->reqs;
+    td_vbd_request_t *vreq, *next;
+
+    vreq = TAILQ_FIRST(list);
+    if (vreq->batch_cb) {
+        vreq->batch_cb(list, batch->token);
+        return;
+    }
+
+    tapdisk_vbd_for_each_request(vreq, next, list) {
+        TAILQ_REMOVE(list, vreq, next);
+        vreq->cb(vreq, vreq->error, vreq->token, TAILQ_EMPTY(list));
+    }
+}
+
 void tapdisk_vbd_kick(td_vbd_t * vbd)
 {
     struct tqh_td_vbd_request *list = &vbd->completed_requests;
-    td_vbd_request_t *vreq, *prev, *next;
+    struct td_vbd_batch batches[TD_VBD_KICK_BATCHES], *batch;
+    td_vbd_request_t *vreq;
+    struct timeval now;
+    int i, n;
 
     vbd->kicked++;
 
+    if (TAILQ_EMPTY(list))
+        return;
+
+    gettimeofday(&now, NULL);
+
+    /* callbacks may complete more requests */
     while (!TAILQ_EMPTY(list)) {
-        prev = TAILQ_FIRST(list);
-        TAILQ_REMOVE(list, prev, next);
+        batch = NULL;
+        n = 0;
+
+        while ((vreq = TAILQ_FIRST(list))) {
+            if (!batch || batch->token != vreq->token) {
+                for (i = 0; i < n; i++)
+                    if (batches[i].token == vreq->token)
+                        break;
+
+                if (i == n) {
+                    if (n == TD_VBD_KICK_BATCHES)
+                        break;
+                    batches[n].token = vreq->token;
+                    TAILQ_INIT(&batches[n].reqs);
+                    n++;
+                }
+
+                batch = &batches[i];
+            }
+
+            TAILQ_REMOVE(list, vreq, next);
+            TAILQ_INSERT_TAIL(&batch->reqs, vreq, next);
+            vreq->list_head = NULL;
+
+            if (td_flag_test(vreq->flags, TD_VREQ_INTERNAL))
+                continue;
+
+            tapdisk_vbd_account_latency(vbd, vreq, &now);
+            vbd->returned++;
+        }
+
+        for (i = 0; i < n; i++)
+            tapdisk_vbd_return_batch(&batches[i]);
+    }
+}
+
+static void
+tapdisk_vbd_latency_stats(td_vbd_t * vbd, td_stats_t * st)
+{
+    static const char *stages[TD_VBD_LAT_STAGES] = {
+        [TD_VBD_LAT_QUEUE] = "queue",
+        [TD_VBD_LAT_SERVICE] = "service",
+        [TD_VBD_LAT_RESPONSE] = "response",
+    };
+    static const char *ops[2] = { "read", "write" };
+    int stage, write, size, n;
+    uint64_t *hist;
+
+    tapdisk_stats_field(st, "latency", "{");
+    tapdisk_stats_field(st, "sizes", "[");
+    for (size = 0; size < TD_VBD_LAT_SIZES - 1; size++)
+        tapdisk_stats_val(st, "d", tapdisk_vbd_latency_secs[size]);
+    tapdisk_stats_leave(st, ']');
+
+    for (stage = 0; stage < TD_VBD_LAT_STAGES; stage++) {
+        tapdisk_stats_field(st, stages[stage], "{");
+
+        for (write = 0; write < 2; write++) {
+            tapdisk_stats_field(st, ops[write], "[");
 
-        tapdisk_vbd_for_each_request(vreq, next, list) {
-            if (vreq->token == prev->token) {
+            for (size = 0; size < TD_VBD_LAT_SIZES; size++) {
+                hist = vbd->latency.hist[stage][write][size];
 
-                prev->cb(prev, prev->error, prev->token, 0);
-                vbd->returned++;
+                /* trailing empty buckets are left out */
+                n = TD_VBD_LAT_BUCKETS;
+                while (n > 0 && !hist[n - 1])
+                    n--;
 
-                TAILQ_REMOVE(list, vreq, next);
-                prev = vreq;
+                tapdisk_stats_enter(st, '[');
+                while (n-- > 0)
+                    tapdisk_stats_val(st, "llu", *hist++);
+                tapdisk_stats_leave(st, ']');
             }
+
+            tapdisk_stats_leave(st, ']');
         }
 
-        prev->cb(prev, prev->error, prev->token, 1);
-        vbd->returned++;
+        tapdisk_stats_leave(st, '}');
+    }
+
+    tapdisk_stats_leave(st, '}');
+}
+
+static void tapdisk_vbd_retry_stats(td_vbd_t * vbd, td_stats_t * st)
+{
+    static const char *classes[TD_VBD_RETRY_CLASSES] = {
+        [TD_VBD_RETRY_BUSY] = "busy",
+        [TD_VBD_RETRY_ERROR] = "error",
+    };
+    int class;
+
+    tapdisk_stats_field(st, "retry", "{");
+    for (class = 0; class < TD_VBD_RETRY_CLASSES; class++) {
+        tapdisk_stats_field(st, classes[class], "{");
+        tapdisk_stats_field(st, "count", "llu", vbd->retry.count[class]);
+        tapdisk_stats_field(st, "delay_usecs", "llu",
+                            vbd->retry.delay_usecs[class]);
+        tapdisk_stats_field(st, "delay_max_usecs", "llu",
+                            vbd->retry.delay_max_usecs[class]);
+        tapdisk_stats_leave(st, '}');
     }
+    tapdisk_stats_leave(st, '}');
 }
 
 void tapdisk_vbd_stats(td_vbd_t * vbd, td_stats_t * st)
@@ -1359,6 +2030,14 @@ void tapdisk_vbd_stats(td_vbd_t * vbd, td_stats_t * st)
         tapdisk_stats_leave(st, '}');
     }
 
+    tapdisk_vbd_latency_stats(vbd, st);
+
+    tapdisk_vbd_retry_stats(vbd, st);
+    tapdisk_readahead_stats(&vbd->readahead, st);
+    if (vbd->secondary_mode == TD_VBD_SECONDARY_ASYNC)
+        tapdisk_mirror_stats(&vbd->mirror, st);
+    tapdisk_server_iosched_stats(vbd, st);
+
     tapdisk_stats_field(st,
                         "FIXME_enospc_redirect_count",
                         "llu", vbd->FIXME_enospc_redirect_count);
@@ -34,11 +34,36 @@
 #include "scheduler.h"
 #include "tapdisk-image.h"
 #include "tapdisk-blktap.h"
+#include "tapdisk-mirror.h"
+#include "tapdisk-readahead.h"
 
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
 
+/*
+ * Failed requests are retried after an exponential backoff with
+ * jitter, by class of error. Delays are in microseconds, the busy
+ * class backs off up to TD_VBD_RETRY_BUSY_MAX_USECS, the error class
+ * up to TD_VBD_RETRY_INTERVAL. TAPDISK_RETRY_{BUSY,ERROR}_USECS
+ * override both as "base:max", with max at most
+ * TD_VBD_RETRY_MAX_USECS.
+ *
+ * The backoff only spaces retries out. A request is retried until it
+ * is TD_VBD_REQUEST_TIMEOUT seconds old, however many times that
+ * takes: TD_VBD_MAX_RETRIES is not enforced.
+ */
+enum {
+    TD_VBD_RETRY_BUSY,          /* EBUSY, EAGAIN, ENOMEM */
+    TD_VBD_RETRY_ERROR,         /* any other retryable error */
+    TD_VBD_RETRY_CLASSES
+};
+
+#define TD_VBD_RETRY_BUSY_USECS     20
+#define TD_VBD_RETRY_BUSY_MAX_USECS 5000
+#define TD_VBD_RETRY_ERROR_USECS    10000
+#define TD_VBD_RETRY_MAX_USECS      SCHEDULER_USECS(60)
+
 #define TD_VBD_DEAD                 0x0001
 #define TD_VBD_CLOSED               0x0002
 #define TD_VBD_QUIESCE_REQUESTED    0x0004
@@ -48,10 +73,71 @@
 #define TD_VBD_SHUTDOWN_REQUESTED   0x0040
 #define TD_VBD_LOCKING              0x0080
 #define TD_VBD_LOG_DROPPED          0x0100
+#define TD_VBD_LIMITS_PENDING       0x0200
+
+/*
+ * Request latency histograms, by stage, read/write and size class.
+ * Buckets are powers of two in microseconds, the last one is open.
+ * Like the received and returned counts, they leave out
+ * TD_VREQ_INTERNAL requests.
+ */
+#define TD_VBD_LAT_BUCKETS          24
+#define TD_VBD_LAT_SIZES            4
+
+enum {
+    TD_VBD_LAT_QUEUE,           /* queued until (last) issued */
+    TD_VBD_LAT_SERVICE,         /* issued until the last sector completed */
+    TD_VBD_LAT_RESPONSE,        /* completed until returned by kick */
+    TD_VBD_LAT_STAGES
+};
+
+struct td_vbd_latency {
+    uint64_t hist[TD_VBD_LAT_STAGES][2][TD_VBD_LAT_SIZES]
+        [TD_VBD_LAT_BUCKETS];
+};
+
+/*
+ * Share of the shard's AIO queue a VBD gets under a fair I/O scheduler,
+ * see tapdisk-iosched.h.
+ */
+#define TD_VBD_WEIGHT_DEFAULT       100
+#define TD_VBD_WEIGHT_MAX           10000
+
+struct td_vbd_sched {
+    int weight;
+
+    /* deficit round robin state, owned by the scheduler */
+    int64_t deficit;
+    int active;
+    int credited;
+     TAILQ_ENTRY(td_vbd_handle) entry;
+
+    /* cost served, in the scheduler's unit */
+    uint64_t served;
+    /* the part of it spent on TD_VREQ_INTERNAL requests, not in shares */
+    uint64_t internal;
+
+    /* new requests issued, and their time spent queued */
+    uint64_t issued;
+    uint64_t delay_usecs;
+    uint64_t delay_max_usecs;
+};
+
+struct td_vbd_retry {
+    /* timer of the earliest retry due, or -1 */
+    event_id_t event;
+    int64_t deadline;
+
+    /* retries, and the time their requests spent failed */
+    uint64_t count[TD_VBD_RETRY_CLASSES];
+    uint64_t delay_usecs[TD_VBD_RETRY_CLASSES];
+    uint64_t delay_max_usecs[TD_VBD_RETRY_CLASSES];
+};
 
 #define TD_VBD_SECONDARY_DISABLED   0
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
+#define TD_VBD_SECONDARY_ASYNC      3
 
 TAILQ_HEAD(tqh_td_vbd_handle, td_vbd_handle);
 
@@ -71,6 +157,7 @@ struct td_vbd_handle {
     char *secondary_name;
     td_image_t *secondary;
     uint8_t secondary_mode;
+    td_mirror_t mirror;
 
     /* FIXME ??? */
     int FIXME_enospc_redirect_count_enabled;
@@ -94,6 +181,9 @@ struct td_vbd_handle {
 
     struct timeval ts;
 
+    /* negotiated with the frontends, applied when opening images */
+    td_limits_t limits;
+
     uint64_t received;
     uint64_t returned;
     uint64_t kicked;
@@ -101,6 +191,11 @@ struct td_vbd_handle {
     uint64_t retries;
     uint64_t errors;
     td_sector_count_t secs;
+
+    struct td_vbd_latency latency;
+    struct td_vbd_sched sched;
+    td_readahead_t readahead;
+    struct td_vbd_retry retry;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -185,19 +280,55 @@ int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
 
 int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
+
+/**
+ * Completes a read which waited for read-ahead, see
+ * tapdisk_readahead_read.
+ */
+void tapdisk_vbd_complete_readahead(td_vbd_request_t *, int err);
+
+/**
+ * Issues a read which waited for read-ahead in vain again, as a plain
+ * read. It goes back to the head of the queue, bypasses read-ahead,
+ * and is not counted again, nor as a retry.
+ */
+void tapdisk_vbd_requeue_readahead(td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
-int tapdisk_vbd_retry_needed(td_vbd_t *);
+
+/**
+ * Sets the retry backoff of an error class, TD_VBD_RETRY_*: the first
+ * retry waits about base_usecs, doubling on each retry up to max_usecs.
+ */
+int tapdisk_vbd_set_retry_policy(int class, int64_t base_usecs,
+                                 int64_t max_usecs);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
 int tapdisk_vbd_issue_requests(td_vbd_t *);
+
+/**
+ * Returns the oldest new request, or NULL if the VBD takes none right
+ * now. For the I/O scheduler, which issues them one by one.
+ */
+td_vbd_request_t *tapdisk_vbd_first_new_request(td_vbd_t *);
+int tapdisk_vbd_issue_new_request(td_vbd_t *, td_vbd_request_t *);
+
+/**
+ * Sets the fair-share weight, 1 to TD_VBD_WEIGHT_MAX.
+ */
+int tapdisk_vbd_set_weight(td_vbd_t *, int);
+
+/**
+ * Sets the request limits of the VBD. The queue drains, then the
+ * drivers resize their pools.
+ */
+int tapdisk_vbd_set_limits(td_vbd_t *, const td_limits_t *);
 int tapdisk_vbd_kill_queue(td_vbd_t *);
 int tapdisk_vbd_pause(td_vbd_t *);
 int tapdisk_vbd_resume(td_vbd_t *, const char *);
 void tapdisk_vbd_kick(td_vbd_t *);
 void tapdisk_vbd_check_state(td_vbd_t *);
-int tapdisk_vbd_recheck_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
 void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
@@ -38,6 +38,7 @@
 #include <xen/xen.h>
 #include <xen/io/blkif.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 
 #include "tapdisk.h"
 #include "tapdisk-xenblkif.h"
@@ -89,16 +90,30 @@ TAILQ_HEAD(tqh_td_xenblkif, td_xenblkif);
 struct td_xenio_ctx {
     char *pool;
 
+    /*
+     * The shard polling the event channel, blkifs on other shards
+     * get a context of their own.
+     */
+    int shard;
+
     xenio_ctx_t *xenio;
 
     event_id_t ring_event;
+    struct tapdisk_server_poller poller;
+    int polling;
 
     struct tqh_td_xenblkif blkifs;
      TAILQ_ENTRY(td_xenio_ctx) entry;
 };
 
-static TAILQ_HEAD(tqh_td_xenio_ctx, td_xenio_ctx) _td_xenio_ctxs
-    = TAILQ_HEAD_INITIALIZER(_td_xenio_ctxs);
+TAILQ_HEAD(tqh_td_xenio_ctx, td_xenio_ctx);
+
+/*
+ * Contexts of the calling shard. A VBD and all queues of its block
+ * interfaces live on one shard, so lookups never need another shard's
+ * contexts. NB. initialized on first use, see tapdisk_xenio_ctx_open.
+ */
+static __thread struct tqh_td_xenio_ctx _td_xenio_ctxs;
 
 #define tapdisk_xenio_for_each_ctx(_ctx) \
 	TAILQ_FOREACH(_ctx, &_td_xenio_ctxs, entry)
@@ -141,12 +156,17 @@ struct td_xenblkif_stats {
         unsigned long long in;
         unsigned long long out;
     } kicks;
+    unsigned long long notifies;
     struct {
         unsigned long long msg;
         unsigned long long map;
         unsigned long long vbd;
         unsigned long long img;
     } errors;
+    struct {
+        unsigned long long batch;
+        unsigned long long one;
+    } maps;
 };
 
 struct td_xenblkif {
@@ -154,6 +174,13 @@ struct td_xenblkif {
     int devid;
     int rport;
 
+    /*
+     * Ring of a multi-queue frontend. Each queue is a block interface of
+     * its own sharing the VBD, responses go back on the ring the request
+     * came from.
+     */
+    int queue;
+
     /**
 	 * TODO Pointer to xen I/O context this block interface belongs to?
 	 */
@@ -176,6 +203,14 @@ struct td_xenblkif {
     int n_reqs_free;
     blkif_request_t **reqs_free;
 
+    /* responses to push in one go, see tapdisk_xenblkif_push_responses */
+    xenio_blkif_req_t **rsps;
+    int n_rsps;
+    td_xenblkif_t *next_pending;
+
+    /* requests to map in one go, see tapdisk_xenblkif_map_requests */
+    xenio_blkif_req_t **maps;
+
     td_vbd_t *vbd;
 
     struct td_xenblkif_stats stats;
@@ -185,7 +220,7 @@ struct td_xenblkif_req {
     td_vbd_request_t vreq;
     xenio_blkif_req_t xenio;
     char name[16 + 1];
-    struct td_iovec iov[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct td_iovec iov[XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST];
     blkif_request_t msg;
 };
 
@@ -214,6 +249,16 @@ static void tapdisk_xenblkif_reqs_free(td_xenblkif_t * blkif)
         free(blkif->reqs_free);
         blkif->reqs_free = NULL;
     }
+
+    if (blkif->rsps) {
+        free(blkif->rsps);
+        blkif->rsps = NULL;
+    }
+
+    if (blkif->maps) {
+        free(blkif->maps);
+        blkif->maps = NULL;
+    }
 }
 
 static int tapdisk_xenblkif_reqs_init(td_xenblkif_t * blkif)
@@ -235,6 +280,18 @@ static int tapdisk_xenblkif_reqs_init(td_xenblkif_t * blkif)
         goto fail;
     }
 
+    blkif->rsps = malloc(blkif->ring_size * sizeof(xenio_blkif_req_t *));
+    if (!blkif->rsps) {
+        err = -errno;
+        goto fail;
+    }
+
+    blkif->maps = malloc(blkif->ring_size * sizeof(xenio_blkif_req_t *));
+    if (!blkif->maps) {
+        err = -errno;
+        goto fail;
+    }
+
     blkif->n_reqs_free = 0;
     for (i = 0; i < blkif->ring_size; i++)
         tapdisk_xenblkif_free_request(blkif, &blkif->reqs[i]);
@@ -247,38 +304,95 @@ static int tapdisk_xenblkif_reqs_init(td_xenblkif_t * blkif)
 }
 
 static void
-tapdisk_xenblkif_complete_request(td_xenblkif_t * blkif,
-                                  td_xenblkif_req_t * tapreq, int error,
-                                  int final)
+tapdisk_xenblkif_finish_request(td_xenblkif_t * blkif,
+                                td_xenblkif_req_t * tapreq, int error)
 {
     xenio_blkif_req_t *req = &tapreq->xenio;
 
-    if (req->vma) {
-        int err;
-        err = xenio_blkif_munmap_one(blkif->xenio, req);
-        WARN_ON_WITH_ERRNO(err);
+    if (error == -EOPNOTSUPP)
+        req->status = BLKIF_RSP_EOPNOTSUPP;
+    else
+        req->status = error ? BLKIF_RSP_ERROR : BLKIF_RSP_OKAY;
+}
+
+/*
+ * Releases the data of finished requests. Comes after the status,
+ * grant-copied reads are only copied back to the guest on success.
+ */
+static void
+tapdisk_xenblkif_unmap_requests(td_xenblkif_t * blkif,
+                                xenio_blkif_req_t ** reqs, int n_reqs)
+{
+    int err;
+
+    err = xenio_blkif_munmap_requests(blkif->xenio, reqs, n_reqs);
+    WARN_ON_WITH(err, "d", err);
+}
+
+/*
+ * Blkifs of this shard with responses staged.
+ */
+static __thread td_xenblkif_t *td_xenblkif_pending;
+
+/*
+ * Holds back the response of a finished request until the next
+ * tapdisk_xenblkif_push_responses. There are never more than a ring of
+ * requests in flight.
+ */
+static void
+tapdisk_xenblkif_stage_response(td_xenblkif_t * blkif,
+                                td_xenblkif_req_t * tapreq)
+{
+    BUG_ON(blkif->n_rsps >= blkif->ring_size);
+
+    if (!blkif->n_rsps) {
+        blkif->next_pending = td_xenblkif_pending;
+        td_xenblkif_pending = blkif;
     }
 
-    req->status = error ? BLKIF_RSP_ERROR : BLKIF_RSP_OKAY;
-    xenio_blkif_put_responses(blkif->xenio, &req, 1, final);
+    blkif->rsps[blkif->n_rsps++] = &tapreq->xenio;
+}
+
+/*
+ * Releases the data of all staged requests, then writes their responses
+ * and pushes them with a single notification.
+ */
+static void tapdisk_xenblkif_flush_responses(td_xenblkif_t * blkif)
+{
+    td_xenblkif_req_t *tapreq;
+    int i, n = blkif->n_rsps;
+
+    tapdisk_xenblkif_unmap_requests(blkif, blkif->rsps, n);
+    if (xenio_blkif_put_responses(blkif->xenio, blkif->rsps, n, 1))
+        blkif->stats.notifies++;
 
-    tapdisk_xenblkif_free_request(blkif, tapreq);
+    for (i = 0; i < n; i++) {
+        tapreq = containerof(blkif->rsps[i], td_xenblkif_req_t, xenio);
+        tapdisk_xenblkif_free_request(blkif, tapreq);
+    }
 
-    blkif->stats.reqs.out++;
-    if (final)
-        blkif->stats.kicks.out++;
+    blkif->n_rsps = 0;
+    blkif->stats.reqs.out += n;
+    blkif->stats.kicks.out++;
 }
 
-static void
-__tapdisk_xenblkif_request_cb(td_vbd_request_t * vreq, int error,
-                              void *token, int final)
+void tapdisk_xenblkif_push_responses(void)
 {
-    td_xenblkif_req_t *tapreq = containerof(vreq, td_xenblkif_req_t, vreq);
-    td_xenblkif_t *blkif = token;
+    td_xenblkif_t *blkif;
 
-    tapdisk_xenblkif_complete_request(blkif, tapreq, error, final);
-    if (error)
-        blkif->stats.errors.img++;
+    while ((blkif = td_xenblkif_pending)) {
+        td_xenblkif_pending = blkif->next_pending;
+        blkif->next_pending = NULL;
+        tapdisk_xenblkif_flush_responses(blkif);
+    }
+}
+
+static void
+tapdisk_xenblkif_complete_request(td_xenblkif_t * blkif,
+                                  td_xenblkif_req_t * tapreq, int error)
+{
+    tapdisk_xenblkif_finish_request(blkif, tapreq, error);
+    tapdisk_xenblkif_stage_response(blkif, tapreq);
 }
 
 static void
@@ -290,8 +404,8 @@ tapdisk_xenblkif_vector_request(td_xenblkif_t * blkif,
     int i;
 
     for (i = 0; i < req->n_iov; i++) {
-        struct iovec *iov = req->iov;
-        struct td_iovec *tiov = tapreq->iov;
+        struct iovec *iov = &req->iov[i];
+        struct td_iovec *tiov = &tapreq->iov[i];
 
         tiov->base = iov->iov_base;
         tiov->secs = iov->iov_len >> SECTOR_SHIFT;
@@ -302,6 +416,53 @@ tapdisk_xenblkif_vector_request(td_xenblkif_t * blkif,
     vreq->sec = tapreq->xenio.offset >> SECTOR_SHIFT;
 }
 
+/*
+ * A flush carrying data is a pre-flush: the data is written once the
+ * flush completed. Returns nonzero if the request went back to the VBD.
+ */
+static int
+tapdisk_xenblkif_requeue_flush(td_xenblkif_t * blkif,
+                               td_xenblkif_req_t * tapreq)
+{
+    td_vbd_request_t *vreq = &tapreq->vreq;
+
+    if (vreq->op != TD_OP_FLUSH || vreq->error || !tapreq->xenio.n_iov)
+        return 0;
+
+    vreq->op = TD_OP_WRITE;
+    tapdisk_xenblkif_vector_request(blkif, tapreq);
+
+    vreq->error = tapdisk_vbd_queue_request(blkif->vbd, vreq);
+
+    return !vreq->error;
+}
+
+/*
+ * Stages the responses of all requests returned by a VBD kick, the server
+ * pushes them once all VBDs got kicked.
+ */
+static void
+__tapdisk_xenblkif_request_batch_cb(struct tqh_td_vbd_request *vreqs,
+                                    void *token)
+{
+    td_xenblkif_t *blkif = token;
+    td_xenblkif_req_t *tapreq;
+    td_vbd_request_t *vreq, *next;
+
+    tapdisk_vbd_for_each_request(vreq, next, vreqs) {
+        TAILQ_REMOVE(vreqs, vreq, next);
+
+        tapreq = containerof(vreq, td_xenblkif_req_t, vreq);
+        if (tapdisk_xenblkif_requeue_flush(blkif, tapreq))
+            continue;
+
+        if (vreq->error)
+            blkif->stats.errors.img++;
+
+        tapdisk_xenblkif_complete_request(blkif, tapreq, vreq->error);
+    }
+}
+
 static int
 tapdisk_xenblkif_make_vbd_request(td_xenblkif_t * blkif,
                                   td_xenblkif_req_t * tapreq)
@@ -317,15 +478,26 @@ tapdisk_xenblkif_make_vbd_request(td_xenblkif_t * blkif,
     case BLKIF_OP_WRITE:
         op = TD_OP_WRITE;
         break;
+    case BLKIF_OP_FLUSH_DISKCACHE:
+        op = TD_OP_FLUSH;
+        break;
+    case BLKIF_OP_DISCARD:
+        if (req->flag & BLKIF_DISCARD_SECURE)
+            return -EOPNOTSUPP;
+        op = TD_OP_DISCARD;
+        break;
     default:
         err = -EOPNOTSUPP;
         return err;
     }
 
-    err = xenio_blkif_mmap_one(blkif->xenio, req);
-    WARN_ON_WITH_ERRNO(err);
-    if (err)
-        return err;
+    if (req->n_segs && !xenio_blkif_req_mapped(req)) {
+        err = xenio_blkif_mmap_one(blkif->xenio, req);
+        WARN_ON_WITH_ERRNO(err);
+        if (err)
+            return err;
+        blkif->stats.maps.one++;
+    }
 
     snprintf(tapreq->name, sizeof(tapreq->name),
              "xenvbd-%d-%d.%" SCNx64 "",
@@ -334,31 +506,85 @@ tapdisk_xenblkif_make_vbd_request(td_xenblkif_t * blkif,
     vreq->op = op;
     vreq->name = tapreq->name;
     vreq->token = blkif;
-    vreq->cb = __tapdisk_xenblkif_request_cb;
+    vreq->cb = NULL;
+    vreq->batch_cb = __tapdisk_xenblkif_request_batch_cb;
 
     tapdisk_xenblkif_vector_request(blkif, tapreq);
 
+    /* data of a flush is written after it, see the batch callback */
+    if (op == TD_OP_FLUSH)
+        vreq->iovcnt = 0;
+
+    vreq->discard_secs = 0;
+    if (op == TD_OP_DISCARD)
+        vreq->discard_secs = req->nr_sectors;
+
     return 0;
 }
 
+/*
+ * Maps the data of all requests pulled off the ring with one grant
+ * operation per direction. Requests left unmapped, e.g. after a bad
+ * grant failed the batch, get mapped one by one instead.
+ */
+static void
+tapdisk_xenblkif_map_requests(td_xenblkif_t * blkif,
+                              xenio_blkif_req_t ** reqs, int n_reqs)
+{
+    int64_t id;
+    int i, err, mapped = 0;
+
+    id = xenio_blkif_map_grants(blkif->xenio, reqs, n_reqs);
+    if (id < 0)
+        return;
+
+    err = xenio_blkif_mmap_requests(blkif->xenio, reqs, n_reqs);
+    WARN_ON_WITH(err, "d", err);
+
+    for (i = 0; i < n_reqs; i++) {
+        if (reqs[i]->batch != id)
+            continue;
+
+        if (err)
+            xenio_blkif_munmap_request(blkif->xenio, reqs[i]);
+        else
+            mapped++;
+    }
+
+    xenio_blkif_unmap_grants(blkif->xenio, id);
+
+    if (mapped)
+        blkif->stats.maps.batch++;
+}
+
 void
 tapdisk_xenblkif_queue_requests(td_xenblkif_t * blkif,
                                 blkif_request_t ** reqs, int n_reqs)
 {
-    int i, err, errors = 0;
+    xenio_blkif_req_t **maps = blkif->maps;
+    td_xenblkif_req_t *tapreq;
+    int i, n_maps = 0, err;
 
     for (i = 0; i < n_reqs; i++) {
-        blkif_request_t *msg = reqs[i];
-        td_xenblkif_req_t *tapreq = msg_to_tapreq(msg);
-
-        errors++;
+        tapreq = msg_to_tapreq(reqs[i]);
 
-        err = xenio_blkif_parse_request(blkif->xenio, msg, &tapreq->xenio);
+        err = xenio_blkif_parse_request(blkif->xenio, reqs[i],
+                                        &tapreq->xenio);
         if (err) {
             blkif->stats.errors.msg++;
-            goto fail_req;
+            tapdisk_xenblkif_complete_request(blkif, tapreq, err);
+            continue;
         }
 
+        maps[n_maps++] = &tapreq->xenio;
+    }
+
+    if (n_maps)
+        tapdisk_xenblkif_map_requests(blkif, maps, n_maps);
+
+    for (i = 0; i < n_maps; i++) {
+        tapreq = containerof(maps[i], td_xenblkif_req_t, xenio);
+
         err = tapdisk_xenblkif_make_vbd_request(blkif, tapreq);
         if (err) {
             blkif->stats.errors.map++;
@@ -371,15 +597,11 @@ tapdisk_xenblkif_queue_requests(td_xenblkif_t * blkif,
             goto fail_req;
         }
 
-        errors--;
         continue;
 
       fail_req:
-        tapdisk_xenblkif_complete_request(blkif, tapreq, err, 1);
+        tapdisk_xenblkif_complete_request(blkif, tapreq, err);
     }
-
-    if (errors)
-        xenio_blkif_put_responses(blkif->xenio, NULL, 0, 1);
 }
 
 void tapdisk_xenblkif_ring_event(td_xenblkif_t * blkif)
@@ -425,8 +647,35 @@ tapdisk_xenio_ctx_ring_event(event_id_t id, char mode, void *private)
         tapdisk_xenblkif_ring_event(blkif);
 }
 
+/*
+ * Busy-polls the rings of the context, see tapdisk_server_poll.
+ */
+static int tapdisk_xenio_ctx_poll(void *private)
+{
+    td_xenio_ctx_t *ctx = private;
+    td_xenblkif_t *blkif;
+    int n = 0;
+
+    tapdisk_xenio_for_each_blkif(blkif, ctx) {
+        if (!blkif->xenio || !blkif->n_reqs_free)
+            continue;
+
+        if (xenio_blkif_has_requests(blkif->xenio)) {
+            tapdisk_xenblkif_ring_event(blkif);
+            n++;
+        }
+    }
+
+    return n;
+}
+
 static void tapdisk_xenio_ctx_close(td_xenio_ctx_t * ctx)
 {
+    if (ctx->polling) {
+        tapdisk_server_unregister_poller(&ctx->poller);
+        ctx->polling = 0;
+    }
+
     if (ctx->ring_event >= 0) {
         tapdisk_server_unregister_event(ctx->ring_event);
         ctx->ring_event = -1;
@@ -438,6 +687,7 @@ static void tapdisk_xenio_ctx_close(td_xenio_ctx_t * ctx)
     }
 
     TAILQ_REMOVE(&_td_xenio_ctxs, ctx, entry);
+    free(ctx);
 }
 
 static int tapdisk_xenio_ctx_open(const char *pool)
@@ -449,11 +699,17 @@ static int tapdisk_xenio_ctx_open(const char *pool)
         return -EINVAL;
 
     ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return -errno;
 
     ctx->xenio = NULL;
     ctx->ring_event = -1;
     ctx->pool = TD_XENBLKIF_DEFAULT_POOL;
+    ctx->shard = tapdisk_server_shard();
     TAILQ_INIT(&ctx->blkifs);
+
+    if (!_td_xenio_ctxs.tqh_last)
+        TAILQ_INIT(&_td_xenio_ctxs);
     TAILQ_INSERT_HEAD(&_td_xenio_ctxs, ctx, entry);
 
     ctx->xenio = xenio_open();
@@ -482,6 +738,11 @@ static int tapdisk_xenio_ctx_open(const char *pool)
         goto fail;
     }
 
+    ctx->poller.fn = tapdisk_xenio_ctx_poll;
+    ctx->poller.arg = ctx;
+    tapdisk_server_register_poller(&ctx->poller);
+    ctx->polling = 1;
+
     return 0;
 
   fail:
@@ -491,6 +752,9 @@ static int tapdisk_xenio_ctx_open(const char *pool)
 
 static int __td_xenio_ctx_match(td_xenio_ctx_t * ctx, const char *pool)
 {
+    if (ctx->shard != tapdisk_server_shard())
+        return 0;
+
     if (unlikely(!pool)) {
         if (NULL != TD_XENBLKIF_DEFAULT_POOL)
             return !strcmp(ctx->pool, TD_XENBLKIF_DEFAULT_POOL);
@@ -525,7 +789,11 @@ static void tapdisk_xenio_ctx_put(td_xenio_ctx_t * ctx)
         tapdisk_xenio_ctx_close(ctx);
 }
 
-static td_xenblkif_t *tapdisk_xenblkif_find(domid_t domid, int devid)
+/*
+ * Looks up a queue of a block interface, any queue if @queue is negative.
+ */
+static td_xenblkif_t *tapdisk_xenblkif_find(domid_t domid, int devid,
+                                            int queue)
 {
     td_xenblkif_t *blkif = NULL;
     td_xenio_ctx_t *ctx;
@@ -533,7 +801,8 @@ static td_xenblkif_t *tapdisk_xenblkif_find(domid_t domid, int devid)
     tapdisk_xenio_for_each_ctx(ctx) {
         tapdisk_xenio_ctx_find_blkif(ctx, blkif,
                                      blkif->domid == domid &&
-                                     blkif->devid == devid);
+                                     blkif->devid == devid &&
+                                     (queue < 0 || blkif->queue == queue));
         if (blkif)
             return blkif;
     }
@@ -562,35 +831,82 @@ static void tapdisk_xenblkif_destroy(td_xenblkif_t * blkif)
         tapdisk_xenio_ctx_put(blkif->ctx);
         blkif->ctx = NULL;
     }
+
+    free(blkif);
 }
 
+/*
+ * Disconnects all queues of a block interface, none if any of them still
+ * has requests in flight.
+ */
 int tapdisk_xenblkif_disconnect(domid_t domid, int devid)
 {
     td_xenblkif_t *blkif;
+    td_xenio_ctx_t *ctx;
 
-    blkif = tapdisk_xenblkif_find(domid, devid);
+    blkif = tapdisk_xenblkif_find(domid, devid, -1);
     if (!blkif)
         return -ESRCH;
 
-    if (blkif->n_reqs_free != blkif->ring_size)
-        return -EBUSY;
+    tapdisk_xenio_for_each_ctx(ctx) {
+        tapdisk_xenio_for_each_blkif(blkif, ctx) {
+            if (blkif->domid != domid || blkif->devid != devid)
+                continue;
+
+            if (blkif->n_reqs_free != blkif->ring_size)
+                return -EBUSY;
+        }
+    }
 
-    tapdisk_xenblkif_destroy(blkif);
+    while ((blkif = tapdisk_xenblkif_find(domid, devid, -1)))
+        tapdisk_xenblkif_destroy(blkif);
 
     return 0;
 }
 
+/*
+ * Sizes the VBD for as many requests as the rings of all queues hold,
+ * so the first queue to connect settles the limits for the rest.
+ */
+static int tapdisk_xenblkif_negotiate_limits(td_xenblkif_t * blkif,
+                                             int n_queues)
+{
+    td_vbd_t *vbd = blkif->vbd;
+    td_limits_t limits;
+
+    limits.requests = MAX(vbd->limits.requests,
+                          MIN(blkif->ring_size * n_queues,
+                              TD_MAX_REQUESTS));
+    limits.segments = MAX(vbd->limits.segments,
+                          XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST);
+
+    return tapdisk_vbd_set_limits(vbd, &limits);
+}
+
 int
 tapdisk_xenblkif_connect(domid_t domid, int devid,
+                         int queue, int n_queues,
                          const grant_ref_t * grefs, int order,
-                         evtchn_port_t port,
-                         int proto, const char *pool, td_vbd_t * vbd)
+                         evtchn_port_t port, int proto, int features,
+                         size_t copy_threshold, const char *pool,
+                         td_vbd_t * vbd)
 {
     td_xenblkif_t *blkif = NULL;
     td_xenio_ctx_t *ctx;
     int err;
 
-    blkif = tapdisk_xenblkif_find(domid, devid);
+    if (order < 0 || order > XENIO_BLKIF_MAX_RING_ORDER)
+        return -EINVAL;
+
+    /* older tap-ctl leaves n_queues at 0 */
+    if (!n_queues)
+        n_queues = 1;
+
+    if (n_queues < 0 || n_queues > XENIO_BLKIF_MAX_QUEUES ||
+        queue < 0 || queue >= n_queues)
+        return -EINVAL;
+
+    blkif = tapdisk_xenblkif_find(domid, devid, queue);
     if (blkif)
         return -EEXIST;
 
@@ -606,6 +922,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid,
 
     blkif->domid = domid;
     blkif->devid = devid;
+    blkif->queue = queue;
     blkif->rport = port;
     blkif->vbd = vbd;
     blkif->ctx = ctx;
@@ -613,17 +930,26 @@ tapdisk_xenblkif_connect(domid_t domid, int devid,
 
     blkif->xenio = xenio_blkif_connect(ctx->xenio,
                                        domid,
-                                       grefs, order, port, proto, blkif);
+                                       grefs, order, port, proto,
+                                       features, blkif);
     WARN_ON_WITH_ERRNO(!blkif->xenio);
     if (!blkif->xenio) {
         err = -errno;
         goto fail;
     }
 
+    /* grant copy is an optimization, mapping works without buffers */
+    err = xenio_blkif_set_copy_threshold(blkif->xenio, copy_threshold);
+    WARN_ON_WITH(err, "d", err);
+
     err = tapdisk_xenblkif_reqs_init(blkif);
     if (err)
         goto fail;
 
+    err = tapdisk_xenblkif_negotiate_limits(blkif, n_queues);
+    if (err)
+        goto fail;
+
     return 0;
 
   fail:
@@ -636,9 +962,14 @@ tapdisk_xenblkif_connect(domid_t domid, int devid,
 static void
 __tapdisk_xenblkif_stats(td_xenblkif_t * blkif, td_stats_t * st)
 {
+    struct xenio_blkif_pgrant_stats pgrants;
+    struct xenio_blkif_copy_stats copy;
+
     tapdisk_stats_field(st, "pool", blkif->ctx->pool);
     tapdisk_stats_field(st, "domid", "d", blkif->domid);
     tapdisk_stats_field(st, "devid", "d", blkif->devid);
+    tapdisk_stats_field(st, "queue", "d", blkif->queue);
+    tapdisk_stats_field(st, "ring-size", "d", blkif->ring_size);
 
     tapdisk_stats_field(st, "reqs", "[");
     tapdisk_stats_val(st, "llu", blkif->stats.reqs.in);
@@ -650,43 +981,69 @@ __tapdisk_xenblkif_stats(td_xenblkif_t * blkif, td_stats_t * st)
     tapdisk_stats_val(st, "llu", blkif->stats.kicks.out);
     tapdisk_stats_leave(st, ']');
 
+    /* against reqs out, the responses per event channel notification */
+    tapdisk_stats_field(st, "notifies", "llu", blkif->stats.notifies);
+
     tapdisk_stats_field(st, "errors", "{");
     tapdisk_stats_field(st, "msg", "llu", blkif->stats.errors.msg);
     tapdisk_stats_field(st, "map", "llu", blkif->stats.errors.map);
     tapdisk_stats_field(st, "vbq", "llu", blkif->stats.errors.vbd);
     tapdisk_stats_field(st, "img", "llu", blkif->stats.errors.img);
+    tapdisk_stats_leave(st, '}');
+
+    tapdisk_stats_field(st, "maps", "[");
+    tapdisk_stats_val(st, "llu", blkif->stats.maps.batch);
+    tapdisk_stats_val(st, "llu", blkif->stats.maps.one);
     tapdisk_stats_leave(st, ']');
+
+    xenio_blkif_copy_stats(blkif->xenio, &copy);
+    if (copy.threshold) {
+        tapdisk_stats_field(st, "grant-copy", "{");
+        tapdisk_stats_field(st, "threshold", "zu", copy.threshold);
+        tapdisk_stats_field(st, "hugepages", "d", copy.hugepages);
+        tapdisk_stats_field(st, "reqs", "llu", copy.reqs);
+        tapdisk_stats_field(st, "ops", "llu", copy.ops);
+        tapdisk_stats_field(st, "errors", "llu", copy.errors);
+        tapdisk_stats_leave(st, '}');
+    }
+
+    xenio_blkif_pgrant_stats(blkif->xenio, &pgrants);
+    if (pgrants.enabled) {
+        tapdisk_stats_field(st, "persistent-grants", "{");
+        tapdisk_stats_field(st, "size", "d", pgrants.size);
+        tapdisk_stats_field(st, "max", "d", pgrants.max);
+        tapdisk_stats_field(st, "hits", "llu", pgrants.hits);
+        tapdisk_stats_field(st, "misses", "llu", pgrants.misses);
+        tapdisk_stats_field(st, "evictions", "llu", pgrants.evictions);
+        tapdisk_stats_field(st, "overflows", "llu", pgrants.overflows);
+        tapdisk_stats_leave(st, '}');
+    }
 }
 
+/*
+ * NB. runs on the VBD's shard, so only its own contexts hold queues of
+ * the VBD, and none of them can be torn down while we walk them.
+ */
 void tapdisk_xenblkif_stats(td_vbd_t * vbd, td_stats_t * st)
 {
     td_xenblkif_t *blkif;
     td_xenio_ctx_t *ctx;
-    int matches;
-
-    tapdisk_xenio_for_each_ctx(ctx) {
-        tapdisk_xenio_for_each_blkif(blkif, ctx) {
-            if (blkif->vbd == vbd) {
-                matches = 1;
-                break;
-            }
-        }
-    }
-    if (!matches)
-        return;
-
-    tapdisk_stats_field(st, "xen-blkifs", "[");
+    int matches = 0;
 
     tapdisk_xenio_for_each_ctx(ctx) {
         tapdisk_xenio_for_each_blkif(blkif, ctx) {
             if (blkif->vbd != vbd)
                 continue;
 
+            if (!matches++)
+                tapdisk_stats_field(st, "xen-blkifs", "[");
+
             tapdisk_stats_enter(st, '{');
             __tapdisk_xenblkif_stats(blkif, st);
             tapdisk_stats_leave(st, '}');
         }
     }
 
-    tapdisk_stats_leave(st, ']');
+    if (matches)
+        tapdisk_stats_leave(st, ']');
 }
@@ -35,12 +35,20 @@
 #include <xen/event_channel.h>
 
 int tapdisk_xenblkif_connect(domid_t domid, int devid,
+                             int queue, int n_queues,
                              const grant_ref_t * grefs, int order,
-                             evtchn_port_t port,
-                             int proto, const char *pool, td_vbd_t * vbd);
+                             evtchn_port_t port, int proto, int features,
+                             size_t copy_threshold, const char *pool,
+                             td_vbd_t * vbd);
 
 int tapdisk_xenblkif_disconnect(domid_t domid, int devid);
 
+/*
+ * Pushes the responses staged on this shard's rings, one notification
+ * per ring.
+ */
+void tapdisk_xenblkif_push_responses(void);
+
 void tapdisk_xenblkif_stats(td_vbd_t * vbd, td_stats_t * stats);
 
 #endif                          /* _TAPDISK_XENBLKIF_H_ */
@@ -43,9 +43,31 @@
  * the resulting iocbs to tapdisk using td_prep_[read,write]() and 
  * td_queue_tiocb().
  *
+ * Disks flagged TD_DRIVER_VECTORED may be passed requests spanning
+ * several segments of a guest request, in td_request.iov, and submit
+ * them with td_prep_[readv,writev](). All others see one segment per
+ * request.
+ *
+ * td_queue_flush() asks a disk to make all writes completed so far
+ * durable. Flush requests carry no sectors. Disks backed by a file
+ * hand them to td_queue_sync(), which group-commits the flushes of one
+ * loop iteration into a single fdatasync. Disks without a td_queue_flush
+ * callback pass flushes on to their parent.
+ *
+ * td_queue_discard() tells a disk the guest no longer needs a range of
+ * sectors, so it may release their storage. Reading them back returns
+ * undefined data. Disks without a td_queue_discard callback ignore
+ * discards. Disks complete each discard with a single callback.
+ *
  * NOTE: tapdisk uses the number of sectors submitted per request as a 
  * ref count.  Plugins must use the callback function to communicate the
  * completion -- or error -- of every sector submitted to them.
+ * Flushes and discards count as a single sector.
+ *
+ * td_set_limits() resizes the request pools of an open disk to new
+ * td_limits_t. It is only called with no requests outstanding. Disks
+ * without a td_set_limits callback keep the pools they were opened
+ * with.
  *
  * td_get_parent_id returns:
  *     0 if parent id successfully retrieved
@@ -64,8 +86,14 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-stats.h"
 
+/*
+ * Default request limits of a VBD, see td_limits_t. Frontends may
+ * negotiate up to TD_MAX_REQUESTS and TD_MAX_SEGMENTS_PER_REQ.
+ */
 #define MAX_SEGMENTS_PER_REQ         11
 #define MAX_REQUESTS                 32U
+#define TD_MAX_SEGMENTS_PER_REQ      256
+#define TD_MAX_REQUESTS              1024
 #define SECTOR_SHIFT                 9
 #define DEFAULT_SECTOR_SIZE          512
 
@@ -78,6 +106,8 @@
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_FLUSH                  2
+#define TD_OP_DISCARD                3
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -92,10 +122,18 @@
 #define TD_OPEN_SECONDARY            0x00400
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
+#define TD_OPEN_ASYNC_MIRROR         0x02000
+
+/* tap_disk flags */
+#define TD_DRIVER_VECTORED           0x00001
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
 
+/* td_vbd_request flags */
+#define TD_VREQ_REQUEUED             0x00001    /* see tapdisk_vbd_requeue_readahead */
+#define TD_VREQ_INTERNAL             0x00002    /* tapdisk's own, e.g. read-ahead */
+
 #define td_flag_set(word, flag)      ((word) |= (flag))
 #define td_flag_clear(word, flag)    ((word) &= ~(flag))
 #define td_flag_test(word, flag)     ((word) & (flag))
@@ -109,6 +147,7 @@ typedef struct td_request td_request_t;
 typedef struct td_driver_handle td_driver_t;
 typedef struct td_image_handle td_image_t;
 typedef struct td_sector_count td_sector_count_t;
+typedef struct td_limits td_limits_t;
 typedef struct td_vbd_request td_vbd_request_t;
 typedef struct td_vbd_handle td_vbd_t;
 
@@ -137,24 +176,42 @@ struct td_iovec {
 
 TAILQ_HEAD(tqh_td_vbd_request, td_vbd_request);
 
+/*
+ * Optional, completes a batch of requests with the same token, in
+ * completion order. The callback takes the requests off the list.
+ */
+typedef void (*td_vreq_batch_callback_t) (struct tqh_td_vbd_request *,
+                                          void *);
+
 struct td_vbd_request {
     int op;
     td_sector_t sec;
     struct td_iovec *iov;
     int iovcnt;
 
+    /* length of a discard, which carries no iovecs */
+    td_sector_t discard_secs;
+
     td_vreq_callback_t cb;
+    td_vreq_batch_callback_t batch_cb;
     void *token;
     const char *name;
 
     int error;
     int prev_error;
 
+    td_flag_t flags;
+
     int submitting;
     int secs_pending;
     int num_retries;
     struct timeval ts;
     struct timeval last_try;
+    struct timeval done;
+
+    /* when it last failed, and is due for a retry, on scheduler_now() */
+    int64_t failed_at;
+    int64_t retry_at;
 
     td_vbd_t *vbd;
 
@@ -173,6 +230,14 @@ struct td_request {
     int op;
     void *buf;
 
+    /*
+     * Segments, if iovcnt > 1. Then buf is iov[0].base and secs the
+     * sum of all segments. Code splitting a request must flatten it
+     * first.
+     */
+    struct td_iovec *iov;
+    int iovcnt;
+
     td_sector_t sec;
     int secs;
 
@@ -199,10 +264,26 @@ struct tap_disk {
     int (*td_validate_parent) (td_driver_t *, td_driver_t *, td_flag_t);
     void (*td_queue_read) (td_driver_t *, td_request_t);
     void (*td_queue_write) (td_driver_t *, td_request_t);
+    void (*td_queue_flush) (td_driver_t *, td_request_t);
+    void (*td_queue_discard) (td_driver_t *, td_request_t);
+    int (*td_allocated) (td_driver_t *, td_sector_t, int);
     void (*td_debug) (td_driver_t *);
     void (*td_stats) (td_driver_t *, td_stats_t *);
+    int (*td_set_limits) (td_driver_t *, const td_limits_t *);
+};
+
+/*
+ * Outstanding requests and segments per request a VBD may issue.
+ * Drivers size their request pools from these when opened, or in
+ * td_set_limits.
+ */
+struct td_limits {
+    int requests;
+    int segments;
 };
 
+#define td_limits_data_requests(_l) ((_l)->requests * (_l)->segments)
+
 struct td_sector_count {
     td_sector_t rd;
     td_sector_t wr;
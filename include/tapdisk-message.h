@@ -33,6 +33,7 @@
 #define TAPDISK_MESSAGE_FLAG_REUSE_PRT   0x040
 #define TAPDISK_MESSAGE_FLAG_SECONDARY   0x080
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
+#define TAPDISK_MESSAGE_FLAG_ASYNC       0x200
 
 typedef struct tapdisk_message tapdisk_message_t;
 typedef uint32_t tapdisk_message_flag_t;
@@ -96,6 +97,10 @@ struct tapdisk_message_blkif {
     uint32_t proto;
     char pool[TAPDISK_MESSAGE_STRING_LENGTH];
     uint32_t port;
+    uint32_t features;
+    uint32_t copy_threshold;
+    uint32_t queue;
+    uint32_t n_queues;
 };
 
 struct tapdisk_message {
@@ -112,6 +117,7 @@ struct tapdisk_message {
         tapdisk_message_list_t list;
         tapdisk_message_stat_t info;
         tapdisk_message_blkif_t blkif;
+        uint32_t weight;
     } u;
 };
 
@@ -145,6 +151,8 @@ enum tapdisk_message_id {
     TAPDISK_MESSAGE_XENBLKIF_CONNECT_RSP,
     TAPDISK_MESSAGE_XENBLKIF_DISCONNECT,
     TAPDISK_MESSAGE_XENBLKIF_DISCONNECT_RSP,
+    TAPDISK_MESSAGE_SET_WEIGHT,
+    TAPDISK_MESSAGE_SET_WEIGHT_RSP,
     TAPDISK_MESSAGE_EXIT,
 };
 
@@ -237,6 +245,12 @@ static inline char *tapdisk_message_name(enum tapdisk_message_id id)
     case TAPDISK_MESSAGE_XENBLKIF_DISCONNECT_RSP:
         return "blkif disconnect response";
 
+    case TAPDISK_MESSAGE_SET_WEIGHT:
+        return "set weight";
+
+    case TAPDISK_MESSAGE_SET_WEIGHT_RSP:
+        return "set weight response";
+
     case TAPDISK_MESSAGE_EXIT:
         return "exit";
 
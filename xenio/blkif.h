@@ -47,7 +47,28 @@ struct blkif_x86_32_response {
     uint8_t operation;          /* copied from request */
     int16_t status;             /* BLKIF_RSP_???       */
 };
+struct blkif_x86_32_request_discard {
+    uint8_t operation;          /* BLKIF_OP_DISCARD                     */
+    uint8_t flag;               /* BLKIF_DISCARD_SECURE or zero         */
+    blkif_vdev_t handle;        /* same as for read/write requests      */
+    uint64_t id;                /* private guest value, echoed in resp  */
+    blkif_sector_t sector_number;   /* start sector idx on disk         */
+    uint64_t nr_sectors;        /* number of contiguous sectors         */
+};
+struct blkif_x86_32_request_indirect {
+    uint8_t operation;          /* BLKIF_OP_INDIRECT                    */
+    uint8_t indirect_op;        /* BLKIF_OP_{READ/WRITE}                */
+    uint16_t nr_segments;       /* number of segments                   */
+    uint64_t id;                /* private guest value, echoed in resp  */
+    blkif_sector_t sector_number;   /* start sector idx on disk (r/w only)  */
+    blkif_vdev_t handle;        /* same as for read/write requests      */
+    uint16_t _pad1;
+    grant_ref_t indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+    uint64_t _pad2;             /* make it 64 byte aligned              */
+};
 typedef struct blkif_x86_32_request blkif_x86_32_request_t;
+typedef struct blkif_x86_32_request_discard blkif_x86_32_request_discard_t;
+typedef struct blkif_x86_32_request_indirect blkif_x86_32_request_indirect_t;
 typedef struct blkif_x86_32_response blkif_x86_32_response_t;
 #pragma pack(pop)
 
@@ -65,7 +86,27 @@ struct blkif_x86_64_response {
     uint8_t operation;          /* copied from request */
     int16_t status;             /* BLKIF_RSP_???       */
 };
+struct blkif_x86_64_request_discard {
+    uint8_t operation;          /* BLKIF_OP_DISCARD                     */
+    uint8_t flag;               /* BLKIF_DISCARD_SECURE or zero         */
+    blkif_vdev_t handle;        /* same as for read/write requests      */
+    uint64_t __attribute__ ((__aligned__(8))) id;
+    blkif_sector_t sector_number;   /* start sector idx on disk         */
+    uint64_t nr_sectors;        /* number of contiguous sectors         */
+};
+struct blkif_x86_64_request_indirect {
+    uint8_t operation;          /* BLKIF_OP_INDIRECT                    */
+    uint8_t indirect_op;        /* BLKIF_OP_{READ/WRITE}                */
+    uint16_t nr_segments;       /* number of segments                   */
+    uint64_t __attribute__ ((__aligned__(8))) id;
+    blkif_sector_t sector_number;   /* start sector idx on disk (r/w only)  */
+    blkif_vdev_t handle;        /* same as for read/write requests      */
+    uint16_t _pad1;
+    grant_ref_t indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+};
 typedef struct blkif_x86_64_request blkif_x86_64_request_t;
+typedef struct blkif_x86_64_request_discard blkif_x86_64_request_discard_t;
+typedef struct blkif_x86_64_request_indirect blkif_x86_64_request_indirect_t;
 typedef struct blkif_x86_64_response blkif_x86_64_response_t;
 
 DEFINE_RING_TYPES(blkif_common, struct blkif_common_request,
@@ -83,10 +124,49 @@ union blkif_back_rings {
 };
 typedef union blkif_back_rings blkif_back_rings_t;
 
+static void inline blkif_get_x86_32_req_discard(blkif_request_t * dst,
+                                                blkif_x86_32_request_t * src)
+{
+    blkif_request_discard_t *d = (blkif_request_discard_t *) dst;
+    blkif_x86_32_request_discard_t *s =
+        (blkif_x86_32_request_discard_t *) src;
+    d->operation = BLKIF_OP_DISCARD;
+    d->flag = s->flag;
+    d->handle = s->handle;
+    d->id = s->id;
+    d->sector_number = s->sector_number;
+    d->nr_sectors = s->nr_sectors;
+}
+
+static void inline blkif_get_x86_32_req_indirect(blkif_request_t * dst,
+                                                 blkif_x86_32_request_t * src)
+{
+    blkif_request_indirect_t *d = (blkif_request_indirect_t *) dst;
+    blkif_x86_32_request_indirect_t *s =
+        (blkif_x86_32_request_indirect_t *) src;
+    int i;
+    d->operation = BLKIF_OP_INDIRECT;
+    d->indirect_op = s->indirect_op;
+    d->nr_segments = s->nr_segments;
+    d->id = s->id;
+    d->sector_number = s->sector_number;
+    d->handle = s->handle;
+    for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++)
+        d->indirect_grefs[i] = s->indirect_grefs[i];
+}
+
 static void inline blkif_get_x86_32_req(blkif_request_t * dst,
                                         blkif_x86_32_request_t * src)
 {
     int i, n = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    if (src->operation == BLKIF_OP_DISCARD) {
+        blkif_get_x86_32_req_discard(dst, src);
+        return;
+    }
+    if (src->operation == BLKIF_OP_INDIRECT) {
+        blkif_get_x86_32_req_indirect(dst, src);
+        return;
+    }
     dst->operation = src->operation;
     dst->nr_segments = src->nr_segments;
     dst->handle = src->handle;
@@ -99,10 +179,49 @@ static void inline blkif_get_x86_32_req(blkif_request_t * dst,
         dst->seg[i] = src->seg[i];
 }
 
+static void inline blkif_get_x86_64_req_discard(blkif_request_t * dst,
+                                                blkif_x86_64_request_t * src)
+{
+    blkif_request_discard_t *d = (blkif_request_discard_t *) dst;
+    blkif_x86_64_request_discard_t *s =
+        (blkif_x86_64_request_discard_t *) src;
+    d->operation = BLKIF_OP_DISCARD;
+    d->flag = s->flag;
+    d->handle = s->handle;
+    d->id = s->id;
+    d->sector_number = s->sector_number;
+    d->nr_sectors = s->nr_sectors;
+}
+
+static void inline blkif_get_x86_64_req_indirect(blkif_request_t * dst,
+                                                 blkif_x86_64_request_t * src)
+{
+    blkif_request_indirect_t *d = (blkif_request_indirect_t *) dst;
+    blkif_x86_64_request_indirect_t *s =
+        (blkif_x86_64_request_indirect_t *) src;
+    int i;
+    d->operation = BLKIF_OP_INDIRECT;
+    d->indirect_op = s->indirect_op;
+    d->nr_segments = s->nr_segments;
+    d->id = s->id;
+    d->sector_number = s->sector_number;
+    d->handle = s->handle;
+    for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++)
+        d->indirect_grefs[i] = s->indirect_grefs[i];
+}
+
 static void inline blkif_get_x86_64_req(blkif_request_t * dst,
                                         blkif_x86_64_request_t * src)
 {
     int i, n = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    if (src->operation == BLKIF_OP_DISCARD) {
+        blkif_get_x86_64_req_discard(dst, src);
+        return;
+    }
+    if (src->operation == BLKIF_OP_INDIRECT) {
+        blkif_get_x86_64_req_indirect(dst, src);
+        return;
+    }
     dst->operation = src->operation;
     dst->nr_segments = src->nr_segments;
     dst->handle = src->handle;
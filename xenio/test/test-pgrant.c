@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2012      Citrix Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Exercises the persistent grant cache against a software grant table:
+ * each grant reference is a page of its own, filled with its number,
+ * and the table tracks which ones are mapped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xenio-pgrant.h"
+
+#define N_GREFS     64
+#define PAGE_SIZE   4096
+
+struct fake_gnttab {
+    char *pages;
+    int mapped[N_GREFS];
+    int n_mapped;
+    int n_maps;
+    int fail;                   /* next map fails with this errno */
+};
+
+#define CHECK(_p)							\
+	do {								\
+		if (!(_p)) {						\
+			fprintf(stderr, "%s:%d: %s: failed: '%s'\n",	\
+				__FILE__, __LINE__, __func__, #_p);	\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static void *fake_map(void *arg, grant_ref_t gref)
+{
+    struct fake_gnttab *gt = arg;
+
+    if (gt->fail) {
+        errno = gt->fail;
+        gt->fail = 0;
+        return NULL;
+    }
+
+    if (gref >= N_GREFS || gt->mapped[gref]) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    gt->mapped[gref] = 1;
+    gt->n_mapped++;
+    gt->n_maps++;
+
+    return gt->pages + (size_t) gref * PAGE_SIZE;
+}
+
+static int fake_unmap(void *arg, void *vma)
+{
+    struct fake_gnttab *gt = arg;
+    grant_ref_t gref = ((char *) vma - gt->pages) / PAGE_SIZE;
+
+    CHECK(gref < N_GREFS && gt->mapped[gref]);
+
+    gt->mapped[gref] = 0;
+    gt->n_mapped--;
+
+    return 0;
+}
+
+static const struct xenio_pgrant_ops fake_ops = {
+    .map = fake_map,
+    .unmap = fake_unmap,
+};
+
+static void setup(struct fake_gnttab *gt, xenio_pgrant_cache_t * cache,
+                  int max)
+{
+    int i;
+
+    memset(gt, 0, sizeof(*gt));
+
+    gt->pages = malloc((size_t) N_GREFS * PAGE_SIZE);
+    CHECK(gt->pages);
+    for (i = 0; i < N_GREFS; i++)
+        memset(gt->pages + (size_t) i * PAGE_SIZE, i, PAGE_SIZE);
+
+    CHECK(!xenio_pgrant_cache_init(cache, max, &fake_ops, gt));
+}
+
+static void teardown(struct fake_gnttab *gt, xenio_pgrant_cache_t * cache)
+{
+    xenio_pgrant_cache_free(cache);
+    CHECK(!gt->n_mapped);
+
+    free(gt->pages);
+}
+
+static void test_hit_miss(void)
+{
+    struct fake_gnttab gt;
+    xenio_pgrant_cache_t cache;
+    xenio_pgrant_t *pg, *again;
+
+    setup(&gt, &cache, 4);
+
+    pg = xenio_pgrant_get(&cache, 7);
+    CHECK(pg && pg->gref == 7);
+    CHECK(((char *) pg->vma)[0] == 7);
+    CHECK(cache.misses == 1 && cache.hits == 0);
+    xenio_pgrant_put(&cache, pg);
+
+    again = xenio_pgrant_get(&cache, 7);
+    CHECK(again == pg);
+    CHECK(cache.misses == 1 && cache.hits == 1);
+    CHECK(gt.n_maps == 1);
+    xenio_pgrant_put(&cache, again);
+
+    CHECK(cache.size == 1 && gt.n_mapped == 1);
+
+    teardown(&gt, &cache);
+}
+
+static void test_lru_eviction(void)
+{
+    struct fake_gnttab gt;
+    xenio_pgrant_cache_t cache;
+    xenio_pgrant_t *pg;
+    grant_ref_t gref;
+
+    setup(&gt, &cache, 3);
+
+    for (gref = 0; gref < 3; gref++) {
+        pg = xenio_pgrant_get(&cache, gref);
+        CHECK(pg);
+        xenio_pgrant_put(&cache, pg);
+    }
+
+    /* touch 0, leaving 1 least recently used */
+    pg = xenio_pgrant_get(&cache, 0);
+    CHECK(pg);
+    xenio_pgrant_put(&cache, pg);
+
+    pg = xenio_pgrant_get(&cache, 3);
+    CHECK(pg && ((char *) pg->vma)[0] == 3);
+    xenio_pgrant_put(&cache, pg);
+
+    CHECK(cache.evictions == 1);
+    CHECK(cache.size == 3 && gt.n_mapped == 3);
+    CHECK(!gt.mapped[1]);
+    CHECK(gt.mapped[0] && gt.mapped[2] && gt.mapped[3]);
+
+    /* 1 got evicted, so it misses again */
+    pg = xenio_pgrant_get(&cache, 1);
+    CHECK(pg && cache.misses == 5);
+    xenio_pgrant_put(&cache, pg);
+    CHECK(!gt.mapped[2]);
+
+    teardown(&gt, &cache);
+}
+
+static void test_overflow(void)
+{
+    struct fake_gnttab gt;
+    xenio_pgrant_cache_t cache;
+    xenio_pgrant_t *held[2], *pg;
+
+    setup(&gt, &cache, 2);
+
+    held[0] = xenio_pgrant_get(&cache, 0);
+    held[1] = xenio_pgrant_get(&cache, 1);
+    CHECK(held[0] && held[1]);
+
+    /* every slot held: callers fall back to one-off mapping */
+    errno = 0;
+    pg = xenio_pgrant_get(&cache, 2);
+    CHECK(!pg && errno == EBUSY);
+    CHECK(cache.overflows == 1 && cache.evictions == 0);
+    CHECK(!gt.mapped[2] && gt.n_mapped == 2);
+
+    /* a held grant still hits */
+    pg = xenio_pgrant_get(&cache, 1);
+    CHECK(pg == held[1]);
+    xenio_pgrant_put(&cache, pg);
+
+    xenio_pgrant_put(&cache, held[0]);
+    pg = xenio_pgrant_get(&cache, 2);
+    CHECK(pg && cache.evictions == 1 && !gt.mapped[0]);
+    xenio_pgrant_put(&cache, pg);
+
+    xenio_pgrant_put(&cache, held[1]);
+
+    teardown(&gt, &cache);
+}
+
+static void test_refcount(void)
+{
+    struct fake_gnttab gt;
+    xenio_pgrant_cache_t cache;
+    xenio_pgrant_t *a, *b, *pg;
+
+    setup(&gt, &cache, 1);
+
+    a = xenio_pgrant_get(&cache, 5);
+    b = xenio_pgrant_get(&cache, 5);
+    CHECK(a && a == b && a->refcnt == 2);
+
+    /* still held once, so not evictable */
+    xenio_pgrant_put(&cache, a);
+    CHECK(a->refcnt == 1);
+    pg = xenio_pgrant_get(&cache, 6);
+    CHECK(!pg && errno == EBUSY);
+    CHECK(gt.mapped[5]);
+
+    /* last put makes it evictable, but keeps it mapped */
+    xenio_pgrant_put(&cache, b);
+    CHECK(!b->refcnt && gt.mapped[5]);
+
+    pg = xenio_pgrant_get(&cache, 6);
+    CHECK(pg && !gt.mapped[5] && gt.mapped[6]);
+    xenio_pgrant_put(&cache, pg);
+
+    teardown(&gt, &cache);
+}
+
+static void test_map_failure(void)
+{
+    struct fake_gnttab gt;
+    xenio_pgrant_cache_t cache;
+    xenio_pgrant_t *pg;
+
+    setup(&gt, &cache, 1);
+
+    gt.fail = ENOMEM;
+    pg = xenio_pgrant_get(&cache, 9);
+    CHECK(!pg && errno == ENOMEM);
+    CHECK(!cache.size && !gt.n_mapped);
+
+    /* the slot went back to the free list */
+    pg = xenio_pgrant_get(&cache, 9);
+    CHECK(pg && cache.size == 1 && cache.evictions == 0);
+    xenio_pgrant_put(&cache, pg);
+
+    xenio_pgrant_cache_flush(&cache);
+    CHECK(!cache.size && !gt.n_mapped);
+
+    pg = xenio_pgrant_get(&cache, 9);
+    CHECK(pg && gt.n_maps == 2);
+    xenio_pgrant_put(&cache, pg);
+
+    teardown(&gt, &cache);
+}
+
+int main(int argc, char **argv)
+{
+    test_hit_miss();
+    test_lru_eviction();
+    test_overflow();
+    test_refcount();
+    test_map_failure();
+
+    printf("%s: all tests passed\n", argv[0]);
+
+    return 0;
+}
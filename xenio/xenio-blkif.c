@@ -16,12 +16,14 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
 #include <xenctrl.h>
 
 #include "blktap.h"
 
 #include "xenio.h"
 #include "xenio-private.h"
+#include "xenio-pgrant.h"
 #include "blkif.h"
 
 void (*xenio_vlog) (int prio, const char *fmt, va_list ap) = vsyslog;
@@ -55,11 +57,32 @@ struct xenio_blkif {
     int proto;
 
     blkif_back_rings_t rings;
-    grant_ref_t ring_ref[8];
+    grant_ref_t ring_ref[1 << XENIO_BLKIF_MAX_RING_ORDER];
     int ring_n_pages;
 
     unsigned int sector_size;
 
+    int features;
+    xenio_pgrant_cache_t pgrants;
+
+    struct xenio_blkif_batch *batches;
+    int *batches_free;
+    int n_batches_free;
+    grant_ref_t *batch_grefs;
+
+    /* grant copy buffers, see xenio_blkif_set_copy_threshold */
+    size_t copy_threshold;
+    int copy_buf_pages;
+    void *copy_vma;
+    size_t copy_size;
+    int copy_hugepages;
+    int *copy_free;
+    int n_copy_free;
+    xengnttab_grant_copy_segment_t *copy_segs;
+    unsigned long long copy_reqs;
+    unsigned long long copy_ops;
+    unsigned long long copy_errors;
+
     /**
 	 * TODO rename to 'entry'
 	 */
@@ -67,6 +90,35 @@ struct xenio_blkif {
     void *data;
 };
 
+/*
+ * Grant mappings shared by a batch of requests, indexed by the
+ * direction of the data: a read needs read-write pages, a frontend
+ * may have granted the pages of a write read-only.
+ */
+struct xenio_blkif_batch {
+    struct {
+        void *vma;
+        int n_pages;
+    } map[2];
+
+    /* requests mapped plus one for the grant mapping */
+    int refcnt;
+};
+
+#define xenio_blkif_req_rw(_req) ((_req)->op == BLKIF_OP_READ)
+
+#define XENIO_BLKIF_HUGEPAGE_SIZE (2 << 20)
+
+#define XENIO_BLKIF_SEGS_PER_INDIRECT_FRAME \
+	((int)(XC_PAGE_SIZE / sizeof(struct blkif_request_segment)))
+
+/*
+ * Persistent grants kept mapped per ring, the budget of Linux blkback
+ * (max_persistent_grants). A full ring of indirect requests would pin
+ * tens of thousands; grants beyond the budget get mapped one-off.
+ */
+#define XENIO_BLKIF_MAX_PGRANTS 1056
+
 #define xenio_for_each_blkif(_ctx, _blkif)	\
 	TAILQ_FOREACH(_blkif, &ctx->ifs, ctx_entry)
 
@@ -83,12 +135,112 @@ struct xenio_blkif {
 			_blkif = NULL;							\
 	} while (0);
 
+static int xenio_blkif_parse_seg(xenio_blkif_req_t * req, int i,
+                                 const struct blkif_request_segment *src)
+{
+    struct xenio_blkif_seg *seg = &req->segs[i];
+    const int spp = XC_PAGE_SIZE >> 9;
+
+    req->gref[i] = src->gref;
+    seg->first = src->first_sect;
+    seg->last = src->last_sect;
+
+    if (seg->last < seg->first)
+        return -EINVAL;
+
+    if (seg->last >= spp)
+        return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Copies the segments out of the descriptor pages of an indirect
+ * request. Those are mapped read-only just long enough, or come from
+ * the persistent grant cache.
+ */
+static int xenio_blkif_parse_indirect(xenio_blkif_t * blkif,
+                                      blkif_request_indirect_t * msg,
+                                      xenio_blkif_req_t * req)
+{
+    const int persistent = blkif->features & XENIO_BLKIF_FEATURE_PERSISTENT;
+    const struct blkif_request_segment *segs;
+    xenio_pgrant_t *pg = NULL;
+    int i, n, page, n_pages, err;
+    void *vma;
+
+    req->op = msg->indirect_op;
+    req->n_segs = msg->nr_segments;
+    req->id = msg->id;
+    req->offset = msg->sector_number << 9;
+
+    if (req->op != BLKIF_OP_READ && req->op != BLKIF_OP_WRITE)
+        return -EINVAL;
+
+    if (req->n_segs <= 0 ||
+        req->n_segs > XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST)
+        return -EINVAL;
+
+    n_pages = (req->n_segs + XENIO_BLKIF_SEGS_PER_INDIRECT_FRAME - 1) /
+        XENIO_BLKIF_SEGS_PER_INDIRECT_FRAME;
+
+    for (i = 0, page = 0; page < n_pages; page++) {
+        if (persistent)
+            pg = xenio_pgrant_get(&blkif->pgrants,
+                                  msg->indirect_grefs[page]);
+        if (pg)
+            vma = pg->vma;
+        else {
+            vma = xc_gnttab_map_grant_ref(blkif->ctx->xcg_handle,
+                                          blkif->rd,
+                                          msg->indirect_grefs[page],
+                                          PROT_READ);
+            if (!vma)
+                return -errno;
+        }
+
+        segs = vma;
+        n = MIN(req->n_segs - i, XENIO_BLKIF_SEGS_PER_INDIRECT_FRAME);
+
+        for (err = 0; !err && n; n--, i++)
+            err = xenio_blkif_parse_seg(req, i, segs++);
+
+        if (pg) {
+            xenio_pgrant_put(&blkif->pgrants, pg);
+            pg = NULL;
+        } else
+            xc_gnttab_munmap(blkif->ctx->xcg_handle, vma, 1);
+
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
 int xenio_blkif_parse_request(xenio_blkif_t * blkif, blkif_request_t * msg,
                               xenio_blkif_req_t * req)
 {
     int i, err = -EINVAL;
 
-    memset(req, 0, sizeof(req));
+    memset(req, 0, sizeof(*req));
+
+    if (msg->operation == BLKIF_OP_INDIRECT)
+        return xenio_blkif_parse_indirect(blkif,
+                                          (blkif_request_indirect_t *) msg,
+                                          req);
+
+    if (msg->operation == BLKIF_OP_DISCARD) {
+        blkif_request_discard_t *discard = (blkif_request_discard_t *) msg;
+
+        req->op = discard->operation;
+        req->id = discard->id;
+        req->offset = discard->sector_number << 9;
+        req->nr_sectors = discard->nr_sectors;
+        req->flag = discard->flag;
+
+        return 0;
+    }
 
     req->op = msg->operation;
     req->n_segs = msg->nr_segments;
@@ -99,17 +251,8 @@ int xenio_blkif_parse_request(xenio_blkif_t * blkif, blkif_request_t * msg,
         goto fail;
 
     for (i = 0; i < req->n_segs; i++) {
-        struct xenio_blkif_seg *seg = &req->segs[i];
-        const int spp = XC_PAGE_SIZE >> 9;
-
-        req->gref[i] = msg->seg[i].gref;
-        seg->first = msg->seg[i].first_sect;
-        seg->last = msg->seg[i].last_sect;
-
-        if (seg->last < seg->first)
-            goto fail;
-
-        if (spp < seg->last)
+        err = xenio_blkif_parse_seg(req, i, &msg->seg[i]);
+        if (err)
             goto fail;
     }
 
@@ -129,11 +272,15 @@ static inline void xenio_blkif_vector_request(xenio_blkif_req_t * req)
 
     iov = req->iov - 1;
     last = NULL;
-    page = req->vma;
 
     for (i = 0; i < req->n_segs; i++) {
         seg = &req->segs[i];
 
+        if (req->n_pgrants)
+            page = req->pgrant[i]->vma;
+        else
+            page = req->vma + i * XC_PAGE_SIZE;
+
         next = page + (seg->first << 9);
         size = (seg->last - seg->first + 1) << 9;
 
@@ -145,17 +292,53 @@ static inline void xenio_blkif_vector_request(xenio_blkif_req_t * req)
             iov->iov_len += size;
 
         last = iov->iov_base + iov->iov_len;
-        page += XC_PAGE_SIZE;
     }
 
     req->n_iov = iov - req->iov + 1;
 }
 
+static void xenio_blkif_put_pgrants(xenio_blkif_t * blkif,
+                                    xenio_blkif_req_t * req)
+{
+    while (req->n_pgrants)
+        xenio_pgrant_put(&blkif->pgrants, req->pgrant[--req->n_pgrants]);
+}
+
+/*
+ * Maps all segments through the persistent grant cache.
+ */
+static int xenio_blkif_mmap_persistent(xenio_blkif_t * blkif,
+                                       xenio_blkif_req_t * req)
+{
+    xenio_pgrant_t *pg;
+    int i;
+
+    for (i = 0; i < req->n_segs; i++) {
+        pg = xenio_pgrant_get(&blkif->pgrants, req->gref[i]);
+        if (!pg) {
+            int err = -errno;
+            xenio_blkif_put_pgrants(blkif, req);
+            return err;
+        }
+
+        req->pgrant[req->n_pgrants++] = pg;
+    }
+
+    xenio_blkif_vector_request(req);
+
+    return 0;
+}
+
 int xenio_blkif_munmap_one(xenio_blkif_t * blkif, xenio_blkif_req_t * req)
 {
     xenio_ctx_t *ctx = blkif->ctx;
     int err;
 
+    if (req->n_pgrants) {
+        xenio_blkif_put_pgrants(blkif, req);
+        return 0;
+    }
+
     err = xc_gnttab_munmap(ctx->xcg_handle, req->vma, req->n_segs);
     if (err)
         return -errno;
@@ -169,6 +352,16 @@ int xenio_blkif_mmap_one(xenio_blkif_t * blkif, xenio_blkif_req_t * req)
     xenio_ctx_t *ctx = blkif->ctx;
     int prot, err;
 
+    /*
+     * A full cache, or a grant device out of handles, still leaves
+     * the one-off mapping below.
+     */
+    if (blkif->features & XENIO_BLKIF_FEATURE_PERSISTENT) {
+        err = xenio_blkif_mmap_persistent(blkif, req);
+        if (!err)
+            return 0;
+    }
+
     prot = PROT_READ;
     prot |= req->op == BLKIF_OP_READ ? PROT_WRITE : 0;
 
@@ -190,6 +383,300 @@ int xenio_blkif_mmap_one(xenio_blkif_t * blkif, xenio_blkif_req_t * req)
     return err;
 }
 
+static void xenio_blkif_batch_put(xenio_blkif_t * blkif, int id)
+{
+    struct xenio_blkif_batch *batch = &blkif->batches[id - 1];
+    int rw;
+
+    if (--batch->refcnt)
+        return;
+
+    for (rw = 0; rw < ARRAY_SIZE(batch->map); rw++) {
+        if (batch->map[rw].vma) {
+            xc_gnttab_munmap(blkif->ctx->xcg_handle, batch->map[rw].vma,
+                             batch->map[rw].n_pages);
+            batch->map[rw].vma = NULL;
+        }
+    }
+
+    blkif->batches_free[blkif->n_batches_free++] = id;
+}
+
+static size_t xenio_blkif_req_bytes(const xenio_blkif_req_t * req)
+{
+    size_t bytes = 0;
+    int i;
+
+    for (i = 0; i < req->n_segs; i++)
+        bytes += (req->segs[i].last - req->segs[i].first + 1) << 9;
+
+    return bytes;
+}
+
+/*
+ * Gives @req a copy buffer, laid out like a mapping of its grants.
+ */
+static int xenio_blkif_copy_get(xenio_blkif_t * blkif,
+                                xenio_blkif_req_t * req)
+{
+    int buf;
+
+    if (!blkif->copy_threshold || !blkif->n_copy_free)
+        return 0;
+
+    if (req->op != BLKIF_OP_READ && req->op != BLKIF_OP_WRITE)
+        return 0;
+
+    if (req->n_segs > blkif->copy_buf_pages ||
+        xenio_blkif_req_bytes(req) > blkif->copy_threshold)
+        return 0;
+
+    buf = blkif->copy_free[--blkif->n_copy_free];
+    req->copy = buf + 1;
+    req->vma = blkif->copy_vma +
+        (size_t) buf * blkif->copy_buf_pages * XC_PAGE_SIZE;
+
+    return 1;
+}
+
+static void xenio_blkif_copy_put(xenio_blkif_t * blkif,
+                                 xenio_blkif_req_t * req)
+{
+    blkif->copy_free[blkif->n_copy_free++] = req->copy - 1;
+    req->copy = 0;
+    req->vma = NULL;
+}
+
+/*
+ * Copies the data of all successful copy requests in @reqs doing @op
+ * with a single grant copy: from the guest for writes, to the guest
+ * for reads. Requests with a failed segment get BLKIF_RSP_ERROR.
+ */
+static void xenio_blkif_copy_data(xenio_blkif_t * blkif,
+                                  xenio_blkif_req_t ** reqs, int count,
+                                  int op)
+{
+    xengnttab_grant_copy_segment_t *seg;
+    xenio_blkif_req_t *req;
+    int i, j, n, err, failed;
+
+    for (n = 0, i = 0; i < count; i++) {
+        req = reqs[i];
+
+        if (!req->copy || req->op != op || req->status != BLKIF_RSP_OKAY)
+            continue;
+
+        for (j = 0; j < req->n_segs; j++) {
+            const struct xenio_blkif_seg *s = &req->segs[j];
+            unsigned int offset = s->first << 9;
+            void *buf = req->vma + j * XC_PAGE_SIZE + offset;
+
+            seg = &blkif->copy_segs[n++];
+            memset(seg, 0, sizeof(*seg));
+
+            if (op == BLKIF_OP_WRITE) {
+                seg->source.foreign.ref = req->gref[j];
+                seg->source.foreign.offset = offset;
+                seg->source.foreign.domid = blkif->rd;
+                seg->dest.virt = buf;
+                seg->flags = GNTCOPY_source_gref;
+            } else {
+                seg->source.virt = buf;
+                seg->dest.foreign.ref = req->gref[j];
+                seg->dest.foreign.offset = offset;
+                seg->dest.foreign.domid = blkif->rd;
+                seg->flags = GNTCOPY_dest_gref;
+            }
+            seg->len = (s->last - s->first + 1) << 9;
+        }
+    }
+
+    if (!n)
+        return;
+
+    err = xengnttab_grant_copy(blkif->ctx->xgt_handle, n, blkif->copy_segs);
+    blkif->copy_ops++;
+
+    for (n = 0, i = 0; i < count; i++) {
+        req = reqs[i];
+
+        if (!req->copy || req->op != op || req->status != BLKIF_RSP_OKAY)
+            continue;
+
+        for (failed = 0, j = 0; j < req->n_segs; j++, n++)
+            failed |= err || blkif->copy_segs[n].status != GNTST_okay;
+
+        if (failed) {
+            req->status = BLKIF_RSP_ERROR;
+            blkif->copy_errors++;
+        }
+    }
+}
+
+int64_t xenio_blkif_map_grants(xenio_blkif_t * blkif,
+                               xenio_blkif_req_t ** reqs, int count)
+{
+    xenio_ctx_t *ctx = blkif->ctx;
+    struct xenio_blkif_batch *batch;
+    xenio_blkif_req_t *req;
+    int i, rw, id, n, err;
+
+    if (!blkif->n_batches_free)
+        return -EBUSY;
+
+    if (blkif->features & XENIO_BLKIF_FEATURE_PERSISTENT) {
+        for (i = 0; i < count; i++)
+            if (reqs[i]->n_segs)
+                xenio_blkif_mmap_persistent(blkif, reqs[i]);
+    }
+
+    if (blkif->copy_threshold) {
+        for (i = 0; i < count; i++) {
+            req = reqs[i];
+            if (req->n_segs && !xenio_blkif_req_mapped(req))
+                xenio_blkif_copy_get(blkif, req);
+        }
+
+        xenio_blkif_copy_data(blkif, reqs, count, BLKIF_OP_WRITE);
+
+        /* failed copies get mapped instead, failing the bad segment */
+        for (i = 0; i < count; i++) {
+            req = reqs[i];
+            if (!req->copy)
+                continue;
+
+            if (req->status != BLKIF_RSP_OKAY) {
+                req->status = BLKIF_RSP_OKAY;
+                xenio_blkif_copy_put(blkif, req);
+                continue;
+            }
+
+            xenio_blkif_vector_request(req);
+            blkif->copy_reqs++;
+        }
+    }
+
+    id = blkif->batches_free[--blkif->n_batches_free];
+    batch = &blkif->batches[id - 1];
+    memset(batch, 0, sizeof(*batch));
+    batch->refcnt = 1;
+
+    for (rw = 0; rw < ARRAY_SIZE(batch->map); rw++) {
+        n = 0;
+
+        for (i = 0; i < count; i++) {
+            req = reqs[i];
+
+            if (!req->n_segs || xenio_blkif_req_mapped(req))
+                continue;
+            if (xenio_blkif_req_rw(req) != rw)
+                continue;
+
+            memcpy(&blkif->batch_grefs[n], req->gref,
+                   req->n_segs * sizeof(grant_ref_t));
+
+            req->batch = id;
+            req->pgoff = n;
+            n += req->n_segs;
+            batch->refcnt++;
+        }
+
+        if (!n)
+            continue;
+
+        batch->map[rw].vma =
+            xc_gnttab_map_domain_grant_refs(ctx->xcg_handle, n, blkif->rd,
+                                            blkif->batch_grefs,
+                                            rw ? PROT_READ | PROT_WRITE :
+                                            PROT_READ);
+        if (!batch->map[rw].vma) {
+            err = -errno;
+            goto fail;
+        }
+        batch->map[rw].n_pages = n;
+    }
+
+    return id;
+
+  fail:
+    for (i = 0; i < count; i++) {
+        if (reqs[i]->batch == id) {
+            reqs[i]->batch = 0;
+            batch->refcnt--;
+        }
+    }
+    xenio_blkif_batch_put(blkif, id);
+
+    return err;
+}
+
+int xenio_blkif_unmap_grants(xenio_blkif_t * blkif, int64_t id)
+{
+    if (id <= 0 || id > xenio_blkif_ring_size(blkif))
+        return -EINVAL;
+
+    xenio_blkif_batch_put(blkif, id);
+
+    return 0;
+}
+
+int xenio_blkif_mmap_requests(xenio_blkif_t * blkif,
+                              xenio_blkif_req_t ** reqs, int count)
+{
+    struct xenio_blkif_batch *batch;
+    xenio_blkif_req_t *req;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        req = reqs[i];
+
+        if (!req->batch)
+            continue;
+
+        batch = &blkif->batches[req->batch - 1];
+        req->vma = batch->map[xenio_blkif_req_rw(req)].vma +
+            (size_t) req->pgoff * XC_PAGE_SIZE;
+
+        xenio_blkif_vector_request(req);
+    }
+
+    return 0;
+}
+
+int xenio_blkif_munmap_requests(xenio_blkif_t * blkif,
+                                xenio_blkif_req_t ** reqs, int count)
+{
+    xenio_blkif_req_t *req;
+    int i, err, rv = 0;
+
+    if (blkif->copy_threshold)
+        xenio_blkif_copy_data(blkif, reqs, count, BLKIF_OP_READ);
+
+    for (i = 0; i < count; i++) {
+        req = reqs[i];
+
+        if (req->copy)
+            xenio_blkif_copy_put(blkif, req);
+        else if (req->batch) {
+            xenio_blkif_batch_put(blkif, req->batch);
+            req->batch = 0;
+            req->vma = NULL;
+        } else if (xenio_blkif_req_mapped(req)) {
+            err = xenio_blkif_munmap_one(blkif, req);
+            if (err)
+                rv = err;
+        }
+    }
+
+    return rv;
+}
+
+int xenio_blkif_munmap_request(xenio_blkif_t * blkif,
+                               xenio_blkif_req_t * req)
+{
+    return xenio_blkif_munmap_requests(blkif, &req, 1);
+}
+
 static inline int xenio_blkif_notify(xenio_blkif_t * blkif)
 {
     xenio_ctx_t *ctx = blkif->ctx;
@@ -309,6 +796,13 @@ int xenio_blkif_get_requests(xenio_blkif_t * blkif,
     return n;
 }
 
+int xenio_blkif_has_requests(xenio_blkif_t * blkif)
+{
+    blkif_common_back_ring_t *ring = &blkif->rings.common;
+
+    return RING_HAS_UNCONSUMED_REQUESTS(ring);
+}
+
 static inline blkif_response_t *xenio_blkif_get_response(xenio_blkif_t *
                                                          blkif,
                                                          RING_IDX rp)
@@ -334,12 +828,12 @@ static inline blkif_response_t *xenio_blkif_get_response(xenio_blkif_t *
     return p;
 }
 
-void xenio_blkif_put_responses(xenio_blkif_t * blkif,
-                               xenio_blkif_req_t ** reqs, int count,
-                               int final)
+int xenio_blkif_put_responses(xenio_blkif_t * blkif,
+                              xenio_blkif_req_t ** reqs, int count,
+                              int final)
 {
     blkif_common_back_ring_t *ring = &blkif->rings.common;
-    int n, notify, err = 0;
+    int n, notify = 0, err = 0;
     RING_IDX rp;
 
     for (rp = ring->rsp_prod_pvt, n = 0; n < count; n++, rp++) {
@@ -365,6 +859,8 @@ void xenio_blkif_put_responses(xenio_blkif_t * blkif,
             }
         }
     }
+
+    return notify;
 }
 
 
@@ -388,11 +884,11 @@ static inline int xenio_blkif_ring_map(xenio_blkif_t * blkif,
     int i, err;
     size_t sz;
 
-    blkif->ring_n_pages = 1 << order;
-
-    if (blkif->ring_n_pages > ARRAY_SIZE(blkif->ring_ref))
+    if (order < 0 || order > XENIO_BLKIF_MAX_RING_ORDER)
         return -EINVAL;
 
+    blkif->ring_n_pages = 1 << order;
+
     for (i = 0; i < blkif->ring_n_pages; i++)
         blkif->ring_ref[i] = grefs[i];
 
@@ -467,11 +963,155 @@ static inline int xenio_blkif_evt_bind(xenio_blkif_t * blkif, int port)
     return err;
 }
 
+static void xenio_blkif_copy_free(xenio_blkif_t * blkif)
+{
+    if (blkif->copy_vma) {
+        munmap(blkif->copy_vma, blkif->copy_size);
+        blkif->copy_vma = NULL;
+    }
+
+    free(blkif->copy_free);
+    blkif->copy_free = NULL;
+
+    free(blkif->copy_segs);
+    blkif->copy_segs = NULL;
+
+    blkif->copy_threshold = 0;
+}
+
+int xenio_blkif_set_copy_threshold(xenio_blkif_t * blkif, size_t threshold)
+{
+    int i, n = xenio_blkif_ring_size(blkif), err;
+    size_t size;
+    void *vma;
+
+    if (blkif->copy_vma && blkif->n_copy_free != n)
+        return -EBUSY;
+
+    xenio_blkif_copy_free(blkif);
+
+    threshold = MIN(threshold,
+                    BLKIF_MAX_SEGMENTS_PER_REQUEST * XC_PAGE_SIZE);
+    if (!threshold)
+        return 0;
+
+    /* without grant copy, requests keep getting mapped */
+    err = xenio_ctx_probe_grant_copy(blkif->ctx);
+    if (err)
+        return err;
+
+    blkif->copy_buf_pages = (threshold + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    size = (size_t) n * blkif->copy_buf_pages * XC_PAGE_SIZE;
+
+    blkif->copy_hugepages = 1;
+    blkif->copy_size = (size + XENIO_BLKIF_HUGEPAGE_SIZE - 1) &
+        ~((size_t) XENIO_BLKIF_HUGEPAGE_SIZE - 1);
+    vma = mmap(NULL, blkif->copy_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+               -1, 0);
+    if (vma == MAP_FAILED) {
+        blkif->copy_hugepages = 0;
+        blkif->copy_size = size;
+        vma = mmap(NULL, blkif->copy_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (vma == MAP_FAILED)
+            return -errno;
+    }
+    blkif->copy_vma = vma;
+
+    blkif->copy_free = calloc(n, sizeof(int));
+    blkif->copy_segs = calloc(n * blkif->copy_buf_pages,
+                              sizeof(xengnttab_grant_copy_segment_t));
+    if (!blkif->copy_free || !blkif->copy_segs) {
+        xenio_blkif_copy_free(blkif);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++)
+        blkif->copy_free[i] = n - 1 - i;
+    blkif->n_copy_free = n;
+
+    blkif->copy_threshold = threshold;
+
+    return 0;
+}
+
+void xenio_blkif_copy_stats(xenio_blkif_t * blkif,
+                            struct xenio_blkif_copy_stats *st)
+{
+    st->threshold = blkif->copy_threshold;
+    st->hugepages = blkif->copy_hugepages;
+    st->reqs = blkif->copy_reqs;
+    st->ops = blkif->copy_ops;
+    st->errors = blkif->copy_errors;
+}
+
+static void xenio_blkif_batches_free(xenio_blkif_t * blkif)
+{
+    free(blkif->batches);
+    blkif->batches = NULL;
+
+    free(blkif->batches_free);
+    blkif->batches_free = NULL;
+
+    free(blkif->batch_grefs);
+    blkif->batch_grefs = NULL;
+}
+
+/*
+ * Every batch maps at least one request, so a ring's worth of batches
+ * never runs out.
+ */
+static int xenio_blkif_batches_init(xenio_blkif_t * blkif)
+{
+    int i, n = xenio_blkif_ring_size(blkif);
+
+    blkif->batches = calloc(n, sizeof(struct xenio_blkif_batch));
+    blkif->batches_free = calloc(n, sizeof(int));
+    blkif->batch_grefs = calloc(n * XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST,
+                                sizeof(grant_ref_t));
+    if (!blkif->batches || !blkif->batches_free || !blkif->batch_grefs) {
+        xenio_blkif_batches_free(blkif);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++)
+        blkif->batches_free[i] = n - i;
+    blkif->n_batches_free = n;
+
+    return 0;
+}
+
+static void *xenio_blkif_pgrant_map(void *arg, grant_ref_t gref)
+{
+    xenio_blkif_t *blkif = arg;
+
+    /* persistent grants are always granted read-write */
+    return xc_gnttab_map_grant_ref(blkif->ctx->xcg_handle, blkif->rd, gref,
+                                   PROT_READ | PROT_WRITE);
+}
+
+static int xenio_blkif_pgrant_unmap(void *arg, void *vma)
+{
+    xenio_blkif_t *blkif = arg;
+
+    return xc_gnttab_munmap(blkif->ctx->xcg_handle, vma, 1);
+}
+
+static const struct xenio_pgrant_ops xenio_blkif_pgrant_ops = {
+    .map = xenio_blkif_pgrant_map,
+    .unmap = xenio_blkif_pgrant_unmap,
+};
+
 void xenio_blkif_disconnect(xenio_blkif_t * blkif)
 {
     if (blkif->ctx)
         TAILQ_REMOVE(&blkif->ctx->ifs, blkif, ctx_entry);
 
+    xenio_pgrant_cache_free(&blkif->pgrants);
+    xenio_blkif_batches_free(blkif);
+    xenio_blkif_copy_free(blkif);
+
     xenio_blkif_evt_unbind(blkif);
 
     xenio_blkif_ring_unmap(blkif);
@@ -482,7 +1122,7 @@ void xenio_blkif_disconnect(xenio_blkif_t * blkif)
 xenio_blkif_t *xenio_blkif_connect(xenio_ctx_t * ctx, domid_t domid,
                                    const grant_ref_t * grefs, int order,
                                    evtchn_port_t port, int proto,
-                                   void *data)
+                                   int features, void *data)
 {
     xenio_blkif_t *blkif = NULL;
     int err;
@@ -512,6 +1152,19 @@ xenio_blkif_t *xenio_blkif_connect(xenio_ctx_t * ctx, domid_t domid,
     if (err)
         goto fail;
 
+    err = xenio_blkif_batches_init(blkif);
+    if (err)
+        goto fail;
+
+    if (features & XENIO_BLKIF_FEATURE_PERSISTENT) {
+        err = xenio_pgrant_cache_init(&blkif->pgrants,
+                                      XENIO_BLKIF_MAX_PGRANTS,
+                                      &xenio_blkif_pgrant_ops, blkif);
+        if (err)
+            goto fail;
+        blkif->features |= XENIO_BLKIF_FEATURE_PERSISTENT;
+    }
+
     err = xenio_blkif_evt_bind(blkif, port);
     if (err)
         goto fail;
@@ -553,6 +1206,20 @@ int xenio_blkif_ring_size(xenio_blkif_t * blkif)
     abort();
 }
 
+void xenio_blkif_pgrant_stats(xenio_blkif_t * blkif,
+                              struct xenio_blkif_pgrant_stats *st)
+{
+    xenio_pgrant_cache_t *cache = &blkif->pgrants;
+
+    st->enabled = !!(blkif->features & XENIO_BLKIF_FEATURE_PERSISTENT);
+    st->size = cache->size;
+    st->max = cache->max;
+    st->hits = cache->hits;
+    st->misses = cache->misses;
+    st->evictions = cache->evictions;
+    st->overflows = cache->overflows;
+}
+
 xenio_blkif_t *xenio_pending_blkif(xenio_ctx_t * ctx, void **data)
 {
     evtchn_port_or_error_t port;
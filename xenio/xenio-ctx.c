@@ -33,9 +33,46 @@ void xenio_close(xenio_ctx_t * ctx)
         ctx->xcg_handle = NULL;
     }
 
+    if (ctx->xgt_handle != NULL) {
+        xengnttab_close(ctx->xgt_handle);
+        ctx->xgt_handle = NULL;
+    }
+
     free(ctx);
 }
 
+/*
+ * Grant copy needs IOCTL_GNTDEV_GRANT_COPY, which older dom0 kernels
+ * lack. An empty copy tells, the result is kept for the context.
+ */
+int xenio_ctx_probe_grant_copy(xenio_ctx_t * ctx)
+{
+    int err;
+
+    if (ctx->copy_probe)
+        return ctx->copy_probe < 0 ? ctx->copy_probe : 0;
+
+    ctx->xgt_handle = xengnttab_open(NULL, 0);
+    if (ctx->xgt_handle == NULL) {
+        err = -errno;
+        goto out;
+    }
+
+    err = xengnttab_grant_copy(ctx->xgt_handle, 0, NULL);
+    if (err) {
+        err = -errno;
+        xengnttab_close(ctx->xgt_handle);
+        ctx->xgt_handle = NULL;
+    }
+
+  out:
+    ctx->copy_probe = err ? : 1;
+    if (err)
+        WARN("grant copy unavailable: %s\n", strerror(-err));
+
+    return err;
+}
+
 xenio_ctx_t *xenio_open(void)
 {
     xenio_ctx_t *ctx;
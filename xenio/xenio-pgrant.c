@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2012      Citrix Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xenio-pgrant.h"
+
+static inline struct tqh_xenio_pgrant *xenio_pgrant_bucket(xenio_pgrant_cache_t
+                                                           * cache,
+                                                           grant_ref_t gref)
+{
+    return &cache->hash[gref & cache->hash_mask];
+}
+
+static xenio_pgrant_t *xenio_pgrant_find(xenio_pgrant_cache_t * cache,
+                                         grant_ref_t gref)
+{
+    xenio_pgrant_t *pg;
+
+    TAILQ_FOREACH(pg, xenio_pgrant_bucket(cache, gref), hash_entry) {
+        if (pg->gref == gref)
+            return pg;
+    }
+
+    return NULL;
+}
+
+static void xenio_pgrant_drop(xenio_pgrant_cache_t * cache,
+                              xenio_pgrant_t * pg)
+{
+    cache->ops->unmap(cache->arg, pg->vma);
+    pg->vma = NULL;
+
+    TAILQ_REMOVE(xenio_pgrant_bucket(cache, pg->gref), pg, hash_entry);
+    cache->size--;
+}
+
+xenio_pgrant_t *xenio_pgrant_get(xenio_pgrant_cache_t * cache,
+                                 grant_ref_t gref)
+{
+    xenio_pgrant_t *pg;
+
+    pg = xenio_pgrant_find(cache, gref);
+    if (pg) {
+        if (!pg->refcnt++)
+            TAILQ_REMOVE(&cache->lru, pg, lru_entry);
+        cache->hits++;
+        return pg;
+    }
+
+    cache->misses++;
+
+    pg = TAILQ_FIRST(&cache->free);
+    if (pg)
+        TAILQ_REMOVE(&cache->free, pg, lru_entry);
+    else {
+        pg = TAILQ_FIRST(&cache->lru);
+        if (!pg) {
+            cache->overflows++;
+            errno = EBUSY;
+            return NULL;
+        }
+
+        TAILQ_REMOVE(&cache->lru, pg, lru_entry);
+        xenio_pgrant_drop(cache, pg);
+        cache->evictions++;
+    }
+
+    pg->vma = cache->ops->map(cache->arg, gref);
+    if (!pg->vma) {
+        int err = errno;
+        TAILQ_INSERT_HEAD(&cache->free, pg, lru_entry);
+        errno = err;
+        return NULL;
+    }
+
+    pg->gref = gref;
+    pg->refcnt = 1;
+    TAILQ_INSERT_HEAD(xenio_pgrant_bucket(cache, gref), pg, hash_entry);
+    cache->size++;
+
+    return pg;
+}
+
+void xenio_pgrant_put(xenio_pgrant_cache_t * cache, xenio_pgrant_t * pg)
+{
+    if (!--pg->refcnt)
+        TAILQ_INSERT_TAIL(&cache->lru, pg, lru_entry);
+}
+
+void xenio_pgrant_cache_flush(xenio_pgrant_cache_t * cache)
+{
+    xenio_pgrant_t *pg;
+
+    while ((pg = TAILQ_FIRST(&cache->lru))) {
+        TAILQ_REMOVE(&cache->lru, pg, lru_entry);
+        xenio_pgrant_drop(cache, pg);
+        TAILQ_INSERT_TAIL(&cache->free, pg, lru_entry);
+    }
+}
+
+void xenio_pgrant_cache_free(xenio_pgrant_cache_t * cache)
+{
+    if (cache->entries)
+        xenio_pgrant_cache_flush(cache);
+
+    free(cache->entries);
+    cache->entries = NULL;
+
+    free(cache->hash);
+    cache->hash = NULL;
+}
+
+int xenio_pgrant_cache_init(xenio_pgrant_cache_t * cache, int max,
+                            const struct xenio_pgrant_ops *ops, void *arg)
+{
+    unsigned int n_buckets;
+    int i, err;
+
+    memset(cache, 0, sizeof(*cache));
+    TAILQ_INIT(&cache->free);
+    TAILQ_INIT(&cache->lru);
+
+    if (max <= 0)
+        return -EINVAL;
+
+    cache->ops = ops;
+    cache->arg = arg;
+    cache->max = max;
+
+    cache->entries = calloc(max, sizeof(xenio_pgrant_t));
+    if (!cache->entries) {
+        err = -errno;
+        goto fail;
+    }
+
+    for (i = 0; i < max; i++)
+        TAILQ_INSERT_TAIL(&cache->free, &cache->entries[i], lru_entry);
+
+    for (n_buckets = 1; n_buckets < max; n_buckets <<= 1);
+
+    cache->hash = malloc(n_buckets * sizeof(*cache->hash));
+    if (!cache->hash) {
+        err = -errno;
+        goto fail;
+    }
+
+    for (i = 0; i < n_buckets; i++)
+        TAILQ_INIT(&cache->hash[i]);
+    cache->hash_mask = n_buckets - 1;
+
+    return 0;
+
+  fail:
+    xenio_pgrant_cache_free(cache);
+    return err;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2012      Citrix Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+
+#ifndef __XENIO_PGRANT_H__
+#define __XENIO_PGRANT_H__
+
+#include <xen/grant_table.h>
+#include "blktap.h"
+
+/*
+ * Persistent grant cache: keeps grant references mapped across
+ * requests, so a frontend recycling a fixed set of grants (blkif
+ * feature-persistent) costs no map/unmap once warmed up.
+ *
+ * Bounded to a fixed number of pages. Mappings no request holds
+ * are kept in LRU order and get evicted when a new reference needs
+ * a slot.
+ */
+
+typedef struct xenio_pgrant xenio_pgrant_t;
+typedef struct xenio_pgrant_cache xenio_pgrant_cache_t;
+
+TAILQ_HEAD(tqh_xenio_pgrant, xenio_pgrant);
+
+struct xenio_pgrant {
+    grant_ref_t gref;
+    void *vma;
+    int refcnt;
+
+    TAILQ_ENTRY(xenio_pgrant) hash_entry;
+    TAILQ_ENTRY(xenio_pgrant) lru_entry;
+};
+
+/*
+ * Maps/unmaps a single granted page, read-write. A grant device in
+ * real life, any page allocator for testing.
+ */
+struct xenio_pgrant_ops {
+    void *(*map) (void *arg, grant_ref_t gref);
+    int (*unmap) (void *arg, void *vma);
+};
+
+struct xenio_pgrant_cache {
+    const struct xenio_pgrant_ops *ops;
+    void *arg;
+
+    int max;
+    int size;
+
+    xenio_pgrant_t *entries;
+    struct tqh_xenio_pgrant free;
+    struct tqh_xenio_pgrant lru;
+
+    struct tqh_xenio_pgrant *hash;
+    unsigned int hash_mask;
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long overflows;
+};
+
+int xenio_pgrant_cache_init(xenio_pgrant_cache_t * cache, int max,
+                            const struct xenio_pgrant_ops *ops, void *arg);
+
+/*
+ * Unmaps all cached grants. No grant may be held.
+ */
+void xenio_pgrant_cache_flush(xenio_pgrant_cache_t * cache);
+
+void xenio_pgrant_cache_free(xenio_pgrant_cache_t * cache);
+
+/*
+ * Returns the mapping of @gref, mapping it if not cached yet. Returns
+ * NULL and sets errno if the mapping failed, or EBUSY if the cache is
+ * full of held grants.
+ */
+xenio_pgrant_t *xenio_pgrant_get(xenio_pgrant_cache_t * cache,
+                                 grant_ref_t gref);
+
+void xenio_pgrant_put(xenio_pgrant_cache_t * cache, xenio_pgrant_t * pg);
+
+#endif                          /* __XENIO_PGRANT_H__ */
@@ -17,6 +17,7 @@
 
 #include "blktap.h"
 #include <xenctrl.h>
+#include <xengnttab.h>
 
 struct xenio_blkif;
 TAILQ_HEAD(tqh_xenio_blkif, xenio_blkif);
@@ -35,6 +36,13 @@ struct xenio_ctx {
 	 */
     xc_evtchn *xce_handle;
 
+    /*
+     * Grant copy handle, opened by xenio_ctx_probe_grant_copy. copy_probe
+     * is 0 until probed, then 1 or a negative error code.
+     */
+    xengnttab_handle *xgt_handle;
+    int copy_probe;
+
     /**
 	 * List of XEN I/O block interfaces.
 	 */
@@ -44,6 +52,8 @@ struct xenio_ctx {
 #include <stdlib.h>
 #include <syslog.h>
 
+int xenio_ctx_probe_grant_copy(xenio_ctx_t * ctx);
+
 void xenio_log(int prio, const char *fmt, ...);
 void (*xenio_vlog) (int prio, const char *fmt, va_list ap);
 
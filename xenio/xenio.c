@@ -68,8 +68,12 @@ typedef struct blkback_device {
     domid_t domid;
     int devid;
 
+    /*
+     * Ring grant references of all queues, n_queues * ring pages.
+     */
     grant_ref_t *gref;
     evtchn_port_t port;
+    int n_queues;
 
     /**
 	 * Descriptor of the tapdisk process serving this virtual block device.
@@ -154,6 +158,7 @@ static struct xenio_backend {
 
     const struct xenio_backend_ops *ops;
     int max_ring_page_order;
+    int max_queues;
 } backend;
 
 #define xenio_backend_for_each_device(_device, _next)	\
@@ -254,9 +259,6 @@ static inline int xenio_device_vscanf(xenio_device_t * device,
     return n;
 }
 
-/**
- * TODO Only called by xenio_device_check_serial, merge into it.
- */
 __scanf(3, 4)
 static int xenio_device_scanf(xenio_device_t * device,
                               const char *path, const char *fmt, ...)
@@ -587,6 +589,12 @@ static inline int xenio_backend_create_device(int domid, const char *name)
     if (err)
         goto fail;
 
+    if (backend.max_queues > 1)
+        err = xenio_device_printf(device, "multi-queue-max-queues", 0, "%d",
+                                  backend.max_queues);
+    if (err)
+        goto fail;
+
     /*
      * Get the tapdisk that is serving this virtual block device, along with
      * it's parameters.
@@ -963,7 +971,7 @@ static void xenio_backend_destroy(void)
  * path? It would only make sense if we want to run multiple xenio daemons.
  */
 static inline int xenio_backend_create(const struct xenio_backend_ops *ops,
-		int max_ring_page_order)
+		int max_ring_page_order, int max_queues)
 {
     bool nerr;
     int err = -EINVAL;
@@ -974,6 +982,7 @@ static inline int xenio_backend_create(const struct xenio_backend_ops *ops,
     }
 
     backend.max_ring_page_order = max_ring_page_order;
+    backend.max_queues = max_queues;
     TAILQ_INIT(&backend.devices);
     backend.xst = XBT_NULL;
 
@@ -1064,21 +1073,68 @@ static inline int blkback_read_otherend_proto(xenio_device_t * xbdev)
     return -EINVAL;
 }
 
+/**
+ * Reads the ring grant references and event channel of one queue. @prefix
+ * is empty for a single queue frontend, "queue-N/" otherwise.
+ */
+static int blkback_read_otherend_ring(xenio_device_t * xbdev,
+                                      const char *prefix, int order,
+                                      grant_ref_t * gref,
+                                      evtchn_port_t * port)
+{
+    char path[32];
+    int n;
+
+    if (order) {
+        int i;
+        for (i = 0; i < (1 << order); i++) {
+            snprintf(path, sizeof(path), "%sring-ref%d", prefix, i);
+            n = xenio_device_scanf_otherend(xbdev, path, "%u", &gref[i]);
+            if (n != 1) {
+                DBG("Failed to read grant ref %s.\n", path);
+                return ENOENT;
+            }
+            DBG("%s = %d\n", path, gref[i]);
+        }
+    } else {
+        snprintf(path, sizeof(path), "%sring-ref", prefix);
+        n = xenio_device_scanf_otherend(xbdev, path, "%u", &gref[0]);
+        if (n != 1) {
+            DBG("Failed to read grant ref %s.\n", path);
+            return ENOENT;
+        }
+
+        DBG("%s = %d\n", path, gref[0]);
+    }
+
+    snprintf(path, sizeof(path), "%sevent-channel", prefix);
+    n = xenio_device_scanf_otherend(xbdev, path, "%u", port);
+    if (n != 1) {
+        DBG("Failed to read event channel %s.\n", path);
+        return ENOENT;
+    }
+
+    return 0;
+}
+
 /**
  * Core functions that instructs the tapdisk to connect to the ring.
  * TODO elaborate more
  *
+ * A multi-queue frontend gets one ring per queue, each connected
+ * separately to the same tapdisk.
+ *
  * TODO Only called by blkback_frontend_changed.
  */
 static inline int blkback_connect_tap(xenio_device_t * xbdev)
 {
     blkback_device_t *bdev = xbdev->bdev;
-    evtchn_port_t port;
+    evtchn_port_t port[XENIO_BLKIF_MAX_QUEUES];
     grant_ref_t *gref = NULL;
-    int n, proto, err = 0;
-    int order;
+    int n, q, proto, err = 0;
+    int order, n_queues, persistent, features, copy_threshold;
     char *pool;
-    char ring_ref[12];
+    char prefix[16];
 
     if (bdev->gref) {
         DBG("blkback already connected to tapdisk.\n");
@@ -1090,44 +1146,45 @@ static inline int blkback_connect_tap(xenio_device_t * xbdev)
     if (n != 1)
         order = 0;
 
-    gref = calloc(ORDER_TO_PAGES(order), sizeof(grant_ref_t));
-    if (!gref) {
-        DBG("Failed to allocate memory for grant refs.\n");
-        err = ENOMEM;
+    if (order < 0 || order > backend.max_ring_page_order) {
+        DBG("Invalid ring-page-order %d, max %d.\n",
+            order, backend.max_ring_page_order);
+        err = EINVAL;
         goto fail;
     }
 
-    if (order) {
-        int i;
-        for (i = 0; i < (1 << order); i++) {
-            sprintf(ring_ref, "ring-ref%d", i);
-            n = xenio_device_scanf_otherend(xbdev, ring_ref, "%u",
-                                            &gref[i]);
-            if (n != 1) {
-                DBG("Failed to read grant ref #%d.\n", i);
-                err = ENOENT;
-                goto fail;
-            }
-            DBG("%s = %d\n", ring_ref, gref[i]);
-        }
-    } else {
-        n = xenio_device_scanf_otherend(xbdev, "ring-ref", "%u", &gref[0]);
-        if (n != 1) {
-            DBG("Failed to read grant ref.\n");
-            err = ENOENT;
-            goto fail;
-        }
+    n = xenio_device_scanf_otherend(xbdev, "multi-queue-num-queues", "%d",
+                                    &n_queues);
+    if (n != 1)
+        n_queues = 1;
 
-        DBG("ring-ref = %d\n", gref[0]);
+    if (n_queues < 1 || n_queues > backend.max_queues) {
+        DBG("Invalid multi-queue-num-queues %d, max %d.\n",
+            n_queues, backend.max_queues);
+        err = EINVAL;
+        goto fail;
     }
 
-    n = xenio_device_scanf_otherend(xbdev, "event-channel", "%u", &port);
-    if (n != 1) {
-        DBG("Failed to read event channel.\n");
-        err = ENOENT;
+    gref = calloc(n_queues * ORDER_TO_PAGES(order), sizeof(grant_ref_t));
+    if (!gref) {
+        DBG("Failed to allocate memory for grant refs.\n");
+        err = ENOMEM;
         goto fail;
     }
 
+    for (q = 0; q < n_queues; q++) {
+        if (n_queues > 1)
+            snprintf(prefix, sizeof(prefix), "queue-%d/", q);
+        else
+            prefix[0] = 0;
+
+        err = blkback_read_otherend_ring(xbdev, prefix, order,
+                                         gref + q * ORDER_TO_PAGES(order),
+                                         &port[q]);
+        if (err)
+            goto fail;
+    }
+
     proto = blkback_read_otherend_proto(xbdev);
     if (proto < 0) {
         DBG("Failed to read protocol.\n");
@@ -1135,25 +1192,56 @@ static inline int blkback_connect_tap(xenio_device_t * xbdev)
         goto fail;
     }
 
+    features = 0;
+
+    n = xenio_device_scanf_otherend(xbdev, "feature-persistent", "%d",
+                                    &persistent);
+    if (n == 1 && persistent)
+        features |= XENIO_BLKIF_FEATURE_PERSISTENT;
+
+    /*
+     * Small requests get grant-copied rather than mapped, 0 maps
+     * everything.
+     */
+    n = xenio_device_scanf(xbdev, "sm-data/grant-copy-threshold", "%d",
+                           &copy_threshold);
+    if (n != 1 || copy_threshold < 0)
+        copy_threshold = XENIO_BLKIF_COPY_THRESHOLD;
+
     pool = xenio_device_read(xbdev, "sm-data/frame-pool");
 
-    DBG("connecting vbd-%d-%d (order %d, evt %d, proto %d, pool %s)"
-        " to tapdisk %d minor %d\n",
-        bdev->domid, bdev->devid,
-        order, port, proto, pool, bdev->tap.pid, bdev->tap.minor);
-
-    err = tap_ctl_connect_xenblkif(bdev->tap.pid,
-                                   bdev->tap.minor,
-                                   bdev->domid,
-                                   bdev->devid,
-                                   gref, order, port, proto, pool);
-    DBG("err=%d errno=%d\n", err, errno);
-    if (err)
-        goto fail;
+    for (q = 0; q < n_queues; q++) {
+        DBG("connecting vbd-%d-%d queue %d/%d (order %d, evt %d, proto %d, "
+            "features %#x, copy threshold %d, pool %s) to tapdisk %d "
+            "minor %d\n", bdev->domid, bdev->devid, q, n_queues, order,
+            port[q], proto, features, copy_threshold, pool,
+            bdev->tap.pid, bdev->tap.minor);
+
+        err = tap_ctl_connect_xenblkif(bdev->tap.pid,
+                                       bdev->tap.minor,
+                                       bdev->domid,
+                                       bdev->devid,
+                                       q, n_queues,
+                                       gref + q * ORDER_TO_PAGES(order),
+                                       order, port[q], proto, features,
+                                       copy_threshold, pool);
+        DBG("err=%d errno=%d\n", err, errno);
+        if (err) {
+            /*
+             * Disconnecting by domid/devid drops the queues already
+             * connected.
+             */
+            if (q)
+                tap_ctl_disconnect_xenblkif(bdev->tap.pid, bdev->tap.minor,
+                                            bdev->domid, bdev->devid, NULL);
+            goto fail;
+        }
+    }
 
     bdev->gref = gref;
     gref = NULL;
-    bdev->port = port;
+    bdev->port = port[0];
+    bdev->n_queues = n_queues;
 
   write_info:
 
@@ -1176,6 +1264,52 @@ static inline int blkback_connect_tap(xenio_device_t * xbdev)
         goto fail;
     }
 
+    err = xenio_device_printf(xbdev, "feature-flush-cache", 1, "%d", 1);
+    if (err) {
+        DBG("Failed to write feature-flush-cache.\n");
+        goto fail;
+    }
+
+    /*
+     * Images without discard support simply ignore them, so offering it
+     * is always safe. Secure discards are refused.
+     */
+    err = xenio_device_printf(xbdev, "feature-discard", 1, "%d", 1);
+    if (err) {
+        DBG("Failed to write feature-discard.\n");
+        goto fail;
+    }
+
+    err = xenio_device_printf(xbdev, "discard-granularity", 1, "%u",
+                              bdev->sector_size);
+    if (err) {
+        DBG("Failed to write discard-granularity.\n");
+        goto fail;
+    }
+
+    err = xenio_device_printf(xbdev, "discard-secure", 1, "%d", 0);
+    if (err) {
+        DBG("Failed to write discard-secure.\n");
+        goto fail;
+    }
+
+    err = xenio_device_printf(xbdev, "feature-max-indirect-segments", 1,
+                              "%d", XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST);
+    if (err) {
+        DBG("Failed to write feature-max-indirect-segments.\n");
+        goto fail;
+    }
+
+    /*
+     * Tapdisk keeps the grants of a frontend with feature-persistent
+     * mapped, see xenio_blkif_mmap_one.
+     */
+    err = xenio_device_printf(xbdev, "feature-persistent", 1, "%d", 1);
+    if (err) {
+        DBG("Failed to write feature-persistent.\n");
+        goto fail;
+    }
+
     err = xenio_device_switch_state(xbdev, XenbusStateConnected);
     if (err) {
         DBG("Failed to switch state %d\n", err);
@@ -1220,6 +1354,7 @@ static inline int blkback_disconnect_tap(xenio_device_t * xbdev)
     free(bdev->gref);
     bdev->gref = NULL;
     bdev->port = -1;
+    bdev->n_queues = 0;
 
     err = xenio_device_switch_state(xbdev, XenbusStateClosed);
   fail:
@@ -1440,31 +1575,40 @@ static void usage(FILE * stream, const char *prog)
 {
     fprintf(stream,
             "usage: %s\n"
-            "\t[-m|--max-ring-order <max ring page order>]\n"
+            "\t[-m|--max-ring-order <max ring page order, default %d>]\n"
+            "\t[-q|--max-queues <max rings per device, default #cpus up to %d>]\n"
             "\t[-D|--debug]\n"
-			"\t[-h|--help]\n", prog);
+			"\t[-h|--help]\n", prog, XENIO_BLKIF_MAX_RING_ORDER,
+            XENIO_BLKIF_MAX_QUEUES);
 }
 
 int main(int argc, char **argv)
 {
     const char *prog;
-    int opt_debug, opt_max_ring_page_order;
+    int opt_debug, opt_max_ring_page_order, opt_max_queues;
     int err;
 
     prog = basename(argv[0]);
 
     opt_debug = 0;
-    opt_max_ring_page_order = 0;
+    opt_max_ring_page_order = XENIO_BLKIF_MAX_RING_ORDER;
+
+    opt_max_queues = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt_max_queues < 1)
+        opt_max_queues = 1;
+    if (opt_max_queues > XENIO_BLKIF_MAX_QUEUES)
+        opt_max_queues = XENIO_BLKIF_MAX_QUEUES;
 
     do {
         const struct option longopts[] = {
             {"help", 0, NULL, 'h'},
             {"max-ring-order", 1, NULL, 'm'},
+            {"max-queues", 1, NULL, 'q'},
             {"debug", 0, NULL, 'D'},
         };
         int c;
 
-        c = getopt_long(argc, argv, "hm:n:D", longopts, NULL);
+        c = getopt_long(argc, argv, "hm:q:D", longopts, NULL);
         if (c < 0)
             break;
 
@@ -1474,7 +1618,14 @@ int main(int argc, char **argv)
             return 0;
         case 'm':
             opt_max_ring_page_order = atoi(optarg);
-            if (opt_max_ring_page_order < 0)
+            if (opt_max_ring_page_order < 0 ||
+                opt_max_ring_page_order > XENIO_BLKIF_MAX_RING_ORDER)
+                goto usage;
+            break;
+        case 'q':
+            opt_max_queues = atoi(optarg);
+            if (opt_max_queues < 1 ||
+                opt_max_queues > XENIO_BLKIF_MAX_QUEUES)
                 goto usage;
             break;
         case 'D':
@@ -1499,7 +1650,8 @@ int main(int argc, char **argv)
         }
     }
 
-	if ((err = xenio_backend_create(&blkback_ops, opt_max_ring_page_order))) {
+	if ((err = xenio_backend_create(&blkback_ops, opt_max_ring_page_order,
+                    opt_max_queues))) {
         WARN("error creating blkback: %s\n", strerror(err));
         goto fail;
     }
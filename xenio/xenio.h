@@ -30,6 +30,7 @@ typedef struct xenio_ctx xenio_ctx_t;
 typedef struct xenio_blkif xenio_blkif_t;
 typedef struct xenio_blkif_req xenio_blkif_req_t;
 struct tq_xenio_blkif;
+struct xenio_pgrant;
 
 /*
  * Create a guest I/O context.
@@ -59,6 +60,37 @@ enum {
     XENIO_BLKIF_PROTO_X86_64 = 3,
 };
 
+/*
+ * Optional blkif features negotiated with the frontend.
+ */
+enum {
+    XENIO_BLKIF_FEATURE_PERSISTENT = 1 << 0,
+};
+
+/*
+ * Most segments a request may carry through indirect descriptor
+ * pages (BLKIF_OP_INDIRECT), versus BLKIF_MAX_SEGMENTS_PER_REQUEST
+ * inline.
+ */
+#define XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST 256
+
+/*
+ * Default for xenio_blkif_set_copy_threshold: requests carrying up to
+ * this many bytes are grant-copied instead of mapped.
+ */
+#define XENIO_BLKIF_COPY_THRESHOLD (16 << 10)
+
+/*
+ * Largest shared ring, in pages log-2. Order 3 holds 256 requests.
+ */
+#define XENIO_BLKIF_MAX_RING_ORDER 3
+
+/*
+ * Most rings a single virtual block device may be spread over, one per
+ * frontend queue.
+ */
+#define XENIO_BLKIF_MAX_QUEUES 16
+
 /*
  * xenio_blkif_connect: Connect to a Xen block I/O ring in @ctx.
  *
@@ -67,6 +99,7 @@ enum {
  * @order: Ring order -- number of grefs, log-2.
  * @port:  Remote interdomain event channel port.
  * @proto: Ring compat for 32/64-bit-guests.
+ * @features: XENIO_BLKIF_FEATURE_* enabled by the frontend.
  * @data:  User token for xenio_pending_blkif.
  *
  * Returns a connection handle, or NULL on failure. Sets errno.
@@ -74,7 +107,7 @@ enum {
 xenio_blkif_t *xenio_blkif_connect(xenio_ctx_t * ctx, domid_t domid,
                                    const grant_ref_t * grefs, int order,
                                    evtchn_port_t port, int proto,
-                                   void *data);
+                                   int features, void *data);
 
 /**
  * Disconnects and destroy a blkif handle.
@@ -103,16 +136,23 @@ struct xenio_blkif_req {
     int status;
 
     off_t offset;
+    uint64_t nr_sectors;        /* discard only, carries no segments */
+    int flag;                   /* discard only, BLKIF_DISCARD_* */
+
     struct xenio_blkif_seg {
         uint8_t first;
         uint8_t last;
-    } segs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
-    grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    } segs[XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    grant_ref_t gref[XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST];
     int n_segs;
 
-    unsigned int pgoff;
+    int batch;                  /* xenio_blkif_map_grants id, or 0 */
+    int copy;                   /* grant copy buffer + 1, or 0 */
+    unsigned int pgoff;         /* first page in the batch mapping */
     void *vma;
-    struct iovec iov[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct xenio_pgrant *pgrant[XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int n_pgrants;
+    struct iovec iov[XENIO_BLKIF_MAX_SEGMENTS_PER_REQUEST];
     int n_iov;
 };
 
@@ -131,11 +171,19 @@ int xenio_blkif_get_requests(xenio_blkif_t * blkif,
                              blkif_request_t ** msgs, int count,
                              int final);
 
+/*
+ * Peek at the shared I/O ring, without consuming requests or
+ * touching the event channel. Cheap enough to busy-poll.
+ */
+int xenio_blkif_has_requests(xenio_blkif_t * blkif);
+
 /*
  * Read a single request message.
  *
  * On success, returns 0 on leaves request content in
- * @req->{offset,segs,gref,n_segs}.
+ * @req->{offset,segs,gref,n_segs}. Indirect requests come back as
+ * plain reads or writes, their segments read from the descriptor
+ * pages.
  *
  * Returns -errno of failure and sets req->status to BLKIF_RSP_ERROR.
  */
@@ -148,13 +196,39 @@ int xenio_blkif_parse_request(xenio_blkif_t * blkif, blkif_request_t * msg,
  * Good for prototyping and applications not dealing with frame
  * pools. Or bound pools not prone to congestion.
  *
- * On success, returns 0 and leaves segment ranges in @req->vma and
- * @req->iovec. Sets and returns -errno on failure.
+ * With persistent grants, segments come from the grant cache of the
+ * blkif and stay mapped after unmapping the request. Falls back to a
+ * one-off mapping if the cache is exhausted.
+ *
+ * On success, returns 0 and leaves segment ranges in @req->iov. Sets
+ * and returns -errno on failure. Check xenio_blkif_req_mapped before
+ * unmapping.
  */
 int xenio_blkif_mmap_one(xenio_blkif_t * blkif, xenio_blkif_req_t * req);
 
 int xenio_blkif_munmap_one(xenio_blkif_t * blkif, xenio_blkif_req_t * req);
 
+static inline int xenio_blkif_req_mapped(const xenio_blkif_req_t * req)
+{
+    return req->vma || req->n_pgrants;
+}
+
+struct xenio_blkif_pgrant_stats {
+    int enabled;
+    int size;
+    int max;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long overflows;
+};
+
+/*
+ * Persistent grant cache occupancy and hit counts.
+ */
+void xenio_blkif_pgrant_stats(xenio_blkif_t * blkif,
+                              struct xenio_blkif_pgrant_stats *st);
+
 /*
  * Batch request mapping.
  *
@@ -167,6 +241,13 @@ int xenio_blkif_munmap_one(xenio_blkif_t * blkif, xenio_blkif_req_t * req);
  * requests. If the blkif context was bound to a frame pool, mapped
  * requests will be backed with page structs. Despite this call
  * succeeding, the latter may happen only asynchronously.
+ *
+ * All reads share one read-write mapping and all writes one
+ * read-only mapping. Requests without segments, or already mapped
+ * through persistent grants, are skipped. A single bad grant fails
+ * the whole batch, callers fall back to xenio_blkif_mmap_one.
+ *
+ * Returns a positive batch id, or -errno on failure.
  */
 int64_t xenio_blkif_map_grants(xenio_blkif_t * blkif,
                                xenio_blkif_req_t ** reqs, int count);
@@ -194,14 +275,55 @@ int xenio_blkif_mmap_requests(xenio_blkif_t * blkif,
 
 /*
  * xenio_blkif_munmap_request: Unmap a previously mmapped @request.
+ * Batch mappings go away with the last request and the grant mapping
+ * released. Works on requests mapped by xenio_blkif_mmap_one too.
+ *
+ * Set @req->status first: grant-copied reads are copied back to the
+ * guest only if successful. A failed copy turns the status into
+ * BLKIF_RSP_ERROR.
  */
 int xenio_blkif_munmap_request(xenio_blkif_t * blkif,
                                xenio_blkif_req_t * req);
 
+/*
+ * xenio_blkif_munmap_requests: Unmap a batch of requests, copying
+ * back all grant-copied reads in one go. Skips unmapped requests.
+ */
+int xenio_blkif_munmap_requests(xenio_blkif_t * blkif,
+                                xenio_blkif_req_t ** reqs, int count);
+
+/*
+ * Grant copy.
+ *
+ * Small reads and writes are cheaper to copy from and to guest
+ * memory than to map. With a nonzero @threshold, xenio_blkif_map_grants
+ * gives reads and writes of up to @threshold bytes a buffer of their
+ * own instead: write data gets copied in on mapping, read data out on
+ * unmapping, with one grant copy operation per batch.
+ *
+ * Buffers for a full ring get allocated up front, from huge pages if
+ * available. Capped to BLKIF_MAX_SEGMENTS_PER_REQUEST pages. Only
+ * while no request is mapped. Returns 0 or -errno.
+ */
+int xenio_blkif_set_copy_threshold(xenio_blkif_t * blkif, size_t threshold);
+
+struct xenio_blkif_copy_stats {
+    size_t threshold;
+    int hugepages;
+    unsigned long long reqs;
+    unsigned long long ops;
+    unsigned long long errors;
+};
+
+void xenio_blkif_copy_stats(xenio_blkif_t * blkif,
+                            struct xenio_blkif_copy_stats *st);
+
 /*
  * Write @count responses, with result codes according to
+ * xenio_blkif_req.status. A @final call pushes them, returns nonzero if
+ * the frontend got notified.
  */
-void xenio_blkif_put_responses(xenio_blkif_t * blkif,
+int xenio_blkif_put_responses(xenio_blkif_t * blkif,
                                xenio_blkif_req_t ** reqs, int count,
                                int final);
 